@@ -1,9 +1,14 @@
 #pragma once
 #include <core/const.h>
 #include <core/list.h>
+#include <cpu/atomic.h>
+#include <cpu/smp.h>
+#include <block/pagecache.h>
+#include <task/semaphore.h>
 
 typedef struct BlockDevicePart BlockDevicePart;
 typedef struct FileSystem FileSystem;
+typedef struct VFSFileOperation VFSFileOperation;
 
 typedef enum BlockDeviceType{
    InvaildBlockDevice,
@@ -11,17 +16,49 @@ typedef enum BlockDeviceType{
    BlockDeviceCDROM
 } BlockDeviceType;
 
+#define BLOCK_STAT_BUCKETS    40
+
+#define BLOCK_SET_POLL_READS  0x4200 /*The ioctl of /dev/sdX,data is 0 or 1.*/
+
+typedef struct BlockStatCPU{
+   u64 ios[2];      /*0:write,1:read.*/
+   u64 sectors[2];  /*512 bytes.*/
+   u64 cycles[2];   /*Service time,in TSC cycles.*/
+   u64 histogram[2][BLOCK_STAT_BUCKETS]; /*Log2 of the service time.*/
+   s64 inflight;    /*Started here minus completed here,only the sum means something.*/
+} __attribute__ ((aligned(64))) BlockStatCPU;
+
+typedef struct BlockStat{
+   BlockStatCPU cpu[CPU_MAX]; /*Every CPU counts without a lock,/dev/blockstat sums them.*/
+} BlockStat;
+
 typedef struct BlockDevice{
    void *data;  
    int (*read)(void *data,u64 start,u64 size,void *buf);
    int (*write)(void *data,u64 start,u64 size,void *buf);
+   int (*flush)(void *data); /*Flush the volatile write cache.*/
+   int (*checkMedia)(void *data);
+      /*Return 1 if the media is changed,removable devices only.*/
    u64 end;
+   u32 sectorSize; /*The logical sector size,the partition tables use it.*/
+                   /*0 means 512 bytes.*/
 
    BlockDeviceType type;
    ListHead list;
 
    BlockDevicePart *parts;
    int partCount;
+
+   char name[12]; /*The devfs name.*/
+   BlockStat stat;
+
+   u64 lastIO;          /*In ticks,when the last I/O completed.*/
+   u64 nextMediaCheck;  /*In ticks.*/
+   u32 mediaInterval;   /*In ms,it grows when nothing changes.*/
+
+   Task *writeback;     /*It writes the dirty pages back,see writeback.c .*/
+   u8 pollReads;        /*Spin for the read completions instead of sleeping.*/
+      /*It saves a context switch and an interrupt for each read,only NVMe uses it.*/
 } BlockDevice;
 
 typedef struct BlockDevicePart{
@@ -33,6 +70,15 @@ typedef struct BlockDevicePart{
    BlockDevicePart *next; 
       /*BlockDevice.*/
    ListHead list;
+
+   int index;
+   BlockStat stat;
+
+   PageCache cache;          /*The buffered data of /dev/sdXN.*/
+   Semaphore cacheSemaphore;
+   Semaphore flushSemaphore; /*Only one flusher for each part.*/
+   u64 dirtyPages;
+   u64 dirtySince;           /*In ticks,when the first page became dirty.*/
 } BlockDevicePart;
 
 typedef struct BlockIO{
@@ -43,5 +89,18 @@ typedef struct BlockIO{
    int read; /*0:write,1:read.*/
 } BlockIO;
 
+typedef int (BlockSectorTransfer)(void *data,u64 sector,u64 count,
+                                  void *buf,int write);
+   /*Transfer 'count' whole sectors,'buf' is always DMA-able.*/
+
 int submitBlockIO(BlockIO *io);
+int flushBlockDevice(BlockDevicePart *part);
 int registerBlockDevice(BlockDevice *device,const char *devfs);
+int initBlockCache(BlockDevicePart *part);
+int invalidateBlockCache(BlockDevicePart *part);
+int syncBlockDevicePart(BlockDevicePart *part);
+   /*Write the dirty pages back and flush the device.*/
+int startBlockWriteback(BlockDevice *device);
+extern VFSFileOperation blockDeviceFileOperation;
+int transferBlockSectors(BlockSectorTransfer *transfer,void *data,
+          u32 sectorSize,u64 start,u64 size,void *buf,int write);
@@ -0,0 +1,10 @@
+#pragma once
+#include <core/const.h>
+
+typedef struct BlockDevicePart BlockDevicePart;
+typedef struct VFSFile VFSFile;
+
+#define LOOP_SET_FD     0x4c00 /*The ioctl of /dev/loopctl,data is a fd.*/
+
+BlockDevicePart *loopAttachFile(VFSFile *file);
+   /*The part returned is the whole file,pass it to doMount.*/
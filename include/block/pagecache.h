@@ -24,3 +24,8 @@ PhysicsPage *getPageFromPageCache(PageCache *cache,unsigned int index,
          int (*readpage)(VFSINode *inode,PhysicsPage *page,unsigned int index));
 
 int putPageIntoPageCache(PhysicsPage *page);
+
+int setPageDirty(PhysicsPage *page);
+   /*Tag it in the radix tree,return 1 if it was clean.*/
+int clearPageDirty(PhysicsPage *page);
+   /*Return 1 if it was dirty.*/
@@ -21,6 +21,8 @@ inline int initHashListNode(HashListNode *node)
                 __attribute__ ((always_inline));
 inline int hashListHeadAdd(HashListNode *node,HashListHead *head)
                 __attribute__ ((always_inline));
+inline int hashListHeadAddRCU(HashListNode *node,HashListHead *head)
+                __attribute__ ((always_inline));
 inline int hashListDelete(HashListNode *node)
                 __attribute__ ((always_inline));
 inline int hashListEmpty(HashListNode *node)
@@ -49,10 +51,23 @@ inline int hashListHeadAdd(HashListNode *node,HashListHead *head)
 {
    node->next = head->first;
    node->pprev = &head->first;
+   if(node->next)
+      node->next->pprev = &node->next;
    head->first = node;
    return 0;
 }
 
+inline int hashListHeadAddRCU(HashListNode *node,HashListHead *head)
+{ /*RCU readers may walk this list at the same time.*/
+   node->next = head->first;
+   node->pprev = &head->first;
+   if(node->next)
+      node->next->pprev = &node->next;
+   asm volatile("":::"memory"); /*Publish the node after it is ready.*/
+   *(HashListNode *volatile *)&head->first = node;
+   return 0;
+}
+
 inline int hashListDelete(HashListNode *node)
 {
    if(node->next) /*Last?*/
@@ -10,5 +10,6 @@
 #define SELECTOR_TSS         0x28
 
 int initGDT(void);
+int loadGDT(unsigned int cpu);
 
 int tssSetStack(u64 stack);
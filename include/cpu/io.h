@@ -18,6 +18,10 @@ inline int startInterrupt(void) __attribute__ ((always_inline));
 inline u64 storeInterrupt(void) __attribute__ ((always_inline));
 inline int restoreInterrupt(u64 rflags) __attribute__ ((always_inline));
 
+inline u64 readTimeStampCounter(void) __attribute__ ((always_inline));
+inline u64 readMSR(u32 msr) __attribute__ ((always_inline));
+inline int writeMSR(u32 msr,u64 data) __attribute__ ((always_inline));
+
 inline u8 inb(u16 port)
 {
    u8 data;
@@ -118,3 +122,23 @@ inline int restoreInterrupt(u64 rflags)
       :"a"(rflags));
    return 0;
 }
+
+inline u64 readTimeStampCounter(void)
+{
+   u32 low,high;
+   asm volatile("rdtsc":"=a"(low),"=d"(high));
+   return ((u64)high << 32) | low;
+}
+
+inline u64 readMSR(u32 msr)
+{
+   u32 low,high;
+   asm volatile("rdmsr":"=a"(low),"=d"(high):"c"(msr));
+   return ((u64)high << 32) | low;
+}
+
+inline int writeMSR(u32 msr,u64 data)
+{
+   asm volatile("wrmsr"::"c"(msr),"a"((u32)data),"d"((u32)(data >> 32)));
+   return 0;
+}
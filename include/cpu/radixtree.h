@@ -2,6 +2,13 @@
 #include <core/const.h>
 #include <cpu/spinlock.h>
 
+#define RADIX_TREE_SHIFT      4
+#define RADIX_TREE_SLOTS      (1 << RADIX_TREE_SHIFT)
+#define RADIX_TREE_MASK       (RADIX_TREE_SLOTS - 1)
+
+#define RADIX_TREE_TAG_DIRTY  0
+#define RADIX_TREE_TAG_COUNT  1
+
 typedef struct RadixTreeNode RadixTreeNode;
 
 typedef struct RadixTreeNode
@@ -9,7 +16,8 @@ typedef struct RadixTreeNode
    unsigned int count;
    unsigned int nr;
    RadixTreeNode *parent;
-   void *data[(1 << 4)];
+   void *data[RADIX_TREE_SLOTS];
+   u16 tags[RADIX_TREE_TAG_COUNT]; /*Bit nr is set if data[nr] has the tag.*/
 } RadixTreeNode;
 
 typedef struct RadixTreeRoot
@@ -35,3 +43,10 @@ int destoryRadixTreeRoot(RadixTreeRoot *root);
 int insertIntoRadixTree(RadixTreeRoot *root,unsigned int index,void *item);
 int removeFromRadixTree(RadixTreeRoot *root,unsigned int index);
 void *getFromRadixTree(RadixTreeRoot *root,unsigned int index);
+
+int setRadixTreeTag(RadixTreeRoot *root,unsigned int index,unsigned int tag);
+int clearRadixTreeTag(RadixTreeRoot *root,unsigned int index,unsigned int tag);
+int getRadixTreeTag(RadixTreeRoot *root,unsigned int index,unsigned int tag);
+unsigned int gangLookUpRadixTree(RadixTreeRoot *root,unsigned int start,
+                 void **items,unsigned int max,int tag);
+   /*Get the items from start in the index order,tag < 0 means all.*/
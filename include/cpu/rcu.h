@@ -1,30 +1,38 @@
 #pragma once
 #include <core/const.h>
-#include <cpu/atomic.h>
-#include <cpu/spinlock.h>
+#include <task/task.h>
 
 typedef int (RCUCallback)(void *data);
 
-typedef struct RCULock
-{
-   RCUCallback *callbacks[20];
-   void *data[20];
-   AtomicType count;
-   int ccount;
-   SpinLock lock;
-} RCULock;
+typedef struct RCUHead{
+   struct RCUHead *next;
+   RCUCallback *callback;
+   void *data;
+} RCUHead; /*Embed it in the objects which are freed by RCU.*/
+
+inline int rcuReadLock(void) __attribute__((always_inline));
+inline int rcuReadUnlock(void) __attribute__((always_inline));
 
-inline int initRCULock(RCULock *lock) __attribute__((always_inline));
+/*Readers only disable preemption,they must not sleep.*/
+/*A CPU which switches tasks,runs the idle task or user mode code*/
+/*is in a quiescent state.*/
+inline int rcuReadLock(void)
+{
+   return disablePreemption();
+}
 
-inline int initRCULock(RCULock *rcu)
+inline int rcuReadUnlock(void)
 {
-   initSpinLock(&rcu->lock);
-   atomicSet(&rcu->count,0);
-   rcu->ccount = 0;
-   return 0;
+   return enablePreemption();
 }
 
-int lockRCUReadLock(RCULock *lock);
-int unlockRCUReadLock(RCULock *lock);
+int callRCU(RCUHead *head,RCUCallback *callback,void *data);
+   /*Call 'callback' after a grace period.callRCU never sleeps,*/
+   /*so it may be called inside rcuReadLock or with a spin lock held.*/
+   /*'callback' runs in the RCU task,it may sleep.*/
+int synchronizeRCU(void);
+   /*Wait for a grace period.*/
 
-int addRCUCallback(RCULock *lock,RCUCallback *callback,void *data);
+int rcuNoteContextSwitch(void);
+int rcuTimerTick(int quiescent);
+   /*Called by the local APIC timer interrupt handler.*/
@@ -0,0 +1,32 @@
+#pragma once
+#include <core/const.h>
+
+#define CPU_MAX            16 /*The most CPUs we start.*/
+
+#define MSR_GS_BASE        0xc0000101
+#define MSR_KERNEL_GS_BASE 0xc0000102 /*Exchanged with MSR_GS_BASE by swapgs.*/
+
+typedef struct CPU{
+   struct CPU *self; /*At %gs:0,see getCPU.*/
+   u32 index; /*0 is the bootstrap CPU.*/
+   u8 apicID;
+   volatile u8 online;
+   struct Task *idle;
+} CPU;
+
+inline CPU *getCPU(void) __attribute__ ((always_inline));
+
+inline CPU *getCPU(void)
+{ /*The entries from the user mode swapgs,so the %gs base is the CPU in the kernel.*/
+   CPU *cpu;
+   asm volatile("movq %%gs:0,%0":"=r"(cpu));
+   return cpu;
+}
+
+CPU *getCPUByIndex(unsigned int index);
+unsigned int getCPUCount(void);
+
+int registerCPU(u8 apicID);
+   /*For the MADT,see parseApic.*/
+int initCPU(CPU *cpu);
+   /*Load the GDT and the TSS of cpu,and point %gs to it.*/
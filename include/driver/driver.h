@@ -2,6 +2,7 @@
 #include <core/const.h>
 #include <cpu/spinlock_types.h>
 #include <core/list.h>
+#include <task/semaphore.h>
 
 typedef struct Driver Driver;
 
@@ -24,6 +25,8 @@ typedef struct Driver{
    int (*disable)(Device *device);
    int (*probe)(Device *device);
 
+   const char *name;
+   Semaphore semaphore; /*Devices of a driver are enabled one by one.*/
    ListHead list;
 } Driver;
 
@@ -33,3 +36,5 @@ int deregisterDriver(Driver *driver);
 int registerDriver(Driver *driver);
 int deregisterDevice(Device *device);
 int registerDevice(Device *device);
+int waitForDevices(void);
+   /*Wait until all the enable callbacks are done.*/
@@ -16,3 +16,25 @@ typedef struct PCIDevice
    Device globalDevice;
 } PCIDevice;
 
+#define PCI_CONFIG_COMMAND        0x04
+#define PCI_CONFIG_STATUS         0x06
+#define PCI_CONFIG_CAPABILITY     0x34
+
+#define PCI_COMMAND_IO            0x0001
+#define PCI_COMMAND_MEMORY        0x0002
+#define PCI_COMMAND_BUS_MASTER    0x0004
+
+#define PCI_STATUS_CAPABILITY     0x0010
+
+#define PCI_CAPABILITY_VENDOR     0x09
+
+u32 pciConfigInl(PCIDevice *pci,u16 offset);
+u16 pciConfigInw(PCIDevice *pci,u16 offset);
+u8 pciConfigInb(PCIDevice *pci,u16 offset);
+int pciConfigOutl(PCIDevice *pci,u16 offset,u32 data);
+int pciConfigOutw(PCIDevice *pci,u16 offset,u16 data);
+
+u8 pciFindCapability(PCIDevice *pci,u8 id,u8 from);
+   /*Return the offset of the capability,0 if not found.*/
+int pciEnableBusMaster(PCIDevice *pci);
+u64 pciGetMemoryBar(PCIDevice *pci,int bar);
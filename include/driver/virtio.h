@@ -0,0 +1,122 @@
+#pragma once
+#include <core/const.h>
+#include <driver/pci.h>
+#include <cpu/spinlock_types.h>
+
+typedef struct VirtioDevice VirtioDevice;
+
+typedef struct VirtQueueDescriptor{
+   u64 address;
+   u32 length;
+   u16 flags;
+   u16 next;
+} __attribute__ ((packed)) VirtQueueDescriptor;
+
+typedef struct VirtQueueAvailable{
+   u16 flags;
+   u16 index;
+   u16 ring[0]; /*And u16 usedEvent after the ring.*/
+} __attribute__ ((packed)) VirtQueueAvailable;
+
+typedef struct VirtQueueUsedElement{
+   u32 id;
+   u32 length;
+} __attribute__ ((packed)) VirtQueueUsedElement;
+
+typedef struct VirtQueueUsed{
+   u16 flags;
+   u16 index;
+   VirtQueueUsedElement ring[0]; /*And u16 availableEvent after the ring.*/
+} __attribute__ ((packed)) VirtQueueUsed;
+
+typedef struct VirtQueueBuffer{
+   void *address; /*Virtual address,it must be in the direct mapping.*/
+   u32 length;
+} VirtQueueBuffer;
+
+typedef struct VirtQueue{
+   VirtioDevice *device;
+   u16 index;
+   u16 size;
+
+   volatile VirtQueueDescriptor *descriptors;
+   volatile VirtQueueAvailable *available;
+   volatile VirtQueueUsed *used;
+   VirtQueueDescriptor *indirect; /*VIRTQUEUE_MAX_INDIRECT entries per head.*/
+   void **data; /*The cookie of each head.*/
+
+   u16 freeHead;
+   u16 freeCount;
+   u16 lastUsed;   /*The last used index we have handled.*/
+   u16 lastKicked; /*The available index when we notified the device.*/
+   u8 order;
+   u8 polling;     /*No interrupts,the driver polls the used ring.*/
+
+   volatile u16 *notify; /*Modern devices only.*/
+   SpinLock lock;
+} VirtQueue;
+
+typedef struct VirtioDevice{
+   PCIDevice *pci;
+   u8 modern;
+   u16 io;   /*The I/O port base of legacy devices.*/
+
+   /*These are for modern devices.*/
+   volatile u8 *common;
+   volatile u8 *isr;
+   volatile u8 *config;
+   volatile u8 *notify;
+   u32 notifyMultiplier;
+
+   u64 features; /*Negotiated.*/
+} VirtioDevice;
+
+#define VIRTIO_PCI_VENDOR              0x1af4
+
+/*Device status.*/
+#define VIRTIO_STATUS_ACKNOWLEDGE      0x01
+#define VIRTIO_STATUS_DRIVER           0x02
+#define VIRTIO_STATUS_DRIVER_OK        0x04
+#define VIRTIO_STATUS_FEATURES_OK      0x08
+#define VIRTIO_STATUS_FAILED           0x80
+
+/*Feature bits,common to all devices.*/
+#define VIRTIO_RING_F_INDIRECT_DESC    28
+#define VIRTIO_RING_F_EVENT_IDX        29
+#define VIRTIO_F_VERSION_1             32
+
+/*Descriptor flags.*/
+#define VIRTQ_DESC_F_NEXT              0x1
+#define VIRTQ_DESC_F_WRITE             0x2
+#define VIRTQ_DESC_F_INDIRECT          0x4
+
+#define VIRTQ_AVAIL_F_NO_INTERRUPT     0x1
+#define VIRTQ_USED_F_NO_NOTIFY         0x1
+
+#define VIRTQUEUE_MAX_SIZE             256
+#define VIRTQUEUE_MAX_INDIRECT         4
+
+inline int virtioHasFeature(VirtioDevice *device,int bit)
+   __attribute__ ((always_inline));
+
+inline int virtioHasFeature(VirtioDevice *device,int bit)
+{
+   return !!(device->features & (1ul << bit));
+}
+
+int initVirtioDevice(VirtioDevice *device,PCIDevice *pci);
+int virtioReset(VirtioDevice *device);
+int virtioSetStatus(VirtioDevice *device,u8 status);
+int virtioNegotiateFeatures(VirtioDevice *device,u64 wanted);
+int virtioReadConfig(VirtioDevice *device,u32 offset,void *buf,u32 size);
+u8 virtioReadISR(VirtioDevice *device);
+
+int virtioSetupQueue(VirtioDevice *device,VirtQueue *queue,u16 index);
+int virtioFreeQueue(VirtQueue *queue);
+
+/*The caller must hold queue->lock for these functions below.*/
+int virtqueueAdd(VirtQueue *queue,VirtQueueBuffer *buffers,
+                 int out,int in,void *data);
+int virtqueueKick(VirtQueue *queue);
+void *virtqueueGetBuffer(VirtQueue *queue,u32 *length);
+int virtqueueEnableInterrupt(VirtQueue *queue);
@@ -0,0 +1,57 @@
+#pragma once
+#include <core/const.h>
+#include <filesystem/virtual.h>
+
+#define IORING_MAX_ENTRIES   1024 /*The most submission entries of a ring.*/
+#define IORING_MAX_BUFFERS   64   /*The most fixed buffers.*/
+
+#define IORING_OP_NOP        0
+#define IORING_OP_READ       1
+#define IORING_OP_WRITE      2
+#define IORING_OP_OPEN       3
+#define IORING_OP_CLOSE      4
+#define IORING_OP_FSYNC      5
+#define IORING_OP_POLL       6
+
+#define IORING_FIXED         0x1 /*The buffer is in the fixed buffer bufferIndex.*/
+
+#define IORING_REGISTER_BUFFERS     0
+#define IORING_UNREGISTER_BUFFERS   1
+
+typedef struct IORingSubmission{ /*64 bytes,never cross the pages.*/
+   u8 opcode;
+   u8 flags;
+   u16 bufferIndex;
+   s32 fd;
+   s64 offset;       /*-1 uses and moves the seek of the file.*/
+   u64 address;      /*The buffer,or the path of open.*/
+   u32 length;
+   u32 mode;         /*The mode of open,or the events of poll.*/
+   u64 userData;     /*Copied to the completion.*/
+   u8 reserved[24];
+} __attribute__ ((packed)) IORingSubmission;
+
+typedef struct IORingCompletion{
+   u64 userData;
+   s32 result;
+   u32 flags;
+} __attribute__ ((packed)) IORingCompletion;
+
+typedef struct IORingHeader{ /*The first page of the mapping.*/
+   u32 submissionHead; /*Moved by the kernel.*/
+   u32 submissionTail; /*Moved by the task.*/
+   u32 submissionMask;
+   u32 submissionEntries;
+   u32 submissionOffset; /*The submission entries,from the start of the mapping.*/
+   u32 completionHead; /*Moved by the task.*/
+   u32 completionTail; /*Moved by the kernel.*/
+   u32 completionMask;
+   u32 completionEntries;
+   u32 completionOffset;
+} IORingHeader;
+
+int doIORingSetup(u32 entries,UserSpace(u64) *address);
+   /*Return the fd of the ring,the header is at *address.*/
+int doIORingEnter(int fd,u32 submit);
+   /*Submit up to submit entries,return how many were submitted.*/
+int doIORingRegister(int fd,int opcode,UserSpace(const IOVector) *vector,int count);
@@ -0,0 +1,11 @@
+#pragma once
+#include <core/const.h>
+#include <filesystem/virtual.h>
+
+#define PIPE_BUF     4096 /*Writes up to it are atomic.*/
+#define PIPE_PAGES   16   /*The size of the ring,64KB.*/
+
+int openFifo(VFSDentry *dentry,VFSFile *file,int mode);
+   /*The open function of the FIFOs,for the file systems.*/
+
+int doPipe(UserSpace(int) *fds);
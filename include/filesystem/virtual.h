@@ -4,6 +4,7 @@
 #include <core/hlist.h>
 #include <cpu/spinlock.h>
 #include <cpu/atomic.h>
+#include <cpu/rcu.h>
 #include <task/semaphore.h>
 #include <block/pagecache.h>
 
@@ -13,8 +14,10 @@ typedef struct VFSFile VFSFile;
 typedef struct VFSDentry VFSDentry;
 typedef struct FileSystemMount FileSystemMount;
 typedef struct FileSystem FileSystem;
+typedef struct Pipe Pipe;
 
-typedef int (*VFSDirFiller)(void *data,u8 isDir,u64 length,const char *name);
+typedef int (*VFSDirFiller)(void *data,u64 ino,u64 mode,u64 size,
+                  u64 length,const char *name);
 
 typedef struct TaskFileSystem{
    AtomicType ref;
@@ -22,11 +25,31 @@ typedef struct TaskFileSystem{
    VFSDentry *pwd;
 } TaskFileSystem;
 
+typedef struct TaskFileTable{
+   RCUHead rcu;
+   unsigned int max; /*The number of the fds.*/
+   VFSFile **fd;
+   u64 *open;        /*Bit fd is set if fd is used or reserved.*/
+   u64 *closeOnExec; /*Bit fd is set if fd is closed by execve.*/
+} TaskFileTable;
+
 typedef struct TaskFiles{
    AtomicType ref;
-   VFSFile *fd[TASK_MAX_FILES];
+   SpinLock lock;       /*For writing,readers use RCU.*/
+   unsigned int next;   /*The fds below it are used.*/
+   TaskFileTable *table;
+
+   TaskFileTable embedded; /*Most tasks don't need more.*/
+   VFSFile *embeddedFd[TASK_INIT_FILES];
+   u64 embeddedOpen[TASK_INIT_FILES / 64];
+   u64 embeddedCloseOnExec[TASK_INIT_FILES / 64];
 } TaskFiles;
 
+typedef struct IOVector{ /*struct iovec.*/
+   UserSpace(void) *base;
+   u64 length;
+} IOVector;
+
 typedef struct VFSFileOperation
 {
    int (*readDir)(VFSFile *file,VFSDirFiller filler,void *data);
@@ -35,18 +58,29 @@ typedef struct VFSFileOperation
    int (*lseek)(VFSFile *file,s64 offset,int type);
    int (*close)(VFSFile *file);
    int (*ioctl)(VFSFile *file,int cmd,UserSpace(void) *data);
+   int (*fsync)(VFSFile *file);
+   int (*splicePage)(VFSFile *file,PhysicsPage *page,u64 offset,u64 length);
+      /*Keep the reference of page if it returns a positive number.*/
+   int (*poll)(VFSFile *file);
+      /*Return the VFS_POLL_* events which are ready now.*/
 } VFSFileOperation;
 
 typedef struct VFSINodeOperation
 {
-   int (*mkdir)(VFSDentry *dentry,const char *name);
-   int (*unlink)(VFSDentry *result);
+   int (*mkdir)(VFSDentry *dentry,VFSDentry *result,const char *name);
+   int (*create)(VFSDentry *dentry,VFSDentry *result,const char *name);
+   int (*mkfifo)(VFSDentry *dentry,VFSDentry *result,const char *name);
+   int (*unlink)(VFSDentry *dentry,VFSDentry *result);
+      /*The VFS holds dentry->inode->semaphore when calling them.*/
    int (*lookUp)(VFSDentry *dentry,VFSDentry *result,const char *name);
    int (*open)(VFSDentry *dentry,VFSFile *file,int mode);
+   int (*truncate)(VFSINode *inode,u64 size);
+   int (*release)(VFSINode *inode);
 } VFSINodeOperation;
 
 typedef struct VFSFile{
    AtomicType ref;
+   RCUHead rcu; /*getTaskFile may see it after it is closed.*/
 
    int mode;
    VFSDentry *dentry;
@@ -55,6 +89,18 @@ typedef struct VFSFile{
    VFSFileOperation *operation;
 } VFSFile;
 
+#define VFS_NAME_MAX         255
+#define VFS_PATH_MAX         4096
+#define VFS_SPLICE_MAX       0x7ffff000ul /*The most bytes moved by spliceFile.*/
+#define VFS_IOVECTOR_MAX     1024 /*The most segments of readv and writev.*/
+#define VFS_IOVECTOR_FAST    8    /*Fewer segments are copied to the stack.*/
+#define VFS_DENTRY_INLINE    32 /*Names shorter than it are in VFSDentry.*/
+
+#define VFS_POLL_IN          0x01 /*Can read without waiting.*/
+#define VFS_POLL_OUT         0x04 /*Can write without waiting.*/
+#define VFS_POLL_ERR         0x08 /*The writes fail,no readers.*/
+#define VFS_POLL_HUP         0x10 /*No writers.*/
+
 typedef struct VFSDentry{
    AtomicType ref;
 
@@ -62,14 +108,21 @@ typedef struct VFSDentry{
    VFSDentry *parent;
    const char *name;
    u64 hash;
+   u16 length;   /*The length of name,without '\0'.*/
 
    FileSystemMount *mnt; 
    FileSystemMount *mounted;
+   AtomicType mounting; /*Set while it is a mount point,see doMount.*/
 
    HashListNode node;
+   u8 negative; /*The file does not exist,see VFS_NEGATIVE_*.*/
+   ListHead lru;  /*For negative and unused dentries.*/
+   RCUHead rcu;
+   char shortName[VFS_DENTRY_INLINE];
 } VFSDentry;
 
 typedef struct VFSINode{
+   u64 ino;   /*The inode number,for stat and getdents64.*/
    u64 start;
    u64 size;
    u64 inodeStart;
@@ -81,6 +134,7 @@ typedef struct VFSINode{
    Semaphore semaphore;
 
    PageCache cache;
+   Pipe *pipe; /*For FIFOs,see pipe.c .*/
 } VFSINode;
 
 typedef struct FileSystemMount{
@@ -93,6 +147,8 @@ typedef struct FileSystemMount{
 
 typedef struct FileSystem{
    int (*mount)(BlockDevicePart *part,FileSystemMount *mnt);
+   int (*mediaChanged)(BlockDevicePart *part);
+      /*Optional,rebuild what the file system caches for the volume on part.*/
    ListHead list;
    const char *name;
 
@@ -106,6 +162,10 @@ typedef struct FileSystem{
 #define O_RDWR      0x0003 /*Read And Write.*/
 #define O_CLOEXEC   0x0010 /*Close On Exec.*/
 #define O_DIRECTORY 0x0020 /*Must Be A Directory.*/
+#define O_CREAT     0x0040 /*Create It If It Doesn't Exist.*/
+#define O_EXCL      0x0080 /*With O_CREAT,It Must Not Exist.*/
+#define O_TRUNC     0x0100 /*Truncate It To Zero.*/
+#define O_SYNC      0x0200 /*Write It Back Before write Returns.*/
 
 #define S_IFMT   00170000
 #define S_IFSOCK 00140000
@@ -146,6 +206,25 @@ typedef struct FileSystem{
 #define SEEK_CUR 1
 #define SEEK_END 2
 
+#define AT_FDCWD       -100   /*fstatat looks up from the current directory.*/
+#define AT_EMPTY_PATH  0x1000 /*fstatat with "" gets the dirfd itself.*/
+
+typedef struct VFSDirEntry64{ /*The records of getdents64.*/
+   u64 ino;
+   u64 size;
+   u16 length; /*The length of the record,a multiple of 8.*/
+   u8 type;    /*The S_IFMT bits of the mode,>> 12.*/
+   char name[]; /*Ends with '\0'.*/
+} __attribute__ ((packed)) VFSDirEntry64;
+
+typedef struct VFSStat{ /*struct stat.*/
+   u64 ino;
+   u64 mode;
+   u64 size;
+   u64 blockSize; /*The preferred size of I/O.*/
+   u64 blocks;    /*The number of 512 bytes blocks.*/
+} VFSStat;
+
 int registerFileSystem(FileSystem *system);
 FileSystem *lookForFileSystem(const char *name);
 BlockDevicePart *openBlockDeviceFile(const char *path);
@@ -158,20 +237,58 @@ int doClose(int fd);
 int doRead(int fd,void *buf,u64 size);
 int doLSeek(int fd,s64 offset,int type);
 int doGetDents64(int fd,void *data,u64 size);
+int doStat(UserSpace(const char) *path,UserSpace(VFSStat) *buf);
+int doFStat(int fd,UserSpace(VFSStat) *buf);
+int doFStatAt(int dirfd,UserSpace(const char) *path,UserSpace(VFSStat) *buf,int flags);
 int doWrite(int fd,const void *buf,u64 size);
+int doPRead(int fd,UserSpace(void) *buf,u64 size,s64 offset);
+int doPWrite(int fd,UserSpace(const void) *buf,u64 size,s64 offset);
+int doReadVector(int fd,UserSpace(const IOVector) *vector,int count);
+int doWriteVector(int fd,UserSpace(const IOVector) *vector,int count);
+int doPReadVector(int fd,UserSpace(const IOVector) *vector,int count,s64 offset);
+int doPWriteVector(int fd,UserSpace(const IOVector) *vector,int count,s64 offset);
 int doChdir(const char *dir);
 int doGetCwd(char *buffer,u64 size);
 int doDup(int fd);
 int doDup2(int fd,int new);
 int doIOControl(int fd,int cmd,void *data);
+int doMakeDir(const char *path);
+int doMakeFifo(UserSpace(const char) *path);
+int doUnlink(const char *path);
+int doRemoveDir(const char *path);
+int doFTruncate(int fd,u64 size);
+int doFSync(int fd);
+int doSendFile(int out,int in,UserSpace(s64) *offset,u64 count);
+int doSplice(int in,UserSpace(s64) *inOffset,int out,UserSpace(s64) *outOffset,u64 count);
 
 VFSFile *vfsGetFile(VFSFile *file);
+VFSFile *getTaskFile(int fd);
+   /*Get the file of current's fd,put it by closeFile.*/
+int allocFileDescriptor(int mode);
+int installFile(int fd,VFSFile *file);
+int releaseFileDescriptor(int fd);
+   /*Reserve a fd,then install the file or release the fd.*/
+int closeFilesOnExec(TaskFiles *files);
 VFSFile *vfsPutFile(VFSFile *file);
 
 VFSFile *openFile(const char *path,int mode);
 int readFile(VFSFile *file,void *buf,u64 size);
 int writeFile(VFSFile *file,const void *buf,u64 size);
+int readFileAt(VFSFile *file,void *buf,u64 size,u64 *seek);
+int writeFileAt(VFSFile *file,const void *buf,u64 size,u64 *seek);
+int readFileVector(VFSFile *file,const IOVector *vector,int count,u64 *seek);
+int writeFileVector(VFSFile *file,const IOVector *vector,int count,u64 *seek);
+   /*The vectors are in the kernel,the buffers may be in the user space.*/
 int closeFile(VFSFile *file);
+int pollFile(VFSFile *file);
 int lseekFile(VFSFile *file,s64 offset,int type);
+int truncateFile(VFSFile *file,u64 size);
+int syncFile(VFSFile *file);
+VFSDentry *createAnonymousDentry(u64 mode);
+VFSFile *openAnonymousFile(VFSDentry *dentry,VFSFileOperation *operation,
+                  void *data,int mode);
+int spliceFile(VFSFile *out,u64 *outSeek,VFSFile *in,u64 *inSeek,u64 count);
 
 int mountRoot(BlockDevicePart *part);
+int vfsInvalidateBlockDevicePart(BlockDevicePart *part);
+int vfsPruneNegativeDentries(void);
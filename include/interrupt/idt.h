@@ -12,3 +12,4 @@
 #define SYSTEM_CALL_INT 0xff
 
 int initIDT(void);
+int loadIDT(void);
@@ -2,9 +2,12 @@
 #include <core/const.h>
 
 int initLocalApic(void);
+int initLocalApicCPU(void);
 u8 getLocalApicID(void);
 
 int localApicSendEOI(void);
 int setupLocalApicTimer(int disable,u32 time);
 u32 getLocalApicTimerCounter(void);
 
+int localApicSendInit(u8 apicID);
+int localApicSendStartup(u8 apicID,u8 vector);
@@ -11,7 +11,8 @@ typedef enum PhysicsPageFlags{
    PageReserved = (1 << 0),
    PageData     = (1 << 1),
    PageSlab     = (1 << 2),
-   PagePageCache= (1 << 3)
+   PagePageCache= (1 << 3),
+   PageDirty    = (1 << 4)  /*Newer than the disk,see setPageDirty.*/
 } PhysicsPageFlags;
 
 typedef struct PhysicsPage{
@@ -40,6 +41,7 @@ PhysicsPage *allocDMAPages(unsigned int order,unsigned int max);
 int dereferencePage(PhysicsPage *page,unsigned int order);
 
 u64 getPhysicsPageCount(void);
+u64 getFreePhysicsPageCount(void);
 PhysicsPage *getMemoryMap(void);
 
 inline void *getPhysicsPageAddress(PhysicsPage *page)
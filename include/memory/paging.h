@@ -5,6 +5,10 @@
 #define PAGE_OFFSET 0x8000000000
 #define PAGE_SIZE   0x1000
 
+#define VMALLOC_START (1024ul * 1024 * 1024 *  768) /*768GB.*/
+#define VMALLOC_END   (1024ul * 1024 * 1024 * 1024) /*1TB.*/
+   /*Only [PAGE_OFFSET,VMALLOC_START) maps the physics memory continuously.*/
+
 #define pa2va(pa) ({ \
    u8 *__ = (u8 *)(pointer)(pa);\
    (void *)(__ + PAGE_OFFSET);\
@@ -34,11 +38,13 @@ typedef struct VirtualMemoryArea {
    u64 start;
    u64 length;
    int prot;
+   int flags; /*MAP_SHARED or MAP_PRIVATE.*/
 } VirtualMemoryArea;
 
 #define MAP_FIXED     0x01
 #define MAP_ANONYMOUS 0x02
 #define MAP_PRIVATE   0x04
+#define MAP_SHARED    0x08
 
 #define PROT_NONE  0x00
 #define PROT_READ  0x01
@@ -49,6 +55,8 @@ void *doMMap(VFSFile *file,u64 offset,pointer address,u64 len,
           int prot,int flags);
 
 int initPaging(void);
+int initPagingCache(void);
+u64 pagingIdentityMap(int map);
 
 inline int pagingFlushTLB(void) __attribute__ ((always_inline));
 
@@ -5,10 +5,14 @@
 typedef u32 SlabObjDescriptor;
 /*It's next free index.*/
 
+typedef void (*SlabConstructor)(void *obj);
+/*Called once when a slab is allocated,the objects must be freed in the same state.*/
+
 typedef struct LocalSlabCache{
    u32 limit;
    u32 avail;
    u32 batchCount;
+   s64 active; /*Allocated minus freed on this cpu,see slabstat.*/
 
    void *data[0];
 } LocalSlabCache;
@@ -24,6 +28,11 @@ typedef struct SlabCache{
 
    u32 freeLimit;
    u32 freeObjCount;
+   u32 slabCount;
+
+   const char *name; /*For slabstat,0 for the anonymous caches.*/
+   SlabConstructor constructor;
+   ListHead list;
 
    ListHead slabFree;
    ListHead slabFull;
@@ -45,4 +54,7 @@ int initSlab(void);
 void *allocByCache(SlabCache *cache);
 int freeByCache(SlabCache *cache,void *obj);
 SlabCache *createCache(unsigned int size,unsigned int align);
+SlabCache *createObjectCache(const char *name,unsigned int size,unsigned int align,
+                  SlabConstructor constructor);
+   /*A cache for one type,the objects are exactly size bytes.*/
 int destoryCache(SlabCache *cache);
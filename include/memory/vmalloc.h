@@ -1,5 +1,11 @@
 #pragma once
 #include <core/const.h>
+#include <memory/user.h>
 
 void *vmalloc(u64 size);
 int vfree(void *obj); /*See also src/memory/paging.c .*/
+
+void *vmapUser(UserSpace(void) *address,u64 length);
+   /*Pin the pages of the current task and map them into the vmalloc area too.*/
+   /*Return the kernel address of address,or an error pointer.*/
+int vunmap(void *obj); /*Unmap and unpin the pages of vmapUser.*/
@@ -6,7 +6,8 @@
 #include <interrupt/interrupt.h>
 
 #define TASK_KERNEL_STACK_SIZE (4096*2)
-#define TASK_MAX_FILES         20
+#define TASK_MAX_FILES         4096 /*The fd tables grow up to it.*/
+#define TASK_INIT_FILES        64   /*The fd table in TaskFiles.*/
 
 typedef struct VFSDentry VFSDentry;
 typedef struct VFSFile VFSFile;
@@ -89,6 +90,7 @@ int doFork(IRQRegisters *reg,ForkFlags flags);
 int createKernelTask(KernelTask task,void *arg);
 int wakeUpTask(Task *task,TaskState state);
 Task *lookForTaskByPID(unsigned int pid);
+Task *createIdleTask(void);
 
 int initTask(void) __attribute__ ((noreturn));
 /*It will never return!!!It will be called in the end of kmain.*/
@@ -20,6 +20,10 @@ inline int wakeUpLocked(WaitQueue *queue)
    __attribute__ ((always_inline));
 inline int wakeUp(WaitQueue *queue)
    __attribute__ ((always_inline));
+inline int wakeUpAllLocked(WaitQueue *queue)
+   __attribute__ ((always_inline));
+inline int wakeUpAll(WaitQueue *queue)
+   __attribute__ ((always_inline));
 inline int addToWaitQueue(WaitQueue *wait,WaitQueue *head)
    __attribute__ ((always_inline));
 inline int removeFromWaitQueueLocked(WaitQueue *wait)
@@ -57,6 +61,13 @@ inline int wakeUpLocked(WaitQueue *queue)
    return wakeUpTask(task,0); /*Wake up it!*/
 }
 
+inline int wakeUpAllLocked(WaitQueue *queue)
+{
+   for(ListHead *list = queue->list.next;list != &queue->list;list = list->next)
+      wakeUpTask(listEntry(list,WaitQueue,list)->task,0);
+   return 0;
+}
+
 inline int removeFromWaitQueueLocked(WaitQueue *wait)
 {
    return listDelete(&wait->list);
@@ -82,6 +93,14 @@ inline int wakeUp(WaitQueue *queue)
    return 0;
 }
 
+inline int wakeUpAll(WaitQueue *queue)
+{
+   lockSpinLock(&queue->lock);
+   wakeUpAllLocked(queue);
+   unlockSpinLock(&queue->lock);
+   return 0;
+}
+
 inline int removeFromWaitQueue(WaitQueue *head,WaitQueue *wait)
 {
    lockSpinLock(&head->lock);
@@ -1,3 +1,4 @@
 #pragma once
 
 int initLocalTime(void);
+int initLocalTimeCPU(void);
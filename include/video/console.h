@@ -4,6 +4,7 @@
 int printk(const char *string, ...) __attribute__ ((format(printf,1,2)));
 int printkInColor(u8 red,u8 green,u8 blue,const char *string, ...)
                  __attribute__ ((format(printf,4,5)));
+int sprintk(char *buf,const char *string, ...) __attribute__ ((format(printf,2,3)));
 #if defined(CONFIG_DEBUG)
 
 int printl(const char *string, ...) __attribute__ ((format(printf,1,2)));
@@ -4,6 +4,7 @@
 #include <acpi/acpi.h>
 #include <memory/paging.h>
 #include <video/console.h>
+#include <cpu/smp.h>
 
 typedef struct ACPIHeader{
    u32 signature;
@@ -101,6 +102,8 @@ static int parseApic(ACPIHeaderApic *apic)
             LocalApic *localApic = (LocalApic *)apicHeader;
             printk("Found CPU: Processor ID => %d, Apic ID => %d \n",
                (int)localApic->apicProcessorID,(int)localApic->apicID);
+            if(localApic->flags & 0x1)
+               registerCPU(localApic->apicID); /*Enabled.*/
             break;
          }
       case APIC_TYPE_IO_APIC:
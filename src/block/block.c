@@ -1,18 +1,203 @@
 #include <core/const.h>
+#include <core/math.h>
 #include <block/block.h>
 #include <filesystem/virtual.h>
 #include <filesystem/devfs.h>
 #include <memory/kmalloc.h>
+#include <memory/buddy.h>
+#include <memory/paging.h>
+#include <memory/user.h>
+#include <task/semaphore.h>
+#include <video/console.h>
+#include <cpu/io.h>
+#include <task/task.h>
+#include <time/time.h>
 #include <lib/string.h>
 
+typedef struct MBRPartition{
+   u8 boot;
+   u8 startCHS[3];
+   u8 type;
+   u8 endCHS[3];
+   u32 start;
+   u32 count;
+} __attribute__ ((packed)) MBRPartition;
+
+typedef struct GPTHeader{
+   u8 signature[8];
+   u32 revision;
+   u32 headerSize;
+   u32 headerCRC;
+   u32 reserved;
+   u64 current;
+   u64 backup;
+   u64 firstUsable;
+   u64 lastUsable;
+   u8 guid[16];
+   u64 entries;     /*The LBA of the partition entries.*/
+   u32 entryCount;
+   u32 entrySize;
+   u32 entriesCRC;
+} __attribute__ ((packed)) GPTHeader;
+
+typedef struct GPTEntry{
+   u8 type[16];     /*All zero means unused.*/
+   u8 guid[16];
+   u64 first;
+   u64 last;        /*Inclusive.*/
+   u64 attributes;
+   u16 name[36];
+} __attribute__ ((packed)) GPTEntry;
+
+#define BLOCK_SECTOR_SIZE           512 /*The default logical sector size.*/
+
+#define MBR_PARTITION_OFFSET        446
+#define MBR_SIGNATURE_OFFSET        510
+#define MBR_SIGNATURE               0xaa55
+
+#define MBR_TYPE_EMPTY              0x00
+#define MBR_TYPE_EXTENDED_CHS       0x05
+#define MBR_TYPE_EXTENDED_LBA       0x0f
+#define MBR_TYPE_GPT                0xee
+
+#define GPT_MAX_ENTRIES             128
+
+#define BLOCK_STAT_BUFFER_ORDER     1
+#define BLOCK_STAT_LINE_MAX         256 /*The first line of a part.*/
+#define BLOCK_STAT_BUCKET_MAX       32  /*" 2^NN:<u64>" or "  write".*/
+
+#define BLOCK_MEDIA_MIN_INTERVAL    1000  /*1 second.*/
+#define BLOCK_MEDIA_MAX_INTERVAL    16000
+
+static int blockStatRead(VFSFile *file,UserSpace(void) *buf,u64 size,u64 *seek);
+
+static VFSFileOperation blockStatOperation = {
+   .read = &blockStatRead
+};
+
 static ListHead parts;
 static ListHead blockDevices;
+static Semaphore blockDevicesSemaphore; /*For the lists above.*/
+static u8 blockMediaTaskCreated = 0;
 
 static int initBlockDevice(void)
 {
+   initSemaphore(&blockDevicesSemaphore);
    return initList(&parts) | initList(&blockDevices);
 }
 
+static int registerBlockStat(void)
+{
+   return devfsRegisterDevice(&blockStatOperation,"blockstat");
+}
+
+static inline BlockStatCPU *getBlockStatCPU(BlockStat *stat)
+{ /*The caller must disable the preemption.*/
+   return &stat->cpu[getCPU()->index];
+}
+
+static int accountBlockIO(BlockStat *stat,int read,u64 size,u64 cycles)
+{ /*The caller must disable the preemption.*/
+   BlockStatCPU *cpu = getBlockStatCPU(stat);
+   int bucket = 0;
+   if(cycles)
+      asm("bsrq %1,%q0":"=r"(bucket):"r"(cycles)); /*Log2.*/
+   if(bucket >= BLOCK_STAT_BUCKETS)
+      bucket = BLOCK_STAT_BUCKETS - 1;
+   ++cpu->ios[read];
+   cpu->sectors[read] += size / 512; /*Always in 512 bytes.*/
+   cpu->cycles[read] += cycles;
+   ++cpu->histogram[read][bucket];
+   return 0;
+}
+
+static int sumBlockStat(BlockStat *stat,BlockStatCPU *sum)
+{ /*The counters may move while we are reading them,it doesn't matter.*/
+   memset(sum,0,sizeof(*sum));
+   for(unsigned int i = 0;i < CPU_MAX;++i)
+   {
+      BlockStatCPU *cpu = &stat->cpu[i];
+      for(int read = 0;read < 2;++read)
+      {
+         sum->ios[read] += cpu->ios[read];
+         sum->sectors[read] += cpu->sectors[read];
+         sum->cycles[read] += cpu->cycles[read];
+         for(int j = 0;j < BLOCK_STAT_BUCKETS;++j)
+            sum->histogram[read][j] += cpu->histogram[read][j];
+      }
+      sum->inflight += cpu->inflight;
+   }
+   return 0;
+}
+
+static char *printBlockStat(char *text,char *end,const char *name,int index,BlockStat *__stat)
+{ /*Return 0 if there isn't enough room before end.*/
+   BlockStatCPU sum,*stat = &sum;
+   if(end - text < BLOCK_STAT_LINE_MAX)
+      return 0;
+   sumBlockStat(__stat,&sum);
+   text += sprintk(text,"%s",name);
+   if(index >= 0) /*-1 means the whole device.*/
+      text += sprintk(text,"%d",index);
+   text += sprintk(text," reads %lu sectors %lu cycles %lu "
+      "writes %lu sectors %lu cycles %lu inflight %d\n",
+      stat->ios[1],stat->sectors[1],stat->cycles[1],
+      stat->ios[0],stat->sectors[0],stat->cycles[0],
+      (int)stat->inflight);
+   for(int read = 1;read >= 0;--read)
+   {
+      if(!stat->ios[read])
+         continue;
+      if(end - text < BLOCK_STAT_BUCKET_MAX * 2)
+         return 0;
+      text += sprintk(text,read ? "  read" : "  write");
+      for(int i = 0;i < BLOCK_STAT_BUCKETS;++i)
+      {
+         if(!stat->histogram[read][i])
+            continue;
+         if(end - text < BLOCK_STAT_BUCKET_MAX * 2)
+            return 0; /*Room for it and "\n".*/
+         text += sprintk(text," 2^%d:%lu",i,stat->histogram[read][i]);
+            /*Like this: 2^12:5,at least 4096 cycles.*/
+      }
+      text += sprintk(text,"\n");
+   }
+   return text;
+}
+
+static int blockStatRead(VFSFile *file,UserSpace(void) *buf,u64 size,u64 *seek)
+{
+   PhysicsPage *page = allocPages(BLOCK_STAT_BUFFER_ORDER);
+   if(!page)
+      return -ENOMEM;
+   char *start = (char *)getPhysicsPageAddress(page);
+   char *text = start;
+   char *end = start + (PHYSICS_PAGE_SIZE << BLOCK_STAT_BUFFER_ORDER);
+   char *next = text;
+   downSemaphore(&blockDevicesSemaphore);
+   for(ListHead *list = blockDevices.next;list != &blockDevices && next;list = list->next)
+   {
+      BlockDevice *device = listEntry(list,BlockDevice,list);
+      if((next = printBlockStat(text,end,device->name,-1,&device->stat)))
+         text = next;
+      for(BlockDevicePart *part = device->parts;part && next;part = part->next)
+         if((next = printBlockStat(text,end,device->name,part->index,&part->stat)))
+            text = next; /*Drop the part which doesn't fit,and stop.*/
+   }
+   upSemaphore(&blockDevicesSemaphore);
+   int ret = 0;
+   if(*seek < text - start)
+   {
+      ret = min(size,text - start - *seek);
+      if(memcpyUser0(buf,start + *seek,ret))
+         ret = -EFAULT;
+      else
+         *seek += ret;
+   }
+   freePages(page,BLOCK_STAT_BUFFER_ORDER);
+   return ret;
+}
+
 static int syncBlockDevice(void)
 {
    for(ListHead *list = parts.next;list != &parts;list = list->next)
@@ -24,44 +209,223 @@ static int syncBlockDevice(void)
    return -ENODEV;
 }
 
+static int blockMediaChanged(BlockDevice *device)
+{
+   printk("The media of %s is changed.\n",device->name);
+   for(BlockDevicePart *part = device->parts;part;part = part->next)
+      (vfsInvalidateBlockDevicePart(part)),(invalidateBlockCache(part));
+   return 0;
+}
+
+static int blockMediaTask(void *arg)
+{
+   Task *current = getCurrentTask();
+   for(;;)
+   {
+      u64 now = getTicks();
+      u64 wait = BLOCK_MEDIA_MAX_INTERVAL * TIMER_HZ / MSEC_PER_SEC;
+      downSemaphore(&blockDevicesSemaphore);
+      for(ListHead *list = blockDevices.next;list != &blockDevices;list = list->next)
+      {
+         BlockDevice *device = listEntry(list,BlockDevice,list);
+         if(!device->checkMedia)
+            continue;
+         u64 interval = device->mediaInterval * TIMER_HZ / MSEC_PER_SEC;
+         if(device->lastIO + interval > device->nextMediaCheck)
+            device->nextMediaCheck = device->lastIO + interval;
+               /*The media was used recently,it is still there.*/
+         if(now >= device->nextMediaCheck)
+         {
+            if((*device->checkMedia)(device->data) > 0)
+            {
+               blockMediaChanged(device);
+               device->mediaInterval = BLOCK_MEDIA_MIN_INTERVAL;
+            }else if(device->mediaInterval < BLOCK_MEDIA_MAX_INTERVAL)
+            {
+               device->mediaInterval *= 2; /*Back off.*/
+            }
+            now = getTicks();
+            interval = device->mediaInterval * TIMER_HZ / MSEC_PER_SEC;
+            device->nextMediaCheck = now + interval;
+         }
+         if(device->nextMediaCheck - now < wait)
+            wait = device->nextMediaCheck - now;
+      }
+      upSemaphore(&blockDevicesSemaphore);
+      current->state = TaskUninterruptible;
+      scheduleTimeout(wait * MSEC_PER_SEC / TIMER_HZ);
+   }
+   return 0;
+}
+
+static BlockDevicePart *createBlockDevicePart(BlockDevice *device,
+                            u64 start,u64 end)
+{
+   BlockDevicePart *part = kmalloc(sizeof(BlockDevicePart));
+   if(!part)
+      return 0;
+   part->next = 0;
+   part->start = start;
+   part->end = end;
+   part->fileSystem = 0;
+   part->device = device;
+   part->index = 0;
+   memset(&part->stat,0,sizeof(part->stat));
+   initBlockCache(part);
+   return part;
+}
+
+static int addBlockDevicePart(BlockDevice *device,BlockDevicePart **last,
+                              u64 lba,u64 count)
+{
+   u64 start = lba * device->sectorSize;
+   u64 end = (lba + count) * device->sectorSize;
+   if(count == 0 || end <= start || end > device->end)
+      return -EINVAL; /*Ignore broken entries.*/
+   BlockDevicePart *part = createBlockDevicePart(device,start,end);
+   if(!part)
+      return -ENOMEM;
+   (*last)->next = part;
+   part->index = (*last)->index + 1;
+   *last = part;
+   ++device->partCount;
+   return 0;
+}
+
+static int parseGPT(BlockDevice *device,BlockDevicePart **last,u8 *buf)
+{
+   GPTHeader *header = (GPTHeader *)buf;
+   u32 sectorSize = device->sectorSize;
+   if((*device->read)(device->data,sectorSize,sectorSize,buf))
+      return -EIO; /*The GPT header is at LBA 1.*/
+   if(memcmp(header->signature,"EFI PART",sizeof(header->signature)))
+      return -EINVAL;
+   u64 entries = header->entries * sectorSize;
+   u32 count = header->entryCount;
+   u32 size = header->entrySize;
+   if(size < sizeof(GPTEntry) || sectorSize % size)
+      return -EINVAL;
+   if(count > GPT_MAX_ENTRIES)
+      count = GPT_MAX_ENTRIES;
+
+   for(u32 i = 0;i < count;++i)
+   {
+      u32 offset = (i * size) % sectorSize;
+      if(offset == 0) /*Read the next sector of entries.*/
+         if((*device->read)(device->data,entries + i * size,
+                               sectorSize,buf))
+            return -EIO;
+      GPTEntry *entry = (GPTEntry *)(buf + offset);
+      int used = 0;
+      for(int j = 0;j < sizeof(entry->type);++j)
+         used |= entry->type[j];
+      if(!used || entry->last < entry->first)
+         continue;
+      addBlockDevicePart(device,last,
+         entry->first,entry->last - entry->first + 1);
+   }
+   return 0;
+}
+
+static int parsePartitions(BlockDevice *device,BlockDevicePart *whole)
+{
+   BlockDevicePart *last = whole;
+   int ret = 0;
+   u8 *buf = kmalloc(device->sectorSize);
+   if(!buf)
+      return -ENOMEM;
+   if((*device->read)(device->data,0,device->sectorSize,buf))
+      goto failed;
+   if(*(u16 *)(buf + MBR_SIGNATURE_OFFSET) != MBR_SIGNATURE)
+      goto out; /*No partition table,only the whole disk.*/
+
+   MBRPartition mbr[4];
+   memcpy(mbr,buf + MBR_PARTITION_OFFSET,sizeof(mbr));
+   for(int i = 0;i < sizeof(mbr) / sizeof(mbr[0]);++i)
+   {
+      switch(mbr[i].type)
+      {
+      case MBR_TYPE_EMPTY:
+         break;
+      case MBR_TYPE_GPT: /*A protective MBR.*/
+         ret = parseGPT(device,&last,buf);
+         goto out;
+      case MBR_TYPE_EXTENDED_CHS:
+      case MBR_TYPE_EXTENDED_LBA: /*Logical partitions are not supported.*/
+         break;
+      default:
+         addBlockDevicePart(device,&last,mbr[i].start,mbr[i].count);
+         break;
+      }
+   }
+out:
+   kfree(buf);
+   return ret;
+failed:
+   kfree(buf);
+   return -EIO;
+}
+
 int registerBlockDevice(BlockDevice *device,const char *devfs)
 {
+   memset(&device->stat,0,sizeof(device->stat));
+   if(!device->sectorSize)
+      device->sectorSize = BLOCK_SECTOR_SIZE;
+   device->lastIO = device->nextMediaCheck = 0;
+   device->mediaInterval = BLOCK_MEDIA_MIN_INTERVAL;
+   device->name[0] = '\0';
+   device->writeback = 0;
+   if(devfs && strlen(devfs) < sizeof(device->name))
+      memcpy(device->name,devfs,strlen(devfs) + 1);
    switch(device->type)
    {
    case BlockDeviceCDROM:
       {
-         BlockDevicePart *part
-            = kmalloc(sizeof(BlockDevicePart));
+         BlockDevicePart *part =
+            createBlockDevicePart(device,0,device->end);
          if(!part)
             return -ENOMEM;
-         part->next = 0;
-         part->start = 0;
-         part->end = device->end;
-         part->fileSystem = 0;
-         part->device = device;
          device->parts = part;
          device->partCount = 1;
-         listAddTail(&part->list,&parts);
          /*CDROM has only one part.*/
       }
       break;
-   case BlockDeviceDisk: /*No support.*/
-      return -ENOSYS;
+   case BlockDeviceDisk:
+      {
+         BlockDevicePart *part =
+            createBlockDevicePart(device,0,device->end);
+         if(!part)
+            return -ENOMEM;
+         device->parts = part;
+         device->partCount = 1;
+         parsePartitions(device,part);
+         /*The first part is the whole disk,others are partitions.*/
+      }
+      break;
    default:
       return -EINVAL;
    }
+   downSemaphore(&blockDevicesSemaphore);
+   for(BlockDevicePart *part = device->parts;part;part = part->next)
+      listAddTail(&part->list,&parts);
    listAddTail(&device->list,&blockDevices);
+   if(device->checkMedia && !blockMediaTaskCreated)
+      blockMediaTaskCreated = !createKernelTask(&blockMediaTask,0);
+         /*Only one task polls all removable devices.*/
+   upSemaphore(&blockDevicesSemaphore);
+   if(device->write)
+      startBlockWriteback(device);
    if(devfs)
    {
       BlockDevicePart *part = device->parts;
       int len = strlen(devfs);
-      char name[len + 2];
+      char name[len + 4];
+      int index = 0;
       memcpy(name,devfs,len);
-      name[len + 0] = '0';
-      name[len + 1] = '\0';
       do{ /*Register the parts of this block device to devfs.*/
+         itoa(index++,name + len,10,0,0,1);
          devfsRegisterBlockDevice(part,name);
-         ++name[len + 0]; /*Like these: sda0,sda1,sda2.....*/
+            /*Like these: sda0,sda1,sda2.....*/
       }while((part = part->next));
    }
    return 0;
@@ -74,13 +438,103 @@ int submitBlockIO(BlockIO *io)
    u64 size = io->size;
    u64 pos = io->start + part->start;
    if(pos + size < pos || pos + size > device->end)
-      return -EINVAL;  
-   if(pos < io->start || pos < part->start)
       return -EINVAL;
-   int ret = (*device->read)(device->data,pos,size,io->buffer);
-   return ret; /*There should have an IO scheduler.*/
-               /*And a waitForBlockIO function.But we don't.*/
+   if(pos < io->start || pos < part->start || pos + size > part->end)
+      return -EINVAL;
+   if(!io->read && !device->write)
+      return -EROFS;
+
+   int ret,read = !!io->read;
+   disablePreemption();
+   ++getBlockStatCPU(&part->stat)->inflight;
+   ++getBlockStatCPU(&device->stat)->inflight;
+   enablePreemption();
+   u64 begin = readTimeStampCounter();
+   if(read)
+      ret = (*device->read)(device->data,pos,size,io->buffer);
+   else
+      ret = (*device->write)(device->data,pos,size,io->buffer);
+      /*There should have an IO scheduler.*/
+      /*And a waitForBlockIO function.But we don't.*/
+   u64 cycles = readTimeStampCounter() - begin;
+   device->lastIO = getTicks();
+   disablePreemption(); /*Stay on this CPU while counting.*/
+   --getBlockStatCPU(&part->stat)->inflight;
+   --getBlockStatCPU(&device->stat)->inflight;
+   if(!ret)
+      (accountBlockIO(&part->stat,read,size,cycles)),
+         (accountBlockIO(&device->stat,read,size,cycles));
+   enablePreemption();
+   return ret;
+}
+
+int flushBlockDevice(BlockDevicePart *part)
+{
+   BlockDevice *device = part->device;
+   if(!device->flush)
+      return 0; /*No volatile write cache.*/
+   return (*device->flush)(device->data);
+}
+
+int transferBlockSectors(BlockSectorTransfer *transfer,void *data,
+          u32 sectorSize,u64 start,u64 size,void *buf,int write)
+{
+   u64 sector = start / sectorSize;
+   u64 offset = start % sectorSize;
+   u8 *bounce = 0;
+   int ret = 0;
+   if(sectorSize > PHYSICS_PAGE_SIZE)
+      return -EINVAL;
+   while(size)
+   {
+      if(offset == 0 && size >= sectorSize &&
+         (pointer)buf >= PAGE_OFFSET && (pointer)buf < VMALLOC_START &&
+         ((pointer)buf & 0x3) == 0)
+      {  /*Transfer the aligned part directly,no copying.*/
+         /*The drivers use va2pa,vmalloc memory isn't continuous.*/
+         u64 count = size / sectorSize;
+         if((ret = (*transfer)(data,sector,count,buf,write)))
+            goto out;
+         sector += count;
+         buf += count * sectorSize;
+         size -= count * sectorSize;
+         continue;
+      }
+      if(!bounce)
+      {
+         PhysicsPage *page = allocPages(0);
+         if(!page)
+            return -ENOMEM;
+         bounce = (u8 *)getPhysicsPageAddress(page);
+      }
+      u64 count = PHYSICS_PAGE_SIZE / sectorSize;
+      u64 length = count * sectorSize - offset;
+      if(length > size)
+         length = size;
+      count = (offset + length + sectorSize - 1) / sectorSize;
+      if(!write || offset || (offset + length) % sectorSize)
+         if((ret = (*transfer)(data,sector,count,bounce,0)))
+            goto out; /*Read it at first,partial sectors need it.*/
+      if(write)
+      {
+         memcpy(bounce + offset,buf,length);
+         if((ret = (*transfer)(data,sector,count,bounce,1)))
+            goto out;
+      }else
+      {
+         memcpy(buf,bounce + offset,length);
+      }
+      sector += count;
+      buf += length;
+      size -= length;
+      offset = 0;
+   }
+out:
+   if(bounce)
+      freePages(getPhysicsPage(bounce),0);
+   return ret;
 }
 
 subsysInitcall(initBlockDevice);
+driverInitcall(registerBlockStat);
 syncInitcall(syncBlockDevice);
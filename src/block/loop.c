@@ -0,0 +1,144 @@
+#include <core/const.h>
+#include <core/math.h>
+#include <block/block.h>
+#include <block/loop.h>
+#include <block/pagecache.h>
+#include <filesystem/virtual.h>
+#include <filesystem/devfs.h>
+#include <memory/buddy.h>
+#include <memory/kmalloc.h>
+#include <memory/paging.h>
+#include <memory/user.h>
+#include <task/semaphore.h>
+#include <lib/string.h>
+
+typedef struct LoopDevice{
+   VFSFile *file;  /*We hold a reference of it.*/
+   VFSINode *inode;
+   int index;
+   BlockDevice block;
+} LoopDevice;
+
+#define LOOP_MAX_DEVICES     8
+#define LOOP_SECTOR_SIZE     512
+
+static int loopIOControl(VFSFile *file,int cmd,UserSpace(void) *data);
+
+static VFSFileOperation loopControlOperation = {
+   .ioctl = &loopIOControl
+};
+
+static LoopDevice *loopDevices[LOOP_MAX_DEVICES];
+static Semaphore loopSemaphore;
+
+static int loopRead(void *data,u64 start,u64 size,void *buf)
+{
+   LoopDevice *loop = (LoopDevice *)data;
+   VFSINode *inode = loop->inode;
+   PageCacheOperation *operation = inode->cache.operation;
+   while(size)
+   {  /*Copy from the page cache of the file directly.*/
+      PhysicsPage *page = (*operation->getPage)(inode,start);
+      if(!page)
+         return -EIO;
+      u64 offset = start & (PAGE_SIZE - 1);
+      u64 length = min(size,PAGE_SIZE - offset);
+      memcpy(buf,getPhysicsPageAddress(page) + offset,length);
+      (*operation->putPage)(page);
+      start += length;
+      buf += length;
+      size -= length;
+   }
+   return 0;
+}
+
+static int loopWrite(void *data,u64 start,u64 size,void *buf)
+{
+   LoopDevice *loop = (LoopDevice *)data;
+   VFSFile *file = loop->file;
+   unsigned long limit = getAddressLimit();
+   u64 seek = start;
+   setKernelAddressLimit(); /*The buffer is in kernel space.*/
+   int ret = (*file->operation->write)(file,buf,size,&seek);
+   setAddressLimit(limit);
+   if(ret < 0)
+      return ret;
+   return (ret == size) ? 0 : -EIO;
+}
+
+BlockDevicePart *loopAttachFile(VFSFile *file)
+{
+   VFSINode *inode = file->dentry->inode;
+   PageCacheOperation *operation = inode->cache.operation;
+   if(!S_ISREG(inode->mode))
+      return makeErrorPointer(-EINVAL);
+   if(!operation || !operation->getPage || !operation->putPage)
+      return makeErrorPointer(-EINVAL); /*No page cache.*/
+   if(inode->size < LOOP_SECTOR_SIZE)
+      return makeErrorPointer(-EINVAL);
+
+   LoopDevice *loop = kmalloc(sizeof(LoopDevice));
+   if(!loop)
+      return makeErrorPointer(-ENOMEM);
+   memset(loop,0,sizeof(*loop));
+   loop->file = vfsGetFile(file);
+   loop->inode = inode;
+   loop->block.data = (void *)loop;
+   loop->block.read = &loopRead;
+   if((file->mode & O_WRONLY) && file->operation->write)
+      loop->block.write = &loopWrite;
+   loop->block.type = BlockDeviceDisk;
+   loop->block.end = inode->size & ~(LOOP_SECTOR_SIZE - 1ul);
+   loop->block.sectorSize = LOOP_SECTOR_SIZE;
+
+   downSemaphore(&loopSemaphore);
+   for(loop->index = 0;loop->index < LOOP_MAX_DEVICES;++loop->index)
+      if(!loopDevices[loop->index])
+         break;
+   if(loop->index == LOOP_MAX_DEVICES)
+      goto failed;
+   char name[8] = "loop";
+   char *end = itoa(loop->index,name + 4,10,0,0,1);
+   *end++ = 'p';
+   *end = '\0'; /*Like this: loop0p0,loop0p1...*/
+   if(registerBlockDevice(&loop->block,name))
+      goto failed;
+   loopDevices[loop->index] = loop;
+   upSemaphore(&loopSemaphore);
+   return loop->block.parts;
+failed:
+   upSemaphore(&loopSemaphore);
+   closeFile(file);
+   kfree(loop);
+   return makeErrorPointer(-EBUSY);
+}
+
+static int loopIOControl(VFSFile *file,int cmd,UserSpace(void) *data)
+{
+   switch(cmd)
+   {
+   case LOOP_SET_FD:
+      {
+         int fd = (int)(pointer)data;
+         VFSFile *backing = getTaskFile(fd);
+         if(!backing)
+            return -EBADF;
+         BlockDevicePart *part = loopAttachFile(backing);
+         closeFile(backing); /*The loop device holds it.*/
+         if(isErrorPointer(part))
+            return getPointerError(part);
+         return ((LoopDevice *)part->device->data)->index;
+      }
+   default:
+      return -EINVAL;
+   }
+}
+
+static int initLoop(void)
+{
+   initSemaphore(&loopSemaphore);
+   memset(loopDevices,0,sizeof(loopDevices));
+   return devfsRegisterDevice(&loopControlOperation,"loopctl");
+}
+
+driverInitcall(initLoop);
@@ -36,8 +36,28 @@ int putPageIntoPageCache(PhysicsPage *page)
    if((retval = atomicAddRet(&page->count,-1)) != 1)
       return retval; 
 
+   if((page->flags & PageDirty) && cache->operation->flushPage)
+      (*cache->operation->flushPage)(page); /*Written by a shared mapping.*/
    removeFromRadixTree(&cache->radix,index);
-   page->flags &= ~(PagePageCache | PageData);
+   page->flags &= ~(PagePageCache | PageData | PageDirty);
    freePages(page,0); /*No one is using the page,free it.*/
    return 0;
 }
+
+int setPageDirty(PhysicsPage *page)
+{
+   if(page->flags & PageDirty)
+      return 0;
+   page->flags |= PageDirty;
+   setRadixTreeTag(&page->cache->radix,page->data,RADIX_TREE_TAG_DIRTY);
+   return 1;
+}
+
+int clearPageDirty(PhysicsPage *page)
+{
+   if(!(page->flags & PageDirty))
+      return 0;
+   page->flags &= ~PageDirty;
+   clearRadixTreeTag(&page->cache->radix,page->data,RADIX_TREE_TAG_DIRTY);
+   return 1;
+}
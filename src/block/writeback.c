@@ -0,0 +1,387 @@
+#include <core/const.h>
+#include <core/math.h>
+#include <block/block.h>
+#include <block/pagecache.h>
+#include <filesystem/virtual.h>
+#include <memory/buddy.h>
+#include <memory/user.h>
+#include <task/semaphore.h>
+#include <task/task.h>
+#include <time/time.h>
+#include <lib/string.h>
+
+#define WRITEBACK_ORDER          5     /*128KB,the largest I/O of the flusher.*/
+#define WRITEBACK_BATCH          (1 << WRITEBACK_ORDER)
+#define WRITEBACK_INTERVAL       500   /*In ms,how often the dirty pages are checked.*/
+#define WRITEBACK_EXPIRE         5000  /*In ms,older dirty pages are written back.*/
+#define WRITEBACK_BACKGROUND     10    /*In percent of the memory,start writing back.*/
+#define WRITEBACK_THROTTLE       20    /*In percent of the memory,writers wait.*/
+#define WRITEBACK_THROTTLE_WAIT  20    /*In ms.*/
+#define WRITEBACK_THROTTLE_MAX   50    /*Give up waiting after 1 second.*/
+#define WRITEBACK_LOW_MEMORY     16    /*Drop clean pages if less than 1/16 is free.*/
+#define WRITEBACK_SHRINK_BATCH   64
+
+static int blockFileRead(VFSFile *file,UserSpace(void) *buf,u64 size,u64 *seek);
+static int blockFileWrite(VFSFile *file,UserSpace(const void) *buf,u64 size,u64 *seek);
+static int blockFileLSeek(VFSFile *file,s64 offset,int type);
+static int blockFileSync(VFSFile *file);
+static int blockFileIOControl(VFSFile *file,int cmd,UserSpace(void) *data);
+
+VFSFileOperation blockDeviceFileOperation = {
+   .read = &blockFileRead,
+   .write = &blockFileWrite,
+   .lseek = &blockFileLSeek,
+   .fsync = &blockFileSync,
+   .ioctl = &blockFileIOControl
+};
+
+static PageCacheOperation blockCacheOperation = {
+   .getPage = 0,
+   .putPage = 0,
+   .flushPage = 0 /*No support for mmap!*/
+};
+
+static AtomicType blockDirtyPages; /*Of all the block devices.*/
+
+static inline u64 blockDirtyLimit(u64 percent)
+{
+   return getPhysicsPageCount() * percent / 100;
+}
+
+static inline int blockWakeUpWriteback(BlockDevice *device)
+{ /*It sleeps in TaskInterruptible only when it is idle,*/
+  /*so we never break the wait for a disk interrupt.*/
+   Task *writeback = device->writeback;
+   if(!writeback)
+      return 0; /*Not running yet,it looks at the dirty pages when it starts.*/
+   return wakeUpTask(writeback,TaskInterruptible);
+}
+
+static int blockCacheDirtyPage(BlockDevicePart *part,PhysicsPage *page)
+{ /*The caller must hold part->cacheSemaphore.*/
+   if(!setPageDirty(page))
+      return 0; /*It has been dirty.*/
+   if(!part->dirtyPages++)
+      part->dirtySince = getTicks();
+   if((u64)atomicAddRet(&blockDirtyPages,1) > blockDirtyLimit(WRITEBACK_BACKGROUND))
+      blockWakeUpWriteback(part->device);
+   return 0;
+}
+
+static int blockCacheCleanPage(BlockDevicePart *part,PhysicsPage *page)
+{ /*The caller must hold part->cacheSemaphore.*/
+   if(!clearPageDirty(page))
+      return 0;
+   --part->dirtyPages;
+   atomicAdd(&blockDirtyPages,-1);
+   return 0;
+}
+
+static int blockCacheDropPage(BlockDevicePart *part,PhysicsPage *page)
+{ /*The caller must hold part->cacheSemaphore.*/
+   blockCacheCleanPage(part,page);
+   removeFromRadixTree(&part->cache.radix,page->data);
+   page->flags &= ~PageData;
+   return freePages(page,0);
+}
+
+static PhysicsPage *blockCacheGetPage(BlockDevicePart *part,u64 index,u8 read)
+{ /*The caller must hold part->cacheSemaphore.*/
+  /*If read is 0,the caller will overwrite the whole page.*/
+   PhysicsPage *page = getFromRadixTree(&part->cache.radix,index);
+   u64 size = part->end - part->start;
+   if(page)
+      return page;
+   if(!(page = allocPages(0)))
+      return 0;
+   BlockIO io = {
+      .part = part,
+      .start = index << 12,
+      .size = min(PAGE_SIZE,size - (index << 12)),
+      .buffer = getPhysicsPageAddress(page),
+      .read = 1
+   };
+   if(read && submitBlockIO(&io))
+      goto failed;
+   page->flags |= PageData;
+   page->cache = &part->cache;
+   page->data = index;
+   if(insertIntoRadixTree(&part->cache.radix,index,page))
+      goto failed;
+   return page; /*The radix tree holds the reference of allocPages.*/
+failed:
+   page->flags &= ~PageData;
+   freePages(page,0);
+   return 0;
+}
+
+static int blockCacheShrink(BlockDevicePart *part)
+{ /*The caller must hold part->cacheSemaphore.*/
+  /*Clean pages can be read again,give them back if the memory is low.*/
+   PhysicsPage *pages[WRITEBACK_SHRINK_BATCH];
+   unsigned int count;
+   u64 index = 0;
+   while(getFreePhysicsPageCount() < getPhysicsPageCount() / WRITEBACK_LOW_MEMORY &&
+      (count = gangLookUpRadixTree(&part->cache.radix,index,
+                   (void **)pages,WRITEBACK_SHRINK_BATCH,-1)))
+   {
+      index = pages[count - 1]->data + 1;
+      for(unsigned int i = 0;i < count;++i)
+         if(!(pages[i]->flags & PageDirty))
+            blockCacheDropPage(part,pages[i]);
+   }
+   return 0;
+}
+
+static int blockCacheFlush(BlockDevicePart *part)
+{ /*Write the dirty pages back in the LBA order,*/
+  /*and merge the contiguous ones into one I/O.*/
+   PhysicsPage *pages[WRITEBACK_BATCH];
+   unsigned int batch = WRITEBACK_BATCH,order = WRITEBACK_ORDER;
+   u64 size = part->end - part->start;
+   u64 index = 0;
+   int retval = 0;
+
+   downSemaphore(&part->flushSemaphore);
+   PhysicsPage *bounce = allocPages(order);
+   if(!bounce && ((batch = 1),(order = 0),!(bounce = allocPages(order))))
+      return (upSemaphore(&part->flushSemaphore),-ENOMEM);
+   u8 *buffer = getPhysicsPageAddress(bounce);
+
+   for(;;)
+   {
+      downSemaphore(&part->cacheSemaphore);
+      unsigned int count = gangLookUpRadixTree(&part->cache.radix,index,
+                   (void **)pages,batch,RADIX_TREE_TAG_DIRTY);
+      unsigned int run = 1;
+      if(!count)
+         break; /*Clean!*/
+      u64 first = pages[0]->data;
+      while(run < count && pages[run]->data == first + run)
+         ++run;
+      for(unsigned int i = 0;i < run;++i)
+      { /*Copy them,so the writers need not wait for the disk.*/
+         memcpy(buffer + i * PAGE_SIZE,getPhysicsPageAddress(pages[i]),PAGE_SIZE);
+         blockCacheCleanPage(part,pages[i]);
+      }
+      upSemaphore(&part->cacheSemaphore);
+
+      BlockIO io = {
+         .part = part,
+         .start = first << 12,
+         .size = min((u64)run << 12,size - (first << 12)),
+         .buffer = buffer,
+         .read = 0
+      };
+      if(submitBlockIO(&io))
+      {
+         downSemaphore(&part->cacheSemaphore);
+         for(unsigned int i = 0;i < run;++i)
+         { /*Dirty them again,they may be dropped now.*/
+            PhysicsPage *page = getFromRadixTree(&part->cache.radix,first + i);
+            if(page)
+               blockCacheDirtyPage(part,page);
+         }
+         upSemaphore(&part->cacheSemaphore);
+         retval = -EIO;
+      }
+      index = first + run;
+   }
+   upSemaphore(&part->cacheSemaphore);
+   freePages(bounce,order);
+   upSemaphore(&part->flushSemaphore);
+   return retval;
+}
+
+static int blockThrottleWriter(BlockDevice *device)
+{ /*Too many dirty pages,wait for the writeback task.*/
+   Task *current = getCurrentTask();
+   for(int i = 0;i < WRITEBACK_THROTTLE_MAX &&
+      (u64)atomicRead(&blockDirtyPages) > blockDirtyLimit(WRITEBACK_THROTTLE);++i)
+   {
+      blockWakeUpWriteback(device);
+      current->state = TaskUninterruptible;
+      scheduleTimeout(WRITEBACK_THROTTLE_WAIT);
+   }
+   return 0;
+}
+
+static int blockWritebackTask(void *arg)
+{
+   BlockDevice *device = arg;
+   Task *current = getCurrentTask();
+   u64 expire = WRITEBACK_EXPIRE * TIMER_HZ / MSEC_PER_SEC;
+   device->writeback = current;
+   for(;;)
+   {
+      u64 now = getTicks();
+      u8 background =
+         (u64)atomicRead(&blockDirtyPages) > blockDirtyLimit(WRITEBACK_BACKGROUND);
+      for(BlockDevicePart *part = device->parts;part;part = part->next)
+      {
+         if(part->dirtyPages && (background || now - part->dirtySince >= expire))
+            blockCacheFlush(part);
+         downSemaphore(&part->cacheSemaphore);
+         blockCacheShrink(part);
+         upSemaphore(&part->cacheSemaphore);
+      }
+      current->state = TaskInterruptible;
+      scheduleTimeout(WRITEBACK_INTERVAL);
+   }
+   return 0;
+}
+
+int initBlockCache(BlockDevicePart *part)
+{
+   part->cache.inode = 0;
+   part->cache.operation = &blockCacheOperation;
+   initRadixTreeRoot(&part->cache.radix);
+   initSemaphore(&part->cacheSemaphore);
+   initSemaphore(&part->flushSemaphore);
+   part->dirtyPages = 0;
+   part->dirtySince = 0;
+   return 0;
+}
+
+int invalidateBlockCache(BlockDevicePart *part)
+{ /*The media is changed,even the dirty pages are useless.*/
+   PhysicsPage *pages[WRITEBACK_SHRINK_BATCH];
+   unsigned int count;
+   downSemaphore(&part->cacheSemaphore);
+   while((count = gangLookUpRadixTree(&part->cache.radix,0,
+                   (void **)pages,WRITEBACK_SHRINK_BATCH,-1)))
+      for(unsigned int i = 0;i < count;++i)
+         blockCacheDropPage(part,pages[i]);
+   upSemaphore(&part->cacheSemaphore);
+   return 0;
+}
+
+int syncBlockDevicePart(BlockDevicePart *part)
+{
+   int retval = blockCacheFlush(part);
+   if(retval)
+      return retval;
+   return flushBlockDevice(part);
+}
+
+int startBlockWriteback(BlockDevice *device)
+{
+   return createKernelTask(&blockWritebackTask,device);
+}
+
+static int blockFileRead(VFSFile *file,UserSpace(void) *buf,u64 size,u64 *seek)
+{
+   BlockDevicePart *part = file->dentry->inode->part;
+   u64 end = part->end - part->start;
+   int retval = 0;
+   if(*seek >= end)
+      return 0;
+   size = min(size,end - *seek);
+   downSemaphore(&part->cacheSemaphore);
+   while(size > 0)
+   {
+      PhysicsPage *page = blockCacheGetPage(part,*seek >> 12,1);
+      u64 offset = *seek & (PAGE_SIZE - 1);
+      u64 read = min(size,PAGE_SIZE - offset);
+      if(!page)
+      {
+         retval = retval ? retval : -EIO;
+         break;
+      }
+      if(memcpyUser0(buf,getPhysicsPageAddress(page) + offset,read))
+      {
+         retval = retval ? retval : -EFAULT;
+         break;
+      }
+      *seek += read;
+      buf += read;
+      size -= read;
+      retval += read;
+   }
+   blockCacheShrink(part);
+   upSemaphore(&part->cacheSemaphore);
+   return retval;
+}
+
+static int blockFileWrite(VFSFile *file,UserSpace(const void) *buf,u64 size,u64 *seek)
+{
+   BlockDevicePart *part = file->dentry->inode->part;
+   u64 end = part->end - part->start;
+   int retval = 0;
+   if(!(file->mode & O_WRONLY))
+      return -EBADF;
+   if(!part->device->write)
+      return -EROFS;
+   if(*seek >= end)
+      return size ? -ENOSPC : 0;
+   size = min(size,end - *seek);
+   blockThrottleWriter(part->device);
+   downSemaphore(&part->cacheSemaphore);
+   while(size > 0)
+   {
+      u64 offset = *seek & (PAGE_SIZE - 1);
+      u64 write = min(size,PAGE_SIZE - offset);
+      PhysicsPage *page = blockCacheGetPage(part,*seek >> 12,
+                   offset || write < PAGE_SIZE);
+      if(!page)
+      {
+         retval = retval ? retval : -EIO;
+         break;
+      }
+      if(memcpyUser1(getPhysicsPageAddress(page) + offset,buf,write))
+      { /*A clean page may be half written,read it again next time.*/
+         if(!(page->flags & PageDirty))
+            blockCacheDropPage(part,page);
+         retval = retval ? retval : -EFAULT;
+         break;
+      }
+      blockCacheDirtyPage(part,page);
+      *seek += write;
+      buf += write;
+      size -= write;
+      retval += write;
+   }
+   upSemaphore(&part->cacheSemaphore);
+   return retval;
+}
+
+static int blockFileLSeek(VFSFile *file,s64 offset,int type)
+{
+   BlockDevicePart *part = file->dentry->inode->part;
+   s64 seek;
+   switch(type)
+   {
+   case SEEK_SET:
+      seek = offset;
+      break;
+   case SEEK_CUR:
+      seek = file->seek + offset;
+      break;
+   case SEEK_END:
+      seek = part->end - part->start + offset;
+      break;
+   default:
+      return -EINVAL;
+   }
+   if(seek < 0)
+      return -EINVAL;
+   return (file->seek = seek);
+}
+
+static int blockFileSync(VFSFile *file)
+{
+   return syncBlockDevicePart(file->dentry->inode->part);
+}
+
+static int blockFileIOControl(VFSFile *file,int cmd,UserSpace(void) *data)
+{
+   BlockDevicePart *part = file->dentry->inode->part;
+   switch(cmd)
+   {
+   case BLOCK_SET_POLL_READS: /*For the whole device,not only this part.*/
+      part->device->pollReads = !!data;
+      return 0;
+   default:
+      return -EINVAL;
+   }
+}
@@ -0,0 +1,347 @@
+#include <core/const.h>
+#include <core/math.h>
+#include <block/block.h>
+#include <filesystem/virtual.h>
+#include <filesystem/devfs.h>
+#include <memory/slab.h>
+#include <memory/kmalloc.h>
+#include <memory/buddy.h>
+#include <memory/paging.h>
+#include <memory/user.h>
+#include <task/semaphore.h>
+#include <video/console.h>
+#include <cpu/io.h>
+#include <lib/string.h>
+
+typedef struct ZramEntry{
+   void *data;  /*Allocated from zramClasses[].*/
+   u16 length;  /*PAGE_SIZE means it isn't compressed.*/
+   u8 flags;
+} ZramEntry;
+
+typedef struct ZramStat{
+   u64 storedPages;
+   u64 zeroPages;
+   u64 compressedBytes;
+   u64 poolBytes;
+   u64 reads,readCycles;
+   u64 writes,writeCycles;
+} ZramStat;
+
+typedef struct Zram{
+   ZramEntry *table;
+   u64 pages;
+   u8 *buffer;  /*Compress to here.*/
+   u16 *hash;   /*The hash table of the compressor.*/
+   Semaphore semaphore;
+   ZramStat stat;
+   BlockDevice block;
+} Zram;
+
+#define ZRAM_SIZE               0x4000000 /*64MB.*/
+#define ZRAM_CLASS_SIZE         128
+#define ZRAM_CLASS_COUNT        (PAGE_SIZE / ZRAM_CLASS_SIZE)
+#define ZRAM_MAX_COMPRESSED     (PAGE_SIZE / 4 * 3)
+   /*Store the page as it is if it can't be compressed to this.*/
+
+#define ZRAM_ENTRY_USED         0x1
+#define ZRAM_ENTRY_ZERO         0x2
+
+#define LZ4_MIN_MATCH           4
+#define LZ4_LAST_LITERALS       5
+#define LZ4_MATCH_LIMIT         12 /*The last match must start before this.*/
+#define LZ4_HASH_BITS           12
+#define LZ4_HASH_SIZE           (1 << LZ4_HASH_BITS)
+
+static int zramStatRead(VFSFile *file,UserSpace(void) *buf,u64 size,u64 *seek);
+
+static VFSFileOperation zramStatOperation = {
+   .read = &zramStatRead
+};
+
+static SlabCache *zramClasses[ZRAM_CLASS_COUNT];
+static Zram zram;
+
+static inline u32 lz4Read32(const u8 *p)
+{
+   return *(const u32 *)p;
+}
+
+static inline u32 lz4Hash(u32 sequence)
+{
+   return (sequence * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+static u8 *lz4WriteLength(u8 *op,u32 length)
+{
+   for(;length >= 255;length -= 255)
+      *op++ = 255;
+   *op++ = length;
+   return op;
+}
+
+static int lz4Compress(const u8 *src,int size,u8 *dst,int limit,u16 *hash)
+{  /*The LZ4 block format,returns 0 if it doesn't fit in 'limit'.*/
+   const u8 *ip = src,*anchor = src,*end = src + size;
+   const u8 *matchEnd = end - LZ4_LAST_LITERALS;
+   const u8 *matchLimit = end - LZ4_MATCH_LIMIT;
+   u8 *op = dst,*oend = dst + limit;
+   u32 literal;
+
+   memset(hash,0,LZ4_HASH_SIZE * sizeof(u16));
+   if(size < LZ4_MATCH_LIMIT + 1)
+      goto last;
+   while(ip < matchLimit)
+   {
+      u32 sequence = lz4Read32(ip);
+      u32 h = lz4Hash(sequence);
+      const u8 *ref = src + hash[h];
+      hash[h] = ip - src;
+      if(ref >= ip || lz4Read32(ref) != sequence)
+      {
+         ++ip;
+         continue;
+      }
+      while(ip > anchor && ref > src && ip[-1] == ref[-1])
+         --ip,--ref; /*Extend the match backwards.*/
+      const u8 *p = ip + LZ4_MIN_MATCH,*q = ref + LZ4_MIN_MATCH;
+      while(p < matchEnd && *p == *q)
+         ++p,++q;
+      literal = ip - anchor;
+      u32 match = p - ip - LZ4_MIN_MATCH;
+      if(op + 1 + literal / 255 + 1 + literal + 2 + match / 255 + 1 > oend)
+         return 0;
+
+      u8 *token = op++;
+      *token = (min(literal,15) << 4) | min(match,15);
+      if(literal >= 15)
+         op = lz4WriteLength(op,literal - 15);
+      memcpy(op,anchor,literal);
+      op += literal;
+      *op++ = (ip - ref) & 0xff; /*The offset,little endian.*/
+      *op++ = (ip - ref) >> 8;
+      if(match >= 15)
+         op = lz4WriteLength(op,match - 15);
+      anchor = ip = p;
+   }
+last:
+   literal = end - anchor;
+   if(op + 1 + literal / 255 + 1 + literal > oend)
+      return 0;
+   *op++ = min(literal,15) << 4;
+   if(literal >= 15)
+      op = lz4WriteLength(op,literal - 15);
+   memcpy(op,anchor,literal);
+   op += literal;
+   return op - dst;
+}
+
+static int lz4ReadLength(const u8 **ip,const u8 *iend,u32 *length)
+{
+   u8 c;
+   do{
+      if(*ip >= iend)
+         return -EIO;
+      c = *(*ip)++;
+      *length += c;
+   }while(c == 255);
+   return 0;
+}
+
+static int lz4Decompress(const u8 *src,int size,u8 *dst,int limit)
+{
+   const u8 *ip = src,*iend = src + size;
+   u8 *op = dst,*oend = dst + limit;
+   while(ip < iend)
+   {
+      u8 token = *ip++;
+      u32 length = token >> 4;
+      if(length == 15 && lz4ReadLength(&ip,iend,&length))
+         return -EIO;
+      if(length > iend - ip || length > oend - op)
+         return -EIO;
+      memcpy(op,ip,length);
+      op += length;
+      ip += length;
+      if(ip >= iend)
+         break; /*The last literals.*/
+
+      if(iend - ip < 2)
+         return -EIO;
+      u32 offset = ip[0] | (ip[1] << 8);
+      ip += 2;
+      if(offset == 0 || offset > op - dst)
+         return -EIO;
+      length = token & 0xf;
+      if(length == 15 && lz4ReadLength(&ip,iend,&length))
+         return -EIO;
+      length += LZ4_MIN_MATCH;
+      if(length > oend - op)
+         return -EIO;
+      for(const u8 *ref = op - offset;length;--length)
+         *op++ = *ref++; /*It may overlap,copy byte by byte.*/
+   }
+   return op - dst;
+}
+
+static int zramIsZeroPage(const u64 *page)
+{
+   for(int i = 0;i < PAGE_SIZE / sizeof(u64);++i)
+      if(page[i])
+         return 0;
+   return 1;
+}
+
+static int zramFreeEntry(Zram *zram,ZramEntry *entry)
+{
+   if(!(entry->flags & ZRAM_ENTRY_USED))
+      return 0;
+   if(entry->flags & ZRAM_ENTRY_ZERO)
+   {
+      --zram->stat.zeroPages;
+   }else
+   {
+      int class = (entry->length - 1) / ZRAM_CLASS_SIZE;
+      freeByCache(zramClasses[class],entry->data);
+      zram->stat.compressedBytes -= entry->length;
+      zram->stat.poolBytes -= (class + 1) * ZRAM_CLASS_SIZE;
+   }
+   --zram->stat.storedPages;
+   entry->flags = 0;
+   entry->data = 0;
+   return 0;
+}
+
+static int zramReadPage(Zram *zram,u64 index,u8 *buf)
+{
+   ZramEntry *entry = &zram->table[index];
+   if(!(entry->flags & ZRAM_ENTRY_USED) || (entry->flags & ZRAM_ENTRY_ZERO))
+      return (memset(buf,0,PAGE_SIZE),0);
+   if(entry->length == PAGE_SIZE)
+      return (memcpy(buf,entry->data,PAGE_SIZE),0);
+   if(lz4Decompress(entry->data,entry->length,buf,PAGE_SIZE) != PAGE_SIZE)
+      return -EIO;
+   return 0;
+}
+
+static int zramWritePage(Zram *zram,u64 index,u8 *buf)
+{
+   ZramEntry *entry = &zram->table[index];
+   zramFreeEntry(zram,entry);
+   if(zramIsZeroPage((const u64 *)buf))
+   {  /*Don't allocate anything for zero pages.*/
+      entry->flags = ZRAM_ENTRY_USED | ZRAM_ENTRY_ZERO;
+      ++zram->stat.zeroPages;
+      ++zram->stat.storedPages;
+      return 0;
+   }
+
+   const u8 *data = zram->buffer;
+   int length = lz4Compress(buf,PAGE_SIZE,zram->buffer,
+                     ZRAM_MAX_COMPRESSED,zram->hash);
+   if(!length)
+      (data = buf),(length = PAGE_SIZE);
+   int class = (length - 1) / ZRAM_CLASS_SIZE;
+   if(!zramClasses[class])
+      zramClasses[class] = createCache((class + 1) * ZRAM_CLASS_SIZE,0x0);
+   if(!zramClasses[class])
+      return -ENOMEM;
+   entry->data = allocByCache(zramClasses[class]);
+   if(!entry->data)
+      return -ENOMEM;
+   memcpy(entry->data,data,length);
+   entry->length = length;
+   entry->flags = ZRAM_ENTRY_USED;
+   ++zram->stat.storedPages;
+   zram->stat.compressedBytes += length;
+   zram->stat.poolBytes += (class + 1) * ZRAM_CLASS_SIZE;
+   return 0;
+}
+
+static int zramTransfer(void *data,u64 index,u64 count,void *buf,int write)
+{
+   Zram *zram = (Zram *)data;
+   int ret = 0;
+   u64 start = readTimeStampCounter();
+   downSemaphore(&zram->semaphore);
+   for(;count && !ret;--count,++index,buf += PAGE_SIZE)
+      ret = write ? zramWritePage(zram,index,buf) : zramReadPage(zram,index,buf);
+   if(write)
+      (++zram->stat.writes),
+         (zram->stat.writeCycles += readTimeStampCounter() - start);
+   else
+      (++zram->stat.reads),
+         (zram->stat.readCycles += readTimeStampCounter() - start);
+   upSemaphore(&zram->semaphore);
+   return ret;
+}
+
+static int zramRead(void *data,u64 start,u64 size,void *buf)
+{
+   return transferBlockSectors(&zramTransfer,data,PAGE_SIZE,start,size,buf,0);
+}
+
+static int zramWrite(void *data,u64 start,u64 size,void *buf)
+{
+   return transferBlockSectors(&zramTransfer,data,PAGE_SIZE,start,size,buf,1);
+}
+
+static int zramStatRead(VFSFile *file,UserSpace(void) *buf,u64 size,u64 *seek)
+{
+   char *text = kmalloc(512);
+   if(!text)
+      return -ENOMEM;
+   downSemaphore(&zram.semaphore);
+   ZramStat stat = zram.stat;
+   upSemaphore(&zram.semaphore);
+
+   u64 original = (stat.storedPages - stat.zeroPages) * PAGE_SIZE;
+   int length = sprintk(text,
+      "disk %lu KB\nstored %lu pages\nzero %lu pages\n"
+      "compressed %lu bytes\npool %lu bytes\nratio %lu%%\n"
+      "reads %lu\nread cycles %lu\nwrites %lu\nwrite cycles %lu\n",
+      zram.pages * (PAGE_SIZE / 1024),stat.storedPages,stat.zeroPages,
+      stat.compressedBytes,stat.poolBytes,
+      stat.compressedBytes ? original * 100 / stat.compressedBytes : 0,
+      stat.reads,stat.reads ? stat.readCycles / stat.reads : 0,
+      stat.writes,stat.writes ? stat.writeCycles / stat.writes : 0);
+   int ret = 0;
+   if(*seek < length)
+   {
+      ret = min(size,length - *seek);
+      if(memcpyUser0(buf,text + *seek,ret))
+         ret = -EFAULT;
+      else
+         *seek += ret;
+   }
+   kfree(text);
+   return ret;
+}
+
+static int initZram(void)
+{
+   zram.pages = ZRAM_SIZE / PAGE_SIZE;
+   zram.table = kmalloc(zram.pages * sizeof(ZramEntry));
+   if(!zram.table)
+      return -ENOMEM;
+   PhysicsPage *page = allocPages(2); /*The buffer and the hash table.*/
+   if(!page)
+      return (kfree(zram.table),-ENOMEM);
+   zram.buffer = (u8 *)getPhysicsPageAddress(page);
+   zram.hash = (u16 *)(zram.buffer + PAGE_SIZE);
+   memset(zram.table,0,zram.pages * sizeof(ZramEntry));
+   memset(&zram.stat,0,sizeof(zram.stat));
+   memset(zramClasses,0,sizeof(zramClasses));
+   initSemaphore(&zram.semaphore);
+
+   zram.block.data = (void *)&zram;
+   zram.block.read = &zramRead;
+   zram.block.write = &zramWrite;
+   zram.block.flush = 0;
+   zram.block.type = BlockDeviceDisk;
+   zram.block.end = ZRAM_SIZE;
+   registerBlockDevice(&zram.block,"zram");
+   return devfsRegisterDevice(&zramStatOperation,"zramstat");
+}
+
+driverInitcall(initZram);
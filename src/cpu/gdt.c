@@ -1,5 +1,6 @@
 #include <core/const.h>
 #include <cpu/gdt.h>
+#include <cpu/smp.h>
 #include <video/console.h>
 
 typedef struct GDTDescriptor /*Code or data.*/
@@ -73,12 +74,12 @@ typedef struct TaskStateSegment{
 #define DA_DPL1     0x0020
 #define DA_DPL0     0x0000
 
-static u8 gdt[GDT_SIZE] = {};
-static u8 gdtr[2 + 8] = {};
+static u8 gdts[CPU_MAX][GDT_SIZE] = {}; /*Every CPU has its GDT and TSS.*/
+static u8 gdtrs[CPU_MAX][2 + 8] = {};
 
-static TaskStateSegment taskStateSegment = {};
+static TaskStateSegment taskStateSegments[CPU_MAX] = {};
 
-static int setCodeDataDescriptor(u32 index,u16 type)
+static int setCodeDataDescriptor(u8 *gdt,u32 index,u16 type)
 {
    GDTDescriptor *desc = (GDTDescriptor *)(gdt + index);
    desc->type1 = type & 0x00ff;
@@ -86,7 +87,7 @@ static int setCodeDataDescriptor(u32 index,u16 type)
    return (int)((u8 *)(desc + 1) - gdt);
 }
 
-static int setSystemDescriptor(u8 index,u16 type,pointer address,u32 limit)
+static int setSystemDescriptor(u8 *gdt,u8 index,u16 type,pointer address,u32 limit)
 {
    GDTSystemDescriptor *desc = (GDTSystemDescriptor *)(gdt + index);
    desc->type1 = type & 0x00ff;
@@ -105,30 +106,32 @@ static int setSystemDescriptor(u8 index,u16 type,pointer address,u32 limit)
 }
 
 int tssSetStack(u64 stack)
-{
-   taskStateSegment.rsp0 = stack;
+{ /*The stack of the interrupts from the user mode on this CPU.*/
+   taskStateSegments[getCPU()->index].rsp0 = stack;
    return 0;
 }
 
-int initGDT(void)
+int loadGDT(unsigned int cpu)
 {
+   u8 *gdt = gdts[cpu];
+   u8 *gdtr = gdtrs[cpu];
    int index = sizeof(GDTDescriptor);
-   index = setCodeDataDescriptor(index,
+   index = setCodeDataDescriptor(gdt,index,
       DA_CODE | DA_CODE_64 | DA_PRESENT | DA_DPL0);
       /*SELECTOR_KERNEL_CODE.*/
-   index = setCodeDataDescriptor(index,
+   index = setCodeDataDescriptor(gdt,index,
       DA_CODE | DA_CODE_64 | DA_PRESENT | DA_DPL3);
       /*SELECTOR_USER_CODE.*/
-   index = setCodeDataDescriptor(index,
+   index = setCodeDataDescriptor(gdt,index,
       DA_DATA | DA_DATA_W  | DA_PRESENT | DA_DPL0);
       /*SELECTOR_KERNEL_DATA.*/
-   index = setCodeDataDescriptor(index,
+   index = setCodeDataDescriptor(gdt,index,
       DA_DATA | DA_DATA_W  | DA_PRESENT | DA_DPL3);
       /*SELECTOR_USER_DATA.*/
 
-   index = setSystemDescriptor(index,
+   index = setSystemDescriptor(gdt,index,
       DA_TSS | DA_PRESENT,
-      (pointer)&taskStateSegment,sizeof(TaskStateSegment));
+      (pointer)&taskStateSegments[cpu],sizeof(TaskStateSegment));
       /*SELECTOR_TSS.*/
 
    *(u16 *)gdtr = (GDT_SIZE - 1);
@@ -165,7 +168,12 @@ int initGDT(void)
       :
       : "a" ((u64)SELECTOR_TSS)
    ); /*Load TSS.*/
+   return 0;
+}
 
+int initGDT(void)
+{
+   initCPU(getCPUByIndex(0)); /*The bootstrap CPU.*/
    printkInColor(0x00,0xff,0x00,"Initialize GDT successfully!!\n");
 
    return 0;
@@ -1,22 +1,30 @@
 #include <core/const.h>
 #include <cpu/radixtree.h>
 #include <memory/kmalloc.h>
+#include <memory/slab.h>
 #include <lib/string.h>
 
-static inline unsigned int getRadixTreeMaxIndex(unsigned int height)
+static SlabCache *radixTreeNodeCache;
+
+static inline u64 getRadixTreeMaxIndex(unsigned int height)
 {
-   height *= 4;
-   height = 1 << height;
-   height -= 1; /*Get the max index of a radix tree.*/
-   return height;
+   return (1ul << (height * RADIX_TREE_SHIFT)) - 1;
+      /*Get the max index of a radix tree.*/
+}
+
+static inline unsigned int getRadixTreeSlot(unsigned int index,
+                  unsigned int height,unsigned int level)
+{ /*The root uses the highest bits,so the items are in the index order.*/
+   return (index >> ((height - 1 - level) * RADIX_TREE_SHIFT)) & RADIX_TREE_MASK;
 }
 
 static RadixTreeNode *createRadixTreeNode(RadixTreeNode *parent,void **item,int nr)
 {
-   RadixTreeNode *node = kmalloc(sizeof(*node));
+   RadixTreeNode *node = allocByCache(radixTreeNodeCache);
    if(!node)
       return 0;
    memset(node->data,0,sizeof(node->data)); /*Set to zero.*/
+   memset(node->tags,0,sizeof(node->tags));
    node->count = 0; /*No data!*/
    node->parent = parent;
    node->nr = nr;
@@ -28,20 +36,27 @@ static RadixTreeNode *createRadixTreeNode(RadixTreeNode *parent,void **item,int
 
 static int extandRadixTree(RadixTreeRoot *root,unsigned int index)
 {
-   unsigned int height = root->height + 1;
-   while(index >= getRadixTreeMaxIndex(height))
+   unsigned int height = root->height ? root->height : 1;
+   while(index > getRadixTreeMaxIndex(height))
       ++height;
    if(!root->node && (root->height = height))
       return 0; /*Just return!*/
 
-   do{
+   while(height > root->height)
+   { /*The old root becomes the first child of the new one.*/
       RadixTreeNode *old = root->node;
       RadixTreeNode *node = createRadixTreeNode(0,(void **)&root->node,0);
       if(!node)
          return -ENOMEM;
       node->data[0] = old; /*First!*/
+      node->count = 1;
+      old->parent = node;
       old->nr = 0;
-   } while(height > root->height);
+      for(int tag = 0;tag < RADIX_TREE_TAG_COUNT;++tag)
+         if(old->tags[tag])
+            node->tags[tag] = 1;
+      ++root->height;
+   }
    return 0;
 }
 
@@ -56,12 +71,27 @@ out:
    return kfree(node);
 }
 
+static RadixTreeNode *lookUpRadixTreeNode(RadixTreeRoot *root,unsigned int index)
+{ /*Get the last level node which has the slot of index.*/
+  /*The caller must hold root->lock.*/
+   RadixTreeNode *node = root->node;
+   unsigned int height = root->height;
+   if(!node || getRadixTreeMaxIndex(height) < index)
+      return 0;
+   for(int i = 0;i < height - 1 && node;++i)
+      node = node->data[getRadixTreeSlot(index,height,i)];
+   return node;
+}
+
 int destoryRadixTreeRoot(RadixTreeRoot *root)
-{
-   if(root->node)
-      return destoryRadixTreeNode(root,root->node,1);
-   else
+{ /*The root is empty again,the inode cache reuses it.*/
+   RadixTreeNode *node = root->node;
+   if(!node)
       return 0; /*Nothing to do.*/
+   destoryRadixTreeNode(root,node,1);
+   root->node = 0;
+   root->height = 0;
+   return 0;
 }
 
 int insertIntoRadixTree(RadixTreeRoot *root,unsigned int index,void *item)
@@ -69,20 +99,18 @@ int insertIntoRadixTree(RadixTreeRoot *root,unsigned int index,void *item)
    lockSpinLock(&root->lock);
 
    int retval = -ENOMEM;
-   unsigned int max = getRadixTreeMaxIndex(root->height);
    unsigned int height;
    RadixTreeNode **node = &root->node,*parent = 0;
-   if(max <= index)
+   if(!root->node || getRadixTreeMaxIndex(root->height) < index)
       if((retval = extandRadixTree(root,index)))
          goto out;
    height = root->height;
 
    for(int i = 0;i < height;++i)
    {
-      int nr = (index >> (i * 4)) & 0xf;
-      if(!*node && parent)
-         createRadixTreeNode(parent,(void **)node,nr);
-      if(!*node)
+      int nr = getRadixTreeSlot(index,height,i);
+      if(!*node && !createRadixTreeNode(parent,(void **)node,
+                        i ? getRadixTreeSlot(index,height,i - 1) : 0))
          goto out; /*OOM,out of memory.*/
       parent = *node;
       node = (typeof(node))&(*node)->data[nr];
@@ -98,39 +126,45 @@ out:
    return retval;
 }
 
+static int clearRadixTreeNodeTag(RadixTreeNode *node,unsigned int nr,
+                  unsigned int tag)
+{ /*Clear the tag,and the tags of the parents which have no tagged children.*/
+   while(node)
+   {
+      node->tags[tag] &= ~(1 << nr);
+      if(node->tags[tag])
+         break;
+      nr = node->nr;
+      node = node->parent;
+   }
+   return 0;
+}
+
 int removeFromRadixTree(RadixTreeRoot *root,unsigned int index)
 {
    lockSpinLock(&root->lock);
 
-   RadixTreeNode **node = &root->node,*parent = 0,*free = 0;
+   RadixTreeNode *parent = lookUpRadixTreeNode(root,index),*free;
+   unsigned int nr = getRadixTreeSlot(index,root->height,root->height - 1);
    int retval = -ENOENT;
-   unsigned int height = root->height;
-   unsigned int nr;
-   if(getRadixTreeMaxIndex(height) <= index)
-      goto out;
+   if(!parent || !parent->data[nr])
+      goto out; /*No such item.*/
+   parent->data[nr] = 0;
+   for(int tag = 0;tag < RADIX_TREE_TAG_COUNT;++tag)
+      if(parent->tags[tag] & (1 << nr))
+         clearRadixTreeNodeTag(parent,nr,tag);
 
-   for(int i = 0;i < height;++i)
-   {
-      int nr = (index >> (i * 4)) & 0xf;
-      if(!*node)
-         goto out; /*No such item.*/
-      parent = *node;
-      node = (typeof(node))&(*node)->data[nr];
-   }
-   *node = 0;
-
-   do{
-      if(free)
-         (parent->data[nr] = 0),kfree(free);
-      if(!--parent->count) /*It isn't used.*/
-         (free = parent),(nr = parent->nr);
-      else if((free = 0) || 1)
-         break;
+   while(parent && !--parent->count)
+   { /*It isn't used,free it.*/
+      free = parent;
+      nr = parent->nr;
       parent = parent->parent;
-   }while(parent);
-
-   if(free)
-      kfree(root->node),root->node = 0;
+      if(parent)
+         parent->data[nr] = 0;
+      kfree(free);
+   }
+   if(!parent)
+      (root->node = 0),(root->height = 0);
 
    retval = 0;
 out:
@@ -141,22 +175,91 @@ out:
 void *getFromRadixTree(RadixTreeRoot *root,unsigned int index)
 {
    lockSpinLock(&root->lock);
+   RadixTreeNode *node = lookUpRadixTreeNode(root,index);
+   void *retval = node ?
+      node->data[getRadixTreeSlot(index,root->height,root->height - 1)] : 0;
+   unlockSpinLock(&root->lock);
+   return retval;
+}
 
-   RadixTreeNode **node = &root->node;
-   void *retval = 0;
-   unsigned int height = root->height;
-   if(getRadixTreeMaxIndex(height) <= index)
-      goto out; /*No such item!*/
-
-   for(int i = 0;i < height;++i)
+int setRadixTreeTag(RadixTreeRoot *root,unsigned int index,unsigned int tag)
+{
+   lockSpinLock(&root->lock);
+   RadixTreeNode *node = lookUpRadixTreeNode(root,index);
+   unsigned int nr = getRadixTreeSlot(index,root->height,root->height - 1);
+   int retval = -ENOENT;
+   if(!node || !node->data[nr])
+      goto out;
+   for(;node;nr = node->nr,node = node->parent)
    {
-      int nr = (index >> (i * 4)) & 0xf;
-      if(!*node)
-         goto out;
-      node = (typeof(node))&(*node)->data[nr];
+      if(node->tags[tag] & (1 << nr))
+         break; /*The parents have been tagged.*/
+      node->tags[tag] |= 1 << nr;
    }
-   retval = *node; /*Get the item.*/
+   retval = 0;
 out:
    unlockSpinLock(&root->lock);
    return retval;
 }
+
+int clearRadixTreeTag(RadixTreeRoot *root,unsigned int index,unsigned int tag)
+{
+   lockSpinLock(&root->lock);
+   RadixTreeNode *node = lookUpRadixTreeNode(root,index);
+   unsigned int nr = getRadixTreeSlot(index,root->height,root->height - 1);
+   int retval = -ENOENT;
+   if(node && node->data[nr] && (retval = 0,node->tags[tag] & (1 << nr)))
+      clearRadixTreeNodeTag(node,nr,tag);
+   unlockSpinLock(&root->lock);
+   return retval;
+}
+
+int getRadixTreeTag(RadixTreeRoot *root,unsigned int index,unsigned int tag)
+{
+   lockSpinLock(&root->lock);
+   RadixTreeNode *node = lookUpRadixTreeNode(root,index);
+   unsigned int nr = getRadixTreeSlot(index,root->height,root->height - 1);
+   int retval = node && (node->tags[tag] & (1 << nr));
+   unlockSpinLock(&root->lock);
+   return retval;
+}
+
+static unsigned int gangLookUpRadixTreeNode(RadixTreeNode *node,unsigned int height,
+       u64 base,u64 start,void **items,unsigned int max,int tag)
+{ /*'height' is the number of the levels from this node to the items.*/
+   unsigned int count = 0,shift = (height - 1) * RADIX_TREE_SHIFT;
+   for(unsigned int nr = 0;nr < RADIX_TREE_SLOTS && count < max;++nr)
+   {
+      u64 first = base + ((u64)nr << shift);
+      if(first + (1ul << shift) - 1 < start || !node->data[nr])
+         continue; /*Before start or empty.*/
+      if(tag >= 0 && !(node->tags[tag] & (1 << nr)))
+         continue;
+      if(height == 1)
+         items[count++] = node->data[nr];
+      else
+         count += gangLookUpRadixTreeNode(node->data[nr],height - 1,
+                     first,start,items + count,max - count,tag);
+   }
+   return count;
+}
+
+unsigned int gangLookUpRadixTree(RadixTreeRoot *root,unsigned int start,
+                 void **items,unsigned int max,int tag)
+{
+   unsigned int count = 0;
+   lockSpinLock(&root->lock);
+   if(root->node && start <= getRadixTreeMaxIndex(root->height))
+      count = gangLookUpRadixTreeNode(root->node,root->height,0,start,
+                        items,max,tag);
+   unlockSpinLock(&root->lock);
+   return count;
+}
+
+static int initRadixTree(void)
+{ /*The page caches insert the first nodes after the subsystems are ready.*/
+   radixTreeNodeCache = createObjectCache("radix-tree-node",sizeof(RadixTreeNode),0,0);
+   return radixTreeNodeCache ? 0 : -ENOMEM;
+}
+
+subsysInitcall(initRadixTree);
@@ -1,46 +1,201 @@
 #include <core/const.h>
-#include <cpu/atomic.h>
+#include <cpu/io.h>
+#include <cpu/spinlock.h>
 #include <cpu/rcu.h>
+#include <task/task.h>
 
-int lockRCUReadLock(RCULock *lock)
+typedef struct RCUList{
+   RCUHead *head;
+   RCUHead **tail;
+} RCUList;
+
+typedef struct RCUCPUData{
+   RCUList next;     /*The new callbacks.*/
+   RCUList waiting;  /*Waiting for the grace period 'batch'.*/
+   RCUList done;     /*Their grace period has completed.*/
+   u64 batch;
+
+   u64 quiescentBatch;  /*The last grace period this CPU has noticed.*/
+   u8 quiescentPending; /*It hasn't passed a quiescent state in it.*/
+   u8 switched;         /*Switched tasks since the last tick.*/
+   u64 mask;            /*The bit of this CPU.*/
+} RCUCPUData;
+
+typedef struct RCUWaiter{
+   Task *task;
+   volatile u8 done;
+} RCUWaiter;
+
+static RCUCPUData rcuCPUData; /*There is only one CPU now.*/
+static u64 rcuOnlineCPUs;
+
+static u64 rcuCurrent;      /*The last grace period which has started.*/
+static u64 rcuCompleted;    /*The last grace period which has completed.*/
+static u64 rcuPendingCPUs;  /*CPUs which have not passed a quiescent state.*/
+static u8 rcuNextPending;   /*Start a new one when the current completes.*/
+static SpinLock rcuLock;
+static Task *rcuTask;
+static u8 rcuReady;
+
+static inline RCUCPUData *getRCUCPUData(void)
 {
-   atomicAdd(&lock->count,1);
-              /*Just add the count.*/
+   return &rcuCPUData;
+}
+
+static int initRCUList(RCUList *list)
+{
+   list->head = 0;
+   list->tail = &list->head;
    return 0;
 }
 
-int unlockRCUReadLock(RCULock *lock)
+static int rcuListSplice(RCUList *to,RCUList *from)
 {
-   if(atomicAddRet(&lock->count,-1) == 0)
-   {   /*This lock is unlocked.*/
-      lockSpinLock(&lock->lock);
-      for(int i = 0;i < lock->ccount;++i)
-         (*lock->callbacks[i])(lock->data[i]);
-      lock->ccount = 0;     /*Call the callbacks.*/
-      unlockSpinLock(&lock->lock);
+   if(!from->head)
+      return 0;
+   *to->tail = from->head;
+   to->tail = from->tail;
+   return initRCUList(from);
+}
+
+static int rcuStartGracePeriod(void)
+{ /*The caller must hold rcuLock.*/
+   if(rcuCurrent != rcuCompleted)
+      return (rcuNextPending = 1),0;
+   ++rcuCurrent;
+   rcuPendingCPUs = rcuOnlineCPUs;
+   rcuNextPending = 0;
+   return 0;
+}
+
+static int rcuWakeUpWaiter(void *arg)
+{
+   RCUWaiter *waiter = arg;
+   Task *task = waiter->task; /*The waiter may return after done is set.*/
+   waiter->done = 1;
+   return wakeUpTask(task,0);
+}
+
+static int rcuThread(void *arg)
+{
+   RCUCPUData *data = getRCUCPUData();
+   Task *current = getCurrentTask();
+   RCUHead *list;
+   u64 rflags;
+
+   rcuTask = current;
+   for(;;)
+   {
+      lockSpinLockCloseInterrupt(&rcuLock,&rflags);
+      list = data->done.head;
+      initRCUList(&data->done);
+      if(!list)
+         current->state = TaskUninterruptible;
+      unlockSpinLockRestoreInterrupt(&rcuLock,&rflags);
+      if(!list && (schedule() || 1))
+         continue; /*Wait for rcuTimerTick.*/
+      while(list)
+      {
+         RCUHead *next = list->next;
+         (*list->callback)(list->data);
+         list = next;
+      }
    }
    return 0;
 }
 
-int addRCUCallback(RCULock *lock,RCUCallback *callback,void *data)
+int callRCU(RCUHead *head,RCUCallback *callback,void *arg)
 {
-   int retval = -EBUSY;
-   if(atomicRead(&lock->count) == 0)
-      return (*callback)(data); /*Unlocked,just call it.*/
+   RCUCPUData *data = getRCUCPUData();
+   u64 rflags;
+   head->next = 0;
+   head->callback = callback;
+   head->data = arg;
 
-   lockSpinLock(&lock->lock);
-   if(atomicRead(&lock->count) == 0)
-      goto call; /*Make sure this lock is locked again.*/
+   lockSpinLockCloseInterrupt(&rcuLock,&rflags);
+   *data->next.tail = head;
+   data->next.tail = &head->next;
+   unlockSpinLockRestoreInterrupt(&rcuLock,&rflags);
+   return 0;
+}
 
-   if(lock->ccount == sizeof(lock->callbacks) / sizeof(lock->callbacks[0]))
-      goto out;
-   lock->data[lock->ccount] = data;
-   lock->callbacks[lock->ccount++] = callback; /*Add the callback.*/
-   retval = 0;
-out:
-   unlockSpinLock(&lock->lock);
-   return retval;
-call:
-   unlockSpinLock(&lock->lock);
-   return (*callback)(data);
+int synchronizeRCU(void)
+{
+   RCUHead head;
+   RCUWaiter waiter = {.task = getCurrentTask(),.done = 0};
+   callRCU(&head,&rcuWakeUpWaiter,&waiter);
+   for(;;)
+   {
+      waiter.task->state = TaskUninterruptible;
+      if(waiter.done)
+         break;
+      schedule();
+   }
+   waiter.task->state = TaskRunning;
+   return 0;
+}
+
+int rcuNoteContextSwitch(void)
+{
+   getRCUCPUData()->switched = 1;
+   return 0;
+}
+
+int rcuTimerTick(int quiescent)
+{
+   RCUCPUData *data = getRCUCPUData();
+   u8 switched = data->switched,wake = 0;
+   u64 rflags;
+   if(!rcuReady)
+      return 0;
+   data->switched = 0;
+
+   lockSpinLockCloseInterrupt(&rcuLock,&rflags);
+   if(data->quiescentBatch != rcuCurrent)
+   { /*A new grace period,the context switches before it don't count.*/
+      data->quiescentBatch = rcuCurrent;
+      data->quiescentPending = !!(rcuPendingCPUs & data->mask);
+      switched = 0;
+   }
+   if(data->quiescentPending && (quiescent || switched))
+   { /*No readers on this CPU now.*/
+      data->quiescentPending = 0;
+      rcuPendingCPUs &= ~data->mask;
+      if(!rcuPendingCPUs)
+      {
+         rcuCompleted = rcuCurrent;
+         if(rcuNextPending)
+            rcuStartGracePeriod();
+      }
+   }
+   if(data->waiting.head && rcuCompleted >= data->batch)
+      rcuListSplice(&data->done,&data->waiting);
+   if(!data->waiting.head && data->next.head)
+   {
+      rcuListSplice(&data->waiting,&data->next);
+      data->batch = rcuCurrent + 1;
+            /*The current grace period may start before these callbacks.*/
+      rcuStartGracePeriod();
+   }
+   wake = !!data->done.head;
+   unlockSpinLockRestoreInterrupt(&rcuLock,&rflags);
+
+   if(wake && rcuTask)
+      wakeUpTask(rcuTask,0);
+   return 0;
 }
+
+static int initRCU(void)
+{
+   RCUCPUData *data = getRCUCPUData();
+   initSpinLock(&rcuLock);
+   initRCUList(&data->next);
+   initRCUList(&data->waiting);
+   initRCUList(&data->done);
+   data->mask = 1;
+   rcuOnlineCPUs = data->mask;
+   rcuReady = 1;
+   return createKernelTask(&rcuThread,0);
+}
+
+subsysInitcall(initRCU);
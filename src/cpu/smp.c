@@ -0,0 +1,150 @@
+#include <core/const.h>
+#include <cpu/smp.h>
+#include <cpu/gdt.h>
+#include <cpu/io.h>
+#include <interrupt/idt.h>
+#include <interrupt/localapic.h>
+#include <memory/paging.h>
+#include <time/localtime.h>
+#include <task/task.h>
+#include <video/console.h>
+#include <lib/string.h>
+
+/*The other CPUs start in real mode at TRAMPOLINE_ADDRESS,*/
+/*the trampoline(trampoline.S) switches to the long mode and calls startAP.*/
+/*The scheduler only runs on the bootstrap CPU now,*/
+/*so the other CPUs only run their idle tasks.*/
+
+#define TRAMPOLINE_ADDRESS 0x8000 /*Must be the same as trampoline.S.*/
+
+#define trampolineSlot(symbol) \
+   ((u64 *)((u8 *)pa2va(TRAMPOLINE_ADDRESS) + ((u8 *)&symbol - trampolineStart)))
+
+extern u8 trampolineStart[];
+extern u8 trampolineEnd[];
+extern u64 trampolinePageTable;
+extern u64 trampolineStack;
+extern u64 trampolineEntry;
+
+static CPU cpus[CPU_MAX] = {};
+static unsigned int cpuCount = 1; /*The bootstrap CPU.*/
+
+static u8 cpuApicIDs[CPU_MAX]; /*Found in the MADT.*/
+static unsigned int cpuApicIDCount = 0;
+
+static CPU *volatile startingCPU = 0; /*Only one CPU starts at a time.*/
+
+static void startAP(void) __attribute__ ((noreturn,used));
+
+static void startAP(void)
+{ /*The interrupts are closed,we are on the stack of the idle task.*/
+   CPU *cpu = startingCPU;
+   initCPU(cpu);
+   loadIDT();
+   initLocalApicCPU();
+   tssSetStack((pointer)(((u8 *)cpu->idle) + TASK_KERNEL_STACK_SIZE - 1));
+   initLocalTimeCPU();
+   asm volatile("":::"memory");
+   cpu->online = 1; /*Tell the bootstrap CPU.*/
+   for(;;)
+      asm volatile("sti;hlt");
+}
+
+static int waitForAP(CPU *cpu,int ms)
+{
+   Task *current = getCurrentTask();
+   for(;ms > 0 && !cpu->online;ms -= 10)
+      (current->state = TaskUninterruptible),scheduleTimeout(10);
+   return cpu->online ? 0 : -ETIMEDOUT;
+}
+
+static int startCPU(CPU *cpu)
+{
+   Task *idle = createIdleTask();
+   if(!idle)
+      return -ENOMEM;
+   cpu->idle = idle;
+   startingCPU = cpu;
+   *trampolineSlot(trampolineStack) =
+      ((pointer)(((u8 *)idle) + TASK_KERNEL_STACK_SIZE)) & ~0xful;
+   asm volatile("":::"memory");
+
+   localApicSendInit(cpu->apicID);
+   waitForAP(cpu,10); /*It can't be online,just wait 10ms.*/
+   for(int i = 0;i < 2 && !cpu->online;++i)
+   { /*Send the Startup IPI twice,as the MP specification says.*/
+      localApicSendStartup(cpu->apicID,TRAMPOLINE_ADDRESS >> 12);
+      waitForAP(cpu,i ? 1000 : 10);
+   }
+   return cpu->online ? 0 : -ETIMEDOUT;
+      /*Never free the idle task,the CPU may use its stack later.*/
+}
+
+static int initSMP(void)
+{
+   u8 self = getLocalApicID();
+   int retval = 0;
+   cpus[0].apicID = self;
+   cpus[0].online = 1;
+   if(cpuApicIDCount <= 1)
+      return 0; /*Only the bootstrap CPU.*/
+
+   memcpy(pa2va(TRAMPOLINE_ADDRESS),trampolineStart,trampolineEnd - trampolineStart);
+   *trampolineSlot(trampolinePageTable) = pagingIdentityMap(1);
+   *trampolineSlot(trampolineEntry) = (u64)(pointer)&startAP;
+
+   for(unsigned int i = 0;i < cpuApicIDCount && cpuCount < CPU_MAX;++i)
+   {
+      CPU *cpu = &cpus[cpuCount];
+      if(cpuApicIDs[i] == self)
+         continue;
+      cpu->self = cpu;
+      cpu->index = cpuCount;
+      cpu->apicID = cpuApicIDs[i];
+      if((retval = startCPU(cpu)))
+      { /*It may run the trampoline later,don't change the trampoline.*/
+         printkInColor(0xff,0x00,0x00,"CPU %d(Apic ID %d) can't be started!\n",
+            (int)cpu->index,(int)cpu->apicID);
+         break;
+      }
+      printk("CPU %d(Apic ID %d) is online.\n",(int)cpu->index,(int)cpu->apicID);
+      ++cpuCount;
+   }
+   if(!retval)
+      pagingIdentityMap(0);
+   printkInColor(0x00,0xff,0x00,"Initialize SMP successfully!%d CPUs are online.\n",
+      (int)cpuCount);
+   return 0;
+}
+
+subsysInitcall(initSMP);
+
+CPU *getCPUByIndex(unsigned int index)
+{
+   if(index >= CPU_MAX)
+      return 0;
+   return &cpus[index];
+}
+
+unsigned int getCPUCount(void)
+{
+   return cpuCount;
+}
+
+int registerCPU(u8 apicID)
+{
+   if(cpuApicIDCount >= CPU_MAX)
+      return -ENOSPC;
+   cpuApicIDs[cpuApicIDCount++] = apicID;
+   return 0;
+}
+
+int initCPU(CPU *cpu)
+{
+   cpu->self = cpu;
+   cpu->index = cpu - cpus;
+   loadGDT(cpu->index); /*It loads %gs,so set the base after it.*/
+   writeMSR(MSR_GS_BASE,(u64)(pointer)cpu);
+   writeMSR(MSR_KERNEL_GS_BASE,0); /*For the user mode,see SWAPGS_IF_USER.*/
+   return 0;
+}
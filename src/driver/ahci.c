@@ -113,6 +113,14 @@ typedef struct AHCIHostToDeviceFIS{
    u8 reserved1[4];
 } __attribute__ ((packed)) AHCIHostToDeviceFIS;
 
+typedef struct AHCIDevice{
+   AHCIPort *port;
+   u32 sectorSize;
+   u8 atapi;
+   u8 noMediaEvents; /*GET EVENT STATUS NOTIFICATION is unsupported.*/
+   u8 mediaPresent;
+} AHCIDevice;
+
 #define AHCI_PCI_CLASS          0x01060000
 #define AHCI_PCI_CLASS_MASK     0xffff0000
 
@@ -139,7 +147,32 @@ typedef struct AHCIHostToDeviceFIS{
 #define AHCI_COMMAND_FR         0x00008000
 #define AHCI_COMMAND_CR         0x00004000
 
+#define AHCI_TASK_FILE_ERROR    0x21 /*ERR and DF.*/
+#define AHCI_SENSE_KEY(taskFile) (((taskFile) >> 12) & 0xf)
+   /*The error register of ATAPI devices has the sense key.*/
+#define ATAPI_ILLEGAL_REQUEST   0x5
+
+/*A command table is in one page,so is the PRD table.*/
+#define AHCI_MAX_PRDS           \
+   ((PHYSICS_PAGE_SIZE - sizeof(AHCICommandTable)) / sizeof(AHCIPrd))
+#define AHCI_PRD_MAX_SIZE       0x400000 /*4MB.*/
+
+/*ATA commands.*/
+#define ATA_CMD_READ_DMA_EXT    0x25
+#define ATA_CMD_WRITE_DMA_EXT   0x35
+#define ATA_CMD_PACKET          0xa0
+#define ATA_CMD_IDENTIFY_PACKET 0xa1
+#define ATA_CMD_FLUSH_CACHE_EXT 0xea
+#define ATA_CMD_IDENTIFY        0xec
+
+#define ATA_DEVICE_LBA          0x40
+#define ATA_IDENTIFY_SIZE       0x200
+
+#define ATA_SECTOR_SIZE         0x200
+#define ATA_MAX_SECTORS         0xffff /*For 48-bit commands.*/
+
 #define ATAPI_SECTOR_SIZE       0x800
+#define ATAPI_MAX_SECTORS       0x2000 /*16MB.*/
 
 static int ahciProbe(Device *device);
 static int ahciEnable(Device *device);
@@ -148,10 +181,13 @@ static int ahciDisable(Device *device);
 static AHCIRegisters *ahciHBA;
 static u8 ahciIRQVector;
 static BlockDevice ahciBlockDevices[AHCI_MAX_PORTS];
+static AHCIDevice ahciDevices[AHCI_MAX_PORTS];
+static int ahciDiskCount;
 static Semaphore ahciSemaphore;
 
 static Driver ahciDriver = 
 {
+   .name = "AHCI",
    .probe = &ahciProbe,
    .enable = &ahciEnable,
    .disable = &ahciDisable
@@ -170,10 +206,12 @@ static int ahciStartCommand(AHCIPort *port)
    return 0;
 }
 
-static int ahciSendCommandATAPI(AHCIPort *port,u8 *command,u8 commandSize,
-                               void *buffer,u64 transferSize)
+static int ahciSendCommand(AHCIPort *port,u8 command,u64 lba,u16 count,
+                 u8 *scsi,void *buffer,u64 transferSize,int write)
 {
-   if(commandSize != 12 && commandSize != 16)
+   /*If scsi isn't zero,it is a 16 bytes ATAPI command.*/
+   u16 prdtl = (transferSize + AHCI_PRD_MAX_SIZE - 1) / AHCI_PRD_MAX_SIZE;
+   if(prdtl > AHCI_MAX_PRDS)
       return -EINVAL;
    downSemaphore(&ahciSemaphore);
 
@@ -183,24 +221,41 @@ static int ahciSendCommandATAPI(AHCIPort *port,u8 *command,u8 commandSize,
    u64 __command = header->command;  /*Store the address.*/
    Task *current = getCurrentTask();
    void *data[] = {current,(void *)port};
+   int ret = 0;
 
    memset(header,0,sizeof(*header));
    header->command = __command; /*Restore the address.*/
    header->length = sizeof(*fis) / sizeof(u32);
-   header->atapi = 1;
-   header->write = 0;  /*Read.*/
-   header->prdtl = 1;
+   header->atapi = !!scsi;
+   header->write = !!write;
+   header->prdtl = prdtl;
    
-   memset(table,0,sizeof(*table) + header->prdtl * sizeof(AHCIPrd));
-   memcpy((void *)table->scsi,(const void *)command,commandSize);
+   memset(table,0,sizeof(*table) + prdtl * sizeof(AHCIPrd));
+   if(scsi)
+      memcpy((void *)table->scsi,(const void *)scsi,sizeof(table->scsi));
 
    fis->type = AHCI_FIS_H2D; /*Host To Device.*/
    fis->cc = 1; /*Command.*/
-   fis->command = 0xa0; /*Packet Command.*/
-
-   table->prdt[0].interrupt = 1;
-   table->prdt[0].address = va2pa(buffer);
-   table->prdt[0].count = transferSize;
+   fis->command = command;
+   fis->device = scsi ? 0 : ATA_DEVICE_LBA;
+   fis->lba0 = (lba >> 0x00) & 0xff;
+   fis->lba1 = (lba >> 0x08) & 0xff;
+   fis->lba2 = (lba >> 0x10) & 0xff;
+   fis->lba3 = (lba >> 0x18) & 0xff;
+   fis->lba4 = (lba >> 0x20) & 0xff;
+   fis->lba5 = (lba >> 0x28) & 0xff;
+   fis->count = count;
+
+   for(int i = 0;i < prdtl;++i)
+   { /*Each PRD can transfer 4MB at most.*/
+      u64 size = transferSize - i * (u64)AHCI_PRD_MAX_SIZE;
+      if(size > AHCI_PRD_MAX_SIZE)
+         size = AHCI_PRD_MAX_SIZE;
+      table->prdt[i].address = va2pa(buffer + i * (u64)AHCI_PRD_MAX_SIZE);
+      table->prdt[i].count = size - 1; /*It is zero-based.*/
+   }
+   if(prdtl)
+      table->prdt[prdtl - 1].interrupt = 1;
 
    ahciStartCommand(port);
 
@@ -212,93 +267,130 @@ static int ahciSendCommandATAPI(AHCIPort *port,u8 *command,u8 commandSize,
 
    ahciStopCommand(port);
 
+   if(port->taskFile & AHCI_TASK_FILE_ERROR)
+      ret = (scsi && AHCI_SENSE_KEY(port->taskFile) == ATAPI_ILLEGAL_REQUEST)
+               ? -EINVAL : -EIO; /*-EINVAL if the device rejects the command.*/
+   else if(header->prdbc != transferSize)
+      ret = -EIO;
    upSemaphore(&ahciSemaphore);
-   return (header->prdbc == transferSize) ? 0 : -EIO;
+   return ret;
 }
 
-static int ahciReadSectorATAPI(AHCIPort *port,u64 lba,u8 sector,void *buffer)
+static int ahciTransferATAPI(void *data,u64 lba,u64 count,void *buf,int write)
 {
-   u8 cmd[12] = {0xa8,0,0,0,0,0,0,0,0,0,0,0};
-   if(sector >= 32)
-      return -EINVAL;
-   cmd[9] = sector;
-   cmd[2] = (lba >> 0x18) & 0xff;
-   cmd[3] = (lba >> 0x10) & 0xff;
-   cmd[4] = (lba >> 0x08) & 0xff;
-   cmd[5] = (lba >> 0x00) & 0xff; /*Set this scsi command.*/
-
-   return ahciSendCommandATAPI(port,cmd,sizeof(cmd),buffer,sector * ATAPI_SECTOR_SIZE);
-      /*Send the command.*/
+   AHCIDevice *device = (AHCIDevice *)data;
+   if(write)
+      return -EROFS;
+   while(count)
+   {
+      u8 cmd[16] = {0xa8 /*READ (12).*/};
+      u64 sector = (count > ATAPI_MAX_SECTORS) ? ATAPI_MAX_SECTORS : count;
+      cmd[2] = (lba >> 0x18) & 0xff;
+      cmd[3] = (lba >> 0x10) & 0xff;
+      cmd[4] = (lba >> 0x08) & 0xff;
+      cmd[5] = (lba >> 0x00) & 0xff;
+      cmd[6] = (sector >> 0x18) & 0xff;
+      cmd[7] = (sector >> 0x10) & 0xff;
+      cmd[8] = (sector >> 0x08) & 0xff;
+      cmd[9] = (sector >> 0x00) & 0xff; /*Set this scsi command.*/
+
+      int ret = ahciSendCommand(device->port,ATA_CMD_PACKET,0,0,cmd,
+                       buf,sector * ATAPI_SECTOR_SIZE,0);
+      if(ret)
+         return ret;
+      lba += sector;
+      count -= sector;
+      buf += sector * ATAPI_SECTOR_SIZE;
+   }
+   return 0;
 }
 
-static int ahciRead(void *data,u64 start,u64 size,void *buf)
+static int ahciTransferATA(void *data,u64 lba,u64 count,void *buf,int write)
 {
-   AHCIPort *port = (AHCIPort *)data;
-   if(port->signature == AHCI_PORT_ATA)
+   AHCIDevice *device = (AHCIDevice *)data;
+   u8 command = write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+   while(count)
    {
-      /*We will support it in the future.*/
-      return -ENOSYS;
-   }else if(port->signature == AHCI_PORT_ATAPI)
+      u64 sector = (count > ATA_MAX_SECTORS) ? ATA_MAX_SECTORS : count;
+      int ret = ahciSendCommand(device->port,command,lba,sector,0,
+                       buf,sector * device->sectorSize,write);
+      if(ret)
+         return ret;
+      lba += sector;
+      count -= sector;
+      buf += sector * device->sectorSize;
+   }
+   return 0;
+}
+
+static int ahciRead(void *data,u64 start,u64 size,void *buf)
+{
+   AHCIDevice *device = (AHCIDevice *)data;
+   return transferBlockSectors(
+      device->atapi ? &ahciTransferATAPI : &ahciTransferATA,
+      data,device->sectorSize,start,size,buf,0);
+}
+
+static int ahciWrite(void *data,u64 start,u64 size,void *buf)
+{
+   AHCIDevice *device = (AHCIDevice *)data;
+   if(device->atapi)
+      return -EROFS;
+   return transferBlockSectors(&ahciTransferATA,
+      data,device->sectorSize,start,size,buf,1);
+}
+
+static int ahciFlush(void *data)
+{
+   AHCIDevice *device = (AHCIDevice *)data;
+   if(device->atapi)
+      return 0;
+   return ahciSendCommand(device->port,ATA_CMD_FLUSH_CACHE_EXT,0,0,0,0,0,0);
+}
+
+static int ahciMediaPresentATAPI(AHCIDevice *device)
+{
+   u8 cmd[16] = {0x25 /*Read Capacity.*/};
+   u8 buf[8];
+   return !ahciSendCommand(device->port,ATA_CMD_PACKET,0,0,cmd,
+                              buf,sizeof(buf),0);
+}
+
+static int ahciCheckMediaATAPI(void *data)
+{
+   AHCIDevice *device = (AHCIDevice *)data;
+   if(!device->noMediaEvents)
    {
-      int ret = -EIO;
-      void *__buf = allocPages(0); /*Alloc a DMA buffer at first.*/
-      /*AHCI Support 64-bit physics address.So we just call 'allocPages'.*/
-      if(!__buf) 
-         return -ENOMEM; 
-      __buf = getPhysicsPageAddress((PhysicsPage *)__buf);
-      u64 lba = start / ATAPI_SECTOR_SIZE;
-      if(start % ATAPI_SECTOR_SIZE != 0)
-      {
-         if(ahciReadSectorATAPI(port,lba,1,__buf))
-            goto out;
-         u64 __size;
-         if(size < ATAPI_SECTOR_SIZE - start % ATAPI_SECTOR_SIZE)
-            __size = size;
-         else
-            __size = ATAPI_SECTOR_SIZE - start % ATAPI_SECTOR_SIZE;
-         memcpy((void *)buf,(const void *)__buf + start % ATAPI_SECTOR_SIZE,__size);
-         ++lba;
-         size -= __size;
-         ret = 0;
-         if(size == 0)
-            goto out;
-         ret = -EIO;
-      }
-      int count = size / ATAPI_SECTOR_SIZE;
-      if(start % ATAPI_SECTOR_SIZE != 0)
-         --count;
-#define PAGE_SECTOR (PHYSICS_PAGE_SIZE / ATAPI_SECTOR_SIZE)
-      while(count > PAGE_SECTOR)
-      {
-         if(ahciReadSectorATAPI(port,lba,PAGE_SECTOR,__buf))
-            goto out;
-         memcpy((void *)buf,(const void *)__buf,PHYSICS_PAGE_SIZE);
-         buf += PHYSICS_PAGE_SIZE;
-         lba += PAGE_SECTOR;
-         count -= PAGE_SECTOR;
-      }
-#undef PAGE_SECTOR
-      if(!count)
-         goto next;
-      if(ahciReadSectorATAPI(port,lba,count,__buf))
-         goto out;
-      memcpy((void *)buf,(const void *)__buf,count * ATAPI_SECTOR_SIZE);
-      buf += ATAPI_SECTOR_SIZE * count;
-next:
-      if(size % ATAPI_SECTOR_SIZE != 0)
+      u8 cmd[16] = {0x4a /*GET EVENT STATUS NOTIFICATION.*/,0x1 /*Polled.*/,
+                    0,0,0x10 /*Media class.*/,0,0,0,8};
+      u8 buf[8];
+      int ret = ahciSendCommand(device->port,ATA_CMD_PACKET,0,0,cmd,
+                                       buf,sizeof(buf),0);
+      if(!ret && !(buf[2] & 0x80) /*No event available?*/)
       {
-         if(ahciReadSectorATAPI(port,lba,1,__buf))
-            goto out;
-         memcpy(buf,__buf,size % ATAPI_SECTOR_SIZE);
+         switch(buf[4] & 0xf) /*The media event code.*/
+         {
+         case 0x2: /*New media.*/
+         case 0x3: /*Media removal.*/
+         case 0x4: /*Media changed.*/
+            return 1;
+         default:
+            return 0;
+         }
       }
-      ret = 0;
-out:
-      freePages(getPhysicsPage(__buf),0); /*Free the buffer.*/
-      return ret;
-   }else
-   {
-      return -ENOSYS;
+      if(ret && ret != -EINVAL)
+         return 0; /*A transient error,try again next time.*/
+      device->noMediaEvents = 1;
+         /*Unsupported,or no media class events.Check the capacity from now on.*/
+      device->mediaPresent = ahciMediaPresentATAPI(device);
+      return 0;
    }
+
+   u8 present = ahciMediaPresentATAPI(device);
+   if(present == device->mediaPresent)
+      return 0;
+   device->mediaPresent = present;
+   return 1;
 }
 
 static int ahciProbe(Device *device)
@@ -327,7 +419,7 @@ static int ahciIRQ(IRQRegisters *reg,void *__data)
    return 0;
 }
 
-static int ahciDisablePortATAPI(AHCIPort *port,int i)
+static int ahciDisablePort(AHCIPort *port,int i)
 {
    /*if(ahciBlockDevices[i].read)*/
    /*   deregisterBlockDevice(&ahciBlockDevices[i])*/
@@ -341,95 +433,130 @@ static int ahciDisablePortATAPI(AHCIPort *port,int i)
    AHCICommandHeader *header = (AHCICommandHeader *)data;
    freePages(getPhysicsPage(pa2va(header->command)),0);
    freePages(getPhysicsPage(data),0); /*Free these pages.*/
+   ahciDevices[i].port = 0;
    return 0;
 }
 
-static int ahciEnablePortATAPI(AHCIPort *port,int i)
+static int ahciInitPort(AHCIPort *port,int i)
 {
-   {
-      PhysicsPage *cmd = allocPages(0);
-      if(!cmd)
-         return -ENOMEM;
-      PhysicsPage *fis = allocPages(0);
-      if(!fis)
-         return (freePages(cmd,0),-ENOMEM);
-      PhysicsPage *table = allocPages(0); /*Alloc some pages.*/
-      if(!table)
-         return (freePages(cmd,0),freePages(fis,0),-ENOMEM);
-
-      port->fis = va2pa(getPhysicsPageAddress(fis));
-      port->commandList = va2pa(getPhysicsPageAddress(cmd));
-      port->interruptEnable = AHCI_PORT_ENABLE_IRQ;  /*Enable interrupts.*/
-      port->interruptStatus = 0;
-
-      AHCICommandHeader *header = (AHCICommandHeader *)getPhysicsPageAddress(cmd);
-      header->command = va2pa(getPhysicsPageAddress(table));
-   }
-
-   {
-      BlockDevice *block = &ahciBlockDevices[i];
-      block->read = 0; /*This port has not been registered.*/
-
-     /*Now we are going to send a PACKET IDENTIFY Command.*/
-      u8 *buffer = (u8 *)allocPages(0);
-      if(!buffer)
-         return ahciDisablePortATAPI(port,i); /*Alloc a buffer.*/
-      buffer = (u8 *)getPhysicsPageAddress((PhysicsPage *)buffer);
-
-      AHCICommandHeader *header = pa2va(port->commandList);
-      AHCICommandTable *table = pa2va(header->command);
-      AHCIHostToDeviceFIS *fis = (AHCIHostToDeviceFIS *)table->fis;
-      u64 __command = header->command;  /*Store the address.*/
-      Task *current = getCurrentTask();
-      void *data[] = {current,(void *)port};
-
-      memset(header,0,sizeof(*header));
-      header->command = __command; /*Restore the address.*/
-      header->length = sizeof(*fis) / sizeof(u32);
-      header->atapi = 0;
-      header->write = 0;  /*Read.*/
-      header->prdtl = 1;
-   
-      memset(table,0,sizeof(*table) + header->prdtl * sizeof(AHCIPrd));
-
-      fis->type = AHCI_FIS_H2D; /*Host To Device.*/
-      fis->cc = 1; /*Command.*/
-      fis->command = 0xa1; /*PACKET IDENTIFY Command.*/
+   PhysicsPage *cmd = allocPages(0);
+   if(!cmd)
+      return -ENOMEM;
+   PhysicsPage *fis = allocPages(0);
+   if(!fis)
+      return (freePages(cmd,0),-ENOMEM);
+   PhysicsPage *table = allocPages(0); /*Alloc some pages.*/
+   if(!table)
+      return (freePages(cmd,0),freePages(fis,0),-ENOMEM);
+
+   port->fis = va2pa(getPhysicsPageAddress(fis));
+   port->commandList = va2pa(getPhysicsPageAddress(cmd));
+   port->interruptEnable = AHCI_PORT_ENABLE_IRQ;  /*Enable interrupts.*/
+   port->interruptStatus = 0;
+
+   AHCICommandHeader *header = (AHCICommandHeader *)getPhysicsPageAddress(cmd);
+   header->command = va2pa(getPhysicsPageAddress(table));
+
+   ahciDevices[i].port = port;
+   ahciBlockDevices[i].read = 0; /*This port has not been registered.*/
+   return 0;
+}
 
-      table->prdt[0].interrupt = 1;
-      table->prdt[0].address = va2pa(buffer);
-      table->prdt[0].count = 128 * 4;
+static int ahciEnablePortATAPI(AHCIPort *port,int i)
+{
+   if(ahciInitPort(port,i))
+      return -ENOMEM;
 
-      ahciStartCommand(port);
+   BlockDevice *block = &ahciBlockDevices[i];
+   AHCIDevice *device = &ahciDevices[i];
 
-      current->state = TaskUninterruptible;
-      setIRQData(ahciIRQVector,data);
-      port->issue = 1; /*Send the command.*/
-      schedule(); /*Wait for an interrupt.*/
-      setIRQData(ahciIRQVector,0);
+   /*Now we are going to send a PACKET IDENTIFY Command.*/
+   u16 *buffer = (u16 *)allocPages(0);
+   if(!buffer)
+      return ahciDisablePort(port,i); /*Alloc a buffer.*/
+   buffer = (u16 *)getPhysicsPageAddress((PhysicsPage *)buffer);
 
-      ahciStopCommand(port);
+   if(ahciSendCommand(port,ATA_CMD_IDENTIFY_PACKET,0,0,0,
+                         buffer,ATA_IDENTIFY_SIZE,0))
+      goto failed;
      
-      switch((((u16 *)buffer)[0] & 0x1f00) >> 8)
-      {
-      case 0x5: /*CD-ROM.*/
-         block->write = 0;
-         block->read = &ahciRead;
-         block->type = BlockDeviceCDROM;
-         block->data = (void *)port;
-         block->end = (u64)-1;
-
-         registerBlockDevice(block,"cdrom"); /*Register the block device.*/
-         break;
-      default: /*Not CD-ROM,no support for it.*/
-         ahciDisablePortATAPI(port,i);
-         break;
-      }
-
-      freePages(getPhysicsPage(buffer),0); /*Free the buffer.*/
+   switch((buffer[0] & 0x1f00) >> 8)
+   {
+   case 0x5: /*CD-ROM.*/
+      device->atapi = 1;
+      device->sectorSize = ATAPI_SECTOR_SIZE;
+
+      block->write = 0;
+      block->flush = 0;
+      block->read = &ahciRead;
+      block->type = BlockDeviceCDROM;
+      block->data = (void *)device;
+      block->end = (u64)-1;
+      block->sectorSize = ATAPI_SECTOR_SIZE;
+      block->checkMedia = &ahciCheckMediaATAPI;
+
+      registerBlockDevice(block,"cdrom"); /*Register the block device.*/
+      break;
+   default: /*Not CD-ROM,no support for it.*/
+      goto failed;
    }
-   
+
+   freePages(getPhysicsPage(buffer),0); /*Free the buffer.*/
    return 0;
+failed:
+   freePages(getPhysicsPage(buffer),0);
+   return ahciDisablePort(port,i);
+}
+
+static int ahciEnablePortATA(AHCIPort *port,int i)
+{
+   /*For more information about IDENTIFY DEVICE data,
+    * see also ATA/ATAPI-7 V1,page 119.*/
+   if(ahciInitPort(port,i))
+      return -ENOMEM;
+
+   BlockDevice *block = &ahciBlockDevices[i];
+   AHCIDevice *device = &ahciDevices[i];
+
+   u16 *buffer = (u16 *)allocPages(0);
+   if(!buffer)
+      return ahciDisablePort(port,i);
+   buffer = (u16 *)getPhysicsPageAddress((PhysicsPage *)buffer);
+
+   if(ahciSendCommand(port,ATA_CMD_IDENTIFY,0,0,0,
+                         buffer,ATA_IDENTIFY_SIZE,0))
+      goto failed;
+   if(!(buffer[83] & (1 << 10)))
+      goto failed; /*We only support 48-bit LBA.*/
+
+   u64 sectors = *(u64 *)&buffer[100];
+   u32 sectorSize = ATA_SECTOR_SIZE;
+   if((buffer[106] & 0xc000) == 0x4000 && (buffer[106] & (1 << 12)))
+      sectorSize = (buffer[117] | ((u32)buffer[118] << 16)) * 2;
+         /*Logical sector size in words.*/
+   if(sectorSize < ATA_SECTOR_SIZE || sectorSize > PHYSICS_PAGE_SIZE)
+      goto failed;
+
+   device->atapi = 0;
+   device->sectorSize = sectorSize;
+
+   block->read = &ahciRead;
+   block->write = &ahciWrite;
+   block->flush = &ahciFlush;
+   block->type = BlockDeviceDisk;
+   block->data = (void *)device;
+   block->end = sectors * sectorSize;
+   block->sectorSize = sectorSize;
+
+   char name[] = "sda";
+   name[2] += ahciDiskCount++; /*sda,sdb,sdc.....*/
+   registerBlockDevice(block,name);
+
+   freePages(getPhysicsPage(buffer),0);
+   return 0;
+failed:
+   freePages(getPhysicsPage(buffer),0);
+   return ahciDisablePort(port,i);
 }
 
 static int ahciEnable(Device *device)
@@ -457,6 +584,7 @@ static int ahciEnable(Device *device)
          switch(port->signature)
          {
          case AHCI_PORT_ATA:
+            ahciEnablePortATA(port,i);
             break;
          case AHCI_PORT_ATAPI:
             ahciEnablePortATAPI(port,i);
@@ -478,29 +606,13 @@ static int ahciDisable(Device *device)
 
    for(int i = 0;i < AHCI_MAX_PORTS;++i)
    {
-      if(ahci->port & (1 << i))
-      {
-         AHCIPort *port = &ahci->ports[i];
-         u32 status = port->status;
-         if((status & AHCI_PORT_IPM_MASK) != AHCI_PORT_IPM_ACTIVE)
-            continue;
-         if((status & AHCI_PORT_DET_MASK) != AHCI_PORT_DET_PRESENT)
-            continue;
-         switch(port->signature)
-         {
-         case AHCI_PORT_ATA:
-            break;
-         case AHCI_PORT_ATAPI:
-            ahciDisablePortATAPI(port,i); /*Disable it!*/
-            break;
-         default:
-            break;
-         }
-      }
+      if(ahciDevices[i].port)
+         ahciDisablePort(ahciDevices[i].port,i); /*Disable it!*/
    }
 
    ahci->hcontrol &= ~AHCI_GHC_ENABLE_IRQ; /*Disable interrupts.*/
    memset(ahciBlockDevices,0,sizeof(ahciBlockDevices));
+   memset(ahciDevices,0,sizeof(ahciDevices));
    freeIRQ(ahciIRQVector);
    ahciHBA = 0;
    return 0;
@@ -509,7 +621,9 @@ static int ahciDisable(Device *device)
 static int initAHCI(void)
 {
    ahciHBA = 0;
+   ahciDiskCount = 0;
    memset(ahciBlockDevices,0,sizeof(ahciBlockDevices));
+   memset(ahciDevices,0,sizeof(ahciDevices));
    initSemaphore(&ahciSemaphore);
    registerDriver(&ahciDriver); /*Register the driver.*/
    return 0;
@@ -1,7 +1,10 @@
 #include <core/const.h>
 #include <driver/driver.h>
 #include <core/list.h>
+#include <cpu/io.h>
 #include <cpu/spinlock.h>
+#include <task/task.h>
+#include <time/time.h>
 #include <video/console.h>
 
 static ListHead drivers = {};
@@ -10,6 +13,45 @@ static ListHead devices = {};
 static SpinLock driverLock = {};
 /*It's a spin lock of drivers and devices.*/
 
+static AtomicType driverEnabling = {};
+static Task *driverWaiter = 0;
+static SpinLock driverWaiterLock = {};
+   /*Protect driverWaiter,and the last decrement of driverEnabling with the wakeup.*/
+
+static int driverEnableDone(void)
+{
+   lockSpinLock(&driverWaiterLock);
+   if(atomicAddRet(&driverEnabling,-1) == 0 && driverWaiter)
+      wakeUpTask(driverWaiter,0);
+   unlockSpinLock(&driverWaiterLock);
+   return 0;
+}
+
+static int driverEnableTask(void *arg)
+{
+   Device *device = (Device *)arg;
+   Driver *driver = device->driver;
+   downSemaphore(&driver->semaphore);
+   unsigned long long ticks = getTicks();
+   int ret = (*driver->enable)(device);
+   ticks = getTicks() - ticks;
+   upSemaphore(&driver->semaphore);
+   printk("%s enabled in %d ms%s.\n",driver->name ? : "Device",
+      (int)(ticks * MSEC_PER_SEC / TIMER_HZ),ret ? ",failed" : "");
+
+   driverEnableDone();
+   return ret;
+}
+
+static int enableDevice(Device *device)
+{  /*Enable it in a kernel task,probing waits for devices.*/
+   int ret;
+   atomicAdd(&driverEnabling,1);
+   if((ret = createKernelTask(&driverEnableTask,device)) < 0)
+      driverEnableDone(); /*Nobody will enable it,don't wait for it.*/
+   return ret;
+}
+
 int registerDevice(Device *device)
 {
    device->driver = 0;
@@ -24,8 +66,7 @@ int registerDevice(Device *device)
       {
          device->driver = driver;
          unlockSpinLock(&driverLock);
-         int ret = driver->enable(device);
-         return ret;
+         return enableDevice(device);
       }
    }
    unlockSpinLock(&driverLock);
@@ -49,6 +90,7 @@ int deregisterDevice(Device *device)
 
 int registerDriver(Driver *driver)
 {
+   initSemaphore(&driver->semaphore);
    lockSpinLock(&driverLock);
    listAddTail(&driver->list,&drivers);
 
@@ -60,7 +102,7 @@ retry:
       {
          device->driver = driver;
          unlockSpinLock(&driverLock);
-         driver->enable(device); /*Enable it.*/
+         enableDevice(device); /*Enable it.*/
          lockSpinLock(&driverLock);
          goto retry;
       }
@@ -87,11 +129,33 @@ int deregisterDriver(Driver *driver)
    return 0;
 }
 
+int waitForDevices(void)
+{
+   Task *current = getCurrentTask();
+   lockSpinLock(&driverWaiterLock);
+   driverWaiter = current;
+   for(;;)
+   { /*Check it under the lock,the last enable task can't miss us.*/
+      current->state = TaskUninterruptible;
+      if(!atomicRead(&driverEnabling))
+         break;
+      unlockSpinLock(&driverWaiterLock);
+      schedule();
+      lockSpinLock(&driverWaiterLock);
+   }
+   current->state = TaskRunning;
+   driverWaiter = 0;
+   unlockSpinLock(&driverWaiterLock);
+   return 0;
+}
+
 int initDriver(void)
 {
    initSpinLock(&driverLock);
    initList(&drivers);
    initList(&devices);
+   atomicSet(&driverEnabling,0);
+   initSpinLock(&driverWaiterLock);
 /*Init some lists and spin locks.*/
    return 0;
 }
@@ -9,6 +9,7 @@
 #include <task/semaphore.h>
 #include <block/block.h>
 #include <memory/buddy.h>
+#include <time/time.h>
 
 typedef enum IDEDeviceType{
    InvalidIDEDevice,
@@ -36,6 +37,8 @@ typedef struct IDEDevice{
    u8 primary,master;
    /*Primary is if this device is primary.*/
    /*Master is if this device is master.*/
+   u8 noMediaEvents; /*GET EVENT STATUS NOTIFICATION is unsupported.*/
+   u8 mediaPresent;
    BlockDevice block;
 } IDEDevice;
 
@@ -49,6 +52,7 @@ typedef struct IDEInterruptWait{
 /*IDE in PCI.*/
 #define IDE_PCI_CLASS                0x01010000
 #define IDE_PCI_CLASS_MASK           0xffff0000
+#define IDE_PCI_BUS_MASTER           0x00008000 /*In the programming interface.*/
 
 /*IDE primary or secondary.*/
 #define IDE_PRIMARY                  0x0
@@ -91,6 +95,14 @@ typedef struct IDEInterruptWait{
 #define IDE_STATUS_ERROR             0x01
 
 #define ATAPI_SECTOR_SIZE            0x800 /*2048.*/
+#define ATAPI_MAX_SECTORS            0x1000 /*8MB per command.*/
+#define ATAPI_PIO_SECTORS            (PHYSICS_PAGE_SIZE / ATAPI_SECTOR_SIZE)
+
+/*Bus Master IDE PRD table.*/
+#define IDE_PRD_BOUNDARY             0x10000 /*A PRD can't cross 64KB.*/
+#define IDE_PRD_END                  0x8000000000000000ul
+#define IDE_MAX_PRDS                 (PHYSICS_PAGE_SIZE / sizeof(u64))
+#define IDE_DMA_LIMIT                0x100000000ul /*4GB.*/
 
 /*The IRQ vector of IDE.*/
 #define IDE_PRIMARY_IRQ              14
@@ -104,7 +116,7 @@ typedef struct IDEInterruptWait{
 static int ideDisable(Device *device);
 static int ideProbe(Device *device);
 static int ideEnable(Device *device);
-static int cdromTask(void *arg);
+static int ideCheckMediaATAPI(void *data);
 static int ideIRQPrimary(IRQRegisters *reg,void *data);
 static int ideIRQSecondary(IRQRegisters *reg,void *data);
 
@@ -126,7 +138,10 @@ static Semaphore ideSemaphores[2] = {};
 
 static IDEDevice ideDevices[2][2] = {{{0},{0}},{{0},{0}}};
 
+static u8 ideBusMaster = 0;
+
 static Driver ideDriver = {
+   .name = "IDE",
    .probe = &ideProbe,
    .disable = &ideDisable,
    .enable = &ideEnable
@@ -270,8 +285,32 @@ static int ideWaitDRQ(u8 device)
    return error;
 }
 
+static int ideSetupPRDT(IDEDevice *device,void *buf,u32 size)
+{
+   u64 *prdt = getPhysicsPageAddress(device->prdt);
+   pointer address = va2pa(buf);
+   int i = 0;
+   if(address + size > IDE_DMA_LIMIT)
+      return -EINVAL;
+   while(size)
+   {
+      u32 length = IDE_PRD_BOUNDARY - (address & (IDE_PRD_BOUNDARY - 1));
+      if(length > size)
+         length = size; /*Split at 64KB boundaries.*/
+      if(i == IDE_MAX_PRDS)
+         return -EINVAL;
+      prdt[i++] = (u32)address | ((u64)(length & 0xffff) << 32);
+         /*Zero means 64KB.*/
+      address += length;
+      size -= length;
+   }
+   if(i)
+      prdt[i - 1] |= IDE_PRD_END;
+   return 0;
+}
+
 static int ideSendCommandATAPI(IDEDevice *device,u8 *cmd,
-                                 u16 cmdSize,u16 transSize,void *buf,u8 dma)
+                                 u16 cmdSize,u32 transSize,void *buf,u8 dma)
 {
    int sizeRead = transSize;
    Task *current = getCurrentTask();
@@ -281,7 +320,9 @@ static int ideSendCommandATAPI(IDEDevice *device,u8 *cmd,
    u8 irq = 
       (primary == IDE_PRIMARY) ? IDE_PRIMARY_IRQ : IDE_SECONDARY_IRQ;
 
-   dma = (dma && device->dma);
+   dma = (dma && device->dma && buf);
+   if(!dma && transSize > 0xffff)
+      return -EINVAL; /*The byte count limit of PIO is 16 bits.*/
 
    downSemaphore(&ideSemaphores[primary]);
 
@@ -289,14 +330,11 @@ static int ideSendCommandATAPI(IDEDevice *device,u8 *cmd,
    ideOutb(primary,IDE_REG_CONTROL,IDE_ENABLE_IRQ);
    if(dma)
    {
-      u64 *prdt = getPhysicsPageAddress(device->prdt);
-      pointer address = va2pa(buf);
-      u64 data = (u32)address;
-      data |= ((u64)transSize) << 32;
-      data |= 0x8000000000000000ul;
-      *prdt = data; /*Set the PRD Table.*/
-
-      address = va2pa(prdt); /*Get the physics address of PRDT.*/
+      if(ideSetupPRDT(device,buf,transSize))
+         goto failed; /*Set the PRD Table.*/
+
+      pointer address = va2pa(getPhysicsPageAddress(device->prdt));
+         /*Get the physics address of PRDT.*/
       ideOutb(primary,IDE_REG_BMCOMMAND,0); /*Stop!*/
       ideOutb(primary,IDE_REG_BMSTATUS,ideInb(primary,IDE_REG_BMSTATUS)); 
                /*Clear all bits of the Status Register.*/
@@ -361,63 +399,63 @@ failed:
    return -EIO;
 }
 
-static int ideGetDMASupportATAPI(IDEDevice *device)
-{
-   u8 cmd[12] = {0xa8,0,0,0,0,0,0,0,0,1,0,0};
-   u8 *buf = (u8 *)allocDMAPages(0,32); /*Alloc a DMA buffer.*/
-   if(!buf)
-      return -ENOMEM;
-   buf = (u8 *)getPhysicsPageAddress((PhysicsPage *)buf);
-   memset(buf,0x11,ATAPI_SECTOR_SIZE);
-   u8 retval;
-
-   device->dma = 1;
-   for(;;)
-   {
-      retval =
-         ideSendCommandATAPI(device,cmd,sizeof(cmd),ATAPI_SECTOR_SIZE,buf,1); 
-      if(retval && (device->dma = 0,1)) /*Try to read data using DMA.*/
-         goto out;
-      for(int i = 0;i < ATAPI_SECTOR_SIZE;i += sizeof(u64))
-         if(*(u64 *)&buf[i] != 0x1111111111111111ul)
-            goto out; /*If the buffer is changed,DMA is supported.*/
-      retval = 
-         ideSendCommandATAPI(device,cmd,sizeof(cmd),ATAPI_SECTOR_SIZE,buf,0); 
-                                         /*Try to read data using PIO.*/
-      if(retval && (device->dma = 0,1))
-         goto out;
-      for(int i = 0;i < ATAPI_SECTOR_SIZE;i += sizeof(u64))
-         if((*(u64 *)&buf[i] != 0x1111111111111111ul) && (device->dma = 0,1))
-            goto out; /*If the buffer is changed,DMA is not supported.*/
-      if(++cmd[5] == 0)
-         if(++cmd[4] == 0)
-            if(++cmd[3] == 0)
-               if((++cmd[2] == 0) && (device->dma = 0,1))
-                  goto out; /*Try to read the next sector.*/
-   }
-out:
-   freePages(getPhysicsPage(buf),0); /*Free the buffer.*/
-   return retval;
-}
-
-static int ideReadSectorATAPI(IDEDevice *device,u64 lba,u8 sector,void *buf)
+static int ideReadSectorATAPI(IDEDevice *device,u64 lba,u32 sector,void *buf)
 {
    u8 cmd[12] = {0xa8 /*READ (12).*/,0,0,0,0,0,0,0,0,0,0,0};
       /*SCSI Command.*/
-   if(sector >= 32)
-      return -EINVAL;
-
-   cmd[9] = sector;
    cmd[2] = (lba >> 0x18) & 0xff;
    cmd[3] = (lba >> 0x10) & 0xff;
    cmd[4] = (lba >> 0x08) & 0xff;
-   cmd[5] = (lba >> 0x00) & 0xff; /*Set this scsi command.*/
+   cmd[5] = (lba >> 0x00) & 0xff;
+   cmd[6] = (sector >> 0x18) & 0xff;
+   cmd[7] = (sector >> 0x10) & 0xff;
+   cmd[8] = (sector >> 0x08) & 0xff;
+   cmd[9] = (sector >> 0x00) & 0xff; /*Set this scsi command.*/
 
    int ret = ideSendCommandATAPI(device,cmd,sizeof(cmd),sector * ATAPI_SECTOR_SIZE,buf,1);
 
    return ret;
 }
 
+static int ideTransferATAPI(void *data,u64 lba,u64 count,void *buf,int write)
+{
+   IDEDevice *device = (IDEDevice *)data;
+   int ret = 0;
+   if(write)
+      return -EROFS;
+   if(device->dma && va2pa(buf) + count * ATAPI_SECTOR_SIZE <= IDE_DMA_LIMIT)
+   {
+      while(count)
+      {  /*DMA to the destination pages directly.*/
+         u64 sector = (count > ATAPI_MAX_SECTORS) ? ATAPI_MAX_SECTORS : count;
+         if((ret = ideReadSectorATAPI(device,lba,sector,buf)))
+            return ret;
+         lba += sector;
+         count -= sector;
+         buf += sector * ATAPI_SECTOR_SIZE;
+      }
+      return 0;
+   }
+
+   /*PIO or the pages are above 4GB,use a bounce buffer.*/
+   void *__buf = allocDMAPages(0,32);
+   if(!__buf)
+      return -ENOMEM;
+   __buf = getPhysicsPageAddress((PhysicsPage *)__buf);
+   while(count)
+   {
+      u64 sector = (count > ATAPI_PIO_SECTORS) ? ATAPI_PIO_SECTORS : count;
+      if((ret = ideReadSectorATAPI(device,lba,sector,__buf)))
+         break;
+      memcpy(buf,__buf,sector * ATAPI_SECTOR_SIZE);
+      lba += sector;
+      count -= sector;
+      buf += sector * ATAPI_SECTOR_SIZE;
+   }
+   freePages(getPhysicsPage(__buf),0); /*Free the buffer.*/
+   return ret;
+}
+
 static int ideRead(void *data,u64 start,u64 size,void *buf)
 {
    IDEDevice *device = (IDEDevice *)data;
@@ -427,61 +465,8 @@ static int ideRead(void *data,u64 start,u64 size,void *buf)
       return -ENOSYS;
    }else if(device->type == IDEDeviceTypeATAPI)
    {
-      int ret = -EIO;
-      void *__buf = allocDMAPages(0,32);
-      if(!__buf) /*Alloc a DMA buffer at first.*/
-         return -ENOMEM;
-      __buf = getPhysicsPageAddress((PhysicsPage *)__buf);
-      u64 lba = start / ATAPI_SECTOR_SIZE;
-      if(start % ATAPI_SECTOR_SIZE != 0)
-      {
-         if(ideReadSectorATAPI(device,lba,1,__buf))
-            goto out;
-         u64 __size;
-         if(size < ATAPI_SECTOR_SIZE - start % ATAPI_SECTOR_SIZE)
-            __size = size;
-         else
-            __size = ATAPI_SECTOR_SIZE - start % ATAPI_SECTOR_SIZE;
-         memcpy((void *)buf,(const void *)__buf + start % ATAPI_SECTOR_SIZE,__size);
-         ++lba;
-         size -= __size;
-         ret = 0;
-         if(size == 0)
-            goto out;
-         ret = -EIO;
-      }
-      int count = size / ATAPI_SECTOR_SIZE;
-      if(start % ATAPI_SECTOR_SIZE != 0)
-         --count;
-#define PAGE_SECTOR (PHYSICS_PAGE_SIZE / ATAPI_SECTOR_SIZE)
-      while(count > PAGE_SECTOR)
-      {
-         if(ideReadSectorATAPI(device,lba,PAGE_SECTOR,__buf))
-            goto out;
-         memcpy((void *)buf,(const void *)__buf,PHYSICS_PAGE_SIZE);
-         buf += PHYSICS_PAGE_SIZE;
-         lba += PAGE_SECTOR;
-         count -= PAGE_SECTOR;
-      }
-#undef PAGE_SECTOR
-      if(!count)
-         goto next;
-      if(ideReadSectorATAPI(device,lba,count,__buf))
-         goto out;
-      memcpy((void *)buf,(const void *)__buf,count * ATAPI_SECTOR_SIZE);
-      buf += ATAPI_SECTOR_SIZE * count;
-      ++lba;
-next:
-      if(size % ATAPI_SECTOR_SIZE != 0)
-      {
-         if(ideReadSectorATAPI(device,lba,1,__buf))
-            goto out;
-         memcpy(buf,__buf,size % ATAPI_SECTOR_SIZE);
-      }
-      ret = 0;
-out:
-      freePages(getPhysicsPage(__buf),0); /*Free the buffer.*/
-      return ret;
+      return transferBlockSectors(&ideTransferATAPI,data,
+                   ATAPI_SECTOR_SIZE,start,size,buf,0);
    }else
    {
       return -ENOSYS;
@@ -510,9 +495,11 @@ static int ideParseIdentifyData(IDEDevice *device,IDEDeviceType type,void *__dat
       if(deviceType != 0x5) 
          return -ENOSYS;  /*CD-ROM device?*/
       device->subType = IDEDeviceSubTypeCDROM;
-      device->dma = !!(data[49] & (1 << 8));
-      if(device->dma)
-         ideGetDMASupportATAPI(device);
+      device->dma = ideBusMaster && device->prdt && (data[49] & (1 << 8));
+         /*Word 49 bit 8: DMA supported.*/
+      if(!(data[63] & 0x7) && !((data[53] & (1 << 2)) && (data[88] & 0x7f)))
+         device->dma = 0;
+         /*No Multiword DMA (word 63) or Ultra DMA (word 88) mode.*/
    }else
    {
       return -ENOSYS;
@@ -539,6 +526,7 @@ static int ideEnable(Device *device)
       return -EBUSY;
    PCIDevice *pci = containerOf(device,PCIDevice,globalDevice);
 
+   ideBusMaster = (pci->class & IDE_PCI_BUS_MASTER) && (pci->bar[4] & 0xfffffffc);
    ports[IDE_PRIMARY  ].base = pci->bar[0] ? (pci->bar[0] & 0xfffffffc) : 0x1f0;
    ports[IDE_PRIMARY  ].ctrl = pci->bar[1] ? (pci->bar[1] & 0xfffffffc) : 0x3f4;
    ports[IDE_PRIMARY  ].busMasterIDE = (pci->bar[4] & 0xfffffffc) + 0;
@@ -639,9 +627,9 @@ snext:
             block->type = BlockDeviceCDROM;
             block->data = (void *)&ideDevices[i][j];
             block->end = (u64)-1;
+            block->sectorSize = ATAPI_SECTOR_SIZE;
+            block->checkMedia = &ideCheckMediaATAPI;
             registerBlockDevice(block,"cdrom");
-            //createKernelTask(&cdromTask,&ideDevices[i][j]);
-            (void)cdromTask;
          }
       }
    }
@@ -665,41 +653,45 @@ static int ideDisable(Device *device)
    return 0;
 }
 
-static int cdromStatusCheck(IDEDevice *device)
+static int ideMediaPresentATAPI(IDEDevice *device)
 {
    u8 cmd[12] = {0x25 /*Read Capacity.*/,0,0,0,0,0,0,0,0,0,0,0};
-   int ret = ideSendCommandATAPI(device,cmd,sizeof(cmd),8,0,0);
-   if(ret < 0)
-      return 1; /*Not inserted.*/
-   return 0; /*This media is inserted.*/
+   u8 buf[8];
+   return !ideSendCommandATAPI(device,cmd,sizeof(cmd),sizeof(buf),buf,0);
 }
 
-static int cdromTask(void *arg)
+static int ideCheckMediaATAPI(void *data)
 {
-   IDEDevice *device = (IDEDevice *)arg;
-   int status = cdromStatusCheck(device);
-   int newStatus;
-   for(;;)
+   IDEDevice *device = (IDEDevice *)data;
+   if(!device->noMediaEvents)
    {
-      getCurrentTask()->state = TaskUninterruptible;
-      scheduleTimeout(1000); /*1 second.*/
-      newStatus = cdromStatusCheck(device);
-      if(status == newStatus)
-         continue; /*Status is changed?*/
-      status = newStatus;
-      switch(status) /*Print some information.*/
+      u8 cmd[12] = {0x4a /*GET EVENT STATUS NOTIFICATION.*/,0x1 /*Polled.*/,
+                    0,0,0x10 /*Media class.*/,0,0,0,8,0,0,0};
+      u8 buf[8];
+      if(!ideSendCommandATAPI(device,cmd,sizeof(cmd),sizeof(buf),buf,0) &&
+         !(buf[2] & 0x80) /*No event available?*/)
       {
-      case 0:
-         printk("CDROM inserted!!\n");
-         break;
-      case 1:
-         printk("CDROM ejected!!\n");
-         break;
-      default:
-         break;
+         switch(buf[4] & 0xf) /*The media event code.*/
+         {
+         case 0x2: /*New media.*/
+         case 0x3: /*Media removal.*/
+         case 0x4: /*Media changed.*/
+            return 1;
+         default:
+            return 0;
+         }
       }
+      device->noMediaEvents = 1;
+      device->mediaPresent = ideMediaPresentATAPI(device);
+      return 0;
    }
-   return 0;
+
+   /*Old drives,check if the media is still there.*/
+   u8 present = ideMediaPresentATAPI(device);
+   if(present == device->mediaPresent)
+      return 0;
+   device->mediaPresent = present;
+   return 1;
 }
 
 static int ideIRQCommon(int primary,IDEInterruptWait *wait)
@@ -0,0 +1,599 @@
+#include <core/const.h>
+#include <driver/driver.h>
+#include <driver/pci.h>
+#include <block/block.h>
+#include <interrupt/interrupt.h>
+#include <interrupt/localapic.h>
+#include <memory/kmalloc.h>
+#include <memory/buddy.h>
+#include <memory/paging.h>
+#include <cpu/io.h>
+#include <cpu/spinlock.h>
+#include <task/task.h>
+#include <time/time.h>
+#include <video/console.h>
+#include <lib/string.h>
+
+typedef struct NVMe NVMe;
+
+typedef struct NVMeCommand{
+   u8 opcode;
+   u8 flags;
+   u16 id;
+   u32 namespace;
+   u64 reserved;
+   u64 metadata;
+   u64 prp1;
+   u64 prp2;
+   u32 cdw10,cdw11,cdw12,cdw13,cdw14,cdw15;
+} __attribute__ ((packed)) NVMeCommand;
+
+typedef struct NVMeCompletion{
+   u32 result;
+   u32 reserved;
+   u16 sqHead;
+   u16 sqID;
+   u16 id;
+   u16 status; /*Bit 0 is the phase tag.*/
+} __attribute__ ((packed)) NVMeCompletion;
+
+typedef struct NVMeRequest{
+   Task *task;
+   volatile u8 done;
+   u16 status;
+   u32 result;
+} NVMeRequest;
+
+typedef struct NVMeQueue{
+   NVMe *nvme;
+   u16 id;
+   u16 size;
+   NVMeCommand *sq;
+   volatile NVMeCompletion *cq;
+   volatile u32 *sqDoorbell;
+   volatile u32 *cqDoorbell;
+   u16 sqTail;
+   u16 cqHead;
+   u16 inflight;
+   u16 nextID;
+   u8 phase;
+   u8 polling;
+   NVMeRequest **requests; /*Indexed by command id.*/
+   SpinLock lock;
+} NVMeQueue;
+
+#define NVME_MAX_QUEUES           8
+
+typedef struct NVMe{
+   volatile u8 *registers;
+   u32 doorbellStride;
+   u8 irq;
+   u64 maxTransfer;  /*In bytes.*/
+   u16 queueCount;   /*I/O queues.*/
+   NVMeQueue queues[NVME_MAX_QUEUES + 1]; /*Queue 0 is the admin queue.*/
+   int index;
+} NVMe;
+
+typedef struct NVMeNamespace{
+   NVMe *nvme;
+   u32 id;
+   u32 sectorSize;
+   BlockDevice block;
+} NVMeNamespace;
+
+#define NVME_PCI_CLASS            0x01080200
+#define NVME_PCI_CLASS_MASK       0xffffff00
+
+/*Controller registers.*/
+#define NVME_REG_CAP              0x00
+#define NVME_REG_CC               0x14
+#define NVME_REG_CSTS             0x1c
+#define NVME_REG_AQA              0x24
+#define NVME_REG_ASQ              0x28
+#define NVME_REG_ACQ              0x30
+#define NVME_REG_DOORBELL         0x1000
+
+#define NVME_CC_ENABLE            0x1
+#define NVME_CC_IOSQES            (6 << 16) /*64 bytes.*/
+#define NVME_CC_IOCQES            (4 << 20) /*16 bytes.*/
+#define NVME_CSTS_READY           0x1
+#define NVME_CSTS_FATAL           0x2
+
+/*Admin commands.*/
+#define NVME_ADMIN_CREATE_SQ      0x01
+#define NVME_ADMIN_CREATE_CQ      0x05
+#define NVME_ADMIN_IDENTIFY       0x06
+#define NVME_ADMIN_SET_FEATURES   0x09
+
+#define NVME_FEATURE_QUEUES       0x07
+#define NVME_IDENTIFY_NAMESPACE   0x0
+#define NVME_IDENTIFY_CONTROLLER  0x1
+
+/*I/O commands.*/
+#define NVME_CMD_FLUSH            0x00
+#define NVME_CMD_WRITE            0x01
+#define NVME_CMD_READ             0x02
+
+#define NVME_ADMIN_QUEUE_SIZE     32
+#define NVME_IO_QUEUE_SIZE        64
+#define NVME_MAX_NAMESPACES       16
+#define NVME_PRP_ENTRIES          (PAGE_SIZE / sizeof(u64))
+#define NVME_MAX_TRANSFER         (NVME_PRP_ENTRIES * PAGE_SIZE) /*One PRP list page.*/
+
+static int nvmeProbe(Device *device);
+static int nvmeEnable(Device *device);
+static int nvmeDisable(Device *device);
+
+static int nvmeCount;
+
+static Driver nvmeDriver = {
+   .name = "NVMe",
+   .probe = &nvmeProbe,
+   .enable = &nvmeEnable,
+   .disable = &nvmeDisable
+};
+
+static inline u32 nvmeInl(NVMe *nvme,u32 reg) __attribute__ ((always_inline));
+static inline int nvmeOutl(NVMe *nvme,u32 reg,u32 data)
+   __attribute__ ((always_inline));
+static inline int nvmeOutq(NVMe *nvme,u32 reg,u64 data)
+   __attribute__ ((always_inline));
+
+static inline u32 nvmeInl(NVMe *nvme,u32 reg)
+{
+   return *(volatile u32 *)(nvme->registers + reg);
+}
+
+static inline int nvmeOutl(NVMe *nvme,u32 reg,u32 data)
+{
+   *(volatile u32 *)(nvme->registers + reg) = data;
+   return 0;
+}
+
+static inline int nvmeOutq(NVMe *nvme,u32 reg,u64 data)
+{
+   nvmeOutl(nvme,reg + 0,(u32)data);
+   nvmeOutl(nvme,reg + 4,(u32)(data >> 32));
+   return 0;
+}
+
+static int nvmeComplete(NVMeQueue *queue)
+{
+   int handled = 0;
+   u64 rflags;
+   lockSpinLockCloseInterrupt(&queue->lock,&rflags);
+   for(;;)
+   {
+      volatile NVMeCompletion *entry = &queue->cq[queue->cqHead];
+      if((entry->status & 0x1) != queue->phase)
+         break; /*Not posted yet.*/
+      NVMeRequest *request = queue->requests[entry->id];
+      queue->requests[entry->id] = 0;
+      --queue->inflight;
+      if(request)
+      {
+         Task *task = request->task;
+         request->status = entry->status >> 1;
+         request->result = entry->result;
+         request->done = 1; /*The request may be freed after this.*/
+         wakeUpTask(task,0);
+      }
+      if(++queue->cqHead == queue->size)
+      {
+         queue->cqHead = 0;
+         queue->phase ^= 1; /*The phase tag is inverted on each pass.*/
+      }
+      handled = 1;
+   }
+   if(handled)
+      *queue->cqDoorbell = queue->cqHead;
+   unlockSpinLockRestoreInterrupt(&queue->lock,&rflags);
+   return handled;
+}
+
+static int nvmeIRQ(IRQRegisters *reg,void *data)
+{
+   NVMe *nvme = (NVMe *)data;
+   if(!nvme)
+      return 0;
+   for(int i = 1;i <= nvme->queueCount;++i)
+      nvmeComplete(&nvme->queues[i]);
+   return 0;
+}
+
+static int nvmeSubmit(NVMeQueue *queue,NVMeCommand *command,
+                      u32 *result,int poll)
+{
+   Task *current = getCurrentTask();
+   NVMeRequest request = {.task = current,.done = 0,.status = 0,.result = 0};
+   u64 rflags;
+
+   poll = poll || queue->polling;
+   lockSpinLockCloseInterrupt(&queue->lock,&rflags);
+   while(queue->inflight == queue->size - 1)
+   {  /*The submission queue is full.*/
+      unlockSpinLockRestoreInterrupt(&queue->lock,&rflags);
+      if(poll)
+         nvmeComplete(queue);
+      schedule();
+      lockSpinLockCloseInterrupt(&queue->lock,&rflags);
+   }
+   while(queue->requests[queue->nextID])
+      queue->nextID = (queue->nextID + 1) % queue->size;
+   command->id = queue->nextID;
+   queue->requests[command->id] = &request;
+   ++queue->inflight;
+
+   memcpy(&queue->sq[queue->sqTail],command,sizeof(*command));
+   if(++queue->sqTail == queue->size)
+      queue->sqTail = 0;
+   asm volatile("":::"memory");
+   *queue->sqDoorbell = queue->sqTail; /*Ring the doorbell.*/
+   unlockSpinLockRestoreInterrupt(&queue->lock,&rflags);
+
+   for(;;)
+   {
+      if(poll)
+         nvmeComplete(queue);
+      else
+         current->state = TaskUninterruptible;
+      if(request.done)
+         break;
+      schedule();
+   }
+   current->state = TaskRunning;
+   if(result)
+      *result = request.result;
+   return request.status ? -EIO : 0;
+}
+
+static int nvmeAdminCommand(NVMe *nvme,NVMeCommand *command,u32 *result)
+{
+   return nvmeSubmit(&nvme->queues[0],command,result,1);
+}
+
+static int nvmeTransfer(void *data,u64 lba,u64 count,void *buf,int write)
+{
+   NVMeNamespace *ns = (NVMeNamespace *)data;
+   NVMe *nvme = ns->nvme;
+   NVMeQueue *queue =
+      &nvme->queues[1 + getLocalApicID() % nvme->queueCount];
+      /*Each CPU has its own queue pair,no lock contention.*/
+   u64 *prpList = 0;
+   u64 maxSectors = nvme->maxTransfer / ns->sectorSize;
+   int ret = 0;
+
+   while(count)
+   {
+      u64 sector = (count > maxSectors) ? maxSectors : count;
+      u64 size = sector * ns->sectorSize;
+      pointer address = va2pa(buf);
+      u64 first = PAGE_SIZE - (address & (PAGE_SIZE - 1));
+      NVMeCommand command;
+      memset(&command,0,sizeof(command));
+      command.opcode = write ? NVME_CMD_WRITE : NVME_CMD_READ;
+      command.namespace = ns->id;
+      command.prp1 = address; /*Point at the caller's pages directly.*/
+      if(size > first + PAGE_SIZE)
+      {  /*More than two pages,use a PRP list.*/
+         if(!prpList)
+         {
+            PhysicsPage *page = allocPages(0);
+            if(!page)
+               return -ENOMEM;
+            prpList = (u64 *)getPhysicsPageAddress(page);
+         }
+         u64 pages = (size - first + PAGE_SIZE - 1) / PAGE_SIZE;
+         for(u64 i = 0;i < pages;++i)
+            prpList[i] = address + first + i * PAGE_SIZE;
+         command.prp2 = va2pa(prpList);
+      }else if(size > first)
+      {
+         command.prp2 = address + first;
+      }
+      command.cdw10 = (u32)lba;
+      command.cdw11 = (u32)(lba >> 32);
+      command.cdw12 = (sector - 1) & 0xffff; /*It is zero-based.*/
+
+      if((ret = nvmeSubmit(queue,&command,0,!write && ns->block.pollReads)))
+            /*Latency-sensitive reads may poll,see BLOCK_SET_POLL_READS.*/
+         break;
+      lba += sector;
+      count -= sector;
+      buf += size;
+   }
+   if(prpList)
+      freePages(getPhysicsPage(prpList),0);
+   return ret;
+}
+
+static int nvmeRead(void *data,u64 start,u64 size,void *buf)
+{
+   NVMeNamespace *ns = (NVMeNamespace *)data;
+   return transferBlockSectors(&nvmeTransfer,data,
+               ns->sectorSize,start,size,buf,0);
+}
+
+static int nvmeWrite(void *data,u64 start,u64 size,void *buf)
+{
+   NVMeNamespace *ns = (NVMeNamespace *)data;
+   return transferBlockSectors(&nvmeTransfer,data,
+               ns->sectorSize,start,size,buf,1);
+}
+
+static int nvmeFlush(void *data)
+{
+   NVMeNamespace *ns = (NVMeNamespace *)data;
+   NVMe *nvme = ns->nvme;
+   NVMeCommand command;
+   memset(&command,0,sizeof(command));
+   command.opcode = NVME_CMD_FLUSH;
+   command.namespace = ns->id;
+   return nvmeSubmit(&nvme->queues[1 + getLocalApicID() % nvme->queueCount],
+                        &command,0,0);
+}
+
+static int nvmeInitQueue(NVMe *nvme,NVMeQueue *queue,u16 id,u16 size)
+{
+   PhysicsPage *sq = allocPages(0);
+   if(!sq)
+      return -ENOMEM;
+   PhysicsPage *cq = allocPages(0);
+   if(!cq)
+      return (freePages(sq,0),-ENOMEM);
+   NVMeRequest **requests = kmalloc(size * sizeof(NVMeRequest *));
+   if(!requests)
+      return (freePages(sq,0),freePages(cq,0),-ENOMEM);
+
+   memset(queue,0,sizeof(*queue));
+   initSpinLock(&queue->lock);
+   queue->nvme = nvme;
+   queue->id = id;
+   queue->size = size;
+   queue->sq = (NVMeCommand *)getPhysicsPageAddress(sq);
+   queue->cq = (NVMeCompletion *)getPhysicsPageAddress(cq);
+   queue->sqDoorbell = (volatile u32 *)(nvme->registers +
+      NVME_REG_DOORBELL + (2 * id + 0) * nvme->doorbellStride);
+   queue->cqDoorbell = (volatile u32 *)(nvme->registers +
+      NVME_REG_DOORBELL + (2 * id + 1) * nvme->doorbellStride);
+   queue->phase = 1;
+   queue->requests = requests;
+   memset(requests,0,size * sizeof(NVMeRequest *));
+   memset((void *)queue->sq,0,PAGE_SIZE);
+   memset((void *)queue->cq,0,PAGE_SIZE);
+   return 0;
+}
+
+static int nvmeFreeQueue(NVMeQueue *queue)
+{
+   if(!queue->size)
+      return 0;
+   freePages(getPhysicsPage((void *)queue->sq),0);
+   freePages(getPhysicsPage((void *)queue->cq),0);
+   kfree(queue->requests);
+   queue->size = 0;
+   return 0;
+}
+
+static int nvmeWaitReady(NVMe *nvme,u32 ready,u64 timeout)
+{
+   unsigned long long ticks = getTicks() + timeout * TIMER_HZ / MSEC_PER_SEC;
+   while((nvmeInl(nvme,NVME_REG_CSTS) & NVME_CSTS_READY) != ready)
+   {
+      if(nvmeInl(nvme,NVME_REG_CSTS) & NVME_CSTS_FATAL)
+         return -EIO;
+      if(getTicks() > ticks)
+         return -ETIMEDOUT;
+      schedule();
+   }
+   return 0;
+}
+
+static int nvmeCreateQueues(NVMe *nvme,u16 size)
+{
+   NVMeCommand command;
+   u16 count = NVME_MAX_QUEUES;
+
+   memset(&command,0,sizeof(command));
+   command.opcode = NVME_ADMIN_SET_FEATURES;
+   command.cdw10 = NVME_FEATURE_QUEUES;
+   command.cdw11 = (count - 1) | ((count - 1) << 16);
+   u32 result;
+   if(nvmeAdminCommand(nvme,&command,&result))
+      return -EIO;
+   if((result & 0xffff) + 1 < count) /*How many queues are allocated?*/
+      count = (result & 0xffff) + 1;
+   if((result >> 16) + 1 < count)
+      count = (result >> 16) + 1;
+
+   for(u16 id = 1;id <= count;++id)
+   {
+      NVMeQueue *queue = &nvme->queues[id];
+      if(nvmeInitQueue(nvme,queue,id,size))
+         break;
+
+      memset(&command,0,sizeof(command));
+      command.opcode = NVME_ADMIN_CREATE_CQ;
+      command.prp1 = va2pa(queue->cq);
+      command.cdw10 = ((size - 1) << 16) | id;
+      command.cdw11 = 0x3; /*Physically contiguous,interrupts enabled.*/
+      if(nvmeAdminCommand(nvme,&command,0))
+      {
+         nvmeFreeQueue(queue);
+         break;
+      }
+
+      memset(&command,0,sizeof(command));
+      command.opcode = NVME_ADMIN_CREATE_SQ;
+      command.prp1 = va2pa(queue->sq);
+      command.cdw10 = ((size - 1) << 16) | id;
+      command.cdw11 = (id << 16) | 0x1; /*Use the completion queue id.*/
+      if(nvmeAdminCommand(nvme,&command,0))
+      {
+         nvmeFreeQueue(queue);
+         break;
+      }
+      nvme->queueCount = id;
+   }
+   return nvme->queueCount ? 0 : -EIO;
+}
+
+static int nvmeAddNamespace(NVMe *nvme,u32 id,u8 *identify)
+{
+   NVMeCommand command;
+   memset(&command,0,sizeof(command));
+   command.opcode = NVME_ADMIN_IDENTIFY;
+   command.namespace = id;
+   command.prp1 = va2pa(identify);
+   command.cdw10 = NVME_IDENTIFY_NAMESPACE;
+   if(nvmeAdminCommand(nvme,&command,0))
+      return -EIO;
+
+   u64 sectors = *(u64 *)&identify[0];
+   u8 format = identify[26] & 0xf;
+   u32 lbaFormat = *(u32 *)&identify[128 + format * 4];
+   u32 sectorSize = 1 << ((lbaFormat >> 16) & 0xff);
+   if(!sectors)
+      return -ENODEV; /*Inactive namespace.*/
+   if(sectorSize < 512 || sectorSize > PAGE_SIZE)
+      return -ENOSYS;
+
+   NVMeNamespace *ns = kmalloc(sizeof(NVMeNamespace));
+   if(!ns)
+      return -ENOMEM;
+   memset(ns,0,sizeof(*ns));
+   ns->nvme = nvme;
+   ns->id = id;
+   ns->sectorSize = sectorSize;
+   ns->block.data = (void *)ns;
+   ns->block.read = &nvmeRead;
+   ns->block.write = &nvmeWrite;
+   ns->block.flush = &nvmeFlush;
+   ns->block.type = BlockDeviceDisk;
+   ns->block.end = sectors * sectorSize;
+   ns->block.sectorSize = sectorSize;
+
+   char name[16] = "nvme";
+   char *end = itoa(nvme->index,name + 4,10,0,0,1);
+   *end++ = 'n';
+   end = itoa(id,end,10,0,0,1);
+   *end++ = 'p';
+   *end = '\0'; /*Like this: nvme0n1p0,nvme0n1p1...*/
+   return registerBlockDevice(&ns->block,name);
+}
+
+static int nvmeProbe(Device *device)
+{
+   if(device->type != DeviceTypePCI)
+      return 1;
+   PCIDevice *pci = containerOf(device,PCIDevice,globalDevice);
+   if((pci->class & NVME_PCI_CLASS_MASK) != NVME_PCI_CLASS)
+      return 1;
+   return 0;
+}
+
+static int nvmeEnable(Device *device)
+{
+   PCIDevice *pci = containerOf(device,PCIDevice,globalDevice);
+   u64 address = pciGetMemoryBar(pci,0);
+   if(!address || address >= 0x100000000ul)
+      return -ENODEV; /*Only 4GB are mapped.*/
+   NVMe *nvme = kmalloc(sizeof(NVMe));
+   if(!nvme)
+      return -ENOMEM;
+   memset(nvme,0,sizeof(*nvme));
+   nvme->registers = (volatile u8 *)pa2va(address);
+   pciEnableBusMaster(pci);
+
+   u64 cap = nvmeInl(nvme,NVME_REG_CAP) |
+      ((u64)nvmeInl(nvme,NVME_REG_CAP + 4) << 32);
+   u16 entries = (cap & 0xffff) + 1; /*Max queue entries.*/
+   u64 timeout = ((cap >> 24) & 0xff) * 500; /*In ms.*/
+   nvme->doorbellStride = 4 << ((cap >> 32) & 0xf);
+   if(((cap >> 48) & 0xf) != 0)
+      goto failed; /*4KB pages must be supported.*/
+
+   nvmeOutl(nvme,NVME_REG_CC,0); /*Reset it.*/
+   if(nvmeWaitReady(nvme,0,timeout))
+      goto failed;
+
+   u16 adminSize = (entries < NVME_ADMIN_QUEUE_SIZE) ? entries : NVME_ADMIN_QUEUE_SIZE;
+   NVMeQueue *admin = &nvme->queues[0];
+   if(nvmeInitQueue(nvme,admin,0,adminSize))
+      goto failed;
+   admin->polling = 1; /*Admin commands are rare.*/
+   nvmeOutl(nvme,NVME_REG_AQA,(adminSize - 1) | ((adminSize - 1) << 16));
+   nvmeOutq(nvme,NVME_REG_ASQ,va2pa(admin->sq));
+   nvmeOutq(nvme,NVME_REG_ACQ,va2pa(admin->cq));
+   nvmeOutl(nvme,NVME_REG_CC,NVME_CC_ENABLE | NVME_CC_IOSQES | NVME_CC_IOCQES);
+   if(nvmeWaitReady(nvme,NVME_CSTS_READY,timeout))
+      goto disable;
+
+   PhysicsPage *page = allocPages(0);
+   if(!page)
+      goto disable;
+   u8 *identify = (u8 *)getPhysicsPageAddress(page);
+
+   NVMeCommand command;
+   memset(&command,0,sizeof(command));
+   command.opcode = NVME_ADMIN_IDENTIFY;
+   command.prp1 = va2pa(identify);
+   command.cdw10 = NVME_IDENTIFY_CONTROLLER;
+   if(nvmeAdminCommand(nvme,&command,0))
+      goto free;
+   u8 mdts = identify[77];
+   u32 namespaces = *(u32 *)&identify[516];
+   nvme->maxTransfer = NVME_MAX_TRANSFER;
+   if(mdts && (PAGE_SIZE << mdts) < nvme->maxTransfer)
+      nvme->maxTransfer = PAGE_SIZE << mdts;
+
+   nvme->irq = pci->interrupt & 0xff;
+   if(nvmeCreateQueues(nvme,
+         (entries < NVME_IO_QUEUE_SIZE) ? entries : NVME_IO_QUEUE_SIZE))
+      goto free;
+   if(requestIRQ(nvme->irq,&nvmeIRQ))
+   {  /*The IRQ is used by others,poll the completion queues.*/
+      nvme->irq = 0xff;
+      for(int i = 1;i <= nvme->queueCount;++i)
+         nvme->queues[i].polling = 1;
+   }else
+   {
+      setIRQData(nvme->irq,nvme);
+   }
+
+   nvme->index = nvmeCount++;
+   printk("NVMe controller %d:%d namespaces,%d I/O queues%s.\n",
+      nvme->index,namespaces,nvme->queueCount,
+      (nvme->irq == 0xff) ? ",polling" : "");
+   if(namespaces > NVME_MAX_NAMESPACES)
+      namespaces = NVME_MAX_NAMESPACES;
+   for(u32 id = 1;id <= namespaces;++id)
+      nvmeAddNamespace(nvme,id,identify);
+
+   freePages(page,0);
+   return 0;
+free:
+   freePages(page,0);
+disable:
+   nvmeOutl(nvme,NVME_REG_CC,0);
+   for(int i = 0;i <= NVME_MAX_QUEUES;++i)
+      nvmeFreeQueue(&nvme->queues[i]);
+failed:
+   kfree(nvme);
+   return -ENODEV;
+}
+
+static int nvmeDisable(Device *device)
+{
+   /*Block devices can't be deregistered now.*/
+   return -ENOSYS;
+}
+
+static int initNVMe(void)
+{
+   nvmeCount = 0;
+   registerDriver(&nvmeDriver);
+   return 0;
+}
+
+driverInitcall(initNVMe);
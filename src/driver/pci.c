@@ -47,6 +47,94 @@ static inline u8 pciInb(u16 bus,u16 device,u16 function,u16 offset)
    return (pciInw(bus,device,function,offset) >> ((offset & 1) *8)) & 0x00ff;
 }
 
+static inline int pciOutl(u16 bus,u16 device,u16 function,u16 offset,u32 data)
+{
+   u32 address = 0x80000000; /*Enable bit.*/
+   address |= (offset & 0xfc);
+   address |= (function << 8);
+   address |= (device << 11);
+   address |= (bus << 16);
+   outl(PCI_CMD_REG,address);
+   outl(PCI_DATA_REG,data);
+   return 0;
+}
+
+static inline int pciOutw(u16 bus,u16 device,u16 function,u16 offset,u16 data)
+{ /*Only write the word,the other half may be write-1-to-clear,like STATUS.*/
+   u32 address = 0x80000000; /*Enable bit.*/
+   address |= (offset & 0xfc);
+   address |= (function << 8);
+   address |= (device << 11);
+   address |= (bus << 16);
+   outl(PCI_CMD_REG,address);
+   outw(PCI_DATA_REG + (offset & 2),data);
+   return 0;
+}
+
+u32 pciConfigInl(PCIDevice *pci,u16 offset)
+{
+   return pciInl(pci->position.bus,pci->position.device,
+                    pci->position.function,offset);
+}
+
+u16 pciConfigInw(PCIDevice *pci,u16 offset)
+{
+   return pciInw(pci->position.bus,pci->position.device,
+                    pci->position.function,offset);
+}
+
+u8 pciConfigInb(PCIDevice *pci,u16 offset)
+{
+   return pciInb(pci->position.bus,pci->position.device,
+                    pci->position.function,offset);
+}
+
+int pciConfigOutl(PCIDevice *pci,u16 offset,u32 data)
+{
+   return pciOutl(pci->position.bus,pci->position.device,
+                    pci->position.function,offset,data);
+}
+
+int pciConfigOutw(PCIDevice *pci,u16 offset,u16 data)
+{
+   return pciOutw(pci->position.bus,pci->position.device,
+                    pci->position.function,offset,data);
+}
+
+u8 pciFindCapability(PCIDevice *pci,u8 id,u8 from)
+{
+   if(!(pciConfigInw(pci,PCI_CONFIG_STATUS) & PCI_STATUS_CAPABILITY))
+      return 0; /*No capabilities list.*/
+   u8 offset = from ? pciConfigInb(pci,from + 1) :
+                      pciConfigInb(pci,PCI_CONFIG_CAPABILITY);
+   for(int i = 0;i < 48 && offset;++i) /*Avoid loops.*/
+   {
+      offset &= 0xfc;
+      if(pciConfigInb(pci,offset) == id)
+         return offset;
+      offset = pciConfigInb(pci,offset + 1);
+   }
+   return 0;
+}
+
+int pciEnableBusMaster(PCIDevice *pci)
+{
+   u16 command = pciConfigInw(pci,PCI_CONFIG_COMMAND);
+   command |= PCI_COMMAND_BUS_MASTER | PCI_COMMAND_MEMORY | PCI_COMMAND_IO;
+   return pciConfigOutw(pci,PCI_CONFIG_COMMAND,command);
+}
+
+u64 pciGetMemoryBar(PCIDevice *pci,int bar)
+{
+   u32 low = pci->bar[bar];
+   if(low & 0x1)
+      return 0; /*It is an I/O BAR.*/
+   u64 address = low & 0xfffffff0;
+   if(((low >> 1) & 0x3) == 0x2 && bar < 5)
+      address |= ((u64)pci->bar[bar + 1]) << 32; /*64-bit BAR.*/
+   return address;
+}
+
 static int parseFunction(u16 bus,u16 device,u16 function)
 {
    static const char * classes[] = {
@@ -0,0 +1,439 @@
+#include <core/const.h>
+#include <driver/virtio.h>
+#include <driver/pci.h>
+#include <memory/buddy.h>
+#include <memory/paging.h>
+#include <cpu/io.h>
+#include <cpu/spinlock.h>
+#include <lib/string.h>
+
+/*Virtio PCI capability types.*/
+#define VIRTIO_PCI_CAP_COMMON       1
+#define VIRTIO_PCI_CAP_NOTIFY       2
+#define VIRTIO_PCI_CAP_ISR          3
+#define VIRTIO_PCI_CAP_DEVICE       4
+
+/*Common configuration of modern devices.*/
+#define VIRTIO_COMMON_DFSELECT      0x00
+#define VIRTIO_COMMON_DF            0x04
+#define VIRTIO_COMMON_GFSELECT      0x08
+#define VIRTIO_COMMON_GF            0x0c
+#define VIRTIO_COMMON_STATUS        0x14
+#define VIRTIO_COMMON_GENERATION    0x15
+#define VIRTIO_COMMON_Q_SELECT      0x16
+#define VIRTIO_COMMON_Q_SIZE        0x18
+#define VIRTIO_COMMON_Q_ENABLE      0x1c
+#define VIRTIO_COMMON_Q_NOTIFY_OFF  0x1e
+#define VIRTIO_COMMON_Q_DESC        0x20
+#define VIRTIO_COMMON_Q_AVAIL       0x28
+#define VIRTIO_COMMON_Q_USED        0x30
+
+/*Registers of legacy devices (in the I/O BAR 0).*/
+#define VIRTIO_LEGACY_HOST_FEATURES 0x00
+#define VIRTIO_LEGACY_GUEST_FEATURES 0x04
+#define VIRTIO_LEGACY_Q_PFN         0x08
+#define VIRTIO_LEGACY_Q_SIZE        0x0c
+#define VIRTIO_LEGACY_Q_SELECT      0x0e
+#define VIRTIO_LEGACY_Q_NOTIFY      0x10
+#define VIRTIO_LEGACY_STATUS        0x12
+#define VIRTIO_LEGACY_ISR           0x13
+#define VIRTIO_LEGACY_CONFIG        0x14 /*MSI-X is disabled.*/
+
+#define VIRTIO_LEGACY_ALIGN         PAGE_SIZE
+
+/*The kernel maps at least 4GB,MMIO above it can't be accessed.*/
+#define VIRTIO_MMIO_LIMIT           0x100000000ul
+
+#define common8(device,offset) \
+   (*(volatile u8 *)((device)->common + (offset)))
+#define common16(device,offset) \
+   (*(volatile u16 *)((device)->common + (offset)))
+#define common32(device,offset) \
+   (*(volatile u32 *)((device)->common + (offset)))
+
+#define alignUp(x,align) (((x) + (align) - 1) & ~((u64)(align) - 1))
+
+static inline int virtioMemoryBarrier(void) __attribute__ ((always_inline));
+
+static inline int virtioMemoryBarrier(void)
+{
+   asm volatile("mfence":::"memory");
+   return 0;
+}
+
+static int virtioWriteCommon64(VirtioDevice *device,u32 offset,u64 data)
+{
+   common32(device,offset + 0) = (u32)data;
+   common32(device,offset + 4) = (u32)(data >> 32);
+   return 0;
+}
+
+static u8 virtioGetStatus(VirtioDevice *device)
+{
+   if(device->modern)
+      return common8(device,VIRTIO_COMMON_STATUS);
+   return inb(device->io + VIRTIO_LEGACY_STATUS);
+}
+
+int virtioSetStatus(VirtioDevice *device,u8 status)
+{
+   status |= virtioGetStatus(device); /*Add these bits.*/
+   if(device->modern)
+      common8(device,VIRTIO_COMMON_STATUS) = status;
+   else
+      outb(device->io + VIRTIO_LEGACY_STATUS,status);
+   return 0;
+}
+
+int virtioReset(VirtioDevice *device)
+{
+   if(device->modern)
+   {
+      common8(device,VIRTIO_COMMON_STATUS) = 0;
+      while(common8(device,VIRTIO_COMMON_STATUS))
+         asm volatile("pause");
+         /*The reset is done when the device reads back 0.*/
+   }else
+   {
+      outb(device->io + VIRTIO_LEGACY_STATUS,0);
+   }
+   return 0;
+}
+
+int initVirtioDevice(VirtioDevice *device,PCIDevice *pci)
+{
+   memset(device,0,sizeof(*device));
+   device->pci = pci;
+   pciEnableBusMaster(pci);
+
+   for(u8 cap = pciFindCapability(pci,PCI_CAPABILITY_VENDOR,0);cap;
+          cap = pciFindCapability(pci,PCI_CAPABILITY_VENDOR,cap))
+   {
+      u8 type = pciConfigInb(pci,cap + 3);
+      u8 bar = pciConfigInb(pci,cap + 4);
+      u32 offset = pciConfigInl(pci,cap + 8);
+      u32 length = pciConfigInl(pci,cap + 12);
+      if(bar > 5)
+         continue;
+      u64 address = pciGetMemoryBar(pci,bar);
+      if(!address || address + offset + length > VIRTIO_MMIO_LIMIT)
+         continue;
+      volatile u8 *mmio = (volatile u8 *)pa2va(address + offset);
+      switch(type)
+      {
+      case VIRTIO_PCI_CAP_COMMON:
+         device->common = mmio;
+         break;
+      case VIRTIO_PCI_CAP_NOTIFY:
+         device->notify = mmio;
+         device->notifyMultiplier = pciConfigInl(pci,cap + 16);
+         break;
+      case VIRTIO_PCI_CAP_ISR:
+         device->isr = mmio;
+         break;
+      case VIRTIO_PCI_CAP_DEVICE:
+         device->config = mmio;
+         break;
+      default:
+         break;
+      }
+   }
+
+   if(device->common && device->notify && device->isr)
+      device->modern = 1;
+   else if(pci->bar[0] & 0x1) /*A legacy (or transitional) device.*/
+      device->io = pci->bar[0] & 0xfffc;
+   else
+      return -ENODEV;
+
+   virtioReset(device);
+   virtioSetStatus(device,VIRTIO_STATUS_ACKNOWLEDGE);
+   virtioSetStatus(device,VIRTIO_STATUS_DRIVER);
+   return 0;
+}
+
+int virtioNegotiateFeatures(VirtioDevice *device,u64 wanted)
+{
+   u64 features;
+   if(device->modern)
+   {
+      common32(device,VIRTIO_COMMON_DFSELECT) = 0;
+      features = common32(device,VIRTIO_COMMON_DF);
+      common32(device,VIRTIO_COMMON_DFSELECT) = 1;
+      features |= ((u64)common32(device,VIRTIO_COMMON_DF)) << 32;
+
+      features &= wanted | (1ul << VIRTIO_F_VERSION_1);
+      if(!(features & (1ul << VIRTIO_F_VERSION_1)))
+         return -ENODEV;
+
+      common32(device,VIRTIO_COMMON_GFSELECT) = 0;
+      common32(device,VIRTIO_COMMON_GF) = (u32)features;
+      common32(device,VIRTIO_COMMON_GFSELECT) = 1;
+      common32(device,VIRTIO_COMMON_GF) = (u32)(features >> 32);
+
+      virtioSetStatus(device,VIRTIO_STATUS_FEATURES_OK);
+      if(!(virtioGetStatus(device) & VIRTIO_STATUS_FEATURES_OK))
+         return -ENODEV; /*The device doesn't accept them.*/
+   }else
+   {
+      features = inl(device->io + VIRTIO_LEGACY_HOST_FEATURES);
+      features &= wanted & 0xffffffff;
+      outl(device->io + VIRTIO_LEGACY_GUEST_FEATURES,(u32)features);
+   }
+   device->features = features;
+   return 0;
+}
+
+int virtioReadConfig(VirtioDevice *device,u32 offset,void *buf,u32 size)
+{
+   u8 *data = (u8 *)buf;
+   if(!device->modern)
+   {
+      for(u32 i = 0;i < size;++i)
+         data[i] = inb(device->io + VIRTIO_LEGACY_CONFIG + offset + i);
+      return 0;
+   }
+   if(!device->config)
+      return -ENODEV;
+   u8 generation;
+   do{ /*Read it again if the config is changed.*/
+      generation = common8(device,VIRTIO_COMMON_GENERATION);
+      for(u32 i = 0;i < size;++i)
+         data[i] = device->config[offset + i];
+   }while(generation != common8(device,VIRTIO_COMMON_GENERATION));
+   return 0;
+}
+
+u8 virtioReadISR(VirtioDevice *device)
+{
+   if(device->modern)
+      return *device->isr;
+   return inb(device->io + VIRTIO_LEGACY_ISR); /*Reading clears it.*/
+}
+
+static PhysicsPage *virtioAllocPages(u64 size,u8 *order)
+{
+   u8 __order = 0;
+   while((PAGE_SIZE << __order) < size)
+      ++__order;
+   PhysicsPage *page = allocPages(__order);
+   if(!page)
+      return 0;
+   memset(getPhysicsPageAddress(page),0,PAGE_SIZE << __order);
+   *order = __order;
+   return page;
+}
+
+int virtioSetupQueue(VirtioDevice *device,VirtQueue *queue,u16 index)
+{
+   u16 size;
+   if(device->modern)
+   {
+      common16(device,VIRTIO_COMMON_Q_SELECT) = index;
+      size = common16(device,VIRTIO_COMMON_Q_SIZE);
+      if(size > VIRTQUEUE_MAX_SIZE)
+         size = VIRTQUEUE_MAX_SIZE; /*Modern devices allow smaller queues.*/
+   }else
+   {
+      outw(device->io + VIRTIO_LEGACY_Q_SELECT,index);
+      size = inw(device->io + VIRTIO_LEGACY_Q_SIZE);
+   }
+   if(!size)
+      return -ENOENT; /*This queue doesn't exist.*/
+
+   /*Use the legacy layout,it also fits modern devices.*/
+   u64 available = size * sizeof(VirtQueueDescriptor);
+   u64 used = alignUp(available + sizeof(VirtQueueAvailable) +
+                 (size + 1) * sizeof(u16),VIRTIO_LEGACY_ALIGN);
+   u64 total = used + alignUp(sizeof(VirtQueueUsed) +
+                 size * sizeof(VirtQueueUsedElement) + sizeof(u16),
+                 VIRTIO_LEGACY_ALIGN);
+   u8 order;
+   PhysicsPage *page = virtioAllocPages(total,&order);
+   if(!page)
+      return -ENOMEM;
+   u8 *ring = (u8 *)getPhysicsPageAddress(page);
+
+   u64 extra = size * sizeof(void *);
+   if(virtioHasFeature(device,VIRTIO_RING_F_INDIRECT_DESC))
+      extra += size * VIRTQUEUE_MAX_INDIRECT * sizeof(VirtQueueDescriptor);
+   u8 extraOrder;
+   PhysicsPage *extraPage = virtioAllocPages(extra,&extraOrder);
+   if(!extraPage)
+      return (freePages(page,order),-ENOMEM);
+   u8 *__extra = (u8 *)getPhysicsPageAddress(extraPage);
+
+   memset(queue,0,sizeof(*queue));
+   initSpinLock(&queue->lock);
+   queue->device = device;
+   queue->index = index;
+   queue->size = size;
+   queue->order = order;
+   queue->descriptors = (VirtQueueDescriptor *)ring;
+   queue->available = (VirtQueueAvailable *)(ring + available);
+   queue->used = (VirtQueueUsed *)(ring + used);
+   queue->data = (void **)__extra;
+   if(virtioHasFeature(device,VIRTIO_RING_F_INDIRECT_DESC))
+      queue->indirect = (VirtQueueDescriptor *)(__extra + size * sizeof(void *));
+      /*The indirect tables are 16 bytes aligned.*/
+   queue->freeHead = 0;
+   queue->freeCount = size;
+   for(u16 i = 0;i < size;++i)
+      queue->descriptors[i].next = i + 1; /*Link the free descriptors.*/
+
+   if(device->modern)
+   {
+      common16(device,VIRTIO_COMMON_Q_SIZE) = size;
+      virtioWriteCommon64(device,VIRTIO_COMMON_Q_DESC,va2pa(ring));
+      virtioWriteCommon64(device,VIRTIO_COMMON_Q_AVAIL,va2pa(ring + available));
+      virtioWriteCommon64(device,VIRTIO_COMMON_Q_USED,va2pa(ring + used));
+      u16 notify = common16(device,VIRTIO_COMMON_Q_NOTIFY_OFF);
+      queue->notify = (volatile u16 *)
+         (device->notify + notify * device->notifyMultiplier);
+      common16(device,VIRTIO_COMMON_Q_ENABLE) = 1;
+   }else
+   {
+      outl(device->io + VIRTIO_LEGACY_Q_PFN,va2pa(ring) / VIRTIO_LEGACY_ALIGN);
+   }
+   return 0;
+}
+
+int virtioFreeQueue(VirtQueue *queue)
+{
+   /*The device must have been reset.*/
+   u64 extra = queue->size * sizeof(void *);
+   u8 order = 0;
+   if(queue->indirect)
+      extra += queue->size * VIRTQUEUE_MAX_INDIRECT * sizeof(VirtQueueDescriptor);
+   while((PAGE_SIZE << order) < extra)
+      ++order;
+   freePages(getPhysicsPage((void *)queue->data),order);
+   freePages(getPhysicsPage((void *)queue->descriptors),queue->order);
+   queue->size = 0;
+   return 0;
+}
+
+int virtqueueAdd(VirtQueue *queue,VirtQueueBuffer *buffers,
+                 int out,int in,void *data)
+{
+   /*The first 'out' buffers are read by the device,*/
+   /*the next 'in' buffers are written by the device.*/
+   int count = out + in;
+   int indirect = queue->indirect && count > 1 &&
+                     count <= VIRTQUEUE_MAX_INDIRECT;
+   u16 head = queue->freeHead;
+   if(count == 0)
+      return -EINVAL;
+   if(queue->freeCount < (indirect ? 1 : count))
+      return -ENOSPC;
+
+   volatile VirtQueueDescriptor *descriptors = queue->descriptors;
+   if(indirect)
+   {  /*Only one descriptor in the ring for this request.*/
+      VirtQueueDescriptor *table =
+         queue->indirect + head * VIRTQUEUE_MAX_INDIRECT;
+      for(int i = 0;i < count;++i)
+      {
+         table[i].address = va2pa(buffers[i].address);
+         table[i].length = buffers[i].length;
+         table[i].flags = (i >= out) ? VIRTQ_DESC_F_WRITE : 0;
+         if(i != count - 1)
+            table[i].flags |= VIRTQ_DESC_F_NEXT;
+         table[i].next = i + 1;
+      }
+      descriptors[head].address = va2pa(table);
+      descriptors[head].length = count * sizeof(VirtQueueDescriptor);
+      descriptors[head].flags = VIRTQ_DESC_F_INDIRECT;
+      queue->freeHead = descriptors[head].next;
+      queue->freeCount -= 1;
+   }else
+   {
+      u16 i = head;
+      for(int j = 0;j < count;++j)
+      {
+         descriptors[i].address = va2pa(buffers[j].address);
+         descriptors[i].length = buffers[j].length;
+         descriptors[i].flags = (j >= out) ? VIRTQ_DESC_F_WRITE : 0;
+         if(j != count - 1)
+            descriptors[i].flags |= VIRTQ_DESC_F_NEXT;
+         i = descriptors[i].next; /*The free list is linked by next.*/
+      }
+      queue->freeHead = i;
+      queue->freeCount -= count;
+   }
+   queue->data[head] = data;
+
+   volatile VirtQueueAvailable *available = queue->available;
+   available->ring[available->index % queue->size] = head;
+   asm volatile("":::"memory"); /*x86 doesn't reorder stores.*/
+   available->index += 1;
+   return 0;
+}
+
+int virtqueueKick(VirtQueue *queue)
+{
+   u16 new = queue->available->index;
+   u16 old = queue->lastKicked;
+   int notify;
+   queue->lastKicked = new;
+   virtioMemoryBarrier(); /*Publish the index before reading the event.*/
+
+   if(virtioHasFeature(queue->device,VIRTIO_RING_F_EVENT_IDX))
+   {
+      u16 event = *(volatile u16 *)&queue->used->ring[queue->size];
+      notify = (u16)(new - event - 1) < (u16)(new - old);
+         /*Only notify if the device asked for this index.*/
+   }else
+   {
+      notify = !(queue->used->flags & VIRTQ_USED_F_NO_NOTIFY);
+   }
+   if(!notify)
+      return 0;
+   if(queue->device->modern)
+      *queue->notify = queue->index;
+   else
+      outw(queue->device->io + VIRTIO_LEGACY_Q_NOTIFY,queue->index);
+   return 1;
+}
+
+void *virtqueueGetBuffer(VirtQueue *queue,u32 *length)
+{
+   if(queue->lastUsed == queue->used->index)
+      return 0;
+   asm volatile("":::"memory");
+
+   volatile VirtQueueUsedElement *element =
+      &queue->used->ring[queue->lastUsed % queue->size];
+   volatile VirtQueueDescriptor *descriptors = queue->descriptors;
+   u16 head = element->id;
+   u16 i = head,count = 1;
+   if(length)
+      *length = element->length;
+   void *data = queue->data[head];
+
+   if(!(descriptors[head].flags & VIRTQ_DESC_F_INDIRECT))
+      while(descriptors[i].flags & VIRTQ_DESC_F_NEXT)
+         i = descriptors[i].next,++count;
+   descriptors[i].next = queue->freeHead; /*Give them back.*/
+   queue->freeHead = head;
+   queue->freeCount += count;
+   ++queue->lastUsed;
+   return data;
+}
+
+int virtqueueEnableInterrupt(VirtQueue *queue)
+{
+   /*Return 1 if there are more used buffers.*/
+   if(queue->polling)
+   {
+      queue->available->flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
+      return 0;
+   }
+   if(virtioHasFeature(queue->device,VIRTIO_RING_F_EVENT_IDX))
+      *(volatile u16 *)&queue->available->ring[queue->size] = queue->lastUsed;
+         /*Interrupt us when the next buffer is used.*/
+   else
+      queue->available->flags = 0;
+   virtioMemoryBarrier();
+   return queue->lastUsed != queue->used->index;
+}
@@ -0,0 +1,325 @@
+#include <core/const.h>
+#include <driver/driver.h>
+#include <driver/pci.h>
+#include <driver/virtio.h>
+#include <block/block.h>
+#include <interrupt/interrupt.h>
+#include <interrupt/localapic.h>
+#include <memory/kmalloc.h>
+#include <memory/paging.h>
+#include <cpu/io.h>
+#include <task/task.h>
+#include <cpu/spinlock.h>
+#include <video/console.h>
+#include <lib/string.h>
+
+typedef struct VirtioBlkRequestHeader{
+   u32 type;
+   u32 reserved;
+   u64 sector; /*Always in 512 bytes.*/
+} __attribute__ ((packed)) VirtioBlkRequestHeader;
+
+typedef struct VirtioBlkRequest{
+   VirtioBlkRequestHeader header;
+   u8 status;     /*Written by the device.*/
+   volatile u8 done;
+   Task *task;
+} VirtioBlkRequest;
+
+#define VIRTIO_BLK_MAX_QUEUES        8
+
+typedef struct VirtioBlk{
+   VirtioDevice virtio;
+   VirtQueue queues[VIRTIO_BLK_MAX_QUEUES];
+   u16 queueCount;
+   u8 irq;
+   u32 sectorSize;
+   u64 maxSectors; /*Per request,in sectorSize.*/
+   BlockDevice block;
+} VirtioBlk;
+
+#define VIRTIO_BLK_PCI_LEGACY        0x1001
+#define VIRTIO_BLK_PCI_MODERN        0x1042
+
+/*Feature bits.*/
+#define VIRTIO_BLK_F_SIZE_MAX        1
+#define VIRTIO_BLK_F_RO              5
+#define VIRTIO_BLK_F_BLK_SIZE        6
+#define VIRTIO_BLK_F_FLUSH           9
+#define VIRTIO_BLK_F_MQ              12
+
+/*Offsets in the device configuration.*/
+#define VIRTIO_BLK_CONFIG_CAPACITY   0
+#define VIRTIO_BLK_CONFIG_SIZE_MAX   8
+#define VIRTIO_BLK_CONFIG_BLK_SIZE   20
+#define VIRTIO_BLK_CONFIG_NUM_QUEUES 34
+
+/*Request types.*/
+#define VIRTIO_BLK_T_IN              0
+#define VIRTIO_BLK_T_OUT             1
+#define VIRTIO_BLK_T_FLUSH           4
+
+#define VIRTIO_BLK_S_OK              0
+
+#define VIRTIO_BLK_SECTOR_SIZE       512
+#define VIRTIO_BLK_MAX_BYTES         0x400000 /*4MB per request.*/
+
+#define VIRTIO_ISR_QUEUE             0x1
+
+static int virtioBlkProbe(Device *device);
+static int virtioBlkEnable(Device *device);
+static int virtioBlkDisable(Device *device);
+
+static int virtioBlkCount;
+
+static Driver virtioBlkDriver = {
+   .name = "Virtio block",
+   .probe = &virtioBlkProbe,
+   .enable = &virtioBlkEnable,
+   .disable = &virtioBlkDisable
+};
+
+static int virtioBlkComplete(VirtQueue *queue)
+{
+   VirtioBlkRequest *request;
+   u64 rflags;
+   lockSpinLockCloseInterrupt(&queue->lock,&rflags);
+   do{
+      while((request = virtqueueGetBuffer(queue,0)))
+      {
+         Task *task = request->task;
+         request->done = 1; /*The request may be freed after this.*/
+         if(!queue->polling)
+            wakeUpTask(task,0);
+      }
+   }while(virtqueueEnableInterrupt(queue));
+   unlockSpinLockRestoreInterrupt(&queue->lock,&rflags);
+   return 0;
+}
+
+static int virtioBlkIRQ(IRQRegisters *reg,void *data)
+{
+   VirtioBlk *blk = (VirtioBlk *)data;
+   if(!blk)
+      return 0;
+   if(!(virtioReadISR(&blk->virtio) & VIRTIO_ISR_QUEUE))
+      return 0;
+   for(int i = 0;i < blk->queueCount;++i)
+      virtioBlkComplete(&blk->queues[i]);
+   return 0;
+}
+
+static int virtioBlkSubmit(VirtioBlk *blk,u32 type,u64 sector,
+                             void *buf,u32 size)
+{
+   /*Use the queue of this CPU,so CPUs don't contend for a ring.*/
+   VirtQueue *queue = &blk->queues[getLocalApicID() % blk->queueCount];
+   Task *current = getCurrentTask();
+   VirtioBlkRequest request = {
+      .header = {.type = type,.reserved = 0,.sector = sector},
+      .status = 0xff,.done = 0,.task = current
+   }; /*Kernel stacks are in the direct mapping,the device can access it.*/
+   VirtQueueBuffer buffers[3] = {
+      {&request.header,sizeof(request.header)},
+      {buf,size},
+      {&request.status,sizeof(request.status)}
+   };
+   int out = 1,in = 1;
+   if(type == VIRTIO_BLK_T_FLUSH)
+      buffers[1] = buffers[2]; /*No data.*/
+   else if(type == VIRTIO_BLK_T_OUT)
+      out = 2;
+   else
+      in = 2;
+
+   u64 rflags;
+   lockSpinLockCloseInterrupt(&queue->lock,&rflags);
+   while(virtqueueAdd(queue,buffers,out,in,&request) == -ENOSPC)
+   {  /*The ring is full,wait for some requests.*/
+      unlockSpinLockRestoreInterrupt(&queue->lock,&rflags);
+      if(queue->polling)
+         virtioBlkComplete(queue);
+      schedule();
+      lockSpinLockCloseInterrupt(&queue->lock,&rflags);
+   }
+   virtqueueKick(queue);
+   unlockSpinLockRestoreInterrupt(&queue->lock,&rflags);
+
+   for(;;)
+   {
+      if(queue->polling)
+         virtioBlkComplete(queue); /*Poll the used ring.*/
+      else
+         current->state = TaskUninterruptible;
+      if(request.done)
+         break;
+      schedule();
+   }
+   current->state = TaskRunning;
+   return (request.status == VIRTIO_BLK_S_OK) ? 0 : -EIO;
+}
+
+static int virtioBlkTransfer(void *data,u64 lba,u64 count,void *buf,int write)
+{
+   VirtioBlk *blk = (VirtioBlk *)data;
+   u32 type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+   while(count)
+   {
+      u64 sector = (count > blk->maxSectors) ? blk->maxSectors : count;
+      int ret = virtioBlkSubmit(blk,type,
+         lba * (blk->sectorSize / VIRTIO_BLK_SECTOR_SIZE),
+         buf,sector * blk->sectorSize);
+      if(ret)
+         return ret;
+      lba += sector;
+      count -= sector;
+      buf += sector * blk->sectorSize;
+   }
+   return 0;
+}
+
+static int virtioBlkRead(void *data,u64 start,u64 size,void *buf)
+{
+   VirtioBlk *blk = (VirtioBlk *)data;
+   return transferBlockSectors(&virtioBlkTransfer,data,
+               blk->sectorSize,start,size,buf,0);
+}
+
+static int virtioBlkWrite(void *data,u64 start,u64 size,void *buf)
+{
+   VirtioBlk *blk = (VirtioBlk *)data;
+   return transferBlockSectors(&virtioBlkTransfer,data,
+               blk->sectorSize,start,size,buf,1);
+}
+
+static int virtioBlkFlush(void *data)
+{
+   return virtioBlkSubmit((VirtioBlk *)data,VIRTIO_BLK_T_FLUSH,0,0,0);
+}
+
+static int virtioBlkProbe(Device *device)
+{
+   if(device->type != DeviceTypePCI)
+      return 1;
+   PCIDevice *pci = containerOf(device,PCIDevice,globalDevice);
+   if(pci->vendor != VIRTIO_PCI_VENDOR)
+      return 1;
+   if(pci->device != VIRTIO_BLK_PCI_LEGACY &&
+      pci->device != VIRTIO_BLK_PCI_MODERN)
+      return 1;
+   return 0;
+}
+
+static int virtioBlkEnable(Device *device)
+{
+   PCIDevice *pci = containerOf(device,PCIDevice,globalDevice);
+   VirtioBlk *blk = kmalloc(sizeof(VirtioBlk));
+   int ret = -ENODEV;
+   if(!blk)
+      return -ENOMEM;
+   memset(blk,0,sizeof(*blk));
+   if(initVirtioDevice(&blk->virtio,pci))
+      goto failed;
+
+   u64 wanted = (1ul << VIRTIO_BLK_F_SIZE_MAX) | (1ul << VIRTIO_BLK_F_RO) |
+      (1ul << VIRTIO_BLK_F_BLK_SIZE) | (1ul << VIRTIO_BLK_F_FLUSH) |
+      (1ul << VIRTIO_BLK_F_MQ) | (1ul << VIRTIO_RING_F_INDIRECT_DESC) |
+      (1ul << VIRTIO_RING_F_EVENT_IDX);
+   if(virtioNegotiateFeatures(&blk->virtio,wanted))
+      goto reset;
+
+   u64 capacity = 0;
+   u32 sizeMax = 0;
+   u32 blockSize = VIRTIO_BLK_SECTOR_SIZE;
+   u16 queues = 1;
+   virtioReadConfig(&blk->virtio,VIRTIO_BLK_CONFIG_CAPACITY,
+                       &capacity,sizeof(capacity));
+   if(virtioHasFeature(&blk->virtio,VIRTIO_BLK_F_SIZE_MAX))
+      virtioReadConfig(&blk->virtio,VIRTIO_BLK_CONFIG_SIZE_MAX,
+                          &sizeMax,sizeof(sizeMax));
+   if(virtioHasFeature(&blk->virtio,VIRTIO_BLK_F_BLK_SIZE))
+      virtioReadConfig(&blk->virtio,VIRTIO_BLK_CONFIG_BLK_SIZE,
+                          &blockSize,sizeof(blockSize));
+   if(virtioHasFeature(&blk->virtio,VIRTIO_BLK_F_MQ))
+      virtioReadConfig(&blk->virtio,VIRTIO_BLK_CONFIG_NUM_QUEUES,
+                          &queues,sizeof(queues));
+   if(blockSize < VIRTIO_BLK_SECTOR_SIZE || blockSize > PAGE_SIZE ||
+      (blockSize & (blockSize - 1)))
+      blockSize = VIRTIO_BLK_SECTOR_SIZE;
+   if(queues == 0)
+      queues = 1;
+   if(queues > VIRTIO_BLK_MAX_QUEUES)
+      queues = VIRTIO_BLK_MAX_QUEUES;
+
+   blk->sectorSize = blockSize;
+   blk->maxSectors = VIRTIO_BLK_MAX_BYTES;
+   if(sizeMax && sizeMax < blk->maxSectors)
+      blk->maxSectors = sizeMax; /*We use one data segment per request.*/
+   blk->maxSectors /= blockSize;
+   if(!blk->maxSectors)
+      blk->maxSectors = 1;
+
+   for(blk->queueCount = 0;blk->queueCount < queues;++blk->queueCount)
+      if(virtioSetupQueue(&blk->virtio,
+            &blk->queues[blk->queueCount],blk->queueCount))
+         break;
+   if(!blk->queueCount)
+      goto reset;
+
+   blk->irq = pci->interrupt & 0xff;
+   if(requestIRQ(blk->irq,&virtioBlkIRQ))
+   {  /*This IRQ has been used by others,poll the rings.*/
+      blk->irq = 0xff;
+      for(int i = 0;i < blk->queueCount;++i)
+         blk->queues[i].polling = 1;
+   }else
+   {
+      setIRQData(blk->irq,blk);
+   }
+   for(int i = 0;i < blk->queueCount;++i)
+      virtqueueEnableInterrupt(&blk->queues[i]);
+   virtioSetStatus(&blk->virtio,VIRTIO_STATUS_DRIVER_OK);
+
+   BlockDevice *block = &blk->block;
+   block->data = (void *)blk;
+   block->read = &virtioBlkRead;
+   block->write = virtioHasFeature(&blk->virtio,VIRTIO_BLK_F_RO) ?
+                     0 : &virtioBlkWrite;
+   block->flush = virtioHasFeature(&blk->virtio,VIRTIO_BLK_F_FLUSH) ?
+                     &virtioBlkFlush : 0;
+   block->type = BlockDeviceDisk;
+   block->end = capacity * VIRTIO_BLK_SECTOR_SIZE;
+   block->sectorSize = blk->sectorSize;
+
+   printk("Virtio block device:%d sectors,%d queues%s.\n",
+      (int)capacity,blk->queueCount,(blk->irq == 0xff) ? ",polling" : "");
+
+   char name[] = "vda";
+   name[2] += virtioBlkCount++; /*vda,vdb,vdc.....*/
+   registerBlockDevice(block,name);
+   return 0;
+
+reset:
+   virtioSetStatus(&blk->virtio,VIRTIO_STATUS_FAILED);
+   virtioReset(&blk->virtio);
+   for(int i = 0;i < blk->queueCount;++i)
+      virtioFreeQueue(&blk->queues[i]);
+failed:
+   kfree(blk);
+   return ret;
+}
+
+static int virtioBlkDisable(Device *device)
+{
+   /*Block devices can't be deregistered now.*/
+   return -ENOSYS;
+}
+
+static int initVirtioBlk(void)
+{
+   virtioBlkCount = 0;
+   registerDriver(&virtioBlkDriver);
+   return 0;
+}
+
+driverInitcall(initVirtioBlk);
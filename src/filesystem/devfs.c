@@ -49,6 +49,7 @@ static PageCacheOperation devfsPageCacheOperation = {
 
 static DevfsINode devfsRoot;
 static VFSDentry *devfsRootDentry = 0;
+static SpinLock devfsLock; /*Devices may be registered at the same time.*/
 
 static int devfsReadDir(VFSFile *file,VFSDirFiller filler,void *data)
 {
@@ -62,11 +63,11 @@ static int devfsReadDir(VFSFile *file,VFSDirFiller filler,void *data)
    switch(file->seek)
    {
    case 0:
-      if((*filler)(data,1,1,".") < 0)
+      if((*filler)(data,(pointer)&devfsRoot,S_IFDIR,0,1,".") < 0)
          break;
       ++file->seek;
    case 1:
-      if((*filler)(data,1,2,"..") < 0)
+      if((*filler)(data,(pointer)&devfsRoot,S_IFDIR,0,2,"..") < 0)
          break;
       ++file->seek;
    default:
@@ -75,7 +76,7 @@ static int devfsReadDir(VFSFile *file,VFSDirFiller filler,void *data)
          DevfsINode *d = listEntry(p,DevfsINode,list);
          if(d->name[0] == '\0')
             continue;
-         if((*filler)(data,0,strlen(d->name),d->name) < 0)
+         if((*filler)(data,(pointer)d,d->mode,0,strlen(d->name),d->name) < 0)
             break;
       }
       listDelete(&inode->list);
@@ -117,6 +118,7 @@ static int devfsLookUp(VFSDentry *dentry,VFSDentry *result,const char *name)
          result->inode->cache.operation = &devfsPageCacheOperation;
          result->inode->data = next;
          result->inode->mode = next->mode;
+         result->inode->ino = (pointer)next; /*Unique while it is registered.*/
          return 0;
       }
    }
@@ -128,6 +130,7 @@ static int devfsMount(BlockDevicePart *part __attribute__ ((unused))
 { /*Just ingore part.*/
    FileSystem *fs = &devfs;
    mnt->root->inode->data = &devfsRoot; /*Set some fields.*/
+   mnt->root->inode->ino = (pointer)&devfsRoot;
    mnt->root->inode->operation = &devfsINodeOperation;
    mnt->root->inode->mode = S_IFDIR | S_IRWXU;
 
@@ -169,6 +172,7 @@ static int devfsOpen(VFSDentry *dentry,VFSFile *file,int mode)
 static int devfsInit(void)
 {
    initList(&devfsRoot.children);
+   initSpinLock(&devfsLock);
    devfsRoot.name[0] = '/';
    devfsRoot.name[1] = '\0';
    devfsRoot.operation = &devfsRootOperation;
@@ -201,15 +205,18 @@ int devfsRegisterBlockDevice(BlockDevicePart *part,const char *name)
       return -ENOMEM;
    memcpy(inode->name,name,len + 1);
    inode->part = part;
-   inode->operation = 0;
+   inode->operation = &blockDeviceFileOperation;
    inode->mode = S_IFBLK | S_IRWXU;
 
    if(devfsRootDentry)
       downSemaphore(&devfsRootDentry->inode->semaphore);
+   lockSpinLock(&devfsLock);
    listAdd(&inode->list,&devfsRoot.children);
+   unlockSpinLock(&devfsLock);
    if(devfsRootDentry)
       upSemaphore(&devfsRootDentry->inode->semaphore);
       /*Add this block device file to devfs' root dir.*/
+   vfsPruneNegativeDentries(); /*It may be looked up before.*/
    return 0;
 }
 
@@ -237,10 +244,13 @@ int devfsRegisterDevice(VFSFileOperation *operation,const char *name)
 
    if(devfsRootDentry)
       downSemaphore(&devfsRootDentry->inode->semaphore);
+   lockSpinLock(&devfsLock);
    listAdd(&inode->list,&devfsRoot.children);
       /*Add this block device file to devfs' root dir.*/
+   unlockSpinLock(&devfsLock);
    if(devfsRootDentry)
       upSemaphore(&devfsRootDentry->inode->semaphore);
+   vfsPruneNegativeDentries(); /*It may be looked up before.*/
    return 0;
 }
 
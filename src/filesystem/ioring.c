@@ -0,0 +1,340 @@
+#include <core/const.h>
+#include <filesystem/virtual.h>
+#include <filesystem/ioring.h>
+#include <memory/buddy.h>
+#include <memory/kmalloc.h>
+#include <memory/paging.h>
+#include <memory/user.h>
+#include <memory/vmalloc.h>
+#include <lib/string.h>
+
+/*doIORingSetup maps the rings into the task,they are shared with the kernel.*/
+/*The task fills the submission entries and calls doIORingEnter once for many of them.*/
+/*The drivers complete the requests before they return,so every entry has*/
+/*its completion entry when doIORingEnter returns.*/
+/*doIORingRegister pins the fixed buffers and maps them into the kernel,*/
+/*so the requests using them copy through the kernel addresses without*/
+/*faulting in the pages again.A fork after it makes the pages of the task copy on write,*/
+/*the task won't see the data read into them after its first write.*/
+
+#define IORING_PER_PAGE(type)   (PAGE_SIZE / sizeof(type))
+#define IORING_MAX_PAGES        (1 + IORING_MAX_ENTRIES / IORING_PER_PAGE(IORingSubmission) \
+                  + IORING_MAX_ENTRIES * 2 / IORING_PER_PAGE(IORingCompletion))
+
+typedef struct IORingBuffer{
+   u64 base;   /*The address in the task.*/
+   u64 length;
+   u8 *kernel; /*The same pages,mapped by vmapUser.*/
+} IORingBuffer;
+
+typedef struct IORing{
+   PhysicsPage *pages[IORING_MAX_PAGES]; /*The header,the submissions,the completions.*/
+   u32 pageCount;
+   IORingHeader *header;
+
+   u32 submissionHead; /*The copies of the kernel,the task may change the header.*/
+   u32 submissionEntries;
+   u32 submissionOffset;
+   u32 completionTail;
+   u32 completionEntries;
+   u32 completionOffset;
+
+   Semaphore semaphore; /*Only one task enters at a time.*/
+   IORingBuffer buffers[IORING_MAX_BUFFERS];
+   u32 bufferCount;
+} IORing;
+
+static PhysicsPage *ioRingGetPage(VFSINode *inode,u64 offset);
+static int ioRingPutPage(PhysicsPage *page);
+static int ioRingClose(VFSFile *file);
+
+static PageCacheOperation ioRingPageCacheOperation = {
+   .getPage = &ioRingGetPage,
+   .putPage = &ioRingPutPage,
+   .flushPage = 0 /*The pages aren't in the page cache.*/
+};
+
+static VFSFileOperation ioRingOperation = {
+   .close = &ioRingClose
+};
+
+static int ioRingUnregister(IORing *ring)
+{
+   for(u32 i = 0;i < ring->bufferCount;++i)
+      vunmap(ring->buffers[i].kernel); /*Unpin the pages.*/
+   ring->bufferCount = 0;
+   return 0;
+}
+
+static int destoryIORing(IORing *ring)
+{
+   ioRingUnregister(ring);
+   for(u32 i = 0;i < ring->pageCount;++i)
+      freePages(ring->pages[i],0); /*The mappings may still hold them.*/
+   return kfree(ring);
+}
+
+static IORing *createIORing(u32 entries)
+{
+   u32 submissionPages = (entries + IORING_PER_PAGE(IORingSubmission) - 1)
+                     / IORING_PER_PAGE(IORingSubmission);
+   u32 completionPages = (entries * 2 + IORING_PER_PAGE(IORingCompletion) - 1)
+                     / IORING_PER_PAGE(IORingCompletion);
+   IORing *ring = kmalloc(sizeof(*ring));
+   if(!ring)
+      return 0;
+   ring->pageCount = 0;
+   for(u32 i = 0;i < 1 + submissionPages + completionPages;++i)
+   { /*The pages needn't be continuous,the entries never cross the pages.*/
+      if(!(ring->pages[i] = allocPages(0)))
+         return (destoryIORing(ring),(IORing *)0);
+      memset(getPhysicsPageAddress(ring->pages[i]),0,PAGE_SIZE);
+      ++ring->pageCount;
+   }
+   ring->submissionHead = ring->completionTail = 0;
+   ring->submissionEntries = entries;
+   ring->submissionOffset = PAGE_SIZE;
+   ring->completionEntries = entries * 2; /*Room for the entries in flight.*/
+   ring->completionOffset = (1 + submissionPages) * PAGE_SIZE;
+   ring->bufferCount = 0;
+   initSemaphore(&ring->semaphore);
+
+   IORingHeader *header = ring->header = getPhysicsPageAddress(ring->pages[0]);
+   header->submissionMask = ring->submissionEntries - 1;
+   header->submissionEntries = ring->submissionEntries;
+   header->submissionOffset = ring->submissionOffset;
+   header->completionMask = ring->completionEntries - 1;
+   header->completionEntries = ring->completionEntries;
+   header->completionOffset = ring->completionOffset;
+   return ring;
+}
+
+static void *ioRingEntry(IORing *ring,u32 offset,u32 index,u32 size)
+{
+   u64 byte = offset + (u64)index * size;
+   return (u8 *)getPhysicsPageAddress(ring->pages[byte / PAGE_SIZE]) + byte % PAGE_SIZE;
+}
+
+static PhysicsPage *ioRingGetPage(VFSINode *inode,u64 offset)
+{ /*For doPageFault,MAP_SHARED maps the pages of the ring.*/
+   IORing *ring = inode->data;
+   PhysicsPage *page;
+   if(offset >= (u64)ring->pageCount * PAGE_SIZE)
+      return 0;
+   page = ring->pages[offset / PAGE_SIZE];
+   atomicAdd(&page->count,1); /*The unmapping dereferences it.*/
+   return page;
+}
+
+static int ioRingPutPage(PhysicsPage *page)
+{
+   return dereferencePage(page,0);
+}
+
+static int ioRingClose(VFSFile *file)
+{ /*The mappings hold the file,nobody uses the ring now.*/
+   return destoryIORing(file->data);
+}
+
+static int ioRingReadWrite(IORing *ring,IORingSubmission *sqe)
+{ /*The entry must be inside the fixed buffer,use the kernel mapping of it.*/
+   UserSpace(void) *buf = (UserSpace(void) *)sqe->address;
+   unsigned long limit = getAddressLimit();
+   int retval;
+   if(sqe->flags & IORING_FIXED)
+   {
+      IORingBuffer *fixed;
+      if(sqe->bufferIndex >= ring->bufferCount)
+         return -EFAULT;
+      fixed = &ring->buffers[sqe->bufferIndex];
+      if(sqe->address < fixed->base || sqe->address + sqe->length < sqe->address
+         || sqe->address + sqe->length > fixed->base + fixed->length)
+         return -EFAULT;
+      buf = fixed->kernel + (sqe->address - fixed->base);
+      setKernelAddressLimit();
+   }
+   if(sqe->opcode == IORING_OP_READ)
+      retval = sqe->offset == -1 ? doRead(sqe->fd,buf,sqe->length)
+         : doPRead(sqe->fd,buf,sqe->length,sqe->offset);
+   else
+      retval = sqe->offset == -1 ? doWrite(sqe->fd,buf,sqe->length)
+         : doPWrite(sqe->fd,buf,sqe->length,sqe->offset);
+   setAddressLimit(limit);
+   return retval;
+}
+
+static int ioRingPoll(int fd,u32 events)
+{ /*Only check the events,it never waits.*/
+   VFSFile *file = getTaskFile(fd);
+   int ready;
+   if(!file)
+      return -EBADF;
+   ready = pollFile(file);
+   closeFile(file);
+   return ready & (events | VFS_POLL_ERR | VFS_POLL_HUP);
+}
+
+static int ioRingIssue(IORing *ring,IORingSubmission *sqe)
+{
+   switch(sqe->opcode)
+   {
+   case IORING_OP_NOP:
+      return 0;
+   case IORING_OP_READ:
+   case IORING_OP_WRITE:
+      return ioRingReadWrite(ring,sqe);
+   case IORING_OP_OPEN:
+      return doOpen((UserSpace(const char) *)sqe->address,sqe->mode);
+   case IORING_OP_CLOSE:
+      return doClose(sqe->fd);
+   case IORING_OP_FSYNC:
+      return doFSync(sqe->fd);
+   case IORING_OP_POLL:
+      return ioRingPoll(sqe->fd,sqe->mode);
+   default:
+      return -EINVAL;
+   }
+}
+
+static IORing *getIORing(VFSFile *file)
+{
+   if(!file)
+      return makeErrorPointer(-EBADF);
+   if(file->operation != &ioRingOperation)
+      return (closeFile(file),makeErrorPointer(-EINVAL));
+   return file->data;
+}
+
+int doIORingSetup(u32 entries,UserSpace(u64) *address)
+{
+   IORing *ring = 0;
+   VFSDentry *dentry;
+   VFSFile *file = 0;
+   void *map;
+   u32 count = 1;
+   int fd,error = -ENOMEM;
+   if(!entries || entries > IORING_MAX_ENTRIES)
+      return -EINVAL;
+   if(verifyUserAddress(address,sizeof(u64)))
+      return -EFAULT;
+   while(count < entries)
+      count <<= 1; /*The masks need a power of 2.*/
+   if((fd = allocFileDescriptor(0)) < 0)
+      return fd;
+   if(!(ring = createIORing(count)))
+      goto failed;
+   if(!(dentry = createAnonymousDentry(S_IRUSR | S_IWUSR)))
+      goto failed;
+   dentry->inode->size = (u64)ring->pageCount * PAGE_SIZE;
+   dentry->inode->data = ring;
+   dentry->inode->cache.operation = &ioRingPageCacheOperation;
+   if(!(file = openAnonymousFile(dentry,&ioRingOperation,ring,O_RDWR)))
+      goto failed; /*The dentry is freed.*/
+   map = doMMap(file,0,0,dentry->inode->size,PROT_READ | PROT_WRITE,MAP_SHARED);
+   if(isErrorPointer(map) && (error = getPointerError(map)))
+      goto failed;
+   error = -EFAULT; /*The mapping holds the file until the task exits.*/
+   if(putUser64Safe(address,(u64)map))
+      goto failed;
+   return installFile(fd,file);
+failed:
+   if(file)
+      closeFile(file); /*The ring is freed by ioRingClose.*/
+   else if(ring)
+      destoryIORing(ring);
+   releaseFileDescriptor(fd);
+   return error;
+}
+
+int doIORingEnter(int fd,u32 submit)
+{
+   VFSFile *file = getTaskFile(fd);
+   IORing *ring = getIORing(file);
+   IORingHeader *header;
+   u32 tail,done = 0;
+   int retval;
+   if(isErrorPointer(ring))
+      return getPointerError(ring);
+   header = ring->header;
+   downSemaphore(&ring->semaphore);
+   tail = *(volatile u32 *)&header->submissionTail;
+   retval = -EINVAL;
+   if(tail - ring->submissionHead > ring->submissionEntries)
+      goto out; /*The task broke the ring.*/
+   for(;done < submit && ring->submissionHead != tail;++done)
+   {
+      IORingSubmission sqe;
+      IORingCompletion *cqe;
+      if(ring->completionTail - *(volatile u32 *)&header->completionHead
+                  >= ring->completionEntries)
+         break; /*Full,the task must take the completions first.*/
+      memcpy(&sqe,ioRingEntry(ring,ring->submissionOffset,
+         ring->submissionHead & (ring->submissionEntries - 1),sizeof(sqe)),sizeof(sqe));
+            /*Copy it,the task may change it at any time.*/
+      header->submissionHead = ++ring->submissionHead;
+
+      int result = ioRingIssue(ring,&sqe);
+      cqe = ioRingEntry(ring,ring->completionOffset,
+         ring->completionTail & (ring->completionEntries - 1),sizeof(*cqe));
+      cqe->userData = sqe.userData;
+      cqe->result = result;
+      cqe->flags = 0;
+      asm volatile("":::"memory"); /*Fill the entry before moving the tail.*/
+      header->completionTail = ++ring->completionTail;
+   }
+   retval = done;
+   if(!done && submit && ring->submissionHead != tail)
+      retval = -EBUSY;
+out:
+   upSemaphore(&ring->semaphore);
+   closeFile(file);
+   return retval;
+}
+
+int doIORingRegister(int fd,int opcode,UserSpace(const IOVector) *vector,int count)
+{
+   VFSFile *file = getTaskFile(fd);
+   IORing *ring = getIORing(file);
+   IOVector buffers[IORING_MAX_BUFFERS];
+   int retval = -EINVAL;
+   if(isErrorPointer(ring))
+      return getPointerError(ring);
+   downSemaphore(&ring->semaphore);
+   switch(opcode)
+   {
+   case IORING_REGISTER_BUFFERS:
+      if(ring->bufferCount && (retval = -EBUSY))
+         break; /*Unregister them first.*/
+      if(count <= 0 || count > IORING_MAX_BUFFERS)
+         break;
+      if((retval = memcpyUser1(buffers,vector,count * sizeof(IOVector))))
+         break;
+      for(int i = 0;i < count && !retval;++i)
+         if(!buffers[i].length || buffers[i].length > VFS_SPLICE_MAX)
+            retval = -EINVAL;
+         else
+            retval = verifyUserAddress(buffers[i].base,buffers[i].length);
+      for(int i = 0;i < count && !retval;++i)
+      {
+         IORingBuffer *fixed = &ring->buffers[i];
+         fixed->kernel = vmapUser(buffers[i].base,buffers[i].length);
+         if(isErrorPointer(fixed->kernel) && (retval = getPointerError(fixed->kernel)))
+            break;
+         fixed->base = (u64)buffers[i].base;
+         fixed->length = buffers[i].length;
+         ++ring->bufferCount;
+      }
+      if(retval)
+         ioRingUnregister(ring); /*All or nothing.*/
+      break;
+   case IORING_UNREGISTER_BUFFERS:
+      retval = ring->bufferCount ? 0 : -ENXIO;
+      ioRingUnregister(ring);
+      break;
+   default:
+      break;
+   }
+   upSemaphore(&ring->semaphore);
+   closeFile(file);
+   return retval;
+}
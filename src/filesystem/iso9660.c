@@ -5,6 +5,64 @@
 #include <lib/string.h>
 #include <video/console.h>
 #include <memory/buddy.h>
+#include <memory/kmalloc.h>
+
+typedef struct ISO9660PathEntry{
+   u32 lba;
+   u32 parent;  /*The directory number of the parent.*/
+   u32 hash;
+   u32 next;    /*The next directory number in the same bucket.*/
+   const char *name; /*In ISO9660Volume::pathTable.*/
+   u8 length;
+} ISO9660PathEntry;
+
+typedef struct ISO9660Volume{
+   AtomicType ref; /*Held by the directories.*/
+   u8 rockRidge;
+   u32 pathCount;
+   ISO9660PathEntry *paths; /*Directory number 1 (the root) is paths[0].*/
+   u32 *pathHash;
+   u32 pathHashMask;
+   u8 *pathTable;
+} ISO9660Volume;
+
+typedef struct ISO9660DirEntry{
+   u64 lba;
+   u64 size;
+   u64 inodeStart;
+   u32 mode;
+   u32 hash;
+   u32 next;    /*The next entry in the same bucket,plus 1.*/
+   u32 name;    /*The offset in ISO9660Directory::names.*/
+   u8 length;
+} ISO9660DirEntry;
+
+typedef struct ISO9660Directory{
+   ISO9660Volume *volume;
+   u32 pathIndex;  /*The directory number,0 if unknown.*/
+   u8 hashed;      /*See ISO9660_HASH_*.*/
+   u8 root;        /*In iso9660Roots.*/
+   VFSINode *inode;
+   ListHead list;
+
+   u32 count;
+   u32 hashMask;
+   u32 *hash;
+   ISO9660DirEntry *entries;
+   char *names;
+} ISO9660Directory;
+
+typedef int (ISO9660RecordFiller)(void *arg,const char *name,u8 length,
+                    u64 mode,u64 size,u64 lba,u64 inodeStart);
+
+#define ISO9660_HASH_NONE     0
+#define ISO9660_HASH_DONE     1
+#define ISO9660_HASH_FAILED   2 /*Too large,scan the records.*/
+
+#define ISO9660_MAX_TABLE     0x100000 /*The limit of kmalloc.*/
+
+static ListHead iso9660Roots; /*The root directories of the mounted volumes.*/
+static Semaphore iso9660RootsSemaphore;
 
 static int iso9660Mount(BlockDevicePart *part,FileSystemMount *mount);
 static int iso9660LookUp(VFSDentry *dentry,VFSDentry *result,const char *name);
@@ -12,11 +70,15 @@ static int iso9660Open(VFSDentry *dentry,VFSFile *file,int mode);
 static int iso9660Read(VFSFile *file,UserSpace(void) *buf,u64 size,u64 *seek);
 static int iso9660LSeek(VFSFile *file,s64 offset,int type);
 static int iso9660ReadDir(VFSFile *file,VFSDirFiller filler,void *data);
+static int iso9660Release(VFSINode *inode);
+static int iso9660MediaChanged(BlockDevicePart *part);
+static int iso9660FreeDirectoryHash(ISO9660Directory *dir);
 static int iso9660PutPage(PhysicsPage *page);
 static PhysicsPage *iso9660GetPage(VFSINode *inode,u64 offset);
 
 static FileSystem iso9660FileSystem = {
    .mount = &iso9660Mount,
+   .mediaChanged = &iso9660MediaChanged,
    .name = "iso9660"
 };
 
@@ -24,7 +86,8 @@ static VFSINodeOperation iso9660INodeOperation = {
    .mkdir = 0,
    .unlink = 0,
    .lookUp = &iso9660LookUp,
-   .open = &iso9660Open
+   .open = &iso9660Open,
+   .release = &iso9660Release
 };
 
 static VFSFileOperation iso9660FileOperation = {
@@ -44,13 +107,187 @@ static PageCacheOperation iso9660PageCacheOperation = {
 /*See also http://wiki.osdev.org/ISO_9660.*/
 /*And http://en.wikipedia.org/wiki/ISO_9660.*/
 
-static int iso9660Mount(BlockDevicePart *part,FileSystemMount *mount)
+static u32 iso9660HashName(u32 seed,const char *name,u8 length)
 {
-   FileSystem *const fs = &iso9660FileSystem;
-   u8 buffer[2048];
+   u32 hash = 2166136261u ^ seed; /*FNV-1a.*/
+   for(int i = 0;i < length;++i)
+      hash = (hash ^ (u8)name[i]) * 16777619u;
+   return hash;
+}
+
+static u8 iso9660NormalizeName(char *name,u8 length)
+{
+   if(name[0] == '_')
+      name[0] = '.'; /*Set to '.'.*/
+   if(length > 1 && name[length - 1] == '.')
+      length -= 1;
+   for(int i = 0;i < length;++i)
+      if(name[i] >= 'A' && name[i] <= 'Z')
+         name[i] -= 'A' - 'a';
+   return length;
+}
+
+static u32 iso9660LookUpPath(ISO9660Volume *volume,u32 parent,
+                               const char *name,u8 length)
+{
+   u32 hash = iso9660HashName(parent,name,length);
+   for(u32 i = volume->pathHash[hash & volume->pathHashMask];i;
+             i = volume->paths[i - 1].next)
+   {
+      ISO9660PathEntry *path = &volume->paths[i - 1];
+      if(path->hash == hash && path->parent == parent &&
+         path->length == length && !memcmp(path->name,name,length))
+         return i; /*The directory number.*/
+   }
+   return 0;
+}
+
+static int iso9660FreePathTable(ISO9660Volume *volume)
+{
+   if(volume->pathTable)
+      kfree(volume->pathTable);
+   if(volume->paths)
+      kfree(volume->paths);
+   if(volume->pathHash)
+      kfree(volume->pathHash);
+   volume->pathTable = 0;
+   volume->paths = 0;
+   volume->pathHash = 0;
+   return 0;
+}
+
+static int iso9660LoadPathTable(BlockDevicePart *part,ISO9660Volume *volume,
+                                  u8 *descriptor)
+{
+   u32 size = *(u32 *)&descriptor[132]; /*Little endian.*/
+   u32 count = 0,buckets = 1;
+   if(size == 0 || size > ISO9660_MAX_TABLE)
+      return -EINVAL;
+   volume->pathTable = kmalloc(size);
+   if(!volume->pathTable)
+      return -ENOMEM;
+   BlockIO io = {
+      .part = part,
+      .start = *(u32 *)&descriptor[140] * 2048ul, /*The L Path Table.*/
+      .size = size,
+      .buffer = volume->pathTable,
+      .read = 1
+   };
+   if(submitBlockIO(&io))
+      goto failed;
+
+   u8 *table = volume->pathTable;
+   for(u32 pos = 0;pos + 8 < size && table[pos];++count)
+   {
+      if(pos + 8 + table[pos] > size)
+         goto failed; /*The name runs past the table.*/
+      pos += 8 + table[pos] + (table[pos] & 1);
+   }
+   if(!count || count * sizeof(ISO9660PathEntry) > ISO9660_MAX_TABLE)
+      goto failed;
+   while(buckets < count)
+      buckets <<= 1;
+   volume->paths = kmalloc(count * sizeof(ISO9660PathEntry));
+   volume->pathHash = kmalloc(buckets * sizeof(u32));
+   if(!volume->paths || !volume->pathHash)
+      goto failed;
+   memset(volume->pathHash,0,buckets * sizeof(u32));
+   volume->pathHashMask = buckets - 1;
+   volume->pathCount = count;
+
+   for(u32 i = 0,pos = 0;i < count;++i)
+   {
+      ISO9660PathEntry *path = &volume->paths[i];
+      u8 length = table[pos];
+      path->lba = *(u32 *)&table[pos + 2];
+      path->parent = *(u16 *)&table[pos + 6];
+      if(path->parent == 0 || path->parent > i + 1)
+         goto failed; /*The parents are sorted before their children.*/
+      path->name = (const char *)&table[pos + 8];
+      path->length = iso9660NormalizeName((char *)path->name,length);
+      path->hash = iso9660HashName(path->parent,path->name,path->length);
+      path->next = 0;
+      pos += 8 + length + (length & 1);
+      if(i == 0)
+         continue; /*The root directory.*/
+      u32 *bucket = &volume->pathHash[path->hash & volume->pathHashMask];
+      path->next = *bucket;
+      *bucket = i + 1;
+   }
+   return 0;
+failed:
+   iso9660FreePathTable(volume);
+   return -EIO;
+}
+
+static int iso9660IsRockRidge(VFSINode *root)
+{
+   u8 record[40];
+   BlockIO io = {
+      .part = root->part,
+      .start = root->start,
+      .size = sizeof(record),
+      .buffer = record,
+      .read = 1
+   };
+   if(submitBlockIO(&io))
+      return 0;
+   return record[32] == 1 && record[34] == 'S' && record[35] == 'P';
+      /*The SUSP "SP" entry follows the name of the dot directory.*/
+}
+
+static int iso9660PutVolume(ISO9660Volume *volume)
+{
+   if(atomicAddRet(&volume->ref,-1) != 0)
+      return 0;
+   iso9660FreePathTable(volume);
+   return kfree(volume);
+}
+
+static ISO9660Volume *iso9660CreateVolume(VFSINode *root,u8 *descriptor)
+{ /*Read the path table,root->data gets the directory number if it is used.*/
+  /*descriptor is 0 if there isn't a volume now,the root is empty.*/
+   ISO9660Directory *dir = root->data;
+   ISO9660Volume *volume = kmalloc(sizeof(ISO9660Volume));
+   if(!volume)
+      return 0;
+   memset(volume,0,sizeof(*volume));
+   atomicSet(&volume->ref,1); /*For root.*/
+   volume->rockRidge = descriptor && iso9660IsRockRidge(root);
+   if(descriptor && !volume->rockRidge
+         && !iso9660LoadPathTable(root->part,volume,descriptor))
+      dir->pathIndex = 1;
+      /*Rock Ridge names are not in the path table.*/
+   dir->volume = volume;
+   return volume;
+}
+
+static int iso9660InitVolume(VFSINode *root,u8 *descriptor)
+{
+   ISO9660Directory *dir = kmalloc(sizeof(ISO9660Directory));
+   if(!dir)
+      return -ENOMEM;
+   memset(dir,0,sizeof(*dir));
+   root->data = dir;
+   if(!iso9660CreateVolume(root,descriptor))
+   {
+      kfree(dir);
+      root->data = 0;
+      return -ENOMEM;
+   }
+   dir->root = 1;
+   dir->inode = root;
+   downSemaphore(&iso9660RootsSemaphore);
+   listAdd(&dir->list,&iso9660Roots);
+   upSemaphore(&iso9660RootsSemaphore);
+   return 0;
+}
+
+static int iso9660ReadDescriptor(BlockDevicePart *part,u8 *buffer,u64 *position)
+{ /*Look for the Primary Volume Descriptor,buffer has 2048 bytes.*/
    BlockIO io;
    io.part = part;
-   io.size = sizeof(buffer);
+   io.size = 2048;
    io.buffer = buffer;
    io.read = 1;
    io.start = 0x8000;
@@ -77,13 +314,67 @@ static int iso9660Mount(BlockDevicePart *part,FileSystemMount *mount)
    /*Directory entry for the root directory.*/
    if(buffer[156] != 0x22)
       return -EPROTO;
+   *position = io.start;
+   return 0;
+}
+
+static int iso9660FillRoot(VFSINode *root,u8 *buffer,u64 position)
+{
+   root->start = *(u32 *)(buffer + 156 + 2);
+   root->ino = root->start;
+   root->start *= 2048; 
+       /*Location of extent (LBA) in both-endian format.*/
+   root->size = *(u32 *)(buffer + 156 + 10);
+   root->inodeStart = position + 156 + 2;
+   return 0;
+}
+
+static int iso9660RebuildRoot(VFSINode *root)
+{ /*Read the new volume,the old directories keep the old one until they are released.*/
+   ISO9660Directory *dir = root->data;
+   u8 buffer[2048];
+   u64 position;
+   int retval = 0;
+   downSemaphore(&root->semaphore); /*Like iso9660LookUp.*/
+   iso9660FreeDirectoryHash(dir);
+   dir->hashed = ISO9660_HASH_NONE;
+   dir->pathIndex = 0;
+   iso9660PutVolume(dir->volume);
+   dir->volume = 0;
+   if(!(retval = iso9660ReadDescriptor(root->part,buffer,&position)))
+      iso9660FillRoot(root,buffer,position);
+   else
+      root->size = 0; /*No media or not ISO9660,the root is empty now.*/
+   if(!iso9660CreateVolume(root,retval ? 0 : buffer))
+      retval = -ENOMEM;
+   upSemaphore(&root->semaphore);
+   return retval;
+}
+
+static int iso9660MediaChanged(BlockDevicePart *part)
+{ /*The VFS has dropped the other dentries of part,only the roots are left.*/
+   downSemaphore(&iso9660RootsSemaphore);
+   for(ListHead *list = iso9660Roots.next;list != &iso9660Roots;list = list->next)
+   {
+      ISO9660Directory *dir = listEntry(list,ISO9660Directory,list);
+      if(dir->inode->part == part)
+         iso9660RebuildRoot(dir->inode);
+   }
+   upSemaphore(&iso9660RootsSemaphore);
+   return 0;
+}
+
+static int iso9660Mount(BlockDevicePart *part,FileSystemMount *mount)
+{
+   FileSystem *const fs = &iso9660FileSystem;
+   u8 buffer[2048];
+   u64 position;
+   int retval;
+   if((retval = iso9660ReadDescriptor(part,buffer,&position)))
+      return retval;
    mount->root->inode->mode = S_IFDIR | S_IRWXU; 
    mount->root->name = 0;
-   mount->root->inode->start = *(u32 *)(buffer + 156 + 2);
-   mount->root->inode->start *= 2048; 
-       /*Location of extent (LBA) in both-endian format.*/
-   mount->root->inode->size = *(u32 *)(buffer + 156 + 10);
-   mount->root->inode->inodeStart = io.start + 156 + 2;
+   iso9660FillRoot(mount->root->inode,buffer,position);
    mount->root->inode->operation = &iso9660INodeOperation;
    mount->root->inode->part = part;
 
@@ -97,7 +388,7 @@ static int iso9660Mount(BlockDevicePart *part,FileSystemMount *mount)
          goto found;
    }
    unlockSpinLock(&fs->lock);
-   return 0;
+   return iso9660InitVolume(mount->root->inode,buffer);
 found:
    atomicAdd(&mnt->root->ref,1);
    unlockSpinLock(&fs->lock);
@@ -185,13 +476,7 @@ iso:
          *pnamelength = 2;
       goto nofilename;
    }
-   if(filename[0] == '_')
-      filename[0] = '.'; /*Set to '.'.*/
-   if(filename[length - 1] == '.')
-      length -= 1;
-   for(int i = 0;i < length;++i)
-      if(*filename >= 'A' && *filename <= 'Z')
-         *filename -= 'A' - 'a';
+   length = iso9660NormalizeName(filename,length);
    if(pfilename)
       *pfilename = filename;
    if(pnamelength)
@@ -240,13 +525,11 @@ static int iso9660PutPage(PhysicsPage *page)
    return 0;
 }
 
-static int iso9660LookUp(VFSDentry *dentry,VFSDentry *result,const char *name)
+static int iso9660ScanDirectory(VFSINode *inode,
+                ISO9660RecordFiller *filler,void *arg)
 {
-   if(!S_ISDIR(dentry->inode->mode))
-      return -ENOTDIR;
-   VFSINode *inode = dentry->inode;
-   u8 length = strlen(name);
    u64 pos = 0,realPosition = 0;
+   int ret = 0;
    PhysicsPage *page = getPageFromPageCache(&inode->cache,0,&iso9660ReadPage);
    if(!page) /*Get the page from the page cache.*/
       return -EIO;
@@ -280,23 +563,241 @@ static int iso9660LookUp(VFSDentry *dentry,VFSDentry *result,const char *name)
       }
       pos += retval;
       realPosition += retval;
-      if(length != namelength)
-         continue;
-      if(memcmp(name,filename,length))
-         continue;
-      result->inode->inodeStart = inode->start + pos;
-      result->inode->size = size;
-      result->inode->start = lba * 2048;
-      result->inode->operation = &iso9660INodeOperation;
-      result->inode->part = inode->part;
-      result->inode->mode = mode;
-      result->inode->cache.operation = &iso9660PageCacheOperation;
-            /*Init the fields of result.*/
-      putPageIntoPageCache(page);
-      return 0;
+      ret = (*filler)(arg,filename,namelength,mode,size,lba,inode->start + pos);
+      if(ret)
+         break; /*Found or failed.*/
    }
    putPageIntoPageCache(page);
-   return -ENOENT;
+   return ret;
+}
+
+typedef struct ISO9660HashBuilder{
+   ISO9660Directory *dir;
+   u32 count;
+   u32 nameSize;
+} ISO9660HashBuilder;
+
+static inline int iso9660IsDot(const char *name,u8 length)
+{
+   return name[0] == '.' && (length == 1 || (length == 2 && name[1] == '.'));
+}
+
+static int iso9660CountRecord(void *arg,const char *name,u8 length,
+                    u64 mode,u64 size,u64 lba,u64 inodeStart)
+{
+   ISO9660HashBuilder *builder = arg;
+   if(iso9660IsDot(name,length))
+      return 0;
+   builder->count += 1;
+   builder->nameSize += length;
+   return 0;
+}
+
+static int iso9660AddRecord(void *arg,const char *name,u8 length,
+                    u64 mode,u64 size,u64 lba,u64 inodeStart)
+{
+   ISO9660HashBuilder *builder = arg;
+   ISO9660Directory *dir = builder->dir;
+   if(iso9660IsDot(name,length))
+      return 0;
+   if(dir->count == builder->count || builder->nameSize < length)
+      return -EIO; /*The directory has been changed?*/
+   ISO9660DirEntry *entry = &dir->entries[dir->count];
+   u32 offset = builder->nameSize - length;
+   builder->nameSize = offset;
+   memcpy(dir->names + offset,name,length);
+   entry->lba = lba;
+   entry->size = size;
+   entry->inodeStart = inodeStart;
+   entry->mode = mode;
+   entry->hash = iso9660HashName(0,name,length);
+   entry->name = offset;
+   entry->length = length;
+   entry->next = dir->hash[entry->hash & dir->hashMask];
+   dir->hash[entry->hash & dir->hashMask] = ++dir->count;
+   return 0;
+}
+
+static int iso9660FreeDirectoryHash(ISO9660Directory *dir)
+{
+   if(dir->entries)
+      kfree(dir->entries);
+   if(dir->names)
+      kfree(dir->names);
+   if(dir->hash)
+      kfree(dir->hash);
+   dir->entries = 0;
+   dir->names = 0;
+   dir->hash = 0;
+   dir->count = 0;
+   return 0;
+}
+
+static int iso9660HashDirectory(VFSINode *inode,ISO9660Directory *dir)
+{
+   ISO9660HashBuilder builder = {.dir = dir};
+   u32 buckets = 1;
+   dir->hashed = ISO9660_HASH_FAILED;
+   if(iso9660ScanDirectory(inode,&iso9660CountRecord,&builder))
+      return -EIO;
+   if(builder.count == 0 ||
+      builder.count * sizeof(ISO9660DirEntry) > ISO9660_MAX_TABLE)
+      return -ENOMEM; /*Nothing to hash or too large,just scan it.*/
+   while(buckets < builder.count)
+      buckets <<= 1;
+   dir->entries = kmalloc(builder.count * sizeof(ISO9660DirEntry));
+   dir->names = kmalloc(builder.nameSize);
+   dir->hash = kmalloc(buckets * sizeof(u32));
+   if(!dir->entries || !dir->names || !dir->hash)
+      goto failed;
+   memset(dir->hash,0,buckets * sizeof(u32));
+   dir->hashMask = buckets - 1;
+   if(iso9660ScanDirectory(inode,&iso9660AddRecord,&builder))
+      goto failed;
+   dir->hashed = ISO9660_HASH_DONE;
+   return 0;
+failed:
+   iso9660FreeDirectoryHash(dir);
+   return -ENOMEM;
+}
+
+static int iso9660FillINode(VFSINode *parent,VFSINode *inode,
+                 const char *name,u8 length,
+                 u64 mode,u64 size,u64 lba,u64 inodeStart,u32 pathIndex)
+{
+   ISO9660Directory *parentDir = parent->data;
+   inode->inodeStart = inodeStart;
+   inode->size = size;
+   inode->start = lba * 2048;
+   inode->ino = lba; /*The extent is unique.*/
+   inode->operation = &iso9660INodeOperation;
+   inode->part = parent->part;
+   inode->mode = mode;
+   inode->cache.operation = &iso9660PageCacheOperation;
+   inode->data = 0;
+         /*Init the fields of the inode.*/
+   if(!S_ISDIR(mode) || !parentDir || !parentDir->volume)
+      return 0;
+   ISO9660Directory *dir = kmalloc(sizeof(ISO9660Directory));
+   if(!dir)
+      return -ENOMEM;
+   memset(dir,0,sizeof(*dir));
+   atomicAdd(&parentDir->volume->ref,1);
+   dir->volume = parentDir->volume;
+   if(pathIndex)
+      dir->pathIndex = pathIndex;
+   else if(parentDir->pathIndex)
+      dir->pathIndex = iso9660LookUpPath(dir->volume,
+                             parentDir->pathIndex,name,length);
+   inode->data = dir;
+   return 0;
+}
+
+typedef struct ISO9660Match{
+   VFSINode *parent;
+   VFSINode *inode;
+   const char *name;
+   u8 length;
+} ISO9660Match;
+
+static int iso9660MatchRecord(void *arg,const char *name,u8 length,
+                    u64 mode,u64 size,u64 lba,u64 inodeStart)
+{
+   ISO9660Match *match = arg;
+   if(length != match->length || memcmp(name,match->name,length))
+      return 0;
+   int error = iso9660FillINode(match->parent,match->inode,
+                   name,length,mode,size,lba,inodeStart,0);
+   return error ? error : 1;
+}
+
+static int iso9660LookUpByPathTable(VFSINode *inode,ISO9660Directory *dir,
+                 VFSINode *result,const char *name,u8 length)
+{
+   ISO9660Volume *volume = dir->volume;
+   u32 index = iso9660LookUpPath(volume,dir->pathIndex,name,length);
+   if(!index)
+      return -ENOENT; /*Not a directory,maybe a file.*/
+   ISO9660PathEntry *path = &volume->paths[index - 1];
+   u8 record[34];
+   BlockIO io = {
+      .part = inode->part,
+      .start = path->lba * 2048ul,
+      .size = sizeof(record),
+      .buffer = record,
+      .read = 1
+   };
+   if(submitBlockIO(&io))
+      return -EIO;
+      /*The dot record has the size of the directory.*/
+   return iso9660FillINode(inode,result,name,length,
+              S_IFDIR | S_IRWXU,*(u32 *)&record[10],path->lba,
+              path->lba * 2048ul,index);
+}
+
+static int iso9660LookUp(VFSDentry *dentry,VFSDentry *result,const char *name)
+{
+   if(!S_ISDIR(dentry->inode->mode))
+      return -ENOTDIR;
+   VFSINode *inode = dentry->inode;
+   ISO9660Directory *dir = inode->data;
+   u8 length = strlen(name);
+   int error;
+
+   /*The lookUp operation is serialized by the semaphore of the inode,*/
+   /*so we can build the hash table here without other locks.*/
+   if(dir && dir->hashed == ISO9660_HASH_NONE && dir->pathIndex)
+   { /*Directories only need the path table,don't hash the parent.*/
+      error = iso9660LookUpByPathTable(inode,dir,result->inode,name,length);
+      if(error != -ENOENT)
+         return error;
+   }
+   if(dir && dir->hashed == ISO9660_HASH_NONE)
+      iso9660HashDirectory(inode,dir);
+   if(dir && dir->hashed == ISO9660_HASH_DONE)
+   {
+      u32 hash = iso9660HashName(0,name,length);
+      for(u32 i = dir->hash[hash & dir->hashMask];i;i = dir->entries[i - 1].next)
+      {
+         ISO9660DirEntry *entry = &dir->entries[i - 1];
+         if(entry->hash != hash || entry->length != length ||
+            memcmp(dir->names + entry->name,name,length))
+            continue;
+         return iso9660FillINode(inode,result->inode,name,length,
+                   entry->mode,entry->size,entry->lba,entry->inodeStart,0);
+      }
+      return -ENOENT;
+   }
+
+   ISO9660Match match = {
+      .parent = inode,
+      .inode = result->inode,
+      .name = name,
+      .length = length
+   };
+   error = iso9660ScanDirectory(inode,&iso9660MatchRecord,&match);
+   if(error == 1)
+      return 0;
+   return error ? error : -ENOENT;
+}
+
+static int iso9660Release(VFSINode *inode)
+{
+   ISO9660Directory *dir = inode->data;
+   if(!dir)
+      return 0;
+   iso9660FreeDirectoryHash(dir);
+   if(dir->root)
+   {
+      downSemaphore(&iso9660RootsSemaphore);
+      listDelete(&dir->list);
+      upSemaphore(&iso9660RootsSemaphore);
+   }
+   if(dir->volume)
+      iso9660PutVolume(dir->volume);
+   kfree(dir);
+   inode->data = 0;
+   return 0;
 }
 
 static int iso9660Open(VFSDentry *dentry,VFSFile *file,int mode)
@@ -405,10 +906,10 @@ static int iso9660ReadDir(VFSFile *file,VFSDirFiller filler,void *data)
          pos = (pos + 0x7ff) & ~0x7ff;
          continue;
       }
+      if((*filler)(data,lba,mode,size,length,filename) < 0)
+         break; /*Full,read it again next time.*/
       pos += retval;
       realPosition += retval;
-      if((*filler)(data,!!S_ISDIR(mode),length,filename) < 0)
-         break; /*Fill the buffer.*/
    }
    u64 old = file->seek;
    file->seek = realPosition; /*Update the seek.*/
@@ -423,6 +924,8 @@ failed:
 
 static int initISO9660(void)
 {
+   initList(&iso9660Roots);
+   initSemaphore(&iso9660RootsSemaphore);
    registerFileSystem(&iso9660FileSystem);
    return 0;
 }
@@ -0,0 +1,393 @@
+#include <core/const.h>
+#include <core/math.h>
+#include <filesystem/virtual.h>
+#include <filesystem/pipe.h>
+#include <memory/buddy.h>
+#include <memory/kmalloc.h>
+#include <memory/user.h>
+#include <task/task.h>
+#include <task/signal.h>
+#include <task/waitqueue.h>
+
+typedef struct PipeBuffer{
+   PhysicsPage *page;
+   u32 offset;
+   u32 length;
+   u8 gift; /*Given by spliceFile,it may be in a page cache.*/
+} PipeBuffer;
+
+typedef struct Pipe{
+   PipeBuffer buffers[PIPE_PAGES];
+   u32 head;  /*The first buffer to read.*/
+   u32 count; /*How many buffers are used.*/
+
+   u32 readers;
+   u32 writers;
+   u32 writeOpens; /*For the FIFOs,a reader waits until it changes.*/
+   u32 readOpens;
+   VFSINode *inode; /*The FIFO,0 for the anonymous pipes.*/
+
+   Semaphore semaphore;
+   WaitQueue readWait;  /*The readers wait for the data.*/
+   WaitQueue writeWait; /*The writers wait for the space.*/
+} Pipe;
+
+static int pipeRead(VFSFile *file,UserSpace(void) *buf,u64 size,u64 *seek);
+static int pipeWrite(VFSFile *file,UserSpace(const void) *buf,u64 size,u64 *seek);
+static int pipeSplicePage(VFSFile *file,PhysicsPage *page,u64 offset,u64 length);
+static int pipePoll(VFSFile *file);
+static int pipeClose(VFSFile *file);
+
+static VFSFileOperation pipeReadOperation = {
+   .read = &pipeRead,
+   .poll = &pipePoll,
+   .close = &pipeClose
+};
+
+static VFSFileOperation pipeWriteOperation = {
+   .write = &pipeWrite,
+   .splicePage = &pipeSplicePage,
+   .poll = &pipePoll,
+   .close = &pipeClose
+};
+
+static VFSFileOperation pipeReadWriteOperation = {
+   .read = &pipeRead,
+   .write = &pipeWrite,
+   .splicePage = &pipeSplicePage,
+   .poll = &pipePoll,
+   .close = &pipeClose
+};
+
+static Pipe *createPipe(VFSINode *inode)
+{
+   Pipe *pipe = kmalloc(sizeof(*pipe));
+   if(!pipe)
+      return 0;
+   pipe->head = pipe->count = 0;
+   pipe->readers = pipe->writers = 0;
+   pipe->readOpens = pipe->writeOpens = 0;
+   pipe->inode = inode;
+   initSemaphore(&pipe->semaphore);
+   initWaitQueueHead(&pipe->readWait);
+   initWaitQueueHead(&pipe->writeWait);
+   return pipe;
+}
+
+static int destoryPipe(Pipe *pipe)
+{
+   for(;pipe->count;--pipe->count,pipe->head = (pipe->head + 1) % PIPE_PAGES)
+      freePages(pipe->buffers[pipe->head].page,0);
+         /*The gifts go back to their page caches.*/
+   return kfree(pipe);
+}
+
+static inline PipeBuffer *pipeLastBuffer(Pipe *pipe)
+{
+   if(!pipe->count)
+      return 0;
+   return &pipe->buffers[(pipe->head + pipe->count - 1) % PIPE_PAGES];
+}
+
+static u64 pipeSpace(Pipe *pipe)
+{ /*How many bytes can be written without waiting.*/
+   PipeBuffer *last = pipeLastBuffer(pipe);
+   u64 space = (u64)(PIPE_PAGES - pipe->count) * PAGE_SIZE;
+   if(last && !last->gift)
+      space += PAGE_SIZE - last->offset - last->length;
+   return space;
+}
+
+static int pipeWait(Pipe *pipe,WaitQueue *queue)
+{ /*The caller holds pipe->semaphore,it is released while sleeping.*/
+   Task *current = getCurrentTask();
+   WaitQueue wait;
+   initWaitQueue(&wait,current);
+   lockSpinLock(&queue->lock);
+   addToWaitQueueLocked(&wait,queue);
+   current->state = TaskInterruptible;
+   unlockSpinLock(&queue->lock);
+   upSemaphore(&pipe->semaphore);
+
+   schedule(); /*Wait for wakeUpAll.*/
+
+   removeFromWaitQueue(queue,&wait);
+   downSemaphore(&pipe->semaphore);
+   if(taskSignalPending(current)) /*Interrupted by signals.*/
+      return -EINTR;
+   return 0;
+}
+
+static int pipeRelease(Pipe *pipe,int mode)
+{
+   VFSINode *inode = pipe->inode;
+   u8 last;
+   if(inode)
+      downSemaphore(&inode->semaphore); /*openFifo may be looking for it.*/
+   downSemaphore(&pipe->semaphore);
+   if(mode & O_RDONLY)
+      --pipe->readers;
+   if(mode & O_WRONLY)
+      --pipe->writers;
+   last = !pipe->readers && !pipe->writers;
+   wakeUpAll(&pipe->readWait); /*The end of file.*/
+   wakeUpAll(&pipe->writeWait); /*Or a broken pipe.*/
+   upSemaphore(&pipe->semaphore);
+   if(last && inode)
+      inode->pipe = 0;
+   if(inode)
+      upSemaphore(&inode->semaphore);
+   if(last)
+      destoryPipe(pipe);
+   return 0;
+}
+
+static int pipeBroken(void)
+{
+   Task *current = getCurrentTask();
+   doKill(current->pid,SIGPIPE);
+   return -EPIPE;
+}
+
+static int pipeRead(VFSFile *file,UserSpace(void) *buf,u64 size,u64 *seek)
+{
+   Pipe *pipe = file->data;
+   int retval = 0;
+   if(!size)
+      return 0;
+   downSemaphore(&pipe->semaphore);
+   while(!pipe->count)
+   {
+      if(!pipe->writers)
+         goto out; /*The end of file.*/
+      if((retval = pipeWait(pipe,&pipe->readWait)))
+         goto out;
+   }
+   while(size > 0 && pipe->count)
+   {
+      PipeBuffer *buffer = &pipe->buffers[pipe->head];
+      u64 length = min(size,buffer->length);
+      if(memcpyUser0(buf,getPhysicsPageAddress(buffer->page) + buffer->offset,length))
+      {
+         retval = retval ? retval : -EFAULT;
+         break;
+      }
+      buffer->offset += length;
+      buffer->length -= length;
+      buf += length;
+      size -= length;
+      retval += length;
+      if(buffer->length)
+         continue;
+      freePages(buffer->page,0); /*Consumed.*/
+      pipe->head = (pipe->head + 1) % PIPE_PAGES;
+      --pipe->count;
+   }
+   wakeUpAll(&pipe->writeWait);
+out:
+   upSemaphore(&pipe->semaphore);
+   return retval;
+}
+
+static int pipeWriteBuffer(Pipe *pipe,UserSpace(const void) *buf,u64 size)
+{
+   int retval = 0,error = 0;
+   downSemaphore(&pipe->semaphore);
+   while(size > 0)
+   {
+      PipeBuffer *last = pipeLastBuffer(pipe);
+      u64 space = pipeSpace(pipe),length;
+      if(!pipe->readers)
+      {
+         error = pipeBroken();
+         break;
+      }
+      if(!space || (size <= PIPE_BUF && space < size))
+      { /*The writes up to PIPE_BUF are never split.*/
+         if((error = pipeWait(pipe,&pipe->writeWait)))
+            break;
+         continue;
+      }
+      if(!last || last->gift || last->offset + last->length == PAGE_SIZE)
+      { /*Start a new page.*/
+         PhysicsPage *page = allocPages(0);
+         if(!page)
+         {
+            error = -ENOMEM;
+            break;
+         }
+         last = &pipe->buffers[(pipe->head + pipe->count++) % PIPE_PAGES];
+         last->page = page;
+         last->offset = last->length = 0;
+         last->gift = 0;
+      }
+      length = min(size,PAGE_SIZE - last->offset - last->length);
+      if(memcpyUser1(getPhysicsPageAddress(last->page) + last->offset + last->length,
+                  buf,length))
+      {
+         if(!last->length && (--pipe->count || 1))
+            freePages(last->page,0); /*Nothing is in the new page.*/
+         error = -EFAULT;
+         break;
+      }
+      last->length += length;
+      buf += length;
+      size -= length;
+      retval += length;
+      wakeUpAll(&pipe->readWait);
+   }
+   upSemaphore(&pipe->semaphore);
+   return retval ? retval : error;
+}
+
+static int pipeWrite(VFSFile *file,UserSpace(const void) *buf,u64 size,u64 *seek)
+{
+   PhysicsPage *page;
+   unsigned long limit;
+   long retval;
+   if(size)
+      return pipeWriteBuffer(file->data,buf,size);
+   if(!(page = allocPages(0)))
+      return -ENOMEM;
+   retval = strncpyUser1(getPhysicsPageAddress(page),buf,PAGE_SIZE);
+   if(retval > 0 && --retval)
+   { /*A string which ends with '\0',like ttyWrite.*/
+      limit = getAddressLimit();
+      setKernelAddressLimit();
+      retval = pipeWriteBuffer(file->data,getPhysicsPageAddress(page),retval);
+      setAddressLimit(limit);
+   }
+   freePages(page,0);
+   return retval;
+}
+
+static int pipeSplicePage(VFSFile *file,PhysicsPage *page,u64 offset,u64 length)
+{ /*Put the page into the ring without copying it.*/
+   Pipe *pipe = file->data;
+   int error = 0;
+   downSemaphore(&pipe->semaphore);
+   while(pipe->readers && pipe->count == PIPE_PAGES)
+      if((error = pipeWait(pipe,&pipe->writeWait)))
+         goto out;
+   if(!pipe->readers)
+   {
+      error = pipeBroken();
+      goto out;
+   }
+   PipeBuffer *buffer = &pipe->buffers[(pipe->head + pipe->count++) % PIPE_PAGES];
+   buffer->page = page;
+   buffer->offset = offset;
+   buffer->length = length;
+   buffer->gift = 1;
+   wakeUpAll(&pipe->readWait);
+out:
+   upSemaphore(&pipe->semaphore);
+   return error ? error : length;
+}
+
+static int pipePoll(VFSFile *file)
+{
+   Pipe *pipe = file->data;
+   int events = 0;
+   downSemaphore(&pipe->semaphore);
+   if((file->mode & O_RDONLY) && pipe->count)
+      events |= VFS_POLL_IN;
+   if((file->mode & O_RDONLY) && !pipe->writers)
+      events |= VFS_POLL_HUP; /*read returns 0.*/
+   if((file->mode & O_WRONLY) && pipeSpace(pipe))
+      events |= VFS_POLL_OUT;
+   if((file->mode & O_WRONLY) && !pipe->readers)
+      events |= VFS_POLL_ERR; /*write gets SIGPIPE.*/
+   upSemaphore(&pipe->semaphore);
+   return events;
+}
+
+static int pipeClose(VFSFile *file)
+{
+   return pipeRelease(file->data,file->mode);
+}
+
+int openFifo(VFSDentry *dentry,VFSFile *file,int mode)
+{ /*A reader waits for a writer,and a writer waits for a reader.*/
+   VFSINode *inode = dentry->inode;
+   Pipe *pipe;
+   u32 opens;
+   int error = 0;
+   downSemaphore(&inode->semaphore);
+   if(!(pipe = inode->pipe) && !(pipe = inode->pipe = createPipe(inode)))
+      return (upSemaphore(&inode->semaphore),-ENOMEM);
+   downSemaphore(&pipe->semaphore);
+   upSemaphore(&inode->semaphore);
+
+   file->dentry = dentry;
+   file->seek = 0;
+   file->data = pipe;
+   switch(mode & O_ACCMODE)
+   {
+   case O_RDONLY:
+      file->operation = &pipeReadOperation;
+      ++pipe->readers;
+      ++pipe->readOpens;
+      wakeUpAll(&pipe->writeWait);
+      for(opens = pipe->writeOpens;!pipe->writers && opens == pipe->writeOpens;)
+         if((error = pipeWait(pipe,&pipe->readWait)))
+            break;
+      break;
+   case O_WRONLY:
+      file->operation = &pipeWriteOperation;
+      ++pipe->writers;
+      ++pipe->writeOpens;
+      wakeUpAll(&pipe->readWait);
+      for(opens = pipe->readOpens;!pipe->readers && opens == pipe->readOpens;)
+         if((error = pipeWait(pipe,&pipe->writeWait)))
+            break;
+      break;
+   default: /*O_RDWR never waits.*/
+      file->operation = &pipeReadWriteOperation;
+      ++pipe->readers;
+      ++pipe->writers;
+      break;
+   }
+   upSemaphore(&pipe->semaphore);
+   if(error)
+      pipeRelease(pipe,mode);
+   return error;
+}
+
+int doPipe(UserSpace(int) *fds)
+{
+   VFSFile *in = 0,*out = 0;
+   VFSDentry *dentry;
+   int read,write,error = -ENOMEM;
+   Pipe *pipe;
+   if((read = allocFileDescriptor(0)) < 0)
+      return read;
+   if((write = allocFileDescriptor(0)) < 0)
+      return (releaseFileDescriptor(read),write);
+   if(!(pipe = createPipe(0)))
+      goto failed;
+   if(!(dentry = createAnonymousDentry(S_IFIFO | S_IRWXU)))
+      goto failed;
+   if(!(in = openAnonymousFile(dentry,&pipeReadOperation,pipe,O_RDONLY)))
+      goto failed; /*The dentry is freed.*/
+   ++pipe->readers;
+   if(!(out = openAnonymousFile(dentry,&pipeWriteOperation,pipe,O_WRONLY)))
+      goto failed;
+   ++pipe->writers;
+   error = -EFAULT;
+   if(putUser32Safe(fds,read) || putUser32Safe(fds + 1,write))
+      goto failed;
+   installFile(read,in);
+   installFile(write,out);
+   return 0;
+failed:
+   if(in)
+      closeFile(in); /*The pipe is freed when the last one is closed.*/
+   else if(pipe)
+      destoryPipe(pipe);
+   if(out)
+      closeFile(out);
+   releaseFileDescriptor(read);
+   releaseFileDescriptor(write);
+   return error;
+}
@@ -0,0 +1,427 @@
+#include <core/const.h>
+#include <core/list.h>
+#include <core/math.h>
+#include <filesystem/virtual.h>
+#include <filesystem/pipe.h>
+#include <memory/buddy.h>
+#include <memory/kmalloc.h>
+#include <memory/user.h>
+#include <lib/string.h>
+
+typedef struct TmpfsINode TmpfsINode;
+
+typedef struct TmpfsVolume{
+   AtomicType pages; /*How many pages the files use.*/
+   AtomicType inodes; /*The next inode number.*/
+   u64 maxPages;
+   TmpfsINode *root;
+} TmpfsVolume;
+
+typedef struct TmpfsINode{
+   TmpfsVolume *volume;
+   VFSDentry *dentry;
+   u8 removed;        /*It has been unlinked.*/
+   ListHead children; /*For directories.*/
+   ListHead list;     /*In the children list of its parent.*/
+} TmpfsINode;
+
+#define TMPFS_SIZE_SHIFT 1 /*At most half of the memory.*/
+#define TMPFS_MAX_SIZE   (0xfffffffful << 12) /*Limited by the radix tree.*/
+
+static int tmpfsMount(BlockDevicePart *part __attribute__ ((unused))
+   ,FileSystemMount *mnt);
+static int tmpfsLookUp(VFSDentry *dentry,VFSDentry *result,const char *name);
+static int tmpfsCreate(VFSDentry *dentry,VFSDentry *result,const char *name);
+static int tmpfsMakeDir(VFSDentry *dentry,VFSDentry *result,const char *name);
+static int tmpfsMakeFifo(VFSDentry *dentry,VFSDentry *result,const char *name);
+static int tmpfsUnlink(VFSDentry *dentry,VFSDentry *result);
+static int tmpfsOpen(VFSDentry *dentry,VFSFile *file,int mode);
+static int tmpfsTruncate(VFSINode *inode,u64 size);
+static int tmpfsRelease(VFSINode *inode);
+static int tmpfsRead(VFSFile *file,UserSpace(void) *buf,u64 size,u64 *seek);
+static int tmpfsWrite(VFSFile *file,UserSpace(const void) *buf,u64 size,u64 *seek);
+static int tmpfsLSeek(VFSFile *file,s64 offset,int type);
+static int tmpfsReadDir(VFSFile *file,VFSDirFiller filler,void *data);
+static PhysicsPage *tmpfsGetPage(VFSINode *inode,u64 offset);
+static int tmpfsPutPage(PhysicsPage *page);
+
+static FileSystem tmpfs = {
+   .name = "tmpfs",
+   .mount = &tmpfsMount
+};
+
+static VFSINodeOperation tmpfsINodeOperation = {
+   .lookUp = &tmpfsLookUp,
+   .create = &tmpfsCreate,
+   .mkdir = &tmpfsMakeDir,
+   .mkfifo = &tmpfsMakeFifo,
+   .unlink = &tmpfsUnlink,
+   .open = &tmpfsOpen,
+   .truncate = &tmpfsTruncate,
+   .release = &tmpfsRelease
+};
+
+static VFSFileOperation tmpfsFileOperation = {
+   .read = &tmpfsRead,
+   .write = &tmpfsWrite,
+   .lseek = &tmpfsLSeek
+};
+
+static VFSFileOperation tmpfsDirOperation = {
+   .readDir = &tmpfsReadDir
+};
+
+static PageCacheOperation tmpfsPageCacheOperation = {
+   .getPage = &tmpfsGetPage,
+   .putPage = &tmpfsPutPage,
+   .flushPage = 0 /*There is no backing store.*/
+};
+
+static PageCacheOperation tmpfsDirPageCacheOperation = {
+   .getPage = 0,
+   .putPage = 0,
+   .flushPage = 0
+};
+
+static u8 tmpfsZeroPage[PAGE_SIZE] __attribute__ ((aligned(PAGE_SIZE)));
+   /*Holes are read from it.*/
+
+static PhysicsPage *tmpfsFindPage(VFSINode *inode,u64 index,u8 create)
+{ /*The caller must hold inode->semaphore.*/
+   TmpfsVolume *volume = ((TmpfsINode *)inode->data)->volume;
+   PhysicsPage *page = getFromRadixTree(&inode->cache.radix,index);
+   if(page || !create)
+      return page;
+   if((u64)atomicAddRet(&volume->pages,1) > volume->maxPages)
+      goto failed; /*The file system is full.*/
+   if(!(page = allocPages(0)))
+      goto failed;
+   memset(getPhysicsPageAddress(page),0,PAGE_SIZE);
+   page->flags |= PagePageCache | PageData;
+   page->cache = &inode->cache;
+   page->data = index;
+   if(insertIntoRadixTree(&inode->cache.radix,index,page))
+   {
+      page->flags &= ~(PagePageCache | PageData);
+      freePages(page,0);
+      goto failed;
+   }
+   return page; /*The radix tree holds the reference of allocPages.*/
+failed:
+   atomicAdd(&volume->pages,-1);
+   return 0;
+}
+
+static int tmpfsFreePage(TmpfsVolume *volume,PhysicsPage *page)
+{
+   removeFromRadixTree(&page->cache->radix,page->data);
+   page->flags &= ~(PagePageCache | PageData | PageDirty);
+   atomicAdd(&volume->pages,-1);
+   return freePages(page,0); /*The mappings may still use it.*/
+}
+
+static int __tmpfsTruncate(VFSINode *inode,u64 size)
+{
+   TmpfsINode *file = inode->data;
+   u64 offset = size & (PAGE_SIZE - 1);
+   PhysicsPage *page;
+   for(u64 index = (size + PAGE_SIZE - 1) >> 12;
+         index < ((inode->size + PAGE_SIZE - 1) >> 12);++index)
+      if((page = tmpfsFindPage(inode,index,0)))
+         tmpfsFreePage(file->volume,page);
+   if(size < inode->size && offset && (page = tmpfsFindPage(inode,size >> 12,0)))
+      memset(getPhysicsPageAddress(page) + offset,0,PAGE_SIZE - offset);
+         /*Zero the tail,the file may be extended again.*/
+   inode->size = size;
+   return 0;
+}
+
+static int tmpfsTruncate(VFSINode *inode,u64 size)
+{
+   if(S_ISDIR(inode->mode))
+      return -EISDIR;
+   if(size > TMPFS_MAX_SIZE)
+      return -EFBIG;
+   downSemaphore(&inode->semaphore);
+   __tmpfsTruncate(inode,size);
+   upSemaphore(&inode->semaphore);
+   return 0;
+}
+
+static int tmpfsRelease(VFSINode *inode)
+{ /*Nobody uses it now,free the data.*/
+   TmpfsINode *file = inode->data;
+   if(!file)
+      return 0;
+   __tmpfsTruncate(inode,0);
+   if(file->volume->root == file)
+      kfree(file->volume); /*Unmounted.*/
+   kfree(file);
+   inode->data = 0;
+   return 0;
+}
+
+static PhysicsPage *tmpfsGetPage(VFSINode *inode,u64 offset)
+{
+   PhysicsPage *page = 0;
+   downSemaphore(&inode->semaphore);
+   if(offset < inode->size && (page = tmpfsFindPage(inode,offset >> 12,1)))
+      referencePage(page);
+   upSemaphore(&inode->semaphore);
+   return page;
+}
+
+static int tmpfsPutPage(PhysicsPage *page)
+{ /*The radix tree holds it until the file is truncated.*/
+   if(atomicAddRet(&page->count,-1) != 0)
+      return 0;
+   page->flags &= ~(PagePageCache | PageData | PageDirty);
+   atomicSet(&page->count,1); /*Truncated,we are the last user.*/
+   return freePages(page,0); /*Not in the page cache now,so it goes to the buddy.*/
+}
+
+/*tmpfsRead and tmpfsWrite don't hold inode->semaphore when they copy,*/
+/*the user buffer may be a mapping of the same file,*/
+/*and the page fault calls tmpfsGetPage.They hold a reference of the page instead.*/
+
+static int tmpfsRead(VFSFile *file,UserSpace(void) *buf,u64 size,u64 *seek)
+{
+   VFSINode *inode = file->dentry->inode;
+   int retval = 0;
+   while(size > 0)
+   {
+      downSemaphore(&inode->semaphore);
+      if(*seek >= inode->size)
+      {
+         upSemaphore(&inode->semaphore);
+         break;
+      }
+      PhysicsPage *page = tmpfsFindPage(inode,*seek >> 12,0);
+      void *addr = page ? getPhysicsPageAddress(referencePage(page)) : tmpfsZeroPage;
+      u64 offset = *seek & (PAGE_SIZE - 1);
+      u64 read = min(min(size,PAGE_SIZE - offset),inode->size - *seek);
+      upSemaphore(&inode->semaphore);
+      int failed = memcpyUser0(buf,addr + offset,read);
+      if(page)
+         freePages(page,0);
+      if(failed)
+      {
+         retval = retval ? retval : -EFAULT;
+         break;
+      }
+      *seek += read;
+      buf += read;
+      size -= read;
+      retval += read;
+   }
+   return retval;
+}
+
+static int tmpfsWrite(VFSFile *file,UserSpace(const void) *buf,u64 size,u64 *seek)
+{
+   VFSINode *inode = file->dentry->inode;
+   int retval = 0;
+   if(!(file->mode & O_WRONLY))
+      return -EBADF;
+   if(*seek + size < *seek || *seek + size > TMPFS_MAX_SIZE)
+      return -EFBIG;
+   while(size > 0)
+   {
+      downSemaphore(&inode->semaphore);
+      PhysicsPage *page = tmpfsFindPage(inode,*seek >> 12,1);
+      u64 offset = *seek & (PAGE_SIZE - 1);
+      u64 write = min(size,PAGE_SIZE - offset);
+      if(page)
+         referencePage(page);
+      upSemaphore(&inode->semaphore);
+      if(!page)
+      {
+         retval = retval ? retval : -ENOSPC;
+         break;
+      }
+      int failed = memcpyUser1(getPhysicsPageAddress(page) + offset,buf,write);
+      freePages(page,0);
+      if(failed)
+      {
+         retval = retval ? retval : -EFAULT;
+         break;
+      }
+      *seek += write;
+      buf += write;
+      size -= write;
+      retval += write;
+      downSemaphore(&inode->semaphore);
+      if(*seek > inode->size)
+         inode->size = *seek; /*Extend the file.*/
+      upSemaphore(&inode->semaphore);
+   }
+   return retval;
+}
+
+static int tmpfsLSeek(VFSFile *file,s64 offset,int type)
+{
+   VFSINode *inode = file->dentry->inode;
+   s64 seek;
+   switch(type)
+   {
+   case SEEK_SET:
+      seek = offset;
+      break;
+   case SEEK_CUR:
+      seek = file->seek + offset;
+      break;
+   case SEEK_END:
+      seek = inode->size + offset;
+      break;
+   default:
+      return -EINVAL;
+   }
+   if(seek < 0)
+      return -EINVAL;
+   return (file->seek = seek);
+}
+
+static int tmpfsReadDir(VFSFile *file,VFSDirFiller filler,void *data)
+{
+   VFSINode *inode = file->dentry->inode;
+   VFSDentry *parent = file->dentry->parent;
+   TmpfsINode *dir = inode->data;
+   u64 index = 2; /*After "." and "..".*/
+   downSemaphore(&inode->semaphore);
+   if(file->seek == 0 && (*filler)(data,inode->ino,S_IFDIR,0,1,".") >= 0)
+      ++file->seek;
+   if(file->seek == 1 && (*filler)(data,
+         parent ? parent->inode->ino : inode->ino,S_IFDIR,0,2,"..") >= 0)
+      ++file->seek;
+   for(ListHead *p = dir->children.next;
+         file->seek >= 2 && p != &dir->children;p = p->next,++index)
+   {
+      VFSDentry *dentry = listEntry(p,TmpfsINode,list)->dentry;
+      if(index < file->seek)
+         continue; /*Read before.*/
+      if((*filler)(data,dentry->inode->ino,dentry->inode->mode,
+                 dentry->inode->size,dentry->length,dentry->name) < 0)
+         break; /*The buffer is full.*/
+      ++file->seek;
+   }
+   upSemaphore(&inode->semaphore);
+   return 0;
+}
+
+static int tmpfsLookUp(VFSDentry *dentry,VFSDentry *result,const char *name)
+{ /*All of the files are pinned in the dentry cache,*/
+  /*so it must not exist if the VFS asks us.*/
+   return -ENOENT;
+}
+
+static int tmpfsMakeINode(VFSDentry *dentry,VFSDentry *result,u64 mode)
+{ /*The VFS holds dentry->inode->semaphore.*/
+   TmpfsINode *dir = dentry->inode->data;
+   if(dir->removed)
+      return -ENOENT;
+   TmpfsINode *inode = kmalloc(sizeof(*inode));
+   if(!inode)
+      return -ENOMEM;
+   inode->volume = dir->volume;
+   inode->dentry = result;
+   inode->removed = 0;
+   initList(&inode->children);
+
+   result->inode->mode = mode;
+   result->inode->ino = atomicAddRet(&inode->volume->inodes,1);
+   result->inode->start = result->inode->inodeStart = 0;
+   result->inode->size = 0;
+   result->inode->data = inode;
+   result->inode->operation = &tmpfsINodeOperation;
+   result->inode->cache.operation = S_ISREG(mode) ?
+      &tmpfsPageCacheOperation : &tmpfsDirPageCacheOperation;
+   listAddTail(&inode->list,&dir->children);
+   atomicAdd(&result->ref,1); /*Pin it in the dentry cache until it is unlinked.*/
+   return 0;
+}
+
+static int tmpfsCreate(VFSDentry *dentry,VFSDentry *result,const char *name)
+{
+   return tmpfsMakeINode(dentry,result,S_IFREG | S_IRWXU);
+}
+
+static int tmpfsMakeDir(VFSDentry *dentry,VFSDentry *result,const char *name)
+{
+   return tmpfsMakeINode(dentry,result,S_IFDIR | S_IRWXU);
+}
+
+static int tmpfsMakeFifo(VFSDentry *dentry,VFSDentry *result,const char *name)
+{ /*The data is in the pipe,not in the page cache.*/
+   return tmpfsMakeINode(dentry,result,S_IFIFO | S_IRWXU);
+}
+
+static int tmpfsUnlink(VFSDentry *dentry,VFSDentry *result)
+{ /*The VFS holds dentry->inode->semaphore.*/
+   TmpfsINode *inode = result->inode->data;
+   if(S_ISDIR(result->inode->mode))
+   {
+      downSemaphore(&result->inode->semaphore);
+      if(!listEmpty(&inode->children))
+         return (upSemaphore(&result->inode->semaphore),-ENOTEMPTY);
+      inode->removed = 1; /*Nothing can be created in it now.*/
+      upSemaphore(&result->inode->semaphore);
+   }
+   listDelete(&inode->list);
+   atomicAdd(&result->ref,-1); /*Unpin it,the caller still holds it.*/
+   return 0;
+}
+
+static int tmpfsOpen(VFSDentry *dentry,VFSFile *file,int mode)
+{
+   if(S_ISDIR(dentry->inode->mode) && (mode & O_WRONLY))
+      return -EISDIR;
+   if(S_ISFIFO(dentry->inode->mode))
+      return openFifo(dentry,file,mode);
+   file->dentry = dentry;
+   file->seek = 0;
+   file->data = 0;
+   file->operation = S_ISDIR(dentry->inode->mode) ?
+      &tmpfsDirOperation : &tmpfsFileOperation;
+   return 0;
+}
+
+static int tmpfsMount(BlockDevicePart *part __attribute__ ((unused))
+   ,FileSystemMount *mnt)
+{ /*Every mount is a new empty file system.*/
+   TmpfsVolume *volume = kmalloc(sizeof(*volume));
+   TmpfsINode *root = kmalloc(sizeof(*root));
+   if(!volume || !root)
+   {
+      if(volume)
+         kfree(volume);
+      if(root)
+         kfree(root);
+      return -ENOMEM;
+   }
+   atomicSet(&volume->pages,0);
+   atomicSet(&volume->inodes,2); /*The root is 1.*/
+   volume->maxPages = getPhysicsPageCount() >> TMPFS_SIZE_SHIFT;
+   volume->root = root;
+   root->volume = volume;
+   root->dentry = mnt->root;
+   root->removed = 0;
+   initList(&root->children);
+   initList(&root->list);
+
+   mnt->root->inode->mode = S_IFDIR | S_IRWXU;
+   mnt->root->inode->ino = 1;
+   mnt->root->inode->start = mnt->root->inode->inodeStart = 0;
+   mnt->root->inode->size = 0;
+   mnt->root->inode->part = 0;
+   mnt->root->inode->data = root;
+   mnt->root->inode->operation = &tmpfsINodeOperation;
+   mnt->root->inode->cache.operation = &tmpfsDirPageCacheOperation;
+   return 0;
+}
+
+static int tmpfsRegister(void)
+{
+   return registerFileSystem(&tmpfs);
+}
+
+fileSystemInitcall(tmpfsRegister);
@@ -5,18 +5,62 @@
 #include <block/block.h>
 #include <filesystem/virtual.h>
 #include <memory/kmalloc.h>
+#include <memory/slab.h>
+#include <memory/buddy.h>
+#include <memory/user.h>
 #include <task/task.h>
 #include <lib/string.h>
 
-#define VFS_DENTRY_CACHE_COUNT 1024
-#define VFS_DENTRY_CACHE_MASK  1023
+#define VFS_DENTRY_ORDER_MIN   1  /*1024 buckets.*/
+#define VFS_DENTRY_ORDER_MAX   10 /*The max order of allocPages.*/
+#define VFS_DENTRY_LOCK_COUNT  256 /*It must not be larger than the buckets.*/
+#define VFS_DENTRY_LOCK_MASK   255
+
+#define VFS_UNUSED_MIN         64  /*Keep them even if memory is low.*/
+#define VFS_UNUSED_BATCH       32  /*Free at most 32 unused dentries once.*/
+
+#define VFS_RCU_PATH_MAX       256 /*Longer paths are looked up by vfsLookUp.*/
+
+#define VFS_NEGATIVE_MAX       512 /*The max count of negative dentries.*/
+#define VFS_NEGATIVE_CACHED    1
+#define VFS_NEGATIVE_EVICTED   2
 
 static ListHead fileSystems; 
 /*A list of file systems which has registered.*/
-static HashListHead vfsDentryCache[VFS_DENTRY_CACHE_COUNT];
-                    /*Dentry Cache Hash Table.*/
-static RCULock vfsDentryCacheRCU; /*For reading.*/
-static SpinLock vfsDentryCacheLock; /*For writing.*/
+
+typedef struct VFSDentryTable{
+   HashListHead *buckets;
+   u64 mask;
+   u8 order;
+   RCUHead rcu;
+} VFSDentryTable;
+
+static SlabCache *vfsDentryCache; /*kfree finds them by the pages,so kfree frees them.*/
+static SlabCache *vfsINodeCache;
+static SlabCache *vfsFileCache;
+static SlabCache *vfsMountCache;
+
+static VFSDentryTable *vfsDentryTable; /*Dentry Cache Hash Table.*/
+static SpinLock vfsDentryLocks[VFS_DENTRY_LOCK_COUNT];
+           /*For writing,readers use RCU.*/
+static volatile u64 vfsDentrySequence; /*Odd while resizing.*/
+static AtomicType vfsDentryCount;
+static AtomicType vfsDentryResizing;
+static volatile u64 vfsMountSequence; /*Odd while the mounts are changing.*/
+
+static ListHead vfsUnusedDentries; /*Nobody uses them,the oldest is the first.*/
+static u64 vfsUnusedCount;
+static SpinLock vfsUnusedLock;
+
+static ListHead vfsNegativeDentries; /*The LRU list,the oldest is the first.*/
+static u32 vfsNegativeCount;
+static u64 vfsNegativeGeneration; /*Changed when all of them are pruned.*/
+static SpinLock vfsNegativeLock;
+
+static int __vfsLookUpClear(VFSDentry *dentry);
+static int vfsLookUpClear(VFSDentry *dentry);
+static VFSDentry *__vfsDentryCacheLookUp(VFSDentry *parent,u64 hash,
+                     const char *s,u64 length);
 
 static int getFileNameFromPath(UserSpace(const char) **path,unsigned long n,unsigned char *last,
                         char *filename)
@@ -82,36 +126,136 @@ static u64 vfsHashName(const char *name,u64 *phash)
 }
 
 static u64 __vfsHashDentry(VFSDentry *parent,u64 hash)
-{
+{ /*Don't mask it,the table may be resized.*/
    hash += (u64)parent / (1 << 7);
    hash += hash >> 32;
-   hash &= VFS_DENTRY_CACHE_MASK; /*Mask the hash number.*/
+   hash ^= hash >> 16;
    return hash;
 }
 
+static VFSDentryTable *vfsCreateDentryTable(u8 order)
+{
+   VFSDentryTable *table = kmalloc(sizeof(VFSDentryTable));
+   if(unlikely(!table))
+      return 0;
+   PhysicsPage *page = allocPages(order);
+   if(unlikely(!page))
+      return (kfree(table),(VFSDentryTable *)0);
+   table->buckets = getPhysicsPageAddress(page);
+   table->mask = (PAGE_SIZE << order) / sizeof(HashListHead) - 1;
+   table->order = order;
+   for(u64 i = 0;i <= table->mask;++i)
+      initHashListHead(&table->buckets[i]);
+   return table;
+}
+
+static int vfsFreeDentryTable(void *data)
+{
+   VFSDentryTable *table = data;
+   freePages(getPhysicsPage(table->buckets),table->order);
+   return kfree(table);
+}
+
+static int vfsLockDentryCache(void)
+{
+   for(int i = 0;i < VFS_DENTRY_LOCK_COUNT;++i)
+      lockSpinLock(&vfsDentryLocks[i]);
+   return 0;
+}
+
+static int vfsUnlockDentryCache(void)
+{
+   for(int i = VFS_DENTRY_LOCK_COUNT - 1;i >= 0;--i)
+      unlockSpinLock(&vfsDentryLocks[i]);
+   return 0;
+}
+
+static int vfsGrowDentryCache(void)
+{
+   VFSDentryTable *old = vfsDentryTable,*new;
+   if(atomicCompareExchange(&vfsDentryResizing,0,1) != 0)
+      return 0; /*Someone is resizing it.*/
+   if(old != vfsDentryTable || old->order >= VFS_DENTRY_ORDER_MAX)
+      goto out;
+   if(!(new = vfsCreateDentryTable(old->order + 1)))
+      goto out; /*No memory,just use the old one.*/
+
+   vfsLockDentryCache();
+   ++vfsDentrySequence; /*Readers which miss must look up again.*/
+   asm volatile("":::"memory");
+   for(u64 i = 0;i <= old->mask;++i)
+   {
+      HashListNode *node;
+      while((node = old->buckets[i].first))
+      {
+         VFSDentry *dentry = hashListEntry(node,VFSDentry,node);
+         u64 hash = __vfsHashDentry(dentry->parent,dentry->hash);
+         hashListDelete(node);
+         hashListHeadAddRCU(node,&new->buckets[hash & new->mask]);
+      }
+   }
+   *(VFSDentryTable *volatile *)&vfsDentryTable = new;
+   asm volatile("":::"memory");
+   ++vfsDentrySequence;
+   vfsUnlockDentryCache();
+
+   callRCU(&old->rcu,&vfsFreeDentryTable,old);
+out:
+   atomicSet(&vfsDentryResizing,0);
+   return 0;
+}
+
 static int vfsHashDentry(VFSDentry *dentry)
 {
    u64 hash = __vfsHashDentry(dentry->parent,dentry->hash);
-   lockSpinLock(&vfsDentryCacheLock);
-   hashListHeadAdd(&dentry->node,&vfsDentryCache[hash]); /*Add to the dentry cache.*/
-   unlockSpinLock(&vfsDentryCacheLock);
+   SpinLock *lock = &vfsDentryLocks[hash & VFS_DENTRY_LOCK_MASK];
+   lockSpinLock(lock);
+   hashListHeadAddRCU(&dentry->node,&vfsDentryTable->buckets[hash & vfsDentryTable->mask]);
+               /*Add to the dentry cache.*/
+   unlockSpinLock(lock);
+   if((u64)atomicAddRet(&vfsDentryCount,1) > (vfsDentryTable->mask + 1) * 2)
+      vfsGrowDentryCache(); /*Keep the chains short.*/
    return 0;
 }
 
 static int vfsUnhashDentry(VFSDentry *dentry)
 {
-   lockSpinLock(&vfsDentryCacheLock);
-   hashListDelete(&dentry->node);  /*Delete from the dentry cache.*/
-   unlockSpinLock(&vfsDentryCacheLock);
+   u64 hash = __vfsHashDentry(dentry->parent,dentry->hash);
+   SpinLock *lock = &vfsDentryLocks[hash & VFS_DENTRY_LOCK_MASK];
+   lockSpinLock(lock);
+   if(dentry->node.pprev && (atomicAdd(&vfsDentryCount,-1) || 1))
+      hashListDelete(&dentry->node);  /*Delete from the dentry cache.*/
+   dentry->node.pprev = 0; /*Zero if it was invalidated.*/
+   unlockSpinLock(lock);
+   return 0;
+}
+
+static int vfsSetDentryName(VFSDentry *dentry,const char *name,u64 length)
+{
+   char *buf = dentry->shortName;
+   if(length >= sizeof(dentry->shortName) && !(buf = kmalloc(length + 1)))
+      return -ENOMEM; /*Only long names need kmalloc.*/
+   memcpy(buf,name,length);
+   buf[length] = '\0';
+   dentry->name = buf;
+   dentry->length = length;
    return 0;
 }
 
+static void vfsConstructINode(void *obj)
+{ /*The inodes are freed with the semaphores released and the radix trees empty.*/
+   VFSINode *inode = obj;
+   initSemaphore(&inode->semaphore);
+   initRadixTreeRoot(&inode->cache.radix);
+   inode->cache.inode = inode;
+}
+
 static VFSDentry *createDentry(void)
 {
-   VFSDentry *dentry = (VFSDentry *)kmalloc(sizeof(VFSDentry));
+   VFSDentry *dentry = (VFSDentry *)allocByCache(vfsDentryCache);
    if(unlikely(!dentry)) /*No memory.*/
       return 0;
-   dentry->inode = (VFSINode *)kmalloc(sizeof(VFSINode));
+   dentry->inode = (VFSINode *)allocByCache(vfsINodeCache);
    if(unlikely(!dentry->inode))
    {
       kfree(dentry);
@@ -120,19 +264,27 @@ static VFSDentry *createDentry(void)
    initHashListNode(&dentry->node);
    atomicSet(&dentry->ref,1); /*Reference count.*/
    dentry->name = 0;
+   dentry->length = 0;
    dentry->mnt = 0;
    dentry->mounted = 0;
-   initSemaphore(&dentry->inode->semaphore);
-   initRadixTreeRoot(&dentry->inode->cache.radix);
-   dentry->inode->cache.inode = dentry->inode;
+   atomicSet(&dentry->mounting,0);
+   dentry->negative = 0;
+   initList(&dentry->lru);
+   dentry->inode->operation = 0;
+   dentry->inode->data = 0;
+   dentry->inode->pipe = 0;
+   dentry->inode->ino = 0;
    return dentry;
 }
 
 static int __destoryDentry(void *data)
 {
    VFSDentry *dentry = data;
+   VFSINode *inode = dentry->inode;
+   if(inode->operation && inode->operation->release)
+      (*inode->operation->release)(inode); /*Free the private data.*/
    destoryRadixTreeRoot(&dentry->inode->cache.radix);
-   if(dentry->name)
+   if(dentry->name && dentry->name != dentry->shortName)
       kfree(dentry->name);
    kfree(dentry->inode);
    return kfree(dentry); /*Free them.*/
@@ -151,12 +303,105 @@ static int destoryDentry(VFSDentry *dentry)
       vfsUnhashDentry(dentry); /*Unhash.*/
    else
       return __destoryDentry(dentry);
-   return addRCUCallback(&vfsDentryCacheRCU,&__destoryDentry,dentry);
+   return callRCU(&dentry->rcu,&__destoryDentry,dentry);
+}
+
+static int vfsCacheNegativeDentry(VFSDentry *parent,VFSDentry *new,
+                  const char *filename,u64 length,u64 hash,u64 generation)
+{ /*The caller must hold parent and parent->inode->semaphore.*/
+   if(unlikely(vfsSetDentryName(new,filename,length)))
+      return -ENOMEM;
+   new->hash = hash;
+   new->parent = parent;
+   new->mnt = parent->mnt;
+   new->negative = VFS_NEGATIVE_CACHED;
+   new->inode->mode = 0;
+   new->inode->part = parent->inode->part;
+   atomicSet(&new->ref,0); /*Only the LRU list uses it.*/
+
+   lockSpinLock(&vfsNegativeLock);
+   if(generation != vfsNegativeGeneration)
+   { /*Pruned while we were looking it up,the file may be created.*/
+      unlockSpinLock(&vfsNegativeLock);
+      return -EAGAIN;
+   }
+   listAddTail(&new->lru,&vfsNegativeDentries);
+   ++vfsNegativeCount;
+   atomicAdd(&parent->ref,1); /*It holds its parent.*/
+   vfsHashDentry(new);
+   unlockSpinLock(&vfsNegativeLock);
+   return 0;
+}
+
+static int vfsTouchNegativeDentry(VFSDentry *dentry)
+{
+   lockSpinLock(&vfsNegativeLock);
+   if(dentry->negative == VFS_NEGATIVE_CACHED)
+   { /*Move it to the end of the LRU list.*/
+      listDelete(&dentry->lru);
+      listAddTail(&dentry->lru,&vfsNegativeDentries);
+   }
+   unlockSpinLock(&vfsNegativeLock);
+   return 0;
+}
+
+static int vfsForgetNegativeDentry(VFSDentry *parent,u64 hash,
+                  const char *name,u64 length)
+{ /*The file is created,the caller holds parent->inode->semaphore.*/
+   VFSDentry *dentry;
+   rcuReadLock();
+   dentry = __vfsDentryCacheLookUp(parent,hash,name,length);
+   if(dentry && !dentry->negative)
+      dentry = 0;
+   lockSpinLock(&vfsNegativeLock);
+   if(dentry && dentry->negative == VFS_NEGATIVE_CACHED)
+   { /*Take it from the LRU list,the shrinker can't see it now.*/
+      listDelete(&dentry->lru);
+      dentry->negative = VFS_NEGATIVE_EVICTED;
+      --vfsNegativeCount;
+   }else
+      dentry = 0; /*The shrinker is freeing it.*/
+   unlockSpinLock(&vfsNegativeLock);
+   if(dentry)
+      destoryDentry(dentry);
+   rcuReadUnlock();
+   if(dentry)
+      __vfsLookUpClear(parent); /*Put the reference it held.*/
+   return 0;
+}
+
+static int vfsShrinkNegativeDentries(u32 max)
+{
+   ListHead victims;
+   initList(&victims);
+   lockSpinLock(&vfsNegativeLock);
+   if(max == 0)
+      ++vfsNegativeGeneration;
+   while(vfsNegativeCount > max)
+   {
+      VFSDentry *dentry =
+         listEntry(vfsNegativeDentries.next,VFSDentry,lru);
+      listDelete(&dentry->lru);
+      listAddTail(&dentry->lru,&victims);
+      dentry->negative = VFS_NEGATIVE_EVICTED;
+      --vfsNegativeCount;
+   }
+   unlockSpinLock(&vfsNegativeLock);
+
+   while(!listEmpty(&victims))
+   {
+      VFSDentry *dentry = listEntry(victims.next,VFSDentry,lru);
+      VFSDentry *parent = dentry->parent;
+      listDelete(&dentry->lru);
+      destoryDentry(dentry); /*Readers may still see it,free it by RCU.*/
+      __vfsLookUpClear(parent); /*Put the reference of its parent.*/
+   }
+   return 0;
 }
 
 static VFSFile *createFile(VFSDentry *dentry)
 {
-   VFSFile *retval = kmalloc(sizeof(*retval));
+   VFSFile *retval = allocByCache(vfsFileCache);
    if(unlikely(!retval))
       return 0;
    atomicSet(&retval->ref,1);
@@ -168,7 +413,7 @@ static VFSFile *createFile(VFSDentry *dentry)
 static FileSystemMount *createFileSystemMount(void)
 {
    FileSystemMount *mnt = 
-      (FileSystemMount *)kmalloc(sizeof(FileSystemMount));
+      (FileSystemMount *)allocByCache(vfsMountCache);
    if(unlikely(!mnt)) /*No memory.*/
       return 0;
    mnt->root = createDentry();
@@ -199,111 +444,261 @@ static int destoryFileSystemMount(FileSystemMount *mnt)
    return kfree(mnt);
 }
 
-static VFSDentry *vfsDentryCacheLookUp(VFSDentry *parent,u64 hash,const char *s,u64 length)
-{
-   int old;
-   VFSDentry *retval = 0;
-   FileSystemMount *mnt = 0;
-   u64 dhash = __vfsHashDentry(parent,hash);
-   lockRCUReadLock(&vfsDentryCacheRCU);
-   for(HashListNode *node = vfsDentryCache[dhash].first;node;node = node->next)
-   {    /*Look for the dentry cache.*/
-      VFSDentry *dentry = hashListEntry(node,VFSDentry,node);
-      if(dentry->hash == hash && memcmp(dentry->name,s,length) == 0)
-      {
-         do {
-            old = atomicRead(&dentry->ref);
-            if(old < 0) /*The dentry is destorying,discard it!*/
-               break;
-         } while(atomicCompareExchange(&dentry->ref,old,old + 1) != old);
-         if(old < 0)
-            continue; /*Destorying.*/
-         if(old & (1 << 16)) /*Mounted?*/
-            while((mnt = *(FileSystemMount *volatile *)&dentry->mounted) == 0)
-               ; /*Wait for the dentry->mounted set..*/
-         if(mnt)
-            dentry = mnt->root;
-         retval = dentry;
+static int vfsParkDentry(VFSDentry *dentry)
+{ /*Nobody uses it,keep it in the dentry cache.*/
+   if(!dentry->node.pprev || hashListEmpty(&dentry->node))
+      return -EINVAL; /*Not in the dentry cache.*/
+   lockSpinLock(&vfsUnusedLock);
+   if(listEmpty(&dentry->lru))
+      ++vfsUnusedCount;
+   else
+      listDelete(&dentry->lru);
+   listAddTail(&dentry->lru,&vfsUnusedDentries);
+   unlockSpinLock(&vfsUnusedLock);
+   return 0;
+}
+
+static int vfsReviveDentry(VFSDentry *dentry)
+{ /*Its reference count was zero,and we have got it again.*/
+   lockSpinLock(&vfsUnusedLock);
+   if(!listEmpty(&dentry->lru) && (--vfsUnusedCount || 1))
+      listDelete(&dentry->lru);
+   unlockSpinLock(&vfsUnusedLock);
+   return 0;
+}
+
+static int __vfsLookUpClear(VFSDentry *dentry)
+{ /*Put a reference of the dentry.*/
+   VFSDentry *parent;
+   while(dentry && atomicAddRet(&dentry->ref,-1) == 0)
+   {
+      if(!(parent = dentry->parent))
+      { /*The root dentry of a mount,the mount frees it.*/
+        /*The anonymous ones (pipes) have no mount,free them here.*/
+         if(!dentry->mnt && hashListEmpty(&dentry->node))
+            destoryDentry(dentry);
          break;
       }
+      if(!vfsParkDentry(dentry))
+         break; /*Keep it unused,it still holds its parent.*/
+      destoryDentry(dentry);
+      dentry = parent; /*Put the reference it held.*/
    }
-   unlockRCUReadLock(&vfsDentryCacheRCU);
-   return retval;
+   return 0;
 }
 
-static int vfsLookUpClear(VFSDentry *dentry)
+static int vfsTrimUnusedDentries(u64 max,u64 batch)
 {
-   VFSDentry *parent;
-   while(dentry)
+   while(batch--)
    {
-      while((parent = dentry->parent))
+      lockSpinLock(&vfsUnusedLock);
+      if(vfsUnusedCount <= max)
       {
-         if(atomicAddRet(&dentry->ref,-1) == 0)
-         { /*If reference count is zero,destory it.*/
-            destoryDentry(dentry);
-            dentry = parent;
-            continue;
-         }
-         dentry = parent;
+         unlockSpinLock(&vfsUnusedLock);
+         break;
       }
+      VFSDentry *dentry = listEntry(vfsUnusedDentries.next,VFSDentry,lru);
+      VFSDentry *parent = dentry->parent;
+      listDelete(&dentry->lru);
+      --vfsUnusedCount;
+      unlockSpinLock(&vfsUnusedLock);
+      if(destoryDentry(dentry))
+         continue; /*It is used again.*/
+      __vfsLookUpClear(parent); /*Its parent may become unused.*/
+   }
+   return 0;
+}
 
-      VFSDentry *point;
-      if(dentry->mnt)
-         point = dentry->mnt->point;
-      else
-         point = dentry;
+static u64 vfsUnusedLimit(void)
+{
+   u64 total = getPhysicsPageCount();
+   if(getFreePhysicsPageCount() < total / 32)
+      return VFS_UNUSED_MIN; /*Memory is low,give back the memory.*/
+   return total; /*At most one unused dentry per page.*/
+}
 
-      atomicAdd(&point->ref,-1); /*It should never be 0.*/
-      dentry = point->parent;
+static int vfsLookUpClear(VFSDentry *dentry)
+{
+   __vfsLookUpClear(dentry);
+   return vfsTrimUnusedDentries(vfsUnusedLimit(),VFS_UNUSED_BATCH);
+}
+
+static VFSDentry *vfsLookUpDentry(VFSDentry *dentry)
+{ /*Get a reference of the dentry,its parents are held by it.*/
+   atomicAdd(&dentry->ref,1);
+   return dentry;
+}
+
+static VFSDentry *__vfsDentryCacheLookUp(VFSDentry *parent,u64 hash,
+                     const char *s,u64 length)
+{ /*The caller must be in a RCU read-side section.*/
+   u64 dhash = __vfsHashDentry(parent,hash);
+   VFSDentryTable *table = *(VFSDentryTable *volatile *)&vfsDentryTable;
+   for(HashListNode *node = table->buckets[dhash & table->mask].first;node;
+            node = *(HashListNode *volatile *)&node->next)
+   {    /*Look for the dentry cache.*/
+      VFSDentry *dentry = hashListEntry(node,VFSDentry,node);
+      if(dentry->hash != hash || dentry->parent != parent ||
+         dentry->length != length || memcmp(dentry->name,s,length))
+         continue;
+      if(atomicRead(&dentry->ref) < 0)
+         continue; /*Destorying.*/
+      return dentry;
    }
    return 0;
 }
 
-static VFSDentry *vfsLookUpDentry(VFSDentry *dentry)
-{
-   VFSDentry *child = dentry,*parent;
-   while(child)
+static VFSDentry *vfsDentryCacheLookUp(VFSDentry *parent,u64 hash,const char *s,u64 length)
+{ /*The caller must hold parent.*/
+   int old;
+   VFSDentry *retval,*revived;
+   FileSystemMount *mnt;
+   u64 sequence;
+retry:
+   retval = revived = 0;
+   mnt = 0;
+   while((sequence = vfsDentrySequence) & 1)
+      asm volatile("pause"); /*Resizing.*/
+   asm volatile("":::"memory");
+   rcuReadLock();
+   VFSDentry *dentry = __vfsDentryCacheLookUp(parent,hash,s,length);
+   if(dentry && dentry->negative)
+   { /*We know it doesn't exist.*/
+      vfsTouchNegativeDentry(dentry);
+      retval = (VFSDentry *)makeErrorPointer(-ENOENT);
+   }else if(dentry)
    {
-      while((parent = child->parent))
+      do {
+         old = atomicRead(&dentry->ref);
+         if(old < 0) /*The dentry is destorying,discard it!*/
+            break;
+      } while(atomicCompareExchange(&dentry->ref,old,old + 1) != old);
+      if(old == 0)
+         revived = dentry;
+      if(old >= 0 && atomicRead(&dentry->mounting)) /*Mounted?*/
+         while((mnt = *(FileSystemMount *volatile *)&dentry->mounted) == 0
+               && atomicRead(&dentry->mounting))
+            ; /*Wait for the dentry->mounted set,or for doMount to give up.*/
+      if(mnt)
+      { /*The mount holds the mount point,hold its root instead.*/
+         retval = vfsLookUpDentry(mnt->root);
+         atomicAdd(&dentry->ref,-1);
+      }else if(old >= 0)
+         retval = dentry;
+   }
+   rcuReadUnlock();
+   asm volatile("":::"memory");
+   if(revived)
+      vfsReviveDentry(revived);
+   if(!retval && sequence != vfsDentrySequence)
+      goto retry; /*The table was resized,we may miss it.*/
+   return retval;
+}
+
+static VFSDentry *vfsLookUpRCU(VFSDentry *base,UserSpace(const char) *path)
+{ /*Look up the path without touching the reference counts,*/
+  /*only the last dentry is held.Return -EAGAIN to use vfsLookUp.*/
+   Task *current = getCurrentTask();
+   VFSDentry *ret,*revived = 0;
+   FileSystemMount *mnt;
+   char buf[VFS_RCU_PATH_MAX];
+   long size = strncpyUser1(buf,path,sizeof(buf));
+   u64 sequence,hash;
+   int old;
+   if(size <= 1 || size >= sizeof(buf))
+      return makeErrorPointer(-EAGAIN); /*Too long or fault.*/
+   if((sequence = vfsMountSequence) & 1)
+      return makeErrorPointer(-EAGAIN); /*Mounting.*/
+   asm volatile("":::"memory");
+
+   rcuReadLock();
+   ret = (buf[0] == '/') ? current->fs->root : (base ? base : current->fs->pwd);
+   if(!ret)
+      goto again;
+   for(char *name = buf,*end;*name;name = end)
+   {
+      while(*name == '/')
+         ++name;
+      if(!*name)
+         break;
+      for(end = name;*end && *end != '/';++end)
+         ;
+      if(*end)
+         *end++ = '\0'; /*Split the path.*/
+      if(!S_ISDIR(ret->inode->mode))
+         goto notFound;
+      if(name[0] == '.' && name[1] == '\0')
+         continue;
+      if(name[0] == '.' && name[1] == '.' && name[2] == '\0')
       {
-         atomicAdd(&child->ref,1); /*Add the reference count.*/
-         child = parent;
+         if(ret->parent)
+            ret = ret->parent;
+         else if(ret->mnt->point->parent && ret != current->fs->root)
+            ret = ret->mnt->point->parent; /*Leave this mount.*/
+         continue;
       }
-      
-      VFSDentry *point;
-      if(dentry->mnt)
-         point = child->mnt->point;
-      else
-         point = child;
-      
-      atomicAdd(&point->ref,1); /*Add the reference count,too!*/
-      child = point->parent;
+      u64 length = vfsHashName(name,&hash);
+      if(length > VFS_NAME_MAX)
+         goto again;
+      VFSDentry *dentry = __vfsDentryCacheLookUp(ret,hash,name,length);
+      if(!dentry)
+         goto again; /*Not in the dentry cache,look it up from the disk.*/
+      if(dentry->negative)
+         goto notFound;
+      if((mnt = *(FileSystemMount *volatile *)&dentry->mounted))
+         dentry = mnt->root; /*Mounted,vfsMountSequence checks it at last.*/
+      ret = dentry;
    }
-   return dentry;
+
+   do { /*Hold the last dentry.*/
+      old = atomicRead(&ret->ref);
+      if(old < 0)
+         goto again; /*Destorying.*/
+   } while(atomicCompareExchange(&ret->ref,old,old + 1) != old);
+   if(old == 0)
+      revived = ret;
+   asm volatile("":::"memory");
+   if(sequence != vfsMountSequence || (ret->parent && !ret->node.pprev))
+   { /*The mounts were changed or the dentry was invalidated.*/
+      __vfsLookUpClear(ret); /*Put it before doUMount frees it.*/
+      goto again;
+   }
+   rcuReadUnlock();
+   if(revived)
+      vfsReviveDentry(revived);
+   return ret;
+notFound:
+   rcuReadUnlock();
+   return makeErrorPointer(-ENOENT);
+again:
+   rcuReadUnlock();
+   return makeErrorPointer(-EAGAIN);
 }
 
-static VFSDentry *vfsLookUp(UserSpace(const char) *path)
-{
+static int vfsPruneDentries(void)
+{ /*Free all of negative and unused dentries.*/
+   vfsShrinkNegativeDentries(0);
+   return vfsTrimUnusedDentries(0,~0ul);
+}
+
+static VFSDentry *vfsLookUpAt(VFSDentry *base,UserSpace(const char) *path)
+{ /*The relative paths start from base,or the current directory if it is 0.*/
    Task *current = getCurrentTask();
    VFSDentry *ret,*new;
-   u64 hash;
-   u8 error = 0;
+   u64 hash,generation;
+   int error = 0;
    unsigned char last;
-   char filename[32];
+   char filename[VFS_NAME_MAX + 1];
    if(getUser8Safe(path,(unsigned char *)&filename[0]))
       return 0;
-
-   switch(filename[0])
-   {
-   case '\0':
+   if(filename[0] == '\0')
       return 0;
-   case '/':
-      ret = getCurrentTask()->fs->root;
-      break;
-   default:
-      ret = getCurrentTask()->fs->pwd;
-      break;
-   }
+
+   ret = vfsLookUpRCU(base,path); /*Try it first,it is fast.*/
+   if(!isErrorPointer(ret) || getPointerError(ret) != -EAGAIN)
+      return ret;
+
+   ret = (filename[0] == '/') ? current->fs->root : (base ? base : current->fs->pwd);
    if(!ret)
       return makeErrorPointer(-ENOENT);
    ret = vfsLookUpDentry(ret);
@@ -311,12 +706,12 @@ static VFSDentry *vfsLookUp(UserSpace(const char) *path)
    for(;;)
    {
       if((error = getFileNameFromPath(&path,sizeof(filename),&last,filename)) < 0)
-         return makeErrorPointer(error);
+         return (vfsLookUpClear(ret),makeErrorPointer(error));
       if(filename[0] == 0)
          return ret;
       if(last)
          break;
-      int pathLength = vfsHashName(filename,&hash) + 1;
+      u64 length = vfsHashName(filename,&hash);
       if(filename[0] == '.' && filename[1] == '\0')
          goto next;
       if(filename[0] == '.' && filename[1] == '.' && filename[2] == '\0')
@@ -328,53 +723,55 @@ static VFSDentry *vfsLookUp(UserSpace(const char) *path)
            /*2. The 'dentry' is the root dentry for a FileSystemMount.*/
             if(!ret->mnt->point->parent || ret == current->fs->root)  
                goto next; /*The first possiblity,just goto next.*/
-            FileSystemMount *mnt = ret->mnt;
-            atomicAdd(&mnt->point->ref,-1); /*It should never be zero.*/
-            ret = mnt->point->parent;
-            goto next;
-         }
-         if(atomicAddRet(&ret->ref,-1) == 0)
-         { /*Destory the dentry if the reference count is zero.*/
-            destoryDentry(ret);
-            ret = parent;
-            goto next;
+            parent = ret->mnt->point->parent;
          }
+         vfsLookUpDentry(parent);
+         __vfsLookUpClear(ret);
          ret = parent;
          goto next;
       }
-      VFSDentry *dentry = vfsDentryCacheLookUp(ret,hash,filename,pathLength);
+      VFSDentry *dentry = vfsDentryCacheLookUp(ret,hash,filename,length);
+      if(isErrorPointer(dentry))
+         goto failed; /*A negative dentry.*/
       if(dentry)
       {
+         __vfsLookUpClear(ret); /*The dentry holds its parent.*/
          ret = dentry;
          if(S_ISDIR(ret->inode->mode))
             goto next;
-         ret = dentry;
          goto failed;
       }
       downSemaphore(&ret->inode->semaphore);
-      dentry = vfsDentryCacheLookUp(ret,hash,filename,pathLength);
+      dentry = vfsDentryCacheLookUp(ret,hash,filename,length);
                 /*Look for the dentry cache again.*/
+      if(isErrorPointer(dentry) && (upSemaphore(&ret->inode->semaphore) || 1))
+         goto failed;
       if(likely(!dentry))
       {
+         generation = *(volatile u64 *)&vfsNegativeGeneration;
          new = createDentry();
          if(unlikely(!new) && (upSemaphore(&ret->inode->semaphore) || 1))
             goto failed;
          error = (*ret->inode->operation->lookUp)(ret,new,filename);
+         if(error == -ENOENT &&
+            !vfsCacheNegativeDentry(ret,new,filename,length,hash,generation) &&
+            (upSemaphore(&ret->inode->semaphore) || 1))
+            goto negative; /*Remember that it doesn't exist.*/
          if((error || !S_ISDIR(new->inode->mode)) && (upSemaphore(&ret->inode->semaphore) || 1)) 
                                                     /*Try to look it up in disk.*/
             goto failedWithNew;
          new->parent = ret;
          new->mnt = ret->mnt;
-         char *name = (char *)kmalloc(pathLength + 1);
-         if(unlikely(!name) && (upSemaphore(&ret->inode->semaphore) || 1)) /*If no memory for name,exit.*/
+         if(unlikely(vfsSetDentryName(new,filename,length)) &&
+            (upSemaphore(&ret->inode->semaphore) || 1)) /*If no memory for name,exit.*/
             goto failedWithNew;
-         memcpy((void *)name,(const void *)filename,pathLength + 1);
-         new->name = name;
          new->hash = hash; /*The hash number.*/
+         vfsLookUpDentry(ret); /*The new dentry holds its parent.*/
          vfsHashDentry(new);
          dentry = new;
       }
       upSemaphore(&ret->inode->semaphore);
+      __vfsLookUpClear(ret);
       ret = dentry;
 next:;
    }
@@ -388,47 +785,53 @@ next:;
       {
          if(!ret->mnt->point->parent || ret == current->fs->root) /*The root dentry.*/
             return ret;
-         atomicAdd(&ret->mnt->point->ref,-1);
-         return ret->mnt->point->parent;
-      }
-      if(atomicAddRet(&ret->ref,-1) == 0)
-      {
-         destoryDentry(ret);
-         return parent;
+         parent = ret->mnt->point->parent;
       }
+      vfsLookUpDentry(parent);
+      vfsLookUpClear(ret);
       return parent;
    }
-   int pathLength = vfsHashName(filename,&hash) + 1;
-   VFSDentry *dentry = vfsDentryCacheLookUp(ret,hash,filename,pathLength);
-   if(dentry && (ret = dentry))
+   u64 length = vfsHashName(filename,&hash);
+   VFSDentry *dentry = vfsDentryCacheLookUp(ret,hash,filename,length);
+   if(isErrorPointer(dentry))
+      goto failed; /*A negative dentry.*/
+   if(dentry)
       goto found; /*Found!! Just return.*/
    downSemaphore(&ret->inode->semaphore);
-   dentry = vfsDentryCacheLookUp(ret,hash,filename,pathLength);
+   dentry = vfsDentryCacheLookUp(ret,hash,filename,length);
                         /*Look for the dentry cache again.*/
+   if(isErrorPointer(dentry) && (upSemaphore(&ret->inode->semaphore) || 1))
+      goto failed;
    if(likely(!dentry))
    {
+      generation = *(volatile u64 *)&vfsNegativeGeneration;
       new = createDentry(); /*Alloc a new dentry.*/
       if(unlikely(!new) && (upSemaphore(&ret->inode->semaphore) || 1))
          goto failed;
       error = (*ret->inode->operation->lookUp)(ret,new,filename);
+      if(error == -ENOENT &&
+         !vfsCacheNegativeDentry(ret,new,filename,length,hash,generation) &&
+         (upSemaphore(&ret->inode->semaphore) || 1))
+         goto negative; /*Remember that it doesn't exist.*/
       if(error && (upSemaphore(&ret->inode->semaphore) || 1))
          goto failedWithNew;
       new->parent = ret;
       new->mnt = ret->mnt;
-      char *name = (char *)kmalloc(pathLength);
-      if(unlikely(!name) && (upSemaphore(&ret->inode->semaphore) || 1)) 
-                                 /*Fill the name field.*/
+      if(unlikely(vfsSetDentryName(new,filename,length)) &&
+         (upSemaphore(&ret->inode->semaphore) || 1)) /*Fill the name field.*/
          goto failedWithNew;
-      memcpy((void *)name,(const void *)filename,pathLength);
-      new->name = name;
       new->hash = hash;
+      vfsLookUpDentry(ret); /*The new dentry holds its parent.*/
       vfsHashDentry(new);
       dentry = new;
    }
    upSemaphore(&ret->inode->semaphore);
-   ret = dentry;
 found:
-   return ret;
+   __vfsLookUpClear(ret); /*The dentry holds its parent.*/
+   return dentry;
+negative:
+   vfsShrinkNegativeDentries(VFS_NEGATIVE_MAX);
+   goto failed;
 failedWithNew:
    __destoryDentry(new);
 failed: /*Failed.*/
@@ -436,42 +839,208 @@ failed: /*Failed.*/
    return makeErrorPointer(-ENOENT);
 }
 
+static VFSDentry *vfsLookUp(UserSpace(const char) *path)
+{
+   return vfsLookUpAt(0,path);
+}
+
+static VFSDentry *vfsLookUpParent(UserSpace(const char) *path,char *filename,u64 *length)
+{ /*Hold the directory which has the last name of the path,*/
+  /*and copy the last name to filename.*/
+   unsigned long limit;
+   VFSDentry *dir;
+   char *buf = kmalloc(VFS_PATH_MAX),*name,*end;
+   long size;
+   if(!buf)
+      return makeErrorPointer(-ENOMEM);
+   if((size = strncpyUser1(buf,path,VFS_PATH_MAX)) < 0)
+      return (kfree(buf),makeErrorPointer(size));
+   if(size >= VFS_PATH_MAX)
+      return (kfree(buf),makeErrorPointer(-ENAMETOOLONG));
+   if(size <= 1)
+      return (kfree(buf),makeErrorPointer(-ENOENT));
+   for(end = buf + size - 1;end > buf && end[-1] == '/';)
+      *--end = '\0'; /*Skip the '/' at the end.*/
+   for(name = end;name > buf && name[-1] != '/';)
+      --name;
+   *length = end - name;
+   if(*length == 0 || (name[0] == '.' && (*length == 1 ||
+                    (name[1] == '.' && *length == 2))))
+      return (kfree(buf),makeErrorPointer(-EEXIST)); /*"/","." or "..".*/
+   if(*length > VFS_NAME_MAX)
+      return (kfree(buf),makeErrorPointer(-ENAMETOOLONG));
+   memcpy(filename,name,*length + 1);
+   if(name == buf)
+      (buf[0] = '.'),(buf[1] = '\0'); /*In the current directory.*/
+   else
+      name[(name == buf + 1) ? 0 : -1] = '\0'; /*Keep "/" for the root.*/
+
+   limit = getAddressLimit();
+   setKernelAddressLimit(); /*The path is in kernel space now.*/
+   dir = vfsLookUp(buf);
+   setAddressLimit(limit);
+   kfree(buf);
+   if(!dir)
+      return makeErrorPointer(-ENOENT);
+   if(!isErrorPointer(dir) && !S_ISDIR(dir->inode->mode))
+      return (vfsLookUpClear(dir),makeErrorPointer(-ENOTDIR));
+   return dir;
+}
+
+static VFSDentry *vfsCreateDentry(VFSDentry *dir,const char *name,u64 length,u64 type)
+{ /*The caller must hold dir and dir->inode->semaphore.*/
+  /*Type is S_IFREG,S_IFDIR or S_IFIFO.*/
+   VFSINodeOperation *operation = dir->inode->operation;
+   int (*create)(VFSDentry *dentry,VFSDentry *result,const char *name)
+      = S_ISDIR(type) ? operation->mkdir :
+        S_ISFIFO(type) ? operation->mkfifo : operation->create;
+   VFSDentry *new;
+   u64 hash;
+   int error = 0;
+   if(!create)
+      return makeErrorPointer(-EROFS);
+   vfsHashName(name,&hash);
+   new = vfsDentryCacheLookUp(dir,hash,name,length);
+   if(new && !isErrorPointer(new))
+      return (vfsLookUpClear(new),makeErrorPointer(-EEXIST));
+   if(new)
+      vfsForgetNegativeDentry(dir,hash,name,length);
+
+   if(!(new = createDentry()))
+      return makeErrorPointer(-ENOMEM);
+   if(unlikely(vfsSetDentryName(new,name,length)))
+      goto failed;
+   new->hash = hash;
+   new->parent = dir;
+   new->mnt = dir->mnt;
+   new->inode->part = dir->inode->part;
+   error = (*operation->lookUp)(dir,new,name); /*Is it on the disk?*/
+   if(error != -ENOENT && (error = error ? error : -EEXIST))
+      goto failed;
+   if((error = (*create)(dir,new,name)))
+      goto failed;
+   vfsLookUpDentry(dir); /*The new dentry holds its parent.*/
+   vfsHashDentry(new);
+   return new;
+failed:
+   __destoryDentry(new);
+   return makeErrorPointer(error ? error : -ENOMEM);
+}
+
+static VFSDentry *vfsCreate(UserSpace(const char) *path,u64 type,u8 exclusive)
+{
+   char filename[VFS_NAME_MAX + 1];
+   u64 length = 0;
+   VFSDentry *dir = vfsLookUpParent(path,filename,&length),*dentry;
+   if(isErrorPointer(dir))
+      return dir;
+   downSemaphore(&dir->inode->semaphore);
+   dentry = vfsCreateDentry(dir,filename,length,type);
+   upSemaphore(&dir->inode->semaphore);
+   vfsLookUpClear(dir);
+   if(isErrorPointer(dentry) && getPointerError(dentry) == -EEXIST && !exclusive)
+      return vfsLookUp(path); /*Just use the old one.*/
+   return dentry;
+}
+
+static int vfsRemove(UserSpace(const char) *path,u8 isDir)
+{
+   VFSDentry *dentry = vfsLookUp(path),*dir;
+   int error;
+   if(!dentry)
+      return -ENOENT;
+   if(isErrorPointer(dentry))
+      return getPointerError(dentry);
+   error = -EBUSY;
+   if(!(dir = dentry->parent))
+      goto out; /*The root dentry of a mount.*/
+   error = isDir ? -ENOTDIR : -EISDIR;
+   if(!S_ISDIR(dentry->inode->mode) != !isDir)
+      goto out;
+   error = -EROFS;
+   if(!dir->inode->operation->unlink)
+      goto out;
+   error = -ENOENT;
+   downSemaphore(&dir->inode->semaphore);
+   if(dentry->node.pprev && !(error = (*dir->inode->operation->unlink)(dir,dentry)))
+      vfsUnhashDentry(dentry); /*It will be freed when the last user puts it.*/
+   upSemaphore(&dir->inode->semaphore);
+out:
+   vfsLookUpClear(dentry);
+   return error;
+}
+
+static int vfsFreeFile(void *data)
+{
+   return kfree(data);
+}
+
 static int destoryFile(VFSFile *file)
 {
    vfsLookUpClear(file->dentry);
-   kfree(file);
-   return 0;
+   return callRCU(&file->rcu,&vfsFreeFile,file);
+      /*getTaskFile may still be looking at its reference count.*/
 }
 
-static int vfsFillDir64(void *__data,u8 isDir,u64 length,const char *name)
+typedef struct VFSDirBuffer{
+   u8 *buffer; /*In the kernel,copied to the user space once.*/
+   u64 used;
+   u64 size;
+   u8 full;
+} VFSDirBuffer;
+
+static int vfsFillDir64(void *data,u64 ino,u64 mode,u64 size,
+                  u64 length,const char *name)
 {
-   UserSpace(u8) *buf = ((UserSpace(u8) **)__data)[0];
-   u64 size = ((u64 *)__data)[1];
+   VFSDirBuffer *dir = data;
+   VFSDirEntry64 *entry = (VFSDirEntry64 *)(dir->buffer + dir->used);
+   u64 record = (sizeof(*entry) + length + 1 + 7) & ~7ul;
+   if(dir->used + record > dir->size)
+      return (dir->full = 1),-EINVAL; /*The buffer is full!*/
+   entry->ino = ino;
+   entry->size = size;
+   entry->length = record;
+   entry->type = (mode & S_IFMT) >> 12;
+   memcpy(entry->name,name,length);
+   entry->name[length] = '\0';
+   dir->used += record;
+   return 0;
+}
 
-   if(length + 3 >= size)
-      return -EINVAL; /*The buffer is full!*/
-   if(putUser8Safe(&buf[0],isDir))
-      return -EFAULT;
-   if(putUser8Safe(&buf[1],length))
+static int vfsFillStat(VFSDentry *dentry,UserSpace(VFSStat) *buf)
+{ /*Everything is in the inode,the file system isn't asked.*/
+   VFSINode *inode = dentry->inode;
+   VFSStat stat = {
+      .ino = inode->ino,
+      .mode = inode->mode,
+      .size = inode->size,
+      .blockSize = PAGE_SIZE,
+      .blocks = (inode->size + 511) / 512
+   };
+   if(memcpyUser0(buf,&stat,sizeof(stat)))
       return -EFAULT;
-   if(memcpyUser0((UserSpace(void) *)&buf[2],name,length))
-      return -EFAULT; /*Copy to buffer.*/
-   if(putUser8Safe(&buf[2 + length],0))
-      return -EFAULT;
-
-   size -= length + 3;
-   buf += length + 3;
-   ((u8 **)__data)[0] = buf;
-   ((u64 *)__data)[1] = size;
    return 0;
 }
 
 static int initVFS(void)
 { /*Init this list.*/
-   initSpinLock(&vfsDentryCacheLock);
-   initRCULock(&vfsDentryCacheRCU);
-   for(int i = VFS_DENTRY_CACHE_COUNT - 1;i >= 0;--i)
-      initHashListHead(&vfsDentryCache[i]);
+   vfsDentryCache = createObjectCache("dentry",sizeof(VFSDentry),0,0);
+   vfsINodeCache = createObjectCache("inode",sizeof(VFSINode),0,&vfsConstructINode);
+   vfsFileCache = createObjectCache("file",sizeof(VFSFile),0,0);
+   vfsMountCache = createObjectCache("mount",sizeof(FileSystemMount),0,0);
+   if(unlikely(!vfsDentryCache || !vfsINodeCache || !vfsFileCache || !vfsMountCache))
+      return -ENOMEM;
+   for(int i = 0;i < VFS_DENTRY_LOCK_COUNT;++i)
+      initSpinLock(&vfsDentryLocks[i]);
+   atomicSet(&vfsDentryCount,0);
+   atomicSet(&vfsDentryResizing,0);
+   vfsDentryTable = vfsCreateDentryTable(VFS_DENTRY_ORDER_MIN);
+   if(unlikely(!vfsDentryTable))
+      return -ENOMEM;
+   initSpinLock(&vfsNegativeLock);
+   initList(&vfsNegativeDentries);
+   initSpinLock(&vfsUnusedLock);
+   initList(&vfsUnusedDentries);
    return initList(&fileSystems);
 }
 
@@ -498,7 +1067,7 @@ FileSystem *lookForFileSystem(const char *name)
 BlockDevicePart *openBlockDeviceFile(const char *path)
 {
    VFSDentry *dentry = vfsLookUp(path);
-   if(!dentry)
+   if(isErrorPointer(dentry))
       return 0;
    if(!S_ISBLK(dentry->inode->mode))
       goto failed; /*Not a block device.*/
@@ -515,11 +1084,14 @@ VFSFile *openFile(const char *path,int mode)
    if((mode & O_ACCMODE) == 0) /*INVAL Access Mode.*/
       return (VFSFile *)makeErrorPointer(-EINVAL);
 
-   VFSDentry *dentry = vfsLookUp(path);
+   VFSDentry *dentry = (mode & O_CREAT) ?
+      vfsCreate(path,S_IFREG,!!(mode & O_EXCL)) : vfsLookUp(path);
+   if(!dentry)
+      return (VFSFile *)makeErrorPointer(-ENOENT);
    if(isErrorPointer(dentry))
       return (VFSFile *)dentry;
    if((mode & O_DIRECTORY) && !S_ISDIR(dentry->inode->mode))
-      return (VFSFile *)makeErrorPointer(-ENOTDIR);
+      return (vfsLookUpClear(dentry),(VFSFile *)makeErrorPointer(-ENOTDIR));
 
    VFSFile *file = createFile(dentry);
    if(unlikely(!file))
@@ -535,6 +1107,9 @@ VFSFile *openFile(const char *path,int mode)
       return (VFSFile *)makeErrorPointer(ret);
    }
    file->mode = mode; /*Set the mode.*/
+   if((mode & O_TRUNC) && (mode & O_WRONLY) && S_ISREG(dentry->inode->mode)
+      && (ret = truncateFile(file,0)))
+      return (closeFile(file),(VFSFile *)makeErrorPointer(ret));
    return file;
 }
 
@@ -547,24 +1122,134 @@ int closeFile(VFSFile *file)
    return destoryFile(file);
 }
 
+VFSDentry *createAnonymousDentry(u64 mode)
+{ /*It isn't in any file systems,the files opened by openAnonymousFile hold it.*/
+  /*It is freed when the last file is closed.*/
+   VFSDentry *dentry = createDentry();
+   if(!dentry)
+      return 0;
+   atomicSet(&dentry->ref,0);
+   dentry->parent = 0;
+   dentry->inode->mode = mode;
+   dentry->inode->size = 0;
+   dentry->inode->part = 0;
+   dentry->inode->cache.operation = 0;
+   return dentry;
+}
+
+VFSFile *openAnonymousFile(VFSDentry *dentry,VFSFileOperation *operation,
+                  void *data,int mode)
+{
+   VFSFile *file = createFile(dentry);
+   if(!file)
+      return (atomicRead(&dentry->ref) ? 0 : __destoryDentry(dentry)),(VFSFile *)0;
+   vfsLookUpDentry(dentry); /*The file holds the dentry.*/
+   file->operation = operation;
+   file->data = data;
+   file->mode = mode;
+   return file;
+}
+
 int readFile(VFSFile *file,void *buf,u64 size)
 {
+   return readFileAt(file,buf,size,&file->seek);
+}
+
+int writeFile(VFSFile *file,const void *buf,u64 size)
+{
+   return writeFileAt(file,buf,size,&file->seek);
+}
+
+int readFileAt(VFSFile *file,void *buf,u64 size,u64 *seek)
+{ /*Read at *seek,pread uses a seek which isn't file->seek.*/
    if(S_ISDIR(file->dentry->inode->mode))
       return -EISDIR;
    if(!file->operation->read)
       return -EBADFD;
-   int ret = (*file->operation->read)(file,buf,size,&file->seek);
+   int ret = (*file->operation->read)(file,buf,size,seek);
    return ret; /*Call file->operation->read.*/
 }
 
-int writeFile(VFSFile *file,const void *buf,u64 size)
+static int writeFileSync(VFSFile *file,int ret)
+{ /*Flush the data which has been written for O_SYNC.*/
+   if(ret > 0 && (file->mode & O_SYNC) && file->operation->fsync)
+   {
+      int error = (*file->operation->fsync)(file);
+      if(error)
+         return error;
+   }
+   return ret;
+}
+
+static int __writeFileAt(VFSFile *file,const void *buf,u64 size,u64 *seek)
 {
    if(S_ISDIR(file->dentry->inode->mode))
       return -EISDIR;
    if(!file->operation->write)
       return -EBADFD;
-   int ret = (*file->operation->write)(file,buf,size,&file->seek);
-   return ret;
+   return (*file->operation->write)(file,buf,size,seek);
+}
+
+int writeFileAt(VFSFile *file,const void *buf,u64 size,u64 *seek)
+{
+   return writeFileSync(file,__writeFileAt(file,buf,size,seek));
+}
+
+int pollFile(VFSFile *file)
+{
+   if(!file->operation->poll)
+      return VFS_POLL_IN | VFS_POLL_OUT; /*The regular files never wait.*/
+   return (*file->operation->poll)(file);
+}
+
+static int checkIOVector(const IOVector *vector,int count)
+{ /*The sum of the lengths must fit in the return value.*/
+   u64 total = 0;
+   for(int i = 0;i < count;++i)
+      if(vector[i].length > VFS_SPLICE_MAX ||
+            (total += vector[i].length) > VFS_SPLICE_MAX)
+         return -EINVAL;
+   return 0;
+}
+
+int readFileVector(VFSFile *file,const IOVector *vector,int count,u64 *seek)
+{
+   int retval = 0,ret;
+   if((ret = checkIOVector(vector,count)))
+      return ret;
+   for(int i = 0;i < count;++i)
+   {
+      if(!vector[i].length)
+         continue; /*Zero means a string for the ttys,skip it.*/
+      ret = readFileAt(file,vector[i].base,vector[i].length,seek);
+      if(ret < 0)
+         return retval ? retval : ret;
+      retval += ret;
+      if(ret < vector[i].length)
+         break; /*The end of file,or no more data now.*/
+   }
+   return retval;
+}
+
+int writeFileVector(VFSFile *file,const IOVector *vector,int count,u64 *seek)
+{ /*O_SYNC flushes once after all of the segments.*/
+   int retval = 0,ret;
+   if((ret = checkIOVector(vector,count)))
+      return ret;
+   for(int i = 0;i < count;++i)
+   {
+      if(!vector[i].length)
+         continue;
+      ret = __writeFileAt(file,vector[i].base,vector[i].length,seek);
+      if(ret < 0 && !retval)
+         return ret;
+      if(ret < 0)
+         break; /*Return what has been written.*/
+      retval += ret;
+      if(ret < vector[i].length)
+         break;
+   }
+   return writeFileSync(file,retval);
 }
 
 int lseekFile(VFSFile *file,s64 offset,int type)
@@ -576,131 +1261,674 @@ int lseekFile(VFSFile *file,s64 offset,int type)
    return (*file->operation->lseek)(file,offset,type);
 }
 
+int truncateFile(VFSFile *file,u64 size)
+{
+   VFSINode *inode = file->dentry->inode;
+   if(S_ISDIR(inode->mode))
+      return -EISDIR;
+   if(!(file->mode & O_WRONLY) || !S_ISREG(inode->mode))
+      return -EINVAL;
+   if(!inode->operation->truncate)
+      return -EROFS;
+   return (*inode->operation->truncate)(inode,size);
+}
+
+int syncFile(VFSFile *file)
+{
+   if(!file->operation->fsync)
+      return 0; /*Nothing is buffered.*/
+   return (*file->operation->fsync)(file);
+}
+
+int spliceFile(VFSFile *out,u64 *outSeek,VFSFile *in,u64 *inSeek,u64 count)
+{ /*Move the data without a user buffer.*/
+  /*The pages of the page cache are given to out's write directly.*/
+   VFSINode *inode = in->dentry->inode;
+   PageCacheOperation *cache = inode->cache.operation;
+   PhysicsPage *bounce = 0;
+   unsigned long limit;
+   int retval = 0;
+   if(S_ISDIR(inode->mode) || S_ISDIR(out->dentry->inode->mode))
+      return -EISDIR;
+   if(!(in->mode & O_RDONLY) || !(out->mode & O_WRONLY))
+      return -EBADF;
+   if(!in->operation->read || !out->operation->write)
+      return -EINVAL;
+   count = min(count,VFS_SPLICE_MAX);
+
+   limit = getAddressLimit();
+   setKernelAddressLimit(); /*The buffers are in kernel space.*/
+   while(count > 0)
+   {
+      u64 offset = *inSeek & (PAGE_SIZE - 1);
+      u64 length = min(count,PAGE_SIZE - offset);
+      int ret = -ENOMEM;
+      if(S_ISREG(inode->mode) && cache && cache->getPage)
+      {
+         PhysicsPage *page;
+         if(*inSeek >= inode->size)
+            break;
+         length = min(length,inode->size - *inSeek);
+         if(!(page = (*cache->getPage)(inode,*inSeek & ~(PAGE_SIZE - 1))))
+            ret = -EIO;
+         else if(out->operation->splicePage)
+         { /*Give the page to out,it doesn't copy it.*/
+            if((ret = (*out->operation->splicePage)(out,page,offset,length)) > 0)
+               *inSeek += ret,page = 0;
+         }else if((ret = (*out->operation->write)(out,
+               getPhysicsPageAddress(page) + offset,length,outSeek)) > 0)
+            *inSeek += ret;
+         page ? (*cache->putPage)(page) : 0;
+      }else if(bounce || (bounce = allocPages(0)))
+      { /*No page cache,read it into a kernel page.*/
+         void *buffer = getPhysicsPageAddress(bounce);
+         if((ret = (*in->operation->read)(in,buffer,length,inSeek)) > 0)
+         {
+            u64 done = 0;
+            length = ret;
+            do /*A pipe can't take the rest back,write all of it.*/
+               ret = (*out->operation->write)(out,buffer + done,length - done,outSeek);
+            while(ret > 0 && (done += ret) < length && !in->operation->lseek);
+            ret = done ? done : ret;
+            if(ret >= 0 && ret < length && in->operation->lseek)
+               *inSeek -= length - ret; /*Give the rest back.*/
+         }
+      }
+      if(ret <= 0)
+      {
+         retval = retval ? retval : ret;
+         break;
+      }
+      retval += ret;
+      count -= ret;
+      if(ret < length)
+         break;
+   }
+   setAddressLimit(limit);
+   if(bounce)
+      freePages(bounce,0);
+   if(retval > 0 && (out->mode & O_SYNC))
+      syncFile(out);
+   return retval;
+}
+
+static inline int testFileBit(u64 *bitmap,unsigned int fd)
+{
+   return !!(bitmap[fd / 64] & (1ul << (fd % 64)));
+}
+
+static inline int setFileBit(u64 *bitmap,unsigned int fd,int set)
+{
+   if(set)
+      bitmap[fd / 64] |= 1ul << (fd % 64);
+   else
+      bitmap[fd / 64] &= ~(1ul << (fd % 64));
+   return 0;
+}
+
+static int vfsFreeFileTable(void *data)
+{
+   return kfree(data);
+}
+
+static int initFileTable(TaskFiles *files)
+{ /*Use the table in files.*/
+   TaskFileTable *table = &files->embedded;
+   table->max = TASK_INIT_FILES;
+   table->fd = files->embeddedFd;
+   table->open = files->embeddedOpen;
+   table->closeOnExec = files->embeddedCloseOnExec;
+   memset(files->embeddedFd,0,sizeof(files->embeddedFd));
+   memset(files->embeddedOpen,0,sizeof(files->embeddedOpen));
+   memset(files->embeddedCloseOnExec,0,sizeof(files->embeddedCloseOnExec));
+   files->table = table;
+   return 0;
+}
+
+static TaskFileTable *createFileTable(unsigned int max)
+{ /*The fds and the bitmaps follow the table in one block.*/
+   u64 size = max * sizeof(VFSFile *) + max / 64 * 2 * sizeof(u64);
+   TaskFileTable *table = kmalloc(sizeof(*table) + size);
+   if(!table)
+      return 0;
+   table->max = max;
+   table->fd = (VFSFile **)(table + 1);
+   table->open = (u64 *)(table->fd + max);
+   table->closeOnExec = table->open + max / 64;
+   memset(table->fd,0,size);
+   return table;
+}
+
+static int expandFileTable(TaskFiles *files,unsigned int fd)
+{ /*Make the table have fd,the caller holds files->lock.*/
+  /*The lock is released while allocating,the caller must look at the table again.*/
+   TaskFileTable *old = files->table,*new;
+   unsigned int max = old->max;
+   if(fd >= TASK_MAX_FILES)
+      return -EMFILE;
+   while(max <= fd)
+      max *= 2;
+   unlockSpinLock(&files->lock);
+   new = createFileTable(min(max,TASK_MAX_FILES));
+   lockSpinLock(&files->lock);
+   if(!new)
+      return -ENOMEM;
+   if(files->table != old)
+      return kfree(new); /*Someone has expanded it.*/
+   memcpy(new->fd,old->fd,old->max * sizeof(VFSFile *));
+   memcpy(new->open,old->open,old->max / 8);
+   memcpy(new->closeOnExec,old->closeOnExec,old->max / 8);
+   asm volatile("":::"memory"); /*Readers must see the fds in the new table.*/
+   *(TaskFileTable *volatile *)&files->table = new;
+   if(old != &files->embedded)
+      callRCU(&old->rcu,&vfsFreeFileTable,old); /*Readers may still use it.*/
+   return 0;
+}
+
+static unsigned int findFreeFileDescriptor(TaskFileTable *table,unsigned int start)
+{ /*Return table->max if all of them are used.*/
+   for(unsigned int i = start / 64;i < table->max / 64;++i)
+   {
+      u64 free = ~table->open[i];
+      if(i == start / 64)
+         free &= ~0ul << (start % 64);
+      if(free)
+         return i * 64 + __builtin_ctzl(free);
+   }
+   return table->max;
+}
+
+static int __releaseFileDescriptor(TaskFiles *files,unsigned int fd)
+{ /*The caller holds files->lock.*/
+   TaskFileTable *table = files->table;
+   table->fd[fd] = 0;
+   setFileBit(table->open,fd,0);
+   setFileBit(table->closeOnExec,fd,0);
+   if(fd < files->next)
+      files->next = fd;
+   return 0;
+}
+
+VFSFile *getTaskFile(int fd)
+{ /*The readers use RCU,so doRead and doWrite take no locks.*/
+   TaskFiles *files = getCurrentTask()->files;
+   TaskFileTable *table;
+   VFSFile *file = 0;
+   int ref;
+   rcuReadLock();
+   table = *(TaskFileTable *volatile *)&files->table;
+   if((unsigned int)fd < table->max)
+      file = *(VFSFile *volatile *)&table->fd[fd];
+   while(file && (ref = atomicRead(&file->ref)) > 0)
+      if(atomicCompareExchange(&file->ref,ref,ref + 1) == ref)
+         goto out;
+   file = 0; /*It is being closed.*/
+out:
+   rcuReadUnlock();
+   return file;
+}
+
+int allocFileDescriptor(int mode)
+{ /*Reserve the lowest free fd.*/
+   TaskFiles *files = getCurrentTask()->files;
+   unsigned int fd;
+   int retval;
+   lockSpinLock(&files->lock);
+   while((fd = findFreeFileDescriptor(files->table,files->next)) >= files->table->max)
+      if((retval = expandFileTable(files,fd)) < 0)
+         goto out;
+   setFileBit(files->table->open,fd,1);
+   setFileBit(files->table->closeOnExec,fd,mode & O_CLOEXEC);
+   files->next = fd + 1;
+   retval = fd;
+out:
+   unlockSpinLock(&files->lock);
+   return retval;
+}
+
+int installFile(int fd,VFSFile *file)
+{ /*Give the reference of file to the reserved fd.*/
+   TaskFiles *files = getCurrentTask()->files;
+   lockSpinLock(&files->lock);
+   asm volatile("":::"memory"); /*Readers must see the initialized file.*/
+   files->table->fd[fd] = file;
+   unlockSpinLock(&files->lock);
+   return fd;
+}
+
+int releaseFileDescriptor(int fd)
+{ /*Release a fd which has been reserved but not installed.*/
+   TaskFiles *files = getCurrentTask()->files;
+   lockSpinLock(&files->lock);
+   __releaseFileDescriptor(files,fd);
+   unlockSpinLock(&files->lock);
+   return 0;
+}
+
+int closeFilesOnExec(TaskFiles *files)
+{
+   for(unsigned int fd = 0;;++fd)
+   {
+      VFSFile *file = 0;
+      lockSpinLock(&files->lock);
+      TaskFileTable *table = files->table;
+      for(;fd < table->max;++fd)
+         if(testFileBit(table->closeOnExec,fd) && (file = table->fd[fd]))
+            break;
+      if(file)
+         __releaseFileDescriptor(files,fd);
+      unlockSpinLock(&files->lock);
+      if(!file)
+         return 0;
+      closeFile(file); /*Close it without the lock,it may sleep.*/
+   }
+}
+
+static int checkFilePosition(VFSFile *file,s64 offset)
+{ /*For pread and pwrite.*/
+   if(!file->operation->lseek)
+      return -ESPIPE; /*Pipes and ttys have no positions.*/
+   if(offset < 0)
+      return -EINVAL;
+   return 0;
+}
+
 int doDup2(int fd,int new)
 {
    TaskFiles *files = getCurrentTask()->files;
-   VFSFile *old,**pnew;
-   if((unsigned int)fd >= TASK_MAX_FILES ||
-      (unsigned int)new >= TASK_MAX_FILES)
+   VFSFile *file,*old = 0;
+   int retval;
+   if((unsigned int)new >= TASK_MAX_FILES)
       return -EBADF;
-   if(fd == new)
-      return new; /*Just do nothing.*/
-   old = files->fd[fd];
-   pnew = &files->fd[new]; 
-   if(!old)
+   if(!(file = getTaskFile(fd)))
       return -EBADF;
-   if(*pnew)
-      closeFile(*pnew); /*First close the file if it is unsed.*/
-   *pnew = vfsGetFile(old); /*Dup it!*/
-   return new;
+   if(fd == new)
+      return (closeFile(file),new); /*Just do nothing.*/
+   lockSpinLock(&files->lock);
+   while(new >= files->table->max)
+      if((retval = expandFileTable(files,new)) < 0)
+         goto out;
+   retval = -EBUSY;
+   if(!files->table->fd[new] && testFileBit(files->table->open,new))
+      goto out; /*It is reserved by allocFileDescriptor.*/
+   old = files->table->fd[new];
+   setFileBit(files->table->open,new,1);
+   setFileBit(files->table->closeOnExec,new,0);
+   asm volatile("":::"memory");
+   files->table->fd[new] = file; /*Dup it!*/
+   file = 0;
+   retval = new;
+out:
+   unlockSpinLock(&files->lock);
+   if(file)
+      closeFile(file);
+   if(old)
+      closeFile(old); /*Close the file which was in new.*/
+   return retval;
 }
 
 int doDup(int fd)
 {
-   TaskFiles *files = getCurrentTask()->files;
-   VFSFile *file;
+   VFSFile *file = getTaskFile(fd);
    int new;
-   if((unsigned int)fd >= TASK_MAX_FILES)
-      return -EBADF;
-   file = files->fd[fd];
    if(!file)
       return -EBADF; /*No file.*/
-   for(new = 0;
-      fd < sizeof(files->fd) / sizeof(files->fd[0]);++fd)
-      if(files->fd[new] == 0) /*Look for a unused fd.*/
-         return doDup2(fd,new);
-   return -EMFILE;
+   if((new = allocFileDescriptor(0)) < 0)
+      return (closeFile(file),new);
+   return installFile(new,file);
 }
 
 int doOpen(UserSpace(const char) *path,int mode)
 {
-   Task *current = getCurrentTask();
-   int fd;
-   for(fd = 0;
-      fd < sizeof(current->files->fd) / sizeof(current->files->fd[0]);++fd)
-      if(current->files->fd[fd] == 0)
-         goto found; /*Found a null position in current->fd.*/
-   return -EMFILE;
-found:;
+   int fd = allocFileDescriptor(mode);
+   if(fd < 0)
+      return fd;
    VFSFile *file = openFile(path,mode);
    if(isErrorPointer(file))
-      return getPointerError(file);
-   current->files->fd[fd] = file;
-   return fd;
+      return (releaseFileDescriptor(fd),getPointerError(file));
+   return installFile(fd,file);
 }
 
 int doRead(int fd,UserSpace(void) *buf,u64 size)
 {
-   if((unsigned int)fd >= TASK_MAX_FILES)
-      return -EBADF;
-   Task *current = getCurrentTask();
-   VFSFile *file = current->files->fd[fd];
+   VFSFile *file = getTaskFile(fd);
+   int retval;
    if(!file)
       return -EBADF;
-   return readFile(file,buf,size); /*Call file->operation->read.*/
+   retval = readFile(file,buf,size); /*Call file->operation->read.*/
+   closeFile(file);
+   return retval;
 }
 
 int doWrite(int fd,UserSpace(const void) *buf,u64 size)
 {
-   if((unsigned int)fd >= TASK_MAX_FILES)
+   VFSFile *file = getTaskFile(fd);
+   int retval;
+   if(!file)
       return -EBADF;
-   Task *current = getCurrentTask();
-   VFSFile *file = current->files->fd[fd];
+   retval = writeFile(file,buf,size); /*Call file->operation->write.*/
+   closeFile(file);
+   return retval;
+}
+
+int doPRead(int fd,UserSpace(void) *buf,u64 size,s64 offset)
+{
+   VFSFile *file = getTaskFile(fd);
+   u64 seek = offset;
+   int retval;
    if(!file)
       return -EBADF;
-   return writeFile(file,buf,size); /*Call file->operation->write.*/
+   if(!(retval = checkFilePosition(file,offset)))
+      retval = readFileAt(file,buf,size,&seek); /*file->seek isn't changed.*/
+   closeFile(file);
+   return retval;
 }
 
-int doLSeek(int fd,s64 offset,int type)
+int doPWrite(int fd,UserSpace(const void) *buf,u64 size,s64 offset)
 {
-   if((unsigned int)fd >= TASK_MAX_FILES)
+   VFSFile *file = getTaskFile(fd);
+   u64 seek = offset;
+   int retval;
+   if(!file)
       return -EBADF;
-   Task *current = getCurrentTask();
-   VFSFile *file = current->files->fd[fd];
+   if(!(retval = checkFilePosition(file,offset)))
+      retval = writeFileAt(file,buf,size,&seek);
+   closeFile(file);
+   return retval;
+}
+
+static int vectorFile(VFSFile *file,UserSpace(const IOVector) *vector,int count,
+                  u64 *seek,u8 write)
+{ /*Copy the vectors to the kernel,and read or write all of them.*/
+   IOVector fast[VFS_IOVECTOR_FAST],*kernel = fast;
+   int retval;
+   if(count < 0 || count > VFS_IOVECTOR_MAX)
+      return -EINVAL;
+   if(count > VFS_IOVECTOR_FAST && !(kernel = kmalloc(count * sizeof(*kernel))))
+      return -ENOMEM;
+   if(memcpyUser1(kernel,vector,count * sizeof(*kernel)))
+      retval = -EFAULT;
+   else if(write)
+      retval = writeFileVector(file,kernel,count,seek);
+   else
+      retval = readFileVector(file,kernel,count,seek);
+   if(kernel != fast)
+      kfree(kernel);
+   return retval;
+}
+
+int doReadVector(int fd,UserSpace(const IOVector) *vector,int count)
+{
+   VFSFile *file = getTaskFile(fd);
+   int retval;
    if(!file)
       return -EBADF;
-   return lseekFile(file,offset,type);
+   retval = vectorFile(file,vector,count,&file->seek,0);
+   closeFile(file);
+   return retval;
 }
 
-int doClose(int fd)
+int doWriteVector(int fd,UserSpace(const IOVector) *vector,int count)
 {
-   if((unsigned int)fd >= TASK_MAX_FILES)
+   VFSFile *file = getTaskFile(fd);
+   int retval;
+   if(!file)
       return -EBADF;
-   Task *current = getCurrentTask();
-   VFSFile *file = current->files->fd[fd];
-   if(!file) /*If there are no files,return.*/
+   retval = vectorFile(file,vector,count,&file->seek,1);
+   closeFile(file);
+   return retval;
+}
+
+int doPReadVector(int fd,UserSpace(const IOVector) *vector,int count,s64 offset)
+{
+   VFSFile *file = getTaskFile(fd);
+   u64 seek = offset;
+   int retval;
+   if(!file)
       return -EBADF;
-   current->files->fd[fd] = 0;
-   return closeFile(file);
+   if(!(retval = checkFilePosition(file,offset)))
+      retval = vectorFile(file,vector,count,&seek,0);
+   closeFile(file);
+   return retval;
 }
 
-int doGetDents64(int fd,UserSpace(void) *data,u64 size)
+int doPWriteVector(int fd,UserSpace(const IOVector) *vector,int count,s64 offset)
 {
-   if((unsigned int)fd >= TASK_MAX_FILES)
+   VFSFile *file = getTaskFile(fd);
+   u64 seek = offset;
+   int retval;
+   if(!file)
       return -EBADF;
-   u64 __data[] = {(u64)data,size};
-   Task *current = getCurrentTask();
-   VFSFile *file = current->files->fd[fd];
+   if(!(retval = checkFilePosition(file,offset)))
+      retval = vectorFile(file,vector,count,&seek,1);
+   closeFile(file);
+   return retval;
+}
+
+int doLSeek(int fd,s64 offset,int type)
+{
+   VFSFile *file = getTaskFile(fd);
+   int retval;
    if(!file)
       return -EBADF;
+   retval = lseekFile(file,offset,type);
+   closeFile(file);
+   return retval;
+}
+
+int doClose(int fd)
+{
+   TaskFiles *files = getCurrentTask()->files;
+   VFSFile *file = 0;
+   lockSpinLock(&files->lock);
+   if((unsigned int)fd < files->table->max && (file = files->table->fd[fd]))
+      __releaseFileDescriptor(files,fd);
+   unlockSpinLock(&files->lock);
+   if(!file) /*If there are no files,return.*/
+      return -EBADF;
+   return closeFile(file); /*getTaskFile's callers may still hold it.*/
+}
+
+int doGetDents64(int fd,UserSpace(void) *data,u64 size)
+{ /*Fill at most a page of records,and copy them once.*/
+   VFSFile *file = getTaskFile(fd);
+   VFSDirBuffer dir = {.used = 0,.size = min(size,PAGE_SIZE),.full = 0};
+   PhysicsPage *page = 0;
+   int ret;
+   if(!file)
+      return -EBADF;
+   ret = -ENOTDIR;
    if(!S_ISDIR(file->dentry->inode->mode))
-      return -ENOTDIR;
-   int ret = (*file->operation->readDir)(file,&vfsFillDir64,__data);
-   if(ret < 0) /*Call the readdir function.*/
-      return 0;
-   return ((void **)__data)[0] - data;
+      goto out;
+   ret = -ENOMEM;
+   if(!(page = allocPages(0)))
+      goto out;
+   dir.buffer = getPhysicsPageAddress(page);
+   ret = (*file->operation->readDir)(file,&vfsFillDir64,&dir);
+   if(dir.used)
+      ret = memcpyUser0(data,dir.buffer,dir.used) ? -EFAULT : dir.used;
+   else if(ret >= 0)
+      ret = dir.full ? -EINVAL : 0; /*Too small for a record,or the end.*/
+out:
+   if(page)
+      freePages(page,0);
+   closeFile(file);
+   return ret;
+}
+
+int doStat(UserSpace(const char) *path,UserSpace(VFSStat) *buf)
+{
+   VFSDentry *dentry = vfsLookUp(path);
+   int retval;
+   if(!dentry)
+      return -ENOENT;
+   if(isErrorPointer(dentry))
+      return getPointerError(dentry);
+   retval = vfsFillStat(dentry,buf);
+   vfsLookUpClear(dentry);
+   return retval;
+}
+
+int doFStat(int fd,UserSpace(VFSStat) *buf)
+{
+   VFSFile *file = getTaskFile(fd);
+   int retval;
+   if(!file)
+      return -EBADF;
+   retval = vfsFillStat(file->dentry,buf);
+   closeFile(file);
+   return retval;
+}
+
+int doFStatAt(int dirfd,UserSpace(const char) *path,UserSpace(VFSStat) *buf,int flags)
+{
+   VFSFile *dir = 0;
+   VFSDentry *dentry;
+   u8 c;
+   int retval;
+   if(flags & ~AT_EMPTY_PATH)
+      return -EINVAL;
+   if(getUser8Safe(path,&c))
+      return -EFAULT;
+   if(dirfd != AT_FDCWD && !(dir = getTaskFile(dirfd)))
+      return -EBADF;
+   if(!c && (flags & AT_EMPTY_PATH))
+   { /*The dirfd itself.*/
+      retval = vfsFillStat(dir ? dir->dentry : getCurrentTask()->fs->pwd,buf);
+      goto out;
+   }
+   retval = -ENOTDIR;
+   if(dir && c != '/' && !S_ISDIR(dir->dentry->inode->mode))
+      goto out;
+   dentry = vfsLookUpAt(dir ? dir->dentry : 0,path);
+   if(!dentry || isErrorPointer(dentry))
+   {
+      retval = dentry ? getPointerError(dentry) : -ENOENT;
+      goto out;
+   }
+   retval = vfsFillStat(dentry,buf);
+   vfsLookUpClear(dentry);
+out:
+   if(dir)
+      closeFile(dir);
+   return retval;
 }
 
 int doIOControl(int fd,int cmd,UserSpace(void) *data)
 {
-   if(fd >= TASK_MAX_FILES || fd < 0)
+   VFSFile *file = getTaskFile(fd);
+   int retval = -ENOTTY;
+   if(!file)
       return -EBADF;
-   VFSFile *file = getCurrentTask()->files->fd[fd];
+   if(file->operation->ioctl)
+      retval = (*file->operation->ioctl)(file,cmd,data);
+   closeFile(file);
+   return retval;
+}
+
+int doMakeDir(UserSpace(const char) *path)
+{
+   VFSDentry *dentry = vfsCreate(path,S_IFDIR,1);
+   if(isErrorPointer(dentry))
+      return getPointerError(dentry);
+   vfsLookUpClear(dentry);
+   return 0;
+}
+
+int doMakeFifo(UserSpace(const char) *path)
+{
+   VFSDentry *dentry = vfsCreate(path,S_IFIFO,1);
+   if(isErrorPointer(dentry))
+      return getPointerError(dentry);
+   vfsLookUpClear(dentry);
+   return 0;
+}
+
+int doUnlink(UserSpace(const char) *path)
+{
+   return vfsRemove(path,0);
+}
+
+int doRemoveDir(UserSpace(const char) *path)
+{
+   return vfsRemove(path,1);
+}
+
+int doFTruncate(int fd,u64 size)
+{
+   VFSFile *file = getTaskFile(fd);
+   int retval;
    if(!file)
       return -EBADF;
-   if(!file->operation->ioctl)
-      return -ENOTTY;
-   return (*file->operation->ioctl)(file,cmd,data);
+   retval = truncateFile(file,size);
+   closeFile(file);
+   return retval;
+}
+
+int doSendFile(int out,int in,UserSpace(s64) *offset,u64 count)
+{
+   VFSFile *outFile = getTaskFile(out);
+   VFSFile *inFile = getTaskFile(in);
+   u64 seek;
+   int retval = -EBADF;
+   if(!outFile || !inFile)
+      goto out;
+   retval = -EFAULT;
+   if(!offset)
+      retval = spliceFile(outFile,&outFile->seek,inFile,&inFile->seek,count);
+   else if(!getUser64Safe(offset,&seek))
+   { /*Read from *offset,the seek of in isn't changed.*/
+      retval = spliceFile(outFile,&outFile->seek,inFile,&seek,count);
+      if(retval >= 0 && putUser64Safe(offset,seek))
+         retval = -EFAULT;
+   }
+out:
+   if(outFile)
+      closeFile(outFile);
+   if(inFile)
+      closeFile(inFile);
+   return retval;
+}
+
+int doSplice(int in,UserSpace(s64) *inOffset,int out,UserSpace(s64) *outOffset,u64 count)
+{
+   VFSFile *outFile = getTaskFile(out);
+   VFSFile *inFile = getTaskFile(in);
+   u64 inSeek,outSeek;
+   int retval = -EBADF;
+   if(!outFile || !inFile)
+      goto out;
+   inSeek = inFile->seek;
+   outSeek = outFile->seek;
+   retval = -EFAULT;
+   if(inOffset && getUser64Safe(inOffset,&inSeek))
+      goto out;
+   if(outOffset && getUser64Safe(outOffset,&outSeek))
+      goto out;
+   retval = spliceFile(outFile,&outSeek,inFile,&inSeek,count);
+   if(retval < 0)
+      goto out;
+   if(inOffset ? putUser64Safe(inOffset,inSeek) : ((inFile->seek = inSeek),0))
+      retval = -EFAULT;
+   if(outOffset ? putUser64Safe(outOffset,outSeek) : ((outFile->seek = outSeek),0))
+      retval = -EFAULT;
+out:
+   if(outFile)
+      closeFile(outFile);
+   if(inFile)
+      closeFile(inFile);
+   return retval;
+}
+
+int doFSync(int fd)
+{
+   VFSFile *file = getTaskFile(fd);
+   int retval;
+   if(!file)
+      return -EBADF;
+   retval = syncFile(file);
+   closeFile(file);
+   return retval;
 }
 
 int doChdir(UserSpace(const char) *dir)
@@ -735,27 +1963,41 @@ int doUMount(UserSpace(const char) *point)
 {
    if(point[0] == '/' && point[1] == '\0')
       return -EPERM; /*Can not umount / .*/
-   int ret,old;
-   VFSDentry *dentry = vfsLookUp(point);
+   int ret;
+   vfsPruneDentries(); /*They hold the mount.*/
+   VFSDentry *dentry = vfsLookUp(point),*root;
    FileSystemMount *mnt; /*Look for this dentry*/
-   if(isErrorPointer(dentry) && (ret = getPointerError(dentry)))
-      goto out;
+   if(isErrorPointer(dentry))
+      return getPointerError(dentry);
    ret = -EINVAL;
    if(dentry->parent)
       goto out;
-   dentry = dentry->mnt->point;
+   root = dentry;
+   dentry = root->mnt->point;
    ret = -EBUSY;
-   do {
-      old = atomicRead(&dentry->ref);
-      if(old != ((1 << 16) + 2))
-         goto out; /*If this is used,failed.*/
-   }while(atomicCompareExchange(&dentry->ref,old,old - (1 << 16)) != old);
+   ++vfsMountSequence; /*RCU path walks must check the mounts again.*/
+   asm volatile("":::"memory");
+   if(atomicCompareExchange(&dentry->mounting,1,0) != 1)
+      goto busy;
+   if(atomicRead(&dentry->ref) != 1 || atomicRead(&root->ref) != 2)
+   { /*Only the mount holds the mount point,the mount and us hold the root.*/
+      atomicSet(&dentry->mounting,1);
+      goto busy;
+   }
    mnt = dentry->mounted; /*Get mnt and set to 0.*/
    dentry->mounted = 0;
+   asm volatile("":::"memory");
+   ++vfsMountSequence;
+   synchronizeRCU(); /*Wait for the RCU path walks which may see the mount.*/
+
+   __vfsLookUpClear(root);
    destoryFileSystemMount(mnt); /*Destory it.*/
-   vfsLookUpClear(dentry);
-   vfsLookUpClear(dentry);
+   vfsLookUpClear(dentry); /*The mount held the mount point.*/
    return 0;
+busy:
+   asm volatile("":::"memory");
+   ++vfsMountSequence;
+   dentry = root;
 out:
    vfsLookUpClear(dentry);
    return ret;
@@ -768,6 +2010,8 @@ int doMount(UserSpace(const char) *point,FileSystem *fs,
    VFSDentry *old = mnt->root;
    if(!mnt)
       return -ENOMEM;
+   vfsPruneDentries();
+      /*The mount point must not be used by them,and they will be stale.*/
    if(fs && (*fs->mount)(part,mnt) == 0)
       goto found;
    if(!part)
@@ -815,19 +2059,27 @@ found:
    }
    int ref;
    disablePreemption();
-   if(init && (atomicSet(&dentry->ref,(1 << 16) + 2) || 1))
-      goto out;
-   do {
-      ref = atomicRead(&dentry->ref);
-      if(ref != 1)
-      {
-         vfsLookUpClear(dentry);
-         destoryFileSystemMount(mnt);
-         return -EBUSY;
-      }
-   } while(atomicCompareExchange(&dentry->ref,ref,ref + (1 << 16)) != ref);
-out:
+   ++vfsMountSequence;
+   asm volatile("":::"memory");
+   if(init && (atomicSet(&dentry->ref,2) || 1))
+      goto out; /*The root is never unmounted.*/
+   if((ref = atomicCompareExchange(&dentry->mounting,0,1)) != 0
+      || atomicRead(&dentry->ref) != 1)
+   { /*Mounted,used by others,or it has children in the dentry cache.*/
+     /*The lookups which see mounting wait for mounted or for it cleared.*/
+      if(ref == 0)
+         atomicSet(&dentry->mounting,0);
+      ++vfsMountSequence;
+      enablePreemption();
+      vfsLookUpClear(dentry);
+      destoryFileSystemMount(mnt);
+      return -EBUSY;
+   }
+out: /*The mount holds our reference of the mount point.*/
+   atomicSet(&dentry->mounting,1);
    dentry->mounted = mnt;
+   asm volatile("":::"memory");
+   ++vfsMountSequence;
    enablePreemption();
    return 0;
 }
@@ -880,6 +2132,36 @@ int doGetCwd(UserSpace(char) *buf,u64 size)
    return j - 1;
 }
 
+int vfsInvalidateBlockDevicePart(BlockDevicePart *part)
+{  /*The media is changed,look up these dentries from the disk again.*/
+   FileSystem *fs = part->fileSystem;
+   vfsLockDentryCache();
+   for(u64 i = 0;i <= vfsDentryTable->mask;++i)
+   {
+      HashListNode *node = vfsDentryTable->buckets[i].first,*next;
+      for(;node;node = next)
+      {
+         VFSDentry *dentry = hashListEntry(node,VFSDentry,node);
+         next = node->next;
+         if(dentry->inode->part != part)
+            continue;
+         hashListDelete(node);
+         node->pprev = 0;
+         atomicAdd(&vfsDentryCount,-1);
+            /*Readers may still see it,destoryDentry frees it by RCU.*/
+      }
+   }
+   vfsUnlockDentryCache();
+   if(fs && fs->mediaChanged)
+      (*fs->mediaChanged)(part); /*The mount roots stay,so do their caches.*/
+   return 0;
+}
+
+int vfsPruneNegativeDentries(void)
+{ /*Call it when files are created,or the mounts are changed.*/
+   return vfsShrinkNegativeDentries(0);
+}
+
 int mountRoot(BlockDevicePart *part)
 {  /*Only use in kernel init.*/
    Task *current = getCurrentTask();
@@ -898,7 +2180,7 @@ int mountRoot(BlockDevicePart *part)
    if(ret)
       return ret;
    VFSDentry *root = current->fs->root->mounted->root;
-   current->fs->root = root;
+   current->fs->root = vfsLookUpDentry(root);
    current->fs->pwd = vfsLookUpDentry(root);
    return 0;
 }
@@ -945,14 +2227,36 @@ TaskFiles *taskForkFiles(TaskFiles *old,ForkFlags flags)
       return old;
    }
    TaskFiles *new = kmalloc(sizeof(*new));
+   TaskFileTable *table;
+   unsigned int max;
    if(unlikely(!new))
       return new;
-   memset(new->fd,0,sizeof(new->fd));
    atomicSet(&new->ref,1);
+   initSpinLock(&new->lock);
+   new->next = 0;
+   initFileTable(new);
    if(!old)
       goto out;
-   for(int i = 0;i < sizeof(old->fd)/sizeof(old->fd[0]);++i)
-      new->fd[i] = vfsGetFile(old->fd[i]);
+   lockSpinLock(&old->lock);
+   while((max = old->table->max) > new->table->max)
+   { /*Old may be expanded while allocating.*/
+      unlockSpinLock(&old->lock);
+      if(new->table != &new->embedded)
+         kfree(new->table);
+      if(!(new->table = createFileTable(max)))
+         return (kfree(new),(TaskFiles *)0);
+      lockSpinLock(&old->lock);
+   }
+   table = old->table;
+   for(unsigned int i = 0;i < table->max;++i)
+   {
+      if(!table->fd[i])
+         continue; /*The reserved fds aren't copied.*/
+      new->table->fd[i] = vfsGetFile(table->fd[i]);
+      setFileBit(new->table->open,i,1);
+      setFileBit(new->table->closeOnExec,i,testFileBit(table->closeOnExec,i));
+   }
+   unlockSpinLock(&old->lock);
       /*Copy the files.*/
 out:
    return new;
@@ -962,9 +2266,12 @@ int taskExitFiles(TaskFiles *old,u8 share)
 {
    if(atomicAddRet(&old->ref,-1) == 0)
    {
-      for(int i = 0;i < sizeof(old->fd) / sizeof(old->fd[0]);++i)
-         if(old->fd[i])
-            closeFile(old->fd[i]); /*Close files which are opened.*/
+      TaskFileTable *table = old->table;
+      for(unsigned int i = 0;i < table->max;++i)
+         if(table->fd[i])
+            closeFile(table->fd[i]); /*Close files which are opened.*/
+      if(table != &old->embedded)
+         kfree(table);
       kfree(old);
    }
    return 0;
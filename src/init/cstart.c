@@ -23,6 +23,7 @@ extern void *endAddressOfKernel;
 
 extern InitcallFunction initcallStart;
 extern InitcallFunction initcallEnd;
+extern InitcallFunction initcallSyncStart;
 
 extern int calcMemorySize(MultibootTagMemoryMap *map);
 
@@ -34,6 +35,8 @@ static int doInitcalls(void)
    printk("\n");
    for(;start < end;++start)
    {
+      if(start == &initcallSyncStart)
+         waitForDevices(); /*The root file system may be on them.*/
       ret = (*start)();
       if(ret)
          return ret;
@@ -69,6 +72,9 @@ int kinit(void)
       printkInColor(0x00,0xff,0x00,"Yes!\n\n");
    else
       printkInColor(0xff,0x00,0x00,"No!\n\n"); 
+   printk("Run 'mount -t tmpfs tmpfs /tmp'.\n");
+   if(doMount("/tmp",lookForFileSystem("tmpfs"),0,0))
+      printkInColor(0xff,0x00,0x00,"Failed!!\n\n");
    frameBufferFillRect(0x00,0x00,0x00,0,0,1024,768); /*Clear the screen.*/
    frameBufferRefreshLine(0,0);
 
@@ -52,12 +52,18 @@ int initIDT(void)
 
    *(u16 *)idtr = (u16)(sizeof(idt) - 1);
    *(u64 *)(idtr + 2) = (u64)(idt); /*Init idtr.*/
-   asm("lidt (%%rax)"::"a"(idtr)); /*Load idt.*/
+   loadIDT();
 
    printk("Initialize IDT successfully!\n");
    return 0;
 }
 
+int loadIDT(void)
+{ /*All CPUs share the IDT.*/
+   asm volatile("lidt (%%rax)"::"a"(idtr)); /*Load idt.*/
+   return 0;
+}
+
 int setLongModeGate(LongModeGate *gate,u16 type, u64 base)
 {
    u16 cs = 0;
@@ -1,5 +1,6 @@
 #include <core/const.h>
 #include <cpu/io.h>
+#include <cpu/spinlock.h>
 #include <video/console.h>
 #include <interrupt/interrupt.h>
 #include <interrupt/pic.h>
@@ -17,6 +18,7 @@ typedef struct IRQInformation{
 extern IRQHandler localApicTimerHandler;
 
 static IRQInformation irqHandlerTable[IRQ_COUNT] = {}; 
+static SpinLock irqLock;
 
 int doIRQ(IRQRegisters *reg)
 {
@@ -71,10 +73,12 @@ int requestIRQ(u8 irq,IRQHandler handler)
    int retval;
    if(irq >= IRQ_COUNT)
       return -EINVAL;
+   lockSpinLock(&irqLock); /*Drivers may be enabled at the same time.*/
    if(irqHandlerTable[irq].handler)
-      return -EBUSY;
+      return (unlockSpinLock(&irqLock),-EBUSY);
    irqHandlerTable[irq].handler = handler;
    irqHandlerTable[irq].data = 0;
+   unlockSpinLock(&irqLock);
    if((retval = ioApicEnableIRQ(irq)))
    {
       irqHandlerTable[irq].handler = 0;
@@ -105,6 +109,7 @@ int freeIRQ(u8 irq)
 int initInterrupt(void)
 {
    initPIC(); /*In fact,it will disable PIC.*/
+   initSpinLock(&irqLock);
    int retval;
 
    if((retval = initLocalApic()))
@@ -11,6 +11,8 @@
 #define LOCAL_APIC_DFR           0x0e0 /*Destination Format*/
 #define LOCAL_APIC_LDR           0x0d0 /*Logical Destination.*/
 #define LOCAL_APIC_SVR           0x0f0 /*Spurious Interrupt Vector.*/
+#define LOCAL_APIC_ICR_LOW       0x300 /*Interrupt Command.*/
+#define LOCAL_APIC_ICR_HIGH      0x310 /*Interrupt Command. (Destination.)*/
 #define LOCAL_APIC_LVT           0x320 /*Local Vector Table(LVT). (Timer.)*/
 #define LOCAL_APIC_TICR          0x380 /*Initial Count For Timer.*/
 #define LOCAL_APIC_TCCR          0x390 /*Current Count For Timer.*/
@@ -64,6 +66,14 @@ int initLocalApic(void)
       return -ENODEV;
    }
 
+   initLocalApicCPU();
+
+   printk("Initialize Local Apic successfully!\n");
+   return 0;
+}
+
+int initLocalApicCPU(void)
+{ /*Every CPU has its own local apic at the same address.*/
    localApicOut(LOCAL_APIC_TPR,0x0);
 
    localApicOut(LOCAL_APIC_DFR,0xffffffff);
@@ -73,8 +83,6 @@ int initLocalApic(void)
    localApicOut(LOCAL_APIC_SVR,0x100 | 0xff); /*Init Local Apic.*/
 
    setupLocalApicTimer(1,0); /*Disable.*/
-
-   printk("Initialize Local Apic successfully!\n");
    return 0;
 }
 
@@ -88,3 +96,23 @@ int localApicSendEOI(void)
    return localApicOut(LOCAL_APIC_EOI,0x0);
 }
 
+
+static int localApicSendIPI(u8 apicID,u32 command)
+{
+   localApicOut(LOCAL_APIC_ICR_HIGH,(u32)apicID << 24);
+   localApicOut(LOCAL_APIC_ICR_LOW,command); /*Send it.*/
+   for(int i = 0;i < 100000;++i)
+      if(!(localApicIn(LOCAL_APIC_ICR_LOW) & 0x1000))
+         return 0; /*Delivered.*/
+   return -EBUSY;
+}
+
+int localApicSendInit(u8 apicID)
+{ /*Level assert,INIT.*/
+   return localApicSendIPI(apicID,0x4500);
+}
+
+int localApicSendStartup(u8 apicID,u8 vector)
+{ /*The CPU starts at vector * 0x1000 in real mode.*/
+   return localApicSendIPI(apicID,0x4600 | vector);
+}
@@ -238,4 +238,9 @@ u64 getPhysicsPageCount(void)
    return physicsPageCount;
 }
 
+u64 getFreePhysicsPageCount(void)
+{
+   return freePhysicsPageCount;
+}
+
 int dereferencePage(PhysicsPage *page,unsigned int order) __attribute__ ((alias("freePages")));
@@ -6,11 +6,12 @@
 
 typedef struct MallocSize{
    u32 size;
+   const char *name;
    SlabCache *cache;
 } MallocSize;
 
 static MallocSize mallocSizes[] = {
-#define CACHE(x) {.size = x,.cache = 0}
+#define CACHE(x) {.size = x,.name = "kmalloc-" #x,.cache = 0}
    CACHE(32),
    CACHE(64),
    CACHE(128),
@@ -34,7 +35,8 @@ int initKMalloc(void)
 {
    for(int i = 0;i < sizeof(mallocSizes)/sizeof(MallocSize);++i)
    {
-      mallocSizes[i].cache = createCache(mallocSizes[i].size,0x0);
+      mallocSizes[i].cache = createObjectCache(mallocSizes[i].name,
+                  mallocSizes[i].size,0x0,0);
       if(unlikely(!mallocSizes[i].cache))
       {
          printkInColor(0xff,0x00,0x00,"(%s) Can't get memorySize[%d].cache!",__func__,i);
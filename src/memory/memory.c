@@ -96,6 +96,8 @@ int initMemory(void)
    initSlab();
    
    initKMalloc();
+   if(initPagingCache())
+      return -ENOMEM;
    printk("Try to use kmalloc.....\n");
 
    void *obj1 = kmalloc(48);
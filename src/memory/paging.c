@@ -4,6 +4,7 @@
 #include <memory/memory.h>
 #include <memory/buddy.h>
 #include <memory/kmalloc.h>
+#include <memory/slab.h>
 #include <memory/vmalloc.h>
 #include <lib/string.h>
 #include <filesystem/virtual.h>
@@ -13,9 +14,7 @@
 
 #define MIN_MAPPING (1024ul * 1024 * 1024 * 4) /*4GB.*/
 
-#define VMALLOC_START (1024ul * 1024 * 1024 *  768) /*768GB.*/
 #define MMAP_START    (1024ul * 1024 * 1024 *    1) /*1GB.*/
-#define VMALLOC_END   (1024ul * 1024 * 1024 * 1024) /*768GB.*/
 #define MMAP_END      PAGE_OFFSET
 
 extern void *endAddressOfKernel;
@@ -30,6 +29,8 @@ static u64 pml4eCount;
 
 static VirtualMemoryArea *vmallocVirtualMemoryAreas = 0;
 static Semaphore vmallocSemaphore;
+static SlabCache *taskMemoryCache;
+static SlabCache *virtualMemoryAreaCache;
 
 extern int calcMemorySize(void);
 
@@ -361,6 +362,15 @@ static int __doMUNMap(TaskMemory *mm,VirtualMemoryArea **pvma)
    return 0;
 }
 
+int initPagingCache(void)
+{ /*After initKMalloc,the first task needs them.*/
+   taskMemoryCache = createObjectCache("task-memory",sizeof(TaskMemory),0,0);
+   virtualMemoryAreaCache = createObjectCache("vm-area",sizeof(VirtualMemoryArea),0,0);
+   if(!taskMemoryCache || !virtualMemoryAreaCache)
+      return -ENOMEM;
+   return 0;
+}
+
 int initPaging(void)
 {
    u64 mappingSize = getMemorySize();
@@ -461,15 +471,18 @@ void *doMMap(VFSFile *file,u64 offset,pointer address,u64 len,
       return makeErrorPointer(-EINVAL); /*Invaild file.*/
    if(!(flags & MAP_ANONYMOUS) && (offset & 0xfff))
       return makeErrorPointer(-EINVAL); /*Invaild offset!*/
-   if(!(flags & MAP_ANONYMOUS) 
-       && !(flags & MAP_PRIVATE) && (prot & PROT_WRITE))
-      return makeErrorPointer(-EPROTONOSUPPORT); /*We don't support!*/
+   if((flags & MAP_SHARED) && (flags & MAP_PRIVATE))
+      return makeErrorPointer(-EINVAL);
+   if(!(flags & MAP_ANONYMOUS) && (flags & MAP_SHARED) && (prot & PROT_WRITE)
+       && ((file->mode & O_ACCMODE) != O_RDWR
+          || (S_ISREG(file->dentry->inode->mode) && !file->operation->write)))
+      return makeErrorPointer(-EACCES); /*The writes go to the file.*/
    if(!(flags & MAP_ANONYMOUS) 
       && !(file->dentry->inode->cache.operation->getPage))
       return makeErrorPointer(-EINVAL); /*This file doesn't support mmap!*/
    if(address & 0xfff)
       return makeErrorPointer(-EINVAL); /*Invaild address.*/
-   VirtualMemoryArea *new = kmalloc(sizeof(*new));
+   VirtualMemoryArea *new = allocByCache(virtualMemoryAreaCache);
    if(!new) /*Alloc the VirtualMemoryArea.*/
       return makeErrorPointer(-ENOMEM);
    new->start = start;
@@ -480,6 +493,7 @@ void *doMMap(VFSFile *file,u64 offset,pointer address,u64 len,
       new->file = vfsGetFile(file);
    new->offset = offset; /*Set the fields.*/
    new->prot = prot;
+   new->flags = flags & (MAP_SHARED | MAP_PRIVATE);
    if(vma)
    {
       new->next = vma->next;
@@ -491,6 +505,14 @@ void *doMMap(VFSFile *file,u64 offset,pointer address,u64 len,
    return (void *)start;
 }
 
+u64 pagingIdentityMap(int map)
+{ /*For the trampoline of the other CPUs,map the low memory at 0 too.*/
+  /*Return the physics address of the kernel page table.*/
+   kernelPML4EDir[0] = map ? kernelPML4EDir[1] : 0;
+   pagingFlushTLB();
+   return (u64)va2pa(kernelPML4EDir);
+}
+
 int taskSwitchMemory(TaskMemory *old,TaskMemory *new)
 {
    if(!new || !new->page)
@@ -513,7 +535,9 @@ TaskMemory *taskForkMemory(TaskMemory *old,ForkFlags flags)
       atomicAdd(&old->ref,1);
       return old; /*Share the struct.*/
    }
-   TaskMemory *new = kmalloc(sizeof(*new));
+   TaskMemory *new = allocByCache(taskMemoryCache);
+   if(!new)
+      return 0;
    atomicSet(&new->ref,1);
    new->page = allocPML4E(); /*Alloc the PML4E page tables.*/
    new->wait = 0;
@@ -544,7 +568,7 @@ TaskMemory *taskForkMemory(TaskMemory *old,ForkFlags flags)
    pvma = &new->vm;
    while(vma)
    {
-      nvma = kmalloc(sizeof(*nvma));
+      nvma = allocByCache(virtualMemoryAreaCache);
       if(!nvma)
       {
          taskExitMemory(new);
@@ -556,6 +580,7 @@ TaskMemory *taskForkMemory(TaskMemory *old,ForkFlags flags)
       else
          nvma->file = vfsGetFile(vma->file);
       nvma->prot = vma->prot;
+      nvma->flags = vma->flags;
       nvma->start = vma->start;
       nvma->length = vma->length;
       nvma->next = 0;
@@ -654,17 +679,15 @@ int taskExitMemory(TaskMemory *old)
    return 0;
 }
 
-int doPageFault(IRQRegisters *reg)
-{
-   u64 address,pos,base = 0;
+static int handlePageFault(u64 address,u64 error)
+{ /*The error code is the same as the page fault exception.*/
+   u64 pos,base = 0;
    VirtualMemoryArea *vma;
    Task *current = getCurrentTask();
    void *pml4e,*pdpte,*pde,*pte;
    void *entry,*data;
    PhysicsPage *entryPage,*dataPage;
 
-   asm volatile("movq %%cr2,%%rax":"=a"(address));
-                      /*Get the address which produces this exception.*/
    if(!current)
       return -EFAULT;
    if(address > PAGE_OFFSET)
@@ -706,7 +729,7 @@ int doPageFault(IRQRegisters *reg)
    if(!pte)
       return -ENOMEM; /*Alloc page tables.*/
 
-   if(reg->irq & 1 /*Exist?*/)
+   if(error & 1 /*Exist?*/)
       goto cow; /*Copy On Write.*/
 
    if(!file)
@@ -717,10 +740,15 @@ int doPageFault(IRQRegisters *reg)
           file->dentry->inode,base); /*Get the data page.*/
    if(!dataPage)
       goto nofile;
-   if(vma->prot & PROT_WRITE)
-      goto copyfile;
+   if(!(vma->flags & MAP_SHARED) && (vma->prot & PROT_WRITE) && (error & 2))
+      goto copyfile; /*Write to a private mapping,copy it now.*/
    setPTEEntry(pte,address,va2pa(getPhysicsPageAddress(dataPage)));
-   setPTEEntryAttribute(pte,address,0); /*Read Only.*/
+   if((vma->flags & MAP_SHARED) && (vma->prot & PROT_WRITE) && (error & 2))
+      (dataPage->flags & PagePageCache) ? setPageDirty(dataPage) : 0;
+         /*Write to the page cache directly,the rings of ioring.c aren't in it.*/
+   else
+      setPTEEntryAttribute(pte,address,0);
+         /*Read Only,the private mappings share the page until the first write.*/
 
    pagingFlushTLB();
    return 0;
@@ -751,7 +779,13 @@ cow:;
    entry = getPTEEntry(pte,address);
 
    entryPage = getPhysicsPage(entry);
-   if(atomicRead(&entryPage->count) == 1)
+   if(vma->flags & MAP_SHARED)
+   { /*Never copy the shared pages.*/
+      if(entryPage->flags & PagePageCache)
+         setPageDirty(entryPage);
+      goto done;
+   }
+   if(atomicRead(&entryPage->count) == 1 && !(entryPage->flags & PagePageCache))
       goto done; /*Only one task is using it,we needn't copy it!*/
    dataPage = allocPages(0);
    if(!dataPage)
@@ -767,6 +801,14 @@ done:
    return 0;
 }
 
+int doPageFault(IRQRegisters *reg)
+{
+   u64 address;
+   asm volatile("movq %%cr2,%%rax":"=a"(address));
+                      /*Get the address which produces this exception.*/
+   return handlePageFault(address,reg->irq);
+}
+
 void *vmalloc(u64 size)
 {
    size = (size + 0xfff) & ~0xfff;
@@ -781,7 +823,7 @@ void *vmalloc(u64 size)
    u64 address,end;
    if((s64)start < 0)
       goto out;
-   VirtualMemoryArea *area = kmalloc(sizeof(area));
+   VirtualMemoryArea *area = allocByCache(virtualMemoryAreaCache);
    if(!area)
       goto out;
    area->start = start;
@@ -873,3 +915,106 @@ out:
    pagingFlushTLB(); /*Flush the TLBs.*/
    return retval;
 }
+
+static PhysicsPage *pinUserPage(u64 address)
+{ /*Fault the page in for writing like the task does,then hold it.*/
+   TaskMemory *mm = getCurrentTask()->mm;
+   for(int i = 0;i < 3;++i) /*Not present,then read only.*/
+   {
+      void *pdpte,*pde,*pte;
+      u64 data = 0;
+      if(mm->page && (pdpte = getPDPTE(mm->page,address))
+            && (pde = getPDE(pdpte,address)) && (pte = getPTE(pde,address)))
+         data = ((u64 *)pte)[(address >> 12) & 0x1ff];
+      if((data & 0x3) == 0x3) /*P and R/W.*/
+         return referencePage(getPhysicsPage(pa2va(data & ~(0x1000ul - 1))));
+      if(handlePageFault(address,(data & 0x1) | 0x2 /*Write.*/))
+         break;
+   }
+   return 0;
+}
+
+static void vmallocUnmapPages(u64 address,u64 end)
+{ /*Unmap the pages one by one and dereference them.*/
+   for(;address < end;address += PAGE_SIZE)
+   {
+      void *pde = getPDE(kernelPDPTEDir,address);
+      void *pte = pde ? getPTE(pde,address) : 0;
+      void *entry = pte ? getPTEEntry(pte,address) : 0;
+      if(!entry)
+         continue;
+      dereferencePage(getPhysicsPage(entry),0);
+      clearKernelPTEEntry(kernelPDPTEDir,pde,pte,address);
+   }
+}
+
+void *vmapUser(UserSpace(void) *address,u64 length)
+{
+   u64 start = (u64)address & ~(PAGE_SIZE - 1);
+   u64 size = (((u64)address + length + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1)) - start;
+   VirtualMemoryArea *vma,*area = 0;
+   void *obj = makeErrorPointer(-EFAULT);
+   u64 base,offset = 0;
+   if(!length || (u64)address + length < (u64)address
+         || (u64)address + length > PAGE_OFFSET)
+      return obj;
+   downSemaphore(&vmallocSemaphore);
+   base = lookForFreeVirtualMemoryArea(
+        VMALLOC_START,VMALLOC_END,vmallocVirtualMemoryAreas,0,size,&vma);
+   if((s64)base < 0 || !(area = allocByCache(virtualMemoryAreaCache)))
+      goto nomemory;
+   area->start = base;
+   area->length = size;
+   area->next = vma ? vma->next : vmallocVirtualMemoryAreas;
+   *(vma ? &vma->next : &vmallocVirtualMemoryAreas) = area;
+
+   for(;offset < size;offset += PAGE_SIZE)
+   {
+      PhysicsPage *page = pinUserPage(start + offset);
+      void *pde,*pte = 0;
+      if(!page)
+         goto failed;
+      if(!(pde = allocKernelPDE(kernelPDPTEDir,base + offset))
+            || !(pte = allocKernelPTE(pde,base + offset)))
+      {
+         dereferencePage(page,0);
+         goto nomemory;
+      }
+      setKernelPTEEntry(pte,base + offset,va2pa(getPhysicsPageAddress(page)));
+   }
+   obj = (u8 *)base + ((u64)address & (PAGE_SIZE - 1));
+   goto out;
+nomemory:
+   obj = makeErrorPointer(-ENOMEM);
+failed:
+   if(area)
+   { /*Give back the pages mapped so far.*/
+      vmallocUnmapPages(base,base + offset);
+      *(vma ? &vma->next : &vmallocVirtualMemoryAreas) = area->next;
+      kfree(area);
+   }
+out:
+   upSemaphore(&vmallocSemaphore);
+   pagingFlushTLB();
+   return obj;
+}
+
+int vunmap(void *obj)
+{
+   u64 address = (u64)obj & ~(PAGE_SIZE - 1);
+   VirtualMemoryArea *vma,**previous;
+   int retval = -EINVAL;
+   downSemaphore(&vmallocSemaphore);
+   vma = lookForVirtualMemoryArea(vmallocVirtualMemoryAreas,address);
+   previous = vma ? &vma->next : &vmallocVirtualMemoryAreas;
+   if(!(vma = *previous) || vma->start != address)
+      goto out;
+   vmallocUnmapPages(vma->start,vma->start + vma->length);
+   *previous = vma->next;
+   kfree(vma);
+   retval = 0;
+out:
+   upSemaphore(&vmallocSemaphore);
+   pagingFlushTLB();
+   return retval;
+}
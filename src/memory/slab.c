@@ -2,12 +2,17 @@
 #include <core/list.h>
 #include <memory/slab.h>
 #include <memory/buddy.h>
+#include <memory/user.h>
+#include <filesystem/virtual.h>
+#include <filesystem/devfs.h>
 #include <video/console.h>
 #include <cpu/spinlock.h>
+#include <core/math.h>
 
 #define LOCAL_SLAB_CACHE_BATCH_COUNT_DEFAULT 0x010
 #define LOCAL_SLAB_CACHE_DATA_COUNT_DEFAULT  0x050
 #define OBJECT_COUNT_PER_SLAB_DEFAULT        0x100
+#define SLAB_STAT_BUFFER_ORDER               1
 
 typedef struct StaticLocalSlabCache{
    LocalSlabCache localSlabCache;
@@ -23,6 +28,15 @@ static StaticLocalSlabCache staticLocalSlabCache[2] = {
    {{LOCAL_SLAB_CACHE_DATA_COUNT_DEFAULT,0,0x10},{0}} /*Used by localCacheCache.*/
    };
 
+static ListHead slabCaches; /*The named caches,for slabstat.*/
+static SpinLock slabCachesLock;
+
+static int slabStatRead(VFSFile *file,UserSpace(void) *buf,u64 size,u64 *seek);
+
+static VFSFileOperation slabStatOperation = {
+   .read = &slabStatRead
+};
+
 static PhysicsPage *slabAllocPages(SlabCache *cache)
 {
    PhysicsPage *page,*tmp;
@@ -71,9 +85,13 @@ static Slab *allocSlabForSlabCache(SlabCache *cache)
    }
    slab->objDescriptor[cache->perSlabObjCount - 1] = (SlabObjDescriptor)(-1);
                                                       /*The last.*/
+   if(cache->constructor)
+      for(int i = 0;i < cache->perSlabObjCount;++i)
+         (*cache->constructor)(slab->memory + i * cache->objSize);
    listAdd(&slab->list,&cache->slabFree);
 
    cache->freeObjCount += cache->perSlabObjCount;
+   ++cache->slabCount;
    return slab;
 }
 
@@ -83,6 +101,7 @@ static int destorySlab(SlabCache *cache,Slab *slab)
    PhysicsPage *page = getPhysicsPage(obj);
 
    cache->freeObjCount -= cache->perSlabObjCount;
+   --cache->slabCount;
    listDelete(&slab->list);
    slabFreePages(cache,page);
    return 0;
@@ -111,6 +130,9 @@ static SlabCache *initSlabCache(SlabCache *cache,u32 objSize,u32 objCount,
    cache->perSlabObjCount = objCount;
    cache->objSize = objSize;
    cache->freeObjCount = 0;
+   cache->slabCount = 0;
+   cache->name = 0;
+   cache->constructor = 0;
    cache->slabSize = slabSize;
    cache->localCache[0] = localCache;
    cache->freeLimit = cache->perSlabObjCount + 2 * cache->localCache[0]->batchCount;
@@ -209,6 +231,8 @@ void *allocByCache(SlabCache *cache)
       ret = localCache->data[--localCache->avail];
    else
       ret = refillCache(cache);
+   if(ret)
+      ++localCache->active;
    enablePreemption();
    return ret;
 }
@@ -222,11 +246,18 @@ int freeByCache(SlabCache *cache,void *obj)
    if(localCache->avail == localCache->limit)
       flushLocalCache(cache);
    localCache->data[localCache->avail++] = obj;
+   --localCache->active;
    enablePreemption();
    return 0;
 }
 
 SlabCache *createCache(unsigned int size,unsigned int align)
+{
+   return createObjectCache(0,size,align,0);
+}
+
+SlabCache *createObjectCache(const char *name,unsigned int size,unsigned int align,
+                  SlabConstructor constructor)
 {
    if(align != 0x0)
    {
@@ -246,6 +277,7 @@ SlabCache *createCache(unsigned int size,unsigned int align)
    }
    localCache->batchCount = LOCAL_SLAB_CACHE_BATCH_COUNT_DEFAULT;
    localCache->avail = 0;
+   localCache->active = 0;
    localCache->limit = LOCAL_SLAB_CACHE_DATA_COUNT_DEFAULT;
    /*Init localCache.*/
 
@@ -255,6 +287,14 @@ SlabCache *createCache(unsigned int size,unsigned int align)
       freeByCache(&localCacheCache,localCache);
       return 0;
    }
+   cache->name = name;
+   cache->constructor = constructor;
+   if(name)
+   {
+      lockSpinLock(&slabCachesLock);
+      listAddTail(&cache->list,&slabCaches);
+      unlockSpinLock(&slabCachesLock);
+   }
    return cache;
 }
 
@@ -262,6 +302,12 @@ int destoryCache(SlabCache *cache)
 {
    ListHead *list;
    Slab *slab;
+   if(cache->name)
+   {
+      lockSpinLock(&slabCachesLock);
+      listDelete(&cache->list);
+      unlockSpinLock(&slabCachesLock);
+   }
    for(list = cache->slabFree.next;list != &cache->slabFree;list = cache->slabFree.next)
    {
       slab = listEntry(list,Slab,list);
@@ -287,8 +333,45 @@ int destoryCache(SlabCache *cache)
    return 0;
 }
 
+static int slabStatRead(VFSFile *file,UserSpace(void) *buf,u64 size,u64 *seek)
+{ /*One line for each named cache:name,size,active objects,all objects,slabs.*/
+   PhysicsPage *page = allocPages(SLAB_STAT_BUFFER_ORDER);
+   if(!page)
+      return -ENOMEM;
+   char *start = (char *)getPhysicsPageAddress(page);
+   char *text = start;
+   char *end = start + (PHYSICS_PAGE_SIZE << SLAB_STAT_BUFFER_ORDER) - 128;
+   lockSpinLock(&slabCachesLock);
+   for(ListHead *list = slabCaches.next;list != &slabCaches && text < end;list = list->next)
+   {
+      SlabCache *cache = listEntry(list,SlabCache,list);
+      text += sprintk(text,"%s size %u active %ld objects %lu slabs %u\n",
+         cache->name,cache->objSize,cache->localCache[0]->active,
+         (u64)cache->slabCount * cache->perSlabObjCount,cache->slabCount);
+   }
+   unlockSpinLock(&slabCachesLock);
+   int ret = 0;
+   if(*seek < text - start)
+   {
+      ret = min(size,text - start - *seek);
+      if(memcpyUser0(buf,start + *seek,ret))
+         ret = -EFAULT;
+      else
+         *seek += ret;
+   }
+   freePages(page,SLAB_STAT_BUFFER_ORDER);
+   return ret;
+}
+
+static int registerSlabStat(void)
+{
+   return devfsRegisterDevice(&slabStatOperation,"slabstat");
+}
+
 int initSlab(void)
 {
+   initList(&slabCaches);
+   initSpinLock(&slabCachesLock);
    initSlabCache(&cacheCache,sizeof(SlabCache),OBJECT_COUNT_PER_SLAB_DEFAULT
       ,&staticLocalSlabCache[0].localSlabCache);
    initSlabCache(&localCacheCache,sizeof(StaticLocalSlabCache),
@@ -296,3 +379,5 @@ int initSlab(void)
    printkInColor(0x00,0xff,0x00,"Initialize slab sucessfully!!\n");
    return 0;
 }
+
+driverInitcall(registerSlabStat);
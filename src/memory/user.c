@@ -149,7 +149,7 @@ long strncpyUser1(char *dest,UserSpace(const char) *src,unsigned long n)
       goto slow;
 
    if(align)
-      for(int i = 0;i < align;++align)
+      for(int i = 0;i < align;++i,--n)
          if(getUser8(src++,&data8)) /*Get the data.*/
             return -EFAULT;
          else if(!data8)
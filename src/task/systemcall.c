@@ -3,6 +3,8 @@
 #include <task/task.h>
 #include <task/signal.h>
 #include <filesystem/virtual.h>
+#include <filesystem/pipe.h>
+#include <filesystem/ioring.h>
 #include <acpi/power.h>
 #include <time/time.h>
 #include <cpu/io.h>
@@ -33,6 +35,27 @@ static u64 systemIOControl(IRQRegisters *reg); /*For the ioctl system call in us
 static u64 systemKill(IRQRegisters *reg);
 static u64 systemSignalAction(IRQRegisters *reg);
 static u64 systemSignalReturn(IRQRegisters *reg);
+static u64 systemMakeDir(IRQRegisters *reg);
+static u64 systemUnlink(IRQRegisters *reg);
+static u64 systemRemoveDir(IRQRegisters *reg);
+static u64 systemFTruncate(IRQRegisters *reg);
+static u64 systemFSync(IRQRegisters *reg);
+static u64 systemSendFile(IRQRegisters *reg);
+static u64 systemSplice(IRQRegisters *reg);
+static u64 systemPipe(IRQRegisters *reg);
+static u64 systemMakeFifo(IRQRegisters *reg);
+static u64 systemReadVector(IRQRegisters *reg);
+static u64 systemWriteVector(IRQRegisters *reg);
+static u64 systemPRead(IRQRegisters *reg);
+static u64 systemPWrite(IRQRegisters *reg);
+static u64 systemPReadVector(IRQRegisters *reg);
+static u64 systemPWriteVector(IRQRegisters *reg);
+static u64 systemStat(IRQRegisters *reg);
+static u64 systemFStat(IRQRegisters *reg);
+static u64 systemFStatAt(IRQRegisters *reg);
+static u64 systemIORingSetup(IRQRegisters *reg);
+static u64 systemIORingEnter(IRQRegisters *reg);
+static u64 systemIORingRegister(IRQRegisters *reg);
 
 SystemCallHandler systemCallHandlers[] = {
    &systemExecve, /*0*/
@@ -55,7 +78,28 @@ SystemCallHandler systemCallHandlers[] = {
    &systemIOControl,
    &systemKill,
    &systemSignalAction,
-   &systemSignalReturn /*20*/
+   &systemSignalReturn, /*20*/
+   &systemMakeDir,
+   &systemUnlink,
+   &systemRemoveDir,
+   &systemFTruncate,
+   &systemFSync, /*25*/
+   &systemSendFile,
+   &systemSplice,
+   &systemPipe,
+   &systemMakeFifo,
+   &systemReadVector, /*30*/
+   &systemWriteVector,
+   &systemPRead,
+   &systemPWrite,
+   &systemPReadVector,
+   &systemPWriteVector, /*35*/
+   &systemStat,
+   &systemFStat,
+   &systemFStatAt,
+   &systemIORingSetup,
+   &systemIORingEnter, /*40*/
+   &systemIORingRegister
 };
 
 static u64 systemOpen(IRQRegisters *reg)
@@ -176,6 +220,98 @@ static u64 systemSignalReturn(IRQRegisters *reg)
 {
    return doSignalReturn(reg);
 }
+static u64 systemMakeDir(IRQRegisters *reg)
+{
+   return doMakeDir((UserSpace(const char) *)reg->rbx);
+}
+static u64 systemUnlink(IRQRegisters *reg)
+{
+   return doUnlink((UserSpace(const char) *)reg->rbx);
+}
+static u64 systemRemoveDir(IRQRegisters *reg)
+{
+   return doRemoveDir((UserSpace(const char) *)reg->rbx);
+}
+static u64 systemFTruncate(IRQRegisters *reg)
+{
+   return doFTruncate((int)reg->rbx,(u64)reg->rcx);
+}
+static u64 systemFSync(IRQRegisters *reg)
+{
+   return doFSync((int)reg->rbx);
+}
+static u64 systemSendFile(IRQRegisters *reg)
+{
+   return doSendFile((int)reg->rbx,(int)reg->rcx,(UserSpace(s64) *)reg->rdx,
+                 (u64)reg->rsi);
+}
+static u64 systemSplice(IRQRegisters *reg)
+{
+   return doSplice((int)reg->rbx,(UserSpace(s64) *)reg->rcx,(int)reg->rdx,
+                 (UserSpace(s64) *)reg->rsi,(u64)reg->rdi);
+}
+static u64 systemPipe(IRQRegisters *reg)
+{
+   return doPipe((UserSpace(int) *)reg->rbx);
+}
+static u64 systemMakeFifo(IRQRegisters *reg)
+{
+   return doMakeFifo((UserSpace(const char) *)reg->rbx);
+}
+static u64 systemReadVector(IRQRegisters *reg)
+{
+   return doReadVector((int)reg->rbx,(UserSpace(const IOVector) *)reg->rcx,(int)reg->rdx);
+}
+static u64 systemWriteVector(IRQRegisters *reg)
+{
+   return doWriteVector((int)reg->rbx,(UserSpace(const IOVector) *)reg->rcx,(int)reg->rdx);
+}
+static u64 systemPRead(IRQRegisters *reg)
+{
+   return doPRead((int)reg->rbx,(UserSpace(void) *)reg->rcx,(u64)reg->rdx,
+                 (s64)reg->rsi);
+}
+static u64 systemPWrite(IRQRegisters *reg)
+{
+   return doPWrite((int)reg->rbx,(UserSpace(const void) *)reg->rcx,(u64)reg->rdx,
+                 (s64)reg->rsi);
+}
+static u64 systemPReadVector(IRQRegisters *reg)
+{
+   return doPReadVector((int)reg->rbx,(UserSpace(const IOVector) *)reg->rcx,
+                 (int)reg->rdx,(s64)reg->rsi);
+}
+static u64 systemPWriteVector(IRQRegisters *reg)
+{
+   return doPWriteVector((int)reg->rbx,(UserSpace(const IOVector) *)reg->rcx,
+                 (int)reg->rdx,(s64)reg->rsi);
+}
+static u64 systemStat(IRQRegisters *reg)
+{
+   return doStat((UserSpace(const char) *)reg->rbx,(UserSpace(VFSStat) *)reg->rcx);
+}
+static u64 systemFStat(IRQRegisters *reg)
+{
+   return doFStat((int)reg->rbx,(UserSpace(VFSStat) *)reg->rcx);
+}
+static u64 systemFStatAt(IRQRegisters *reg)
+{
+   return doFStatAt((int)reg->rbx,(UserSpace(const char) *)reg->rcx,
+                 (UserSpace(VFSStat) *)reg->rdx,(int)reg->rsi);
+}
+static u64 systemIORingSetup(IRQRegisters *reg)
+{
+   return doIORingSetup((u32)reg->rbx,(UserSpace(u64) *)reg->rcx);
+}
+static u64 systemIORingEnter(IRQRegisters *reg)
+{
+   return doIORingEnter((int)reg->rbx,(u32)reg->rcx);
+}
+static u64 systemIORingRegister(IRQRegisters *reg)
+{
+   return doIORingRegister((int)reg->rbx,(int)reg->rcx,
+                 (UserSpace(const IOVector) *)reg->rdx,(int)reg->rsi);
+}
 
 int doSystemCall(IRQRegisters *reg)
 {
@@ -11,7 +11,9 @@
 #include <cpu/io.h>
 #include <cpu/atomic.h>
 #include <cpu/gdt.h>
+#include <cpu/smp.h>
 #include <cpu/spinlock.h>
+#include <cpu/rcu.h>
 #include <lib/string.h>
 #include <interrupt/interrupt.h>
 #include <time/time.h>
@@ -211,6 +213,8 @@ int schedule(void)
    Task *from;
 
    u64 rflags;
+   if(prev->preemption == 0)
+      rcuNoteContextSwitch(); /*Readers never call schedule.*/
 repeat:
    disablePreemption();
    lockSpinLockCloseInterrupt(&runnableTaskLock,&rflags);
@@ -517,15 +521,8 @@ next:;
       goto failed;
    taskExitSignal(sig);
 
-   for(int j = 0;j < TASK_MAX_FILES;++j)
-   {
-      VFSFile **file = &current->files->fd[j];
-      if(!*file || !((*file)->mode & O_CLOEXEC))
-         continue;
-      closeFile(*file);
-             /*Close the files which have set the O_CLOEXEC mode.*/
-      *file = 0;
-   }
+   closeFilesOnExec(current->files);
+          /*Close the fds which have set the O_CLOEXEC mode.*/
    if(old)
       taskExitMemory(old);
 
@@ -558,9 +555,9 @@ int createKernelTask(KernelTask task,void *arg)
 
    regs.rsp = (u64)-1;
    regs.rflags = storeInterrupt();
-   doFork(&regs,ForkKernel);
+   int pid = doFork(&regs,ForkKernel);
 
-   return 0;
+   return pid < 0 ? pid : 0;
 }
 
 int wakeUpTask(Task *task,TaskState state)
@@ -602,6 +599,22 @@ Task *lookForTaskByPID(unsigned int pid)
    return ret;
 }
 
+Task *createIdleTask(void)
+{ /*For the other CPUs,they only run their idle tasks.*/
+   PhysicsPage *page = allocAlignedPages(1);
+   if(unlikely(!page))
+      return 0;
+   Task *ret = (Task *)getPhysicsPageAddress(page);
+   memset(ret,0,sizeof(Task));
+      /*The pid is 0 like idleTask,it isn't in allTaskList.*/
+   ret->state = TaskRunning;
+   initList(&ret->children);
+   initList(&ret->sibling);
+   initList(&ret->list);
+   initList(&ret->runnable);
+   return ret;
+}
+
 int initTask(void)
 {
    initList(&allTaskList);
@@ -615,6 +628,7 @@ int initTask(void)
 
    idleTask = createTask((u64)(pointer)(&idle));
    idleTask->state = TaskRunning;
+   getCPU()->idle = idleTask;
    scheduleFirst(); /*Never return.*/
 
    for(;;);
@@ -6,14 +6,22 @@
 #include <time/time.h>
 #include <video/console.h>
 #include <task/task.h>
+#include <cpu/rcu.h>
+#include <cpu/smp.h>
 
 IRQHandler localApicTimerHandler = 0;
+static u32 localApicTimerFreq = 0; /*The same on all CPUs.*/
 
 #define END_LOOPS                  20
 
 static int localTimeInterrupt(IRQRegisters *reg,void *data)
 {
-   getCurrentTask()->needSchedule = 1;
+   if(getCPU()->index)
+      return 0; /*The other CPUs only run their idle tasks.*/
+   Task *current = getCurrentTask();
+   current->needSchedule = 1;
+   rcuTimerTick(current->preemption == 1);
+      /*Only doIRQ disabled preemption,it isn't in a RCU read-side section.*/
    return 0;
 }
 
@@ -61,9 +69,14 @@ int initLocalTime(void)
    printk("Counter Freq: %d\n",freq);
 
    localApicTimerHandler = localTimeInterrupt; /*Set the handler.*/
-   setupLocalApicTimer(0x0,freq);/*Enable local apic timer.*/
+   setupLocalApicTimer(0x0,localApicTimerFreq = freq);/*Enable local apic timer.*/
    
    printkInColor(0x00,0xff,0x00,"Initialize Local Apic Timer successfully!\n");
 
    return 0;
 }
+
+int initLocalTimeCPU(void)
+{ /*Use the frequency of the bootstrap CPU.*/
+   return setupLocalApicTimer(0x0,localApicTimerFreq);
+}
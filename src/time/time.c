@@ -9,9 +9,11 @@
 #include <cpu/io.h>
 #include <cpu/spinlock.h>
 #include <memory/kmalloc.h>
+#include <memory/slab.h>
 
 static ListHead timers;
 static SpinLock timerLock;
+static SlabCache *timerCache;
 static unsigned long long ticks = 0;
 
 static int timeInterrupt(IRQRegisters *reg,void *data)
@@ -42,6 +44,9 @@ static int timeInterrupt(IRQRegisters *reg,void *data)
 
 int initTime(void)
 {
+   timerCache = createObjectCache("timer",sizeof(Timer),0,0);
+   if(!timerCache)
+      return -ENOMEM;
    if(initHpet(timeInterrupt,TIMER_HZ))
       if(initPit(timeInterrupt,TIMER_HZ))
          return -ENODEV;
@@ -71,7 +76,9 @@ int initTimer(Timer *timer,
 
 Timer *createTimer(TimerCallBackFunction callback,int timeout,void *data)
 {
-   Timer *timer = (Timer *)kmalloc(sizeof(Timer));
+   Timer *timer = (Timer *)allocByCache(timerCache);
+   if(!timer)
+      return 0;
    initTimer(timer,callback,timeout,data);
    timer->onStack = 0; /*It will be free auto.*/
    return timer;
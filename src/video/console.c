@@ -40,6 +40,16 @@ int printk(const char *string, ...)
    return ret;
 }
 
+int sprintk(char *buf,const char *string, ...)
+{
+   int ret = 0;
+   VarArgsList list;
+   varArgsStart(list,string);
+   ret = (int)(vsprintk(buf,string,list) - buf);
+   varArgsEnd(list);
+   return ret; /*Return the length,without '\0'.*/
+}
+
 #if defined(CONFIG_DEBUG)
 int printl(const char *string,...)
 {
@@ -305,22 +305,35 @@ int ttyKeyboardPress(KeyboardCallback *callback,u8 data)
 
 int ttyWrite(VFSFile *file,UserSpace(const void) *string,u64 size)
 {
-   PhysicsPage *page = allocPages(0);
+   PhysicsPage *page;
    long retval = 0;
    void *buffer;
-   if(!page)
+   if(size && size <= PAGE_SIZE && (pointer)string >= PAGE_OFFSET
+      && !verifyUserAddress(string,size))
+      return ttyWriteScreen(&ttyMainScreen,(const char *)string,size),size;
+         /*From the kernel (spliceFile),needn't copy it.*/
+   if(!(page = allocPages(0)))
       return -ENOMEM;
    
    buffer = getPhysicsPageAddress(page);
-   if(size)
-      retval = memcpyUser1(buffer,string,size) < 0 ? -EFAULT : size;
-   else
-      retval = strncpyUser1(buffer,string,4096) - 1;
-   if(retval < 0)
-      return freePages(page,0),retval;
-   ttyWriteScreen(&ttyMainScreen,buffer,retval);
+   if(!size)
+   { /*A string which ends with '\0'.*/
+      retval = strncpyUser1(buffer,string,PAGE_SIZE);
+      if(retval > 0 && --retval)
+         ttyWriteScreen(&ttyMainScreen,buffer,retval);
+   }else while(retval < size)
+   { /*One page each time.*/
+      u64 length = min(size - retval,PAGE_SIZE);
+      if(memcpyUser1(buffer,string + retval,length))
+      {
+         retval = retval ? retval : -EFAULT;
+         break;
+      }
+      ttyWriteScreen(&ttyMainScreen,buffer,length);
+      retval += length;
+   }
    freePages(page,0);
-   return 0;
+   return retval;
 }
 
 int ttyRead(VFSFile *file,UserSpace(void) *string,u64 data)
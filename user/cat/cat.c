@@ -17,15 +17,19 @@ int main(int argc,const char *argv[])
       write(stdout,"\n",0);
       return 0;
    }
-   for(;;)
-   {
-      size = read(fd,buf,sizeof(buf) - 1);
-      if(size <= 0)
-         break; /*No data,return.*/
-      ++null;
-      buf[size] = '\0';
-      write(stdout,buf,size); /*Write to stdout.*/
-   }
+   if(fd != stdin)
+      while((size = sendfile(stdout,fd,0,1ul << 20)) > 0)
+         null = 1; /*The kernel writes the file to stdout directly.*/
+   if(fd == stdin || (size < 0 && errno == EINVAL))
+      for(;;)
+      { /*It can't be spliced,read and write it.*/
+         size = read(fd,buf,sizeof(buf) - 1);
+         if(size <= 0)
+            break; /*No data,return.*/
+         ++null;
+         buf[size] = '\0';
+         write(stdout,buf,size); /*Write to stdout.*/
+      }
    if(size < 0)
       write(stdout,strerror(errno),0),write(stdout,"\n",0);
    if(fd != stdin)
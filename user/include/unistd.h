@@ -28,9 +28,95 @@
 #define O_RDWR      0x0003
 #define O_CLOEXEC   0x0010
 #define O_DIRECTORY 0x0020
+#define O_CREAT     0x0040
+#define O_EXCL      0x0080
+#define O_TRUNC     0x0100
+#define O_SYNC      0x0200
 
 struct sigaction;
+
+struct iovec{
+   void *iov_base;
+   unsigned long iov_len;
+};
+
+#define DT_UNKNOWN  0
+#define DT_FIFO     1
+#define DT_CHR      2
+#define DT_DIR      4
+#define DT_BLK      6
+#define DT_REG      8
+
+struct dirent64{ /*The records of getdents64.*/
+   unsigned long d_ino;
+   unsigned long d_size;
+   unsigned short d_reclen; /*Add it to get the next record.*/
+   unsigned char d_type;
+   char d_name[];
+} __attribute__ ((packed));
+
+#define AT_FDCWD       -100
+#define AT_EMPTY_PATH  0x1000
+
+#define IORING_OP_NOP    0
+#define IORING_OP_READ   1
+#define IORING_OP_WRITE  2
+#define IORING_OP_OPEN   3
+#define IORING_OP_CLOSE  4
+#define IORING_OP_FSYNC  5
+#define IORING_OP_POLL   6
+
+#define IORING_FIXED     0x1 /*Use the fixed buffer buf_index.*/
+
+#define IORING_REGISTER_BUFFERS    0
+#define IORING_UNREGISTER_BUFFERS  1
+
+#define POLLIN    0x01
+#define POLLOUT   0x04
+#define POLLERR   0x08
+#define POLLHUP   0x10
+
+struct ioring_sqe{ /*The submission entries.*/
+   unsigned char opcode;
+   unsigned char flags;
+   unsigned short buf_index;
+   int fd;
+   long offset; /*-1 uses the position of fd.*/
+   unsigned long addr;
+   unsigned int len;
+   unsigned int mode; /*For IORING_OP_OPEN and IORING_OP_POLL.*/
+   unsigned long user_data;
+   unsigned char reserved[24];
+} __attribute__ ((packed));
+
+struct ioring_cqe{ /*The completion entries.*/
+   unsigned long user_data;
+   int res;
+   unsigned int flags;
+} __attribute__ ((packed));
+
+struct ioring_header{ /*At the start of the mapping,the offsets are from it.*/
+   unsigned int sq_head;
+   unsigned int sq_tail;
+   unsigned int sq_mask;
+   unsigned int sq_entries;
+   unsigned int sq_offset;
+   unsigned int cq_head;
+   unsigned int cq_tail;
+   unsigned int cq_mask;
+   unsigned int cq_entries;
+   unsigned int cq_offset;
+};
+
+struct stat{
+   unsigned long st_ino;
+   unsigned long st_mode;
+   unsigned long st_size;
+   unsigned long st_blksize;
+   unsigned long st_blocks;
+};
 #define TIOCSPGRP 5
+#define BLOCK_SET_POLL_READS 0x4200 /*The ioctl of /dev/sdX,poll for the reads if data is 1.*/
 
 int fork(void);
 int exit(int n);
@@ -53,3 +139,24 @@ int dup2(int fd,int new);
 int kill(unsigned int pid,unsigned int sig);
 int sigaction(unsigned int sig,const struct sigaction *act,const void * unused);
 int ioctl(int fd,int cmd,void *data);
+int mkdir(const char *path);
+int unlink(const char *path);
+int rmdir(const char *path);
+int ftruncate(int fd,unsigned long size);
+int fsync(int fd);
+long sendfile(int out,int in,long *offset,unsigned long count);
+long splice(int in,long *inOffset,int out,long *outOffset,unsigned long count);
+int pipe(int *fds);
+int mkfifo(const char *path);
+long readv(int fd,const struct iovec *vector,int count);
+long writev(int fd,const struct iovec *vector,int count);
+long pread(int fd,void *buf,unsigned long size,long offset);
+long pwrite(int fd,const void *buf,unsigned long size,long offset);
+long preadv(int fd,const struct iovec *vector,int count,long offset);
+long pwritev(int fd,const struct iovec *vector,int count,long offset);
+int stat(const char *path,struct stat *buf);
+int fstat(int fd,struct stat *buf);
+int fstatat(int dirfd,const char *path,struct stat *buf,int flags);
+int ioring_setup(unsigned int entries,struct ioring_header **header);
+int ioring_enter(int fd,unsigned int submit);
+int ioring_register(int fd,int opcode,const struct iovec *vector,int count);
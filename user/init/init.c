@@ -143,6 +143,32 @@ int doTheTest(void)
    return 0;
 }
 
+int shellRunCommand(char *cmd);
+
+int shellRunPipeline(char *left,char *right)
+{ /*left | right.*/
+   int fds[2],pid[2],ret = 0;
+   if(pipe(fds) < 0)
+      return write(stdout,"Can't create the pipe.Abort!",0);
+   for(int i = 0;i < 2;++i)
+   {
+      if((pid[i] = fork()) < 0)
+         write(stdout,"Can't fork.Abort!",0);
+      if(pid[i]) /*Parent process.*/
+         continue;
+      dup2(fds[!i],i ? stdin : stdout);
+      close(fds[0]);
+      close(fds[1]); /*Or the reader never sees the end of file.*/
+      exit(shellRunCommand(i ? right : left));
+   }
+   close(fds[0]);
+   close(fds[1]);
+   for(int i = 0;i < 2;++i)
+      if(pid[i] > 0)
+         waitpid(pid[i],&ret,0);
+   return ret;
+}
+
 int shellRunCommand(char *cmd)
 {
    static char pathenv[][64] = {
@@ -154,6 +180,10 @@ int shellRunCommand(char *cmd)
           (cmd[4] == ' ' || cmd[4] == '\0' || cmd[4] == '\n'))
      return doTheTest(); /*The 'test' command.*/
 
+   for(char *bar = cmd;*bar;++bar)
+      if(*bar == '|' && ((*bar = '\0') || 1))
+         return shellRunPipeline(cmd,bar + 1);
+
    while(*cmd == ' ')
       ++cmd; /*Skip ' '.*/
    if(*cmd == '\0' || *cmd == '\n')
@@ -24,6 +24,27 @@ int errno;
 #define __NR_kill              0x0012
 #define __NR_sigaction         0x0013
 #define __NR_sigret            0x0014
+#define __NR_mkdir             0x0015
+#define __NR_unlink            0x0016
+#define __NR_rmdir             0x0017
+#define __NR_ftruncate         0x0018
+#define __NR_fsync             0x0019
+#define __NR_sendfile          0x001a
+#define __NR_splice            0x001b
+#define __NR_pipe              0x001c
+#define __NR_mkfifo            0x001d
+#define __NR_readv             0x001e
+#define __NR_writev            0x001f
+#define __NR_pread             0x0020
+#define __NR_pwrite            0x0021
+#define __NR_preadv            0x0022
+#define __NR_pwritev           0x0023
+#define __NR_stat              0x0024
+#define __NR_fstat             0x0025
+#define __NR_fstatat           0x0026
+#define __NR_ioring_setup      0x0027
+#define __NR_ioring_enter      0x0028
+#define __NR_ioring_register   0x0029
 
 #define __syscall0(ret,name)  \
    ret name(void) \
@@ -42,6 +63,44 @@ int errno;
       return (ret)__ret; \
    }
 
+#define __syscall4(ret,name,a1,__a1,a2,__a2,a3,__a3,a4,__a4)  \
+   ret name(a1 __a1,a2 __a2,a3 __a3,a4 __a4) \
+   { \
+      unsigned long __ret; \
+      asm volatile( \
+         "int $0xff" \
+         : "=a" (__ret) \
+         : "a" (__NR_##name),"b" ((unsigned long)__a1), \
+           "c" ((unsigned long)__a2),"d" ((unsigned long)__a3), \
+           "S" ((unsigned long)__a4) \
+      ); \
+      if((long)__ret < 0 && (long)__ret >= -200) \
+      { \
+         errno = -__ret; \
+         __ret = -1; \
+      } \
+     return (ret)__ret; \
+   }
+
+#define __syscall5(ret,name,a1,__a1,a2,__a2,a3,__a3,a4,__a4,a5,__a5)  \
+   ret name(a1 __a1,a2 __a2,a3 __a3,a4 __a4,a5 __a5) \
+   { \
+      unsigned long __ret; \
+      asm volatile( \
+         "int $0xff" \
+         : "=a" (__ret) \
+         : "a" (__NR_##name),"b" ((unsigned long)__a1), \
+           "c" ((unsigned long)__a2),"d" ((unsigned long)__a3), \
+           "S" ((unsigned long)__a4),"D" ((unsigned long)__a5) \
+      ); \
+      if((long)__ret < 0 && (long)__ret >= -200) \
+      { \
+         errno = -__ret; \
+         __ret = -1; \
+      } \
+     return (ret)__ret; \
+   }
+
 #define __syscall1(ret,name,a1,__a1)  \
    ret name(a1 __a1) \
    { \
@@ -103,12 +162,23 @@ __syscall1(int,close,int,fd);
 __syscall1(int,reboot,unsigned long,command);
 __syscall1(int,chdir,const char *,dir);
 __syscall1(int,dup,int,fd);
+__syscall1(int,mkdir,const char *,path);
+__syscall1(int,unlink,const char *,path);
+__syscall1(int,rmdir,const char *,path);
+__syscall1(int,fsync,int,fd);
+__syscall1(int,pipe,int *,fds);
+__syscall1(int,mkfifo,const char *,path);
 
 __syscall2(int,gettimeofday,unsigned long *,time,void *,unused);
 __syscall2(int,dup2,int,fd,int,new);
 __syscall2(int,getcwd,char *,buf,unsigned long,size);
 __syscall2(int,open,const char *,path,int,mode);
 __syscall2(int,kill,unsigned int,pid,unsigned int,sig);
+__syscall2(int,ftruncate,int,fd,unsigned long,size);
+__syscall2(int,stat,const char *,path,struct stat *,buf);
+__syscall2(int,fstat,int,fd,struct stat *,buf);
+__syscall2(int,ioring_setup,unsigned int,entries,struct ioring_header **,header);
+__syscall2(int,ioring_enter,int,fd,unsigned int,submit);
 
 __syscall3(int,execve,const char *,path,const char **,argc,const char **,envp);
 __syscall3(unsigned long,read,int,fd,void *,buf,unsigned long,size);
@@ -118,3 +188,15 @@ __syscall3(int,waitpid,int,pid,int *,result,int,nowait);
 __syscall3(unsigned long,lseek,int,fd,signed long,offset,int,type);
 __syscall3(int,sigaction,unsigned int,sig,const struct sigaction *,act,const void *,unused);
 __syscall3(int,ioctl,int,fd,int,cmd,void *,data);
+__syscall3(long,readv,int,fd,const struct iovec *,vector,int,count);
+__syscall3(long,writev,int,fd,const struct iovec *,vector,int,count);
+
+__syscall4(long,sendfile,int,out,int,in,long *,offset,unsigned long,count);
+__syscall4(long,pread,int,fd,void *,buf,unsigned long,size,long,offset);
+__syscall4(long,pwrite,int,fd,const void *,buf,unsigned long,size,long,offset);
+__syscall4(long,preadv,int,fd,const struct iovec *,vector,int,count,long,offset);
+__syscall4(long,pwritev,int,fd,const struct iovec *,vector,int,count,long,offset);
+__syscall4(int,fstatat,int,dirfd,const char *,path,struct stat *,buf,int,flags);
+__syscall4(int,ioring_register,int,fd,int,opcode,const struct iovec *,vector,int,count);
+
+__syscall5(long,splice,int,in,long *,inOffset,int,out,long *,outOffset,unsigned long,count);
@@ -2,80 +2,70 @@
 #include <errno.h>
 #include <string.h>
 
+static char *lsCopy(char *to,const char *from)
+{
+   while((*to = *from++) != '\0')
+      ++to;
+   return to;
+}
+
+static char *lsNumber(char *to,unsigned long n,int width)
+{ /*Right aligned.*/
+   char digits[20];
+   int count = 0;
+   do{
+      digits[count++] = '0' + n % 10;
+   }while(n /= 10);
+   while(width-- > count)
+      *to++ = ' ';
+   while(count)
+      *to++ = digits[--count];
+   return to;
+}
+
 int main(int argc,const char *argv[])
 {
-   const char *dir;
-   if(argc > 1)
-      dir = argv[1];
-   else
-      dir = ".";
+   static unsigned char buffer[4096]; /*A page of records each time.*/
+   const char *dir = ".";
+   int size,count = 0,sizes = 0;
+   for(int i = 1;i < argc;++i)
+      if(argv[i][0] == '-' && argv[i][1] == 'l' && argv[i][2] == '\0')
+         sizes = 1; /*'ls -l' prints the sizes.*/
+      else
+         dir = argv[i];
    int fd = open(dir,O_RDONLY | O_DIRECTORY);
    if(fd < 0)
+      goto failed;
+   while((size = getdents64(fd,buffer,sizeof(buffer))) > 0)
    {
-      write(stdout,strerror(errno),0);
-      write(stdout,"\n",0);
-      return -1;
-   }
-   unsigned char buffer[2048 + 5];
-   int size,i = 8,first = 0;
-   if((size = getdents64(fd,&buffer[8],sizeof(buffer) - 8)) < 0)
-   {
-      write(stdout,strerror(errno),0);
-         /*Write the error string to the screen.*/
-      write(stdout,"\n",0);
-      return -1;
-   }
-retry:
-   while(i < size + 5)
-   {
-      if(first == 5){
-         write(stdout,"\n",0);
-         first = 0;
-      }
-      unsigned char isdir = !!buffer[i]; /*Is it a dir?*/
-      unsigned char length = buffer[i + 1];
-      switch(isdir)
+      struct dirent64 *entry;
+      for(int i = 0;i < size;i += entry->d_reclen)
       {
-      case 0:
-         if(first++){
-            buffer[i + 1] = ' '; /*Add a ' ' before filename.*/
-            write(stdout,&buffer[i + 1],0);
-         }else{
-            write(stdout,&buffer[i + 2],0);
-         }
-         break;
-      case 1:
-         if(first++){
-            buffer[i + 1] = ' ';
-            buffer[i + 0] = 'm';
-            buffer[i - 1] = '4';
-            buffer[i - 2] = '3';
-            buffer[i - 3] = ';';
-            buffer[i - 4] = '1';
-            buffer[i - 5] = '0';
-            buffer[i - 6] = '[';
-            buffer[i - 7] = '\033';
-            write(stdout,&buffer[i - 7],0);
-         }else{
-            buffer[i + 1] = 'm';
-            buffer[i + 0] = '4';
-            buffer[i - 1] = '3';
-            buffer[i - 2] = ';'; /*Color Blue.*/
-            buffer[i - 3] = '1';
-            buffer[i - 4] = '0';
-            buffer[i - 5] = '[';
-            buffer[i - 6] = '\033';
-            write(stdout,&buffer[i - 6],0);
-         }
-         break;
+         char line[300],*p = line;
+         entry = (struct dirent64 *)&buffer[i];
+         if(sizes)
+            (p = lsNumber(p,entry->d_size,10)),(*p++ = ' ');
+         else if(count % 5)
+            *p++ = ' '; /*Add a ' ' before filename.*/
+         else if(count)
+            write(stdout,"\n",0);
+         if(entry->d_type == DT_DIR)
+            p = lsCopy(p,"\033[01;34m"); /*Color Blue.*/
+         p = lsCopy(p,entry->d_name);
+         lsCopy(p,sizes ? "\n" : "\t");
+         write(stdout,line,0);
+         ++count;
       }
-      write(stdout,"\t",0);
-      i += length + 3;
    }
-   if((size = getdents64(fd,&buffer[8],sizeof(buffer) - 8)) > 0 &&
-      (i = 8))
-      goto retry; /*Read until there is no data.*/
    close(fd);
-   write(stdout,"\n",0); /*Print a '\n'.*/
+   if(size < 0)
+      goto failed;
+   if(!sizes)
+      write(stdout,"\n",0); /*Print a '\n'.*/
    return 0;
+failed:
+   write(stdout,strerror(errno),0);
+         /*Write the error string to the screen.*/
+   write(stdout,"\n",0);
+   return -1;
 }
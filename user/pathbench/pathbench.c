@@ -0,0 +1,58 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+
+/*Open and close an 8-deep directory again and again,*/
+/*so every open walks the cached path.*/
+/*'pathbench [iterations] [base]',the base defaults to /tmp.*/
+
+#define PATH_DEPTH 8
+
+static inline unsigned long rdtsc(void)
+{
+   unsigned int low,high;
+   asm volatile("rdtsc":"=a"(low),"=d"(high));
+   return ((unsigned long)high << 32) | low;
+}
+
+int main(int argc,const char *argv[])
+{
+   char path[256],*end;
+   const char *base = "/tmp";
+   int iterations = 100000;
+   if(argc > 1 && sscanf(argv[1],"%d",&iterations) != 1)
+      iterations = 100000;
+   if(argc > 2)
+      base = argv[2];
+   if(iterations <= 0)
+      iterations = 1;
+   end = path + sprintf(path,"%s",base);
+   for(int i = 0;i < PATH_DEPTH;++i)
+   { /*Like this: /tmp/d0/d1/.../d7 .*/
+      end += sprintf(end,"/d%d",i);
+      if(mkdir(path) < 0 && errno != EEXIST)
+         goto failed;
+   }
+
+   int fd = open(path,O_RDONLY | O_DIRECTORY);
+   if(fd < 0) /*Warm the dentry cache.*/
+      goto failed;
+   close(fd);
+
+   unsigned long start = rdtsc();
+   for(int i = 0;i < iterations;++i)
+   {
+      if((fd = open(path,O_RDONLY | O_DIRECTORY)) < 0)
+         goto failed;
+      close(fd);
+   }
+   unsigned long cycles = rdtsc() - start;
+
+   printf("%s: %d iterations,%d cycles per open and close.\n",
+      path,iterations,(int)(cycles / iterations));
+   return 0;
+failed:
+   printf("pathbench: %s: %s\n",path,strerror(errno));
+   return -1;
+}
@@ -0,0 +1,79 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+
+/*Write PIPE_TOTAL bytes through a pipe with 4K,64K and 1M writes,*/
+/*the child reads them with the same size.Print the throughput.*/
+
+#define PIPE_TOTAL (64ul * 1024 * 1024)
+#define PIPE_MAX   (1024 * 1024)
+
+static char buffer[PIPE_MAX]; /*The contents don't matter.*/
+
+static inline unsigned long rdtsc(void)
+{
+   unsigned int low,high;
+   asm volatile("rdtsc":"=a"(low),"=d"(high));
+   return ((unsigned long)high << 32) | low;
+}
+
+static unsigned long cyclesPerSecond(void)
+{ /*gettimeofday only has seconds,count the cycles in one of them.*/
+   unsigned long now,then,start;
+   gettimeofday(&then,0);
+   do
+      gettimeofday(&now,0);
+   while(now == then);
+   start = rdtsc();
+   then = now;
+   do
+      gettimeofday(&now,0);
+   while(now == then);
+   return rdtsc() - start;
+}
+
+static int pipeBench(unsigned long size,unsigned long freq)
+{
+   int fds[2],pid,ret;
+   if(pipe(fds) < 0)
+      return -1;
+   unsigned long start = rdtsc();
+   if((pid = fork()) < 0)
+      return -1;
+   if(pid == 0)
+   { /*The reader.*/
+      long n;
+      close(fds[1]);
+      while((n = read(fds[0],buffer,size)) > 0)
+         ;
+      exit(n < 0);
+   }
+   close(fds[0]);
+   for(unsigned long done = 0;done < PIPE_TOTAL;)
+   {
+      long n = write(fds[1],buffer,size);
+      if(n <= 0)
+         return (close(fds[1]),waitpid(pid,&ret,0),-1);
+      done += n;
+   }
+   close(fds[1]); /*The reader gets EOF.*/
+   waitpid(pid,&ret,0);
+   unsigned long cycles = rdtsc() - start;
+   printf("%d KB writes: %d KB/s,%d cycles per KB.\n",(int)(size / 1024),
+      (int)(PIPE_TOTAL / 1024 * freq / cycles),(int)(cycles / (PIPE_TOTAL / 1024)));
+   return ret ? -1 : 0;
+}
+
+int main(int argc,const char *argv[])
+{
+   static const unsigned long sizes[] = {4 * 1024,64 * 1024,1024 * 1024};
+   unsigned long freq = cyclesPerSecond();
+   for(int i = 0;i < sizeof(sizes) / sizeof(sizes[0]);++i)
+      if(pipeBench(sizes[i],freq))
+         goto failed;
+   return 0;
+failed:
+   printf("pipebench: %s\n",strerror(errno));
+   return -1;
+}